@@ -0,0 +1,240 @@
+#ifndef ARGUMENTSH
+#define ARGUMENTSH
+
+// arguments.hpp: Define the command line options of the headless batch mode
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+#include "host_common.hpp"
+
+// Exit status of the batch mode
+enum Exit_Status {
+  EXIT_OK = 0,            // image rendered and saved
+  EXIT_RENDER_ERROR = 1,  // scene creation, rendering or saving failed
+  EXIT_USAGE_ERROR = 2,   // invalid command line arguments
+  EXIT_CHECK_FAILED = 3   // --attribute-check found errors over their bounds
+};
+
+void Print_Usage(const char *program) {
+  printf("Usage: %s [options]\n", program);
+  printf("Renders without opening a window if any option is given.\n\n");
+  printf("  --scene <id>      scene to render, 0 to 4 (default 2)\n");
+  printf("  --model <id>      model of the test scene, 0 to 5 (default 0)\n");
+  printf("  --width <px>      image width (default 500)\n");
+  printf("  --height <px>     image height (default 500)\n");
+  printf("  --spp <n>         samples per pixel (default 500)\n");
+  printf("  --batch <n>       samples per launch (default 1)\n");
+  printf("  --depth <n>       max ray depth (default 50)\n");
+  printf("  --output <file>   output file, .png or .hdr (default out.png)\n");
+  printf("  --no-russian      disable Russian Roulette\n");
+  printf("  --no-rtx          disable RTX mode\n");
+  printf("  --no-env-sampling don't sample HDR environments as lights\n");
+  printf("  --compact-mesh    pack mesh normals and texcoords in 32 bits\n");
+  printf("  --compact-positions\n");
+  printf("                    also pack mesh positions in 16 bits per axis\n");
+  printf("  --texture-memory <MB>\n");
+  printf("                    texture cache limit, 0 for none (default 0)\n");
+  printf("  --mipmaps <filter>\n");
+  printf("                    mipmap image textures, box or kaiser\n");
+  printf("  --anisotropy <n>  most probes of a mipmapped lookup, 1 to 16 "
+         "(default 8)\n");
+  printf("  --cpu             render with the CPU backend\n");
+  printf("  --threads <n>     loader and CPU threads, 0 for all (default 0)\n");
+  printf("  --bvh-width <n>   CPU BVH width, 2, 4 or 8 (default 8)\n");
+  printf("  --lbvh            build CPU BVHs with the faster linear builder\n");
+  printf("  --compress-bvh    store 4 and 8-wide CPU BVH boxes in 8 bits\n");
+  printf("  --wavefront       render with the CPU wavefront integrator\n");
+  printf("  --reorder <n>     sort wavefront bounces of n+ rays (default 0)\n");
+  printf("  --packets         trace CPU camera rays in 8x8 packets\n");
+  printf("  --benchmark       report CPU ray traversal speed, don't render\n");
+  printf("  --parse-benchmark <file.obj>\n");
+  printf("                    time the OBJ parsers on a file, don't render\n");
+  printf("  --hdr-benchmark <file.hdr>\n");
+  printf("                    time the HDR loaders on a file, don't render\n");
+  printf("  --attribute-check <file.obj>\n");
+  printf("                    check the compact attributes of a mesh, don't "
+         "render\n");
+  printf("  --help            show this message\n");
+}
+
+// Reads a non-negative integer option value, returns false if it's invalid
+bool Parse_Int(const char *option, const char *value, int &result) {
+  char *end;
+  long parsed = strtol(value, &end, 10);
+
+  if (*value == '\0' || *end != '\0' || parsed < 0 || parsed > INT_MAX) {
+    fprintf(stderr, "Invalid value '%s' for option %s.\n", value, option);
+    return false;
+  }
+
+  result = (int)parsed;
+  return true;
+}
+
+// Splits the output path into file name and file type
+bool Parse_Output(const char *value, App_State &app) {
+  std::string path = value;
+  size_t dot = path.find_last_of('.');
+  std::string extension = dot == std::string::npos ? "" : path.substr(dot);
+
+  for (size_t i = 0; i < extension.size(); i++)
+    extension[i] = (char)tolower(extension[i]);
+
+  if (extension == ".png")
+    app.fileType = 0;
+  else if (extension == ".hdr")
+    app.fileType = 1;
+  else {
+    fprintf(stderr, "Output file '%s' should end with .png or .hdr.\n", value);
+    return false;
+  }
+
+  // Save_PNG and Save_HDR add the extension back
+  app.fileName = path.substr(0, dot);
+  return !app.fileName.empty();
+}
+
+// Fills the App_State from the command line, returns false if the arguments
+// are invalid. 'help' is set if the usage message was requested.
+bool Parse_Arguments(App_State &app, int ac, char **av, bool &help) {
+  help = false;
+
+  for (int i = 1; i < ac; i++) {
+    const char *option = av[i];
+
+    // flags
+    if (!strcmp(option, "--help") || !strcmp(option, "-h")) {
+      help = true;
+      return true;
+    } else if (!strcmp(option, "--no-russian"))
+      app.russian = false;
+    else if (!strcmp(option, "--no-rtx"))
+      app.RTX = false;
+    else if (!strcmp(option, "--no-env-sampling"))
+      app.environmentSampling = false;
+    else if (!strcmp(option, "--compact-mesh")) {
+      if (app.meshAttributes == FULL_ATTRIBUTES)
+        app.meshAttributes = COMPACT_ATTRIBUTES;
+    } else if (!strcmp(option, "--compact-positions"))
+      app.meshAttributes = COMPACT_POSITIONS;
+    else if (!strcmp(option, "--cpu"))
+      app.CPU = true;
+    else if (!strcmp(option, "--lbvh"))
+      app.linearBVH = true;
+    else if (!strcmp(option, "--compress-bvh"))
+      app.compressedBVH = true;
+    else if (!strcmp(option, "--wavefront"))
+      app.wavefront = true;
+    else if (!strcmp(option, "--packets"))
+      app.packets = true;
+    else if (!strcmp(option, "--benchmark"))
+      app.benchmark = true;
+
+    // options with a value
+    else {
+      if (i + 1 >= ac) {
+        fprintf(stderr, "Unknown option or missing value: %s\n", option);
+        return false;
+      }
+
+      const char *value = av[++i];
+      bool valid;
+
+      if (!strcmp(option, "--scene"))
+        valid = Parse_Int(option, value, app.scene);
+      else if (!strcmp(option, "--model"))
+        valid = Parse_Int(option, value, app.model);
+      else if (!strcmp(option, "--width"))
+        valid = Parse_Int(option, value, app.W);
+      else if (!strcmp(option, "--height"))
+        valid = Parse_Int(option, value, app.H);
+      else if (!strcmp(option, "--spp"))
+        valid = Parse_Int(option, value, app.samples);
+      else if (!strcmp(option, "--batch"))
+        valid = Parse_Int(option, value, app.batch);
+      else if (!strcmp(option, "--depth"))
+        valid = Parse_Int(option, value, app.depth);
+      else if (!strcmp(option, "--threads"))
+        valid = Parse_Int(option, value, app.threads);
+      else if (!strcmp(option, "--bvh-width"))
+        valid = Parse_Int(option, value, app.bvhWidth);
+      else if (!strcmp(option, "--texture-memory"))
+        valid = Parse_Int(option, value, app.textureMemory);
+      else if (!strcmp(option, "--anisotropy"))
+        valid = Parse_Int(option, value, app.anisotropy);
+      else if (!strcmp(option, "--mipmaps")) {
+        if (!strcmp(value, "box"))
+          app.mipmaps = BOX_MIPMAPS;
+        else if (!strcmp(value, "kaiser"))
+          app.mipmaps = KAISER_MIPMAPS;
+        else {
+          fprintf(stderr, "Invalid value '%s' for option %s.\n", value,
+                  option);
+          return false;
+        }
+        valid = true;
+      } else if (!strcmp(option, "--reorder"))
+        valid = Parse_Int(option, value, app.reorderBatch);
+      else if (!strcmp(option, "--output"))
+        valid = Parse_Output(value, app);
+      else if (!strcmp(option, "--parse-benchmark")) {
+        app.parseBenchmark = value;
+        valid = true;
+      } else if (!strcmp(option, "--hdr-benchmark")) {
+        app.hdrBenchmark = value;
+        valid = true;
+      } else if (!strcmp(option, "--attribute-check")) {
+        app.attributeCheck = value;
+        valid = true;
+      } else {
+        fprintf(stderr, "Unknown option: %s\n", option);
+        valid = false;
+      }
+
+      if (!valid) return false;
+    }
+  }
+
+  // validate settings, same rules as the GUI
+  if (app.W <= 0 || app.H <= 0 || app.samples <= 0 || app.batch <= 0 ||
+      app.depth <= 0) {
+    fprintf(stderr, "Width, height, spp, batch and depth must be positive.\n");
+    return false;
+  }
+
+  if (app.bvhWidth != 2 && app.bvhWidth != 4 && app.bvhWidth != 8) {
+    fprintf(stderr, "BVH width must be 2, 4 or 8.\n");
+    return false;
+  }
+
+  if (app.compressedBVH && app.bvhWidth == 2) {
+    fprintf(stderr, "Compressed BVHs must be 4 or 8-wide.\n");
+    return false;
+  }
+
+  if (app.anisotropy < 1 || app.anisotropy > 16) {
+    fprintf(stderr, "Anisotropy must be between 1 and 16.\n");
+    return false;
+  }
+
+  if (app.benchmark && !app.CPU) {
+    fprintf(stderr, "The benchmark is only available in CPU mode.\n");
+    return false;
+  }
+
+  if (app.scene > 4) {
+    fprintf(stderr, "Selected scene is unknown.\n");
+    return false;
+  }
+
+  if (app.model > 5) {
+    fprintf(stderr, "Selected model is unknown.\n");
+    return false;
+  }
+
+  return true;
+}
+
+#endif
@@ -5,6 +5,8 @@
 
 #include "host_common.hpp"
 
+#include <string.h>
+
 /////////////////////////////
 // Output buffer functions //
 /////////////////////////////
@@ -107,6 +109,21 @@ Buffer createBuffer(std::vector<float3> &list, Context &g_context) {
   return buffer;
 }
 
+// Create float4 OptiX buffer
+Buffer createBuffer(std::vector<float4> &list, Context &g_context) {
+  Buffer buffer = g_context->createBuffer(RT_BUFFER_INPUT);
+  buffer->setFormat(RT_FORMAT_FLOAT4);
+  buffer->setSize(list.size());
+
+  float4 *data = static_cast<float4 *>(buffer->map());
+
+  for (int i = 0; i < list.size(); i++) data[i] = list[i];
+
+  buffer->unmap();
+
+  return buffer;
+}
+
 // Create int OptiX buffer
 Buffer createBuffer(std::vector<int> &list, Context &g_context) {
   Buffer buffer = g_context->createBuffer(RT_BUFFER_INPUT);
@@ -137,4 +154,21 @@ Buffer createBuffer(std::vector<uint3> &list, Context &g_context) {
   return buffer;
 }
 
+// Create OptiX buffer of the given format straight from host memory, e.g. a
+// memory mapped file
+template <typename T>
+Buffer createBuffer(const T *list, int count, RTformat format,
+                    Context &g_context) {
+  Buffer buffer = g_context->createBuffer(RT_BUFFER_INPUT);
+  buffer->setFormat(format);
+  buffer->setSize(count);
+
+  if (count > 0) {
+    memcpy(buffer->map(), list, count * sizeof(T));
+    buffer->unmap();
+  }
+
+  return buffer;
+}
+
 #endif
\ No newline at end of file
@@ -50,6 +50,25 @@ class Camera {
     g_context["camera_lens_radius"]->setFloat(lens_radius);
   }
 
+  void set(CPU_Scene &scene) {
+    scene.camera.lower_left_corner = lower_left_corner;
+    scene.camera.horizontal = horizontal;
+    scene.camera.vertical = vertical;
+    scene.camera.origin = origin;
+    scene.camera.u = u;
+    scene.camera.v = v;
+    scene.camera.time0 = time0;
+    scene.camera.time1 = time1;
+    scene.camera.lens_radius = lens_radius;
+  }
+
+  void set(App_State &app) {
+    if (app.CPU)
+      set(app.cpuScene);
+    else
+      set(app.context);
+  }
+
  private:
   float3 origin;
   float3 lower_left_corner;
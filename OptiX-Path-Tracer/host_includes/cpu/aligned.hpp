@@ -0,0 +1,57 @@
+#ifndef ALIGNEDH
+#define ALIGNEDH
+
+// aligned.hpp: Define an allocator for cache line aligned std::vectors
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+// Size in bytes of a cache line
+#define CACHE_LINE_SIZE 64
+
+// Allocator returning blocks aligned to 'Alignment' bytes. The pointer
+// returned by malloc is kept right before the aligned block.
+template <typename T, size_t Alignment = CACHE_LINE_SIZE>
+struct Aligned_Allocator {
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind {
+    typedef Aligned_Allocator<U, Alignment> other;
+  };
+
+  Aligned_Allocator() {}
+
+  template <typename U>
+  Aligned_Allocator(const Aligned_Allocator<U, Alignment> &) {}
+
+  T *allocate(size_t n) {
+    void *raw = malloc(n * sizeof(T) + Alignment + sizeof(void *));
+    if (!raw) throw std::bad_alloc();
+
+    uintptr_t aligned = ((uintptr_t)raw + sizeof(void *) + Alignment - 1) &
+                        ~(uintptr_t)(Alignment - 1);
+    ((void **)aligned)[-1] = raw;
+
+    return (T *)aligned;
+  }
+
+  void deallocate(T *p, size_t) {
+    if (p) free(((void **)p)[-1]);
+  }
+};
+
+template <typename T, typename U, size_t A>
+bool operator==(const Aligned_Allocator<T, A> &,
+                const Aligned_Allocator<U, A> &) {
+  return true;
+}
+
+template <typename T, typename U, size_t A>
+bool operator!=(const Aligned_Allocator<T, A> &,
+                const Aligned_Allocator<U, A> &) {
+  return false;
+}
+
+#endif
@@ -0,0 +1,590 @@
+#ifndef CPUBENCHMARKH
+#define CPUBENCHMARKH
+
+// benchmark.hpp: Measure the ray throughput of the CPU backend for every BVH
+// width and node format, on camera rays and incoherent secondary rays, and
+// compare the render time of its integrators and ray orders
+
+#include "wavefront.hpp"
+
+// Traces a ray set with the BVHs selected for the scene, returns the time
+// spent in seconds. Hit distances are stored for the consistency check.
+float traceRays(CPU_Scene &scene, Thread_Pool &pool,
+                const std::vector<Ray> &rays, std::vector<float> &distances) {
+  const int chunk = 1024;
+  int chunks = ((int)rays.size() + chunk - 1) / chunk;
+  distances.resize(rays.size());
+
+  auto t0 = std::chrono::system_clock::now();
+  pool.parallel_for(chunks, [&](int c) {
+    int end = std::min((c + 1) * chunk, (int)rays.size());
+    for (int i = c * chunk; i < end; i++) {
+      uint seed = i;
+      CPU_Hit hit;
+      bool found = traceScene(scene, rays[i], 0.f, seed, hit);
+      distances[i] = found ? hit.t : -1.f;
+    }
+  });
+  auto t1 = std::chrono::system_clock::now();
+
+  return std::chrono::duration<float>(t1 - t0).count();
+}
+
+// Traces a width x height grid of camera rays in packets, with the same
+// results and timing as traceRays
+float tracePackets(const CPU_Scene &scene, Thread_Pool &pool,
+                   const std::vector<Ray> &rays, int width, int height,
+                   std::vector<float> &distances, Packet_Stats &total) {
+  int packetsX = (width + PACKET_SIZE - 1) / PACKET_SIZE;
+  int packetsY = (height + PACKET_SIZE - 1) / PACKET_SIZE;
+  std::vector<Packet_Stats> stats(pool.size());
+  distances.resize(rays.size());
+
+  auto t0 = std::chrono::system_clock::now();
+  pool.parallel_for(packetsX * packetsY, [&](int p) {
+    int x0 = (p % packetsX) * PACKET_SIZE, y0 = (p / packetsX) * PACKET_SIZE;
+    int x1 = std::min(x0 + PACKET_SIZE, width);
+    int y1 = std::min(y0 + PACKET_SIZE, height);
+
+    Ray_Packet packet;
+    CPU_Hit hits[PACKET_RAYS];
+    uint64_t mask = 0;
+
+    for (int y = y0; y < y1; y++)
+      for (int x = x0; x < x1; x++) {
+        int r = (y - y0) * PACKET_SIZE + (x - x0);
+        const Ray &ray = rays[width * y + x];
+        packet.setRay(r, ray.origin, ray.direction, ray.tmin, ray.tmax);
+        packet.time[r] = 0.f;
+        packet.seed[r] = width * y + x;
+        mask |= 1ull << r;
+      }
+
+    tracePacket(scene, packet, mask, hits, &stats[Thread_Pool::threadIndex()]);
+
+    for (int y = y0; y < y1; y++)
+      for (int x = x0; x < x1; x++) {
+        const CPU_Hit &hit = hits[(y - y0) * PACKET_SIZE + (x - x0)];
+        distances[width * y + x] = hit.instance >= 0 ? hit.t : -1.f;
+      }
+  });
+  auto t1 = std::chrono::system_clock::now();
+
+  total = Packet_Stats();
+  for (size_t i = 0; i < stats.size(); i++) total.add(stats[i]);
+
+  return std::chrono::duration<float>(t1 - t0).count();
+}
+
+// Compares packet traversal of the camera rays with single ray traversal in
+// the BVHs selected for the scene
+void benchmarkPackets(CPU_Scene &scene, Thread_Pool &pool,
+                      const std::vector<Ray> &primary, int width, int height) {
+  if (scene.hasVolumes) {
+    printf("Packets: skipped, volumes need the single ray traversal order\n");
+    return;
+  }
+
+  std::vector<float> expected, result;
+  Packet_Stats stats;
+
+  // best of three runs
+  float single = FLT_MAX, packets = FLT_MAX;
+  for (int run = 0; run < 3; run++) {
+    single = std::min(single, traceRays(scene, pool, primary, expected));
+    packets = std::min(packets, tracePackets(scene, pool, primary, width,
+                                             height, result, stats));
+  }
+
+  int mismatches = 0;
+  for (int i = 0; i < (int)result.size(); i++)
+    if (fabsf(result[i] - expected[i]) > 1e-4f * fabsf(expected[i]))
+      mismatches++;
+
+  float speed = primary.size() / (1e6f * packets);
+  printf("Packets primary  : %8d rays, %7.2f Mrays/s, %d mismatches, %.1f%% "
+         "of single ray speed\n",
+         (int)primary.size(), speed, mismatches, 100.f * single / packets);
+  printf("Packets: %.1f nodes tested per packet, %.2f single ray traversals "
+         "per ray\n",
+         stats.nodes / (float)std::max(stats.packets, 1LL),
+         stats.singleRays / (float)std::max((int)primary.size(), 1));
+}
+
+// Compares the SIMD intersection of analytic leaves with the scalar one, for
+// single rays and for packets of camera rays
+void benchmarkPrimitiveLanes(CPU_Scene &scene, Thread_Pool &pool,
+                             const std::vector<Ray> *sets[2],
+                             const char *names[2], int width, int height) {
+  bool simd = false;
+  for (int g = 0; g < (int)scene.geometries.size(); g++)
+    simd |= scene.geometries[g].lanes.kernels > 0;
+  if (!simd) return;
+
+  for (int s = 0; s < 3; s++) {
+    // the last set is the camera rays traced in packets
+    bool packets = s == 2;
+    if (packets && scene.hasVolumes) continue;
+
+    const std::vector<Ray> &rays = *sets[packets ? 0 : s];
+    std::vector<float> result[2];
+    Packet_Stats stats;
+    float time[2];
+
+    for (int lanes = 0; lanes < 2; lanes++) {
+      scene.primitiveLanes = lanes == 1;
+
+      // best of three runs
+      time[lanes] = FLT_MAX;
+      for (int run = 0; run < 3; run++)
+        time[lanes] = std::min(
+            time[lanes],
+            packets ? tracePackets(scene, pool, rays, width, height,
+                                   result[lanes], stats)
+                    : traceRays(scene, pool, rays, result[lanes]));
+    }
+
+    int mismatches = 0;
+    for (int i = 0; i < (int)rays.size(); i++)
+      if (result[0][i] != result[1][i]) mismatches++;
+
+    printf("SIMD primitives %-9s: %7.2f Mrays/s scalar, %7.2f Mrays/s SIMD, "
+           "%.2fx, %d mismatches\n",
+           packets ? "packets" : names[s], rays.size() / (1e6f * time[0]),
+           rays.size() / (1e6f * time[1]), time[0] / time[1], mismatches);
+  }
+
+  scene.primitiveLanes = true;
+}
+
+// One object per texture, calling its children through virtual calls like the
+// callable programs the texture table replaced, for the texture benchmark
+struct Texture_Program {
+  virtual ~Texture_Program() {}
+  virtual float3 sample(float u, float v, const float3 &p, int i) const = 0;
+
+  std::vector<const Texture_Program *> children;
+};
+
+struct Constant_Program : public Texture_Program {
+  Constant_Program(const float3 &color) : color(color) {}
+
+  virtual float3 sample(float /* u */, float /* v */, const float3 & /* p */,
+                        int /* i */) const override {
+    return color;
+  }
+
+  float3 color;
+};
+
+struct Image_Program : public Texture_Program {
+  Image_Program(const CPU_Image &image) : image(image) {}
+
+  virtual float3 sample(float u, float v, const float3 & /* p */,
+                        int /* i */) const override {
+    return make_float3(tex2D(image.levels[0], u, v));
+  }
+
+  const CPU_Image &image;
+};
+
+// Noise and gradient textures, evaluated as a table of a single entry
+struct Leaf_Program : public Texture_Program {
+  Leaf_Program(const CPU_Scene &scene, const Texture_Entry &tex)
+      : table(scene.textureTable), tex(tex) {}
+
+  virtual float3 sample(float u, float v, const float3 &p,
+                        int i) const override {
+    return Evaluate_Texture(*this, 0, u, v, p, i);
+  }
+
+  // the entry is the only texture of its table
+  const Texture_Entry &entry(int /* i */) const { return tex; }
+  int child(int /* i */) const { return 0; }
+  float4 image(int data, float u, float v,
+               const Texture_Footprint &footprint) const {
+    return table.image(data, u, v, footprint);
+  }
+  float3 noiseVector(int n, int i) const { return table.noiseVector(n, i); }
+  int permutation(int n, int axis, int i) const {
+    return table.permutation(n, axis, i);
+  }
+
+  CPU_Texture_Table table;
+  Texture_Entry tex;
+};
+
+struct Checker_Program : public Texture_Program {
+  virtual float3 sample(float u, float v, const float3 &p,
+                        int /* i */) const override {
+    float sines = sinf(10 * p.x) * sinf(10 * p.y) * sinf(10 * p.z);
+
+    if (sines < 0)
+      return children[0]->sample(u, v, p, 0);
+    else
+      return children[1]->sample(u, v, p, 0);
+  }
+};
+
+struct Vector_Program : public Texture_Program {
+  virtual float3 sample(float u, float v, const float3 &p,
+                        int i) const override {
+    if (i >= (int)children.size() || i < 0)
+      return make_float3(0.f);
+    else
+      return children[i]->sample(u, v, p, 0);
+  }
+};
+
+// Creates the program tree of a texture table entry, the programs are
+// appended to 'programs' to be deleted by the caller
+const Texture_Program *createTextureProgram(
+    const CPU_Scene &scene, int index,
+    std::vector<Texture_Program *> &programs) {
+  const Texture_Entry &tex = scene.textures[index];
+
+  Texture_Program *program;
+  if (tex.type == CONSTANT_TEXTURE)
+    program = new Constant_Program(tex.colors[0]);
+  else if (tex.type == IMAGE_TEXTURE)
+    program = new Image_Program(scene.images[tex.data]);
+  else if (tex.type == CHECKER_TEXTURE)
+    program = new Checker_Program();
+  else if (tex.type == VECTOR_TEXTURE)
+    program = new Vector_Program();
+  else
+    program = new Leaf_Program(scene, tex);
+  programs.push_back(program);
+
+  for (int c = 0; c < tex.count; c++)
+    program->children.push_back(createTextureProgram(
+        scene, scene.textureChildren[tex.first + c], programs));
+
+  return program;
+}
+
+// Texture lookup of a camera ray hit
+struct Texture_Lookup {
+  int texture;  // texture table index
+  int index;    // texture index of the hit record
+  float u, v;
+  float3 P;
+};
+
+// Compares the cost per sample of the flat texture table with the tree of
+// callable programs, on the textures seen by the camera rays
+void benchmarkTextures(const CPU_Scene &scene,
+                       const std::vector<Ray> &primary) {
+  std::vector<Texture_Lookup> lookups;
+  for (int i = 0; i < (int)primary.size(); i++) {
+    uint seed = i;
+    CPU_Hit hit;
+    if (!traceScene(scene, primary[i], 0.f, seed, hit)) continue;
+
+    const CPU_Material &material = scene.materials[getMaterial(scene, hit)];
+    if (material.textures[0] < 0) continue;
+
+    HitRecord rec = getHitRecord(scene, hit, primary[i], 0.f);
+    Texture_Lookup lookup = {material.textures[0], rec.index, rec.u, rec.v,
+                             rec.P};
+    lookups.push_back(lookup);
+  }
+  if (lookups.empty()) return;
+
+  std::vector<Texture_Program *> owner;
+  std::vector<const Texture_Program *> programs(scene.textures.size());
+  for (int t = 0; t < (int)scene.textures.size(); t++)
+    programs[t] = createTextureProgram(scene, t, owner);
+
+  std::vector<float3> table(lookups.size()), tree(lookups.size());
+  float tableTime = FLT_MAX, treeTime = FLT_MAX;
+
+  // best of three runs
+  for (int run = 0; run < 3; run++) {
+    auto t0 = std::chrono::system_clock::now();
+    for (int i = 0; i < (int)lookups.size(); i++) {
+      const Texture_Lookup &l = lookups[i];
+      table[i] = sampleTexture(scene, l.texture, l.u, l.v, l.P, l.index);
+    }
+    auto t1 = std::chrono::system_clock::now();
+    for (int i = 0; i < (int)lookups.size(); i++) {
+      const Texture_Lookup &l = lookups[i];
+      tree[i] = programs[l.texture]->sample(l.u, l.v, l.P, l.index);
+    }
+    auto t2 = std::chrono::system_clock::now();
+
+    tableTime =
+        std::min(tableTime, std::chrono::duration<float>(t1 - t0).count());
+    treeTime =
+        std::min(treeTime, std::chrono::duration<float>(t2 - t1).count());
+  }
+
+  for (int i = 0; i < (int)owner.size(); i++) delete owner[i];
+
+  int mismatches = 0;
+  for (int i = 0; i < (int)lookups.size(); i++)
+    if (table[i].x != tree[i].x || table[i].y != tree[i].y ||
+        table[i].z != tree[i].z)
+      mismatches++;
+
+  float n = (float)lookups.size();
+  printf("Texture samples: %d, %.1f ns flat table, %.1f ns program tree, ",
+         (int)lookups.size(), 1e9f * tableTime / n, 1e9f * treeTime / n);
+  printf("%.2fx, %d mismatches\n", treeTime / tableTime, mismatches);
+}
+
+// Bytes used by the mesh BVHs in the selected width and format, nodes and
+// primitive indices, per mesh triangle
+float meshBVHBytes(const CPU_Scene &scene) {
+  size_t bytes = 0, triangles = 0;
+
+  for (int g = 0; g < (int)scene.geometries.size(); g++) {
+    const CPU_Geometry &geometry = scene.geometries[g];
+    if (geometry.mesh < 0) continue;
+
+    triangles += scene.meshes[geometry.mesh].indices.size();
+    if (scene.bvhWidth == 2)
+      bytes += geometry.bvh.nodes.size() * sizeof(BVH_Node) +
+               geometry.bvh.indices.size() * sizeof(int);
+    else if (scene.bvhWidth == 4 && scene.compressedBVH)
+      bytes += geometry.qbvh4.nodes.size() * sizeof(Quantized_BVH_Node<4>) +
+               geometry.qbvh4.indices.size() * sizeof(int);
+    else if (scene.bvhWidth == 4)
+      bytes += geometry.bvh4.nodes.size() * sizeof(Wide_BVH_Node<4>) +
+               geometry.bvh4.indices.size() * sizeof(int);
+    else if (scene.compressedBVH)
+      bytes += geometry.qbvh8.nodes.size() * sizeof(Quantized_BVH_Node<8>) +
+               geometry.qbvh8.indices.size() * sizeof(int);
+    else
+      bytes += geometry.bvh8.nodes.size() * sizeof(Wide_BVH_Node<8>) +
+               geometry.bvh8.indices.size() * sizeof(int);
+  }
+
+  return (float)bytes / std::max(triangles, (size_t)1);
+}
+
+// Traversal counters of a mesh instance's binary BVH, for the given rays
+BVH_Stats measureTraversal(const CPU_Scene &scene, const CPU_Instance &instance,
+                           const BVH &bvh, Thread_Pool &pool,
+                           const std::vector<Ray> &rays) {
+  const CPU_Mesh &mesh =
+      scene.meshes[scene.geometries[instance.geometry].mesh];
+  std::vector<BVH_Stats> stats(pool.size());
+
+  pool.parallel_blocks((int)rays.size(), 1024, [&](int begin, int end) {
+    BVH_Stats &threadStats = stats[Thread_Pool::threadIndex()];
+
+    for (int i = begin; i < end; i++) {
+      float3 origin = transformPoint(instance.toObject, rays[i].origin);
+      float3 direction = transformVector(instance.toObject, rays[i].direction);
+      float tmax = rays[i].tmax;
+
+      auto intersect = [&](int face, float &t) {
+        float2 bc;
+        return intersectTriangle(mesh, face, origin, direction, rays[i].tmin,
+                                 t, bc);
+      };
+
+      traverseBVH(bvh, origin, direction, rays[i].tmin, tmax, intersect,
+                  &threadStats);
+    }
+  });
+
+  BVH_Stats total;
+  for (size_t i = 0; i < stats.size(); i++) total.add(stats[i]);
+  return total;
+}
+
+// Compares the traversal steps of the spatial split BVHs of the scene meshes
+// with the BVHs they would get from the regular builder
+void reportSpatialSplits(CPU_Scene &scene, Thread_Pool &pool,
+                         const std::vector<Ray> *sets[2],
+                         const char *names[2]) {
+  for (int i = 0; i < (int)scene.instances.size(); i++) {
+    const CPU_Instance &instance = scene.instances[i];
+    const CPU_Geometry &geometry = scene.geometries[instance.geometry];
+    if (geometry.mesh < 0 || geometry.splitBudget <= 0.f) continue;
+
+    std::vector<Aabb> bounds(scene.meshes[geometry.mesh].indices.size());
+    for (int f = 0; f < (int)bounds.size(); f++)
+      bounds[f] = getBounds(scene.meshes[geometry.mesh], f);
+
+    BVH regular;
+    if (scene.linearBVH)
+      buildLBVH(regular, bounds, &pool);
+    else
+      buildBVH(regular, bounds, &pool);
+
+    for (int s = 0; s < 2; s++) {
+      BVH_Stats before = measureTraversal(scene, instance, regular, pool,
+                                          *sets[s]);
+      BVH_Stats after = measureTraversal(scene, instance, geometry.bvh, pool,
+                                         *sets[s]);
+      float rays = (float)std::max(before.rays, 1LL);
+
+      printf("Mesh %d %-9s: %.1f nodes, %.1f triangles per ray without "
+             "spatial splits, %.1f nodes, %.1f triangles with them\n",
+             i, names[s], before.nodes / rays, before.primitives / rays,
+             after.nodes / rays, after.primitives / rays);
+    }
+  }
+}
+
+// Generates one camera ray per pixel, and one ray in a random direction from
+// every camera ray hit point. Then reports the Mrays/s and mesh memory of each
+// BVH width and node format, the speed of packet traversal, SIMD primitive
+// intersection and texture sampling, and the traversal steps saved by spatial
+// splits.
+void benchmarkTraversal(CPU_Scene &scene, Thread_Pool &pool, int width,
+                        int height) {
+  int selectedWidth = scene.bvhWidth;
+  bool selectedCompression = scene.compressedBVH;
+
+  std::vector<Ray> primary(width * height);
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      uint seed = tea<64>(width * y + x, 0);
+      float u = float(x + rnd(seed)) / width;
+      float v = float(y + rnd(seed)) / height;
+      primary[width * y + x] = generateRay(scene.camera, u, v, seed);
+    }
+
+  // the binary BVH results are the reference
+  scene.bvhWidth = 2;
+  scene.compressedBVH = false;
+  buildWideBVHs(scene, pool);
+
+  std::vector<float> reference;
+  traceRays(scene, pool, primary, reference);
+
+  std::vector<Ray> secondary;
+  for (int i = 0; i < (int)primary.size(); i++) {
+    if (reference[i] < 0.f) continue;
+
+    uint seed = tea<64>(i, 1);
+    const Ray &ray = primary[i];
+    secondary.push_back(make_Ray(ray.origin + reference[i] * ray.direction,
+                                 random_on_unit_sphere(seed), 0, 1e-3f,
+                                 RT_DEFAULT_MAX));
+  }
+
+  const std::vector<Ray> *sets[2] = {&primary, &secondary};
+  const char *names[2] = {"primary", "secondary"};
+
+  // compressed formats come after the uncompressed ones of the same width
+  const int widths[5] = {2, 4, 8, 4, 8};
+  const bool compressed[5] = {false, false, false, true, true};
+  float speed[5][2];
+
+  std::vector<float> expected[2];
+  expected[0] = reference;
+  traceRays(scene, pool, secondary, expected[1]);
+
+  for (int f = 0; f < 5; f++) {
+    scene.bvhWidth = widths[f];
+    scene.compressedBVH = compressed[f];
+    buildWideBVHs(scene, pool);
+
+    const char *format = compressed[f] ? "QBVH" : "BVH";
+    float bytes = meshBVHBytes(scene);
+    if (bytes > 0.f)
+      printf("%s%d: %.1f bytes per mesh triangle\n", format, widths[f], bytes);
+
+    for (int s = 0; s < 2; s++) {
+      std::vector<float> result;
+
+      // best of three runs
+      float time = FLT_MAX;
+      for (int run = 0; run < 3; run++)
+        time = std::min(time, traceRays(scene, pool, *sets[s], result));
+
+      int mismatches = 0;
+      for (int i = 0; i < (int)result.size(); i++)
+        if (fabsf(result[i] - expected[s][i]) > 1e-4f * fabsf(expected[s][i]))
+          mismatches++;
+
+      speed[f][s] = sets[s]->size() / (1e6f * time);
+      printf("%s%d %-9s: %8d rays, %7.2f Mrays/s, %d mismatches", format,
+             widths[f], names[s], (int)sets[s]->size(), speed[f][s],
+             mismatches);
+
+      // relative speed of the compressed format
+      if (compressed[f])
+        printf(", %.1f%% of BVH%d speed",
+               100.f * speed[f][s] / speed[widths[f] / 4][s], widths[f]);
+      printf("\n");
+    }
+  }
+
+  scene.bvhWidth = selectedWidth;
+  scene.compressedBVH = selectedCompression;
+  buildWideBVHs(scene, pool);
+
+  benchmarkPackets(scene, pool, primary, width, height);
+  benchmarkPrimitiveLanes(scene, pool, sets, names, width, height);
+  benchmarkTextures(scene, primary);
+  reportSpatialSplits(scene, pool, sets, names);
+}
+
+// Renders 'samples' samples per pixel with the per path and the wavefront
+// integrators, reporting their render times and the pixels that differ. Then
+// reports the intersection speed of the wavefront rays from the second bounce
+// on, with and without ray reordering, and the render time of the per path
+// integrator with packets of camera rays.
+void benchmarkIntegrators(CPU_Scene &scene, Thread_Pool &pool, int width,
+                          int height, int samples) {
+  int selectedReorder = scene.reorderBatch;
+  bool selectedPackets = scene.packets;
+  std::vector<float4> acc[5];
+  std::vector<uchar4> display[5];
+  Wavefront_Stats stats[5];
+  float time[5];
+
+  // per path, wavefront as selected, wavefront without and with reordering,
+  // then per path with packets
+  const int reorder[5] = {0, selectedReorder, 0,
+                          selectedReorder > 0 ? selectedReorder : 256, 0};
+
+  for (int i = 0; i < 5; i++) {
+    acc[i].resize(width * height);
+    display[i].resize(width * height);
+    scene.reorderBatch = reorder[i];
+    scene.packets = i == 4;
+
+    auto t0 = std::chrono::system_clock::now();
+    if (i == 0 || i == 4)
+      renderFrame(scene, pool, width, height, 0, samples, acc[i].data(),
+                  display[i].data());
+    else
+      renderWavefront(scene, pool, width, height, 0, samples, acc[i].data(),
+                      display[i].data(), &stats[i]);
+    auto t1 = std::chrono::system_clock::now();
+    time[i] = std::chrono::duration<float>(t1 - t0).count();
+  }
+
+  scene.reorderBatch = selectedReorder;
+  scene.packets = selectedPackets;
+
+  int differences[5] = {0, 0, 0, 0, 0};
+  for (int f = 1; f < 5; f++)
+    for (int i = 0; i < width * height; i++)
+      if (memcmp(&acc[0][i], &acc[f][i], sizeof(float4))) differences[f]++;
+
+  printf("Per path integrator : %.2fs for %d spp\n", time[0], samples);
+  printf("Wavefront integrator: %.2fs, %.2fx speedup, %d different pixels\n",
+         time[1], time[0] / time[1], differences[1]);
+
+  for (int f = 2; f < 4; f++) {
+    float speed = stats[f].rays / (1e6f * std::max(stats[f].seconds, 1e-6f));
+    printf("Bounce 2+ rays, reorder %4d: %lld rays, %7.2f Mrays/s, %.3fs "
+           "sorting, %.2fs total, %d different pixels\n",
+           reorder[f], stats[f].rays, speed, stats[f].sortSeconds, time[f],
+           differences[f]);
+  }
+
+  if (!scene.hasVolumes)
+    printf("Packet camera rays  : %.2fs, %.2fx speedup, %d different pixels\n",
+           time[4], time[0] / time[4], differences[4]);
+}
+
+#endif
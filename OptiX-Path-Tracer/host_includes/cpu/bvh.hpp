@@ -0,0 +1,435 @@
+#ifndef BVHH
+#define BVHH
+
+// bvh.hpp: Define the bounding volume hierarchy used by the CPU backend
+
+#include <float.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "../../programs/vec.hpp"
+#include "aligned.hpp"
+#include "thread_pool.hpp"
+
+// Number of bins per axis evaluated by the SAH builder
+#define BVH_SAH_BINS 16
+
+// SAH costs of a node traversal and of a primitive intersection
+#define BVH_TRAVERSAL_COST 1.f
+#define BVH_INTERSECTION_COST 1.f
+
+// Nodes with more primitives than this are split in parallel tasks
+#define BVH_TASK_THRESHOLD 4096
+
+// Deepest SAH split, deeper nodes split at their median centroid. SAH splits
+// can peel a few primitives per level off badly clustered centroids, median
+// splits keep trees of up to 2^31 primitives within 61 levels, under the 64
+// entries of the traversal stacks.
+#define BVH_MAX_SAH_DEPTH 30
+
+// Flattened BVH node, two nodes per cache line. The children of an interior
+// node are stored next to each other, at 'offset' and 'offset + 1', so they
+// share a cache line. Leaves store the position of their first primitive in
+// the BVH index array.
+struct alignas(32) BVH_Node {
+  float3 bmin;
+  int offset;
+  float3 bmax;
+  int count;  // number of primitives, zero for interior nodes
+};
+
+struct BVH {
+  std::vector<BVH_Node, Aligned_Allocator<BVH_Node> > nodes;
+  std::vector<int> indices;  // primitive indices referenced by the leaves
+};
+
+// Bounds used by the builder, min_vec/max_vec are cheaper than the fminf based
+// Aabb::include in the binning loops
+struct BVH_Bounds {
+  BVH_Bounds() : bmin(make_float3(FLT_MAX)), bmax(make_float3(-FLT_MAX)) {}
+
+  void include(const float3 &p) {
+    bmin = min_vec(bmin, p);
+    bmax = max_vec(bmax, p);
+  }
+
+  void include(const float3 &lo, const float3 &hi) {
+    bmin = min_vec(bmin, lo);
+    bmax = max_vec(bmax, hi);
+  }
+
+  void include(const BVH_Bounds &b) { include(b.bmin, b.bmax); }
+
+  float extent(int axis) const { return (&bmax.x)[axis] - (&bmin.x)[axis]; }
+
+  float area() const {
+    float3 d = bmax - bmin;
+    if (d.x < 0.f || d.y < 0.f || d.z < 0.f) return 0.f;
+
+    return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  float3 bmin, bmax;
+};
+
+// Primitive reference sorted by the builder, kept contiguous so that binning
+// and partitioning don't go through the index array
+struct BVH_Reference {
+  float3 bmin;
+  int prim;
+  float3 bmax;
+  float pad;
+
+  float centroid(int axis) const {
+    return 0.5f * ((&bmin.x)[axis] + (&bmax.x)[axis]);
+  }
+};
+
+// Binned SAH builder. Each node bins the centroids of its primitives along the
+// three axes in a single pass and splits at the cheapest bin boundary. Large
+// subtrees are built as tasks of the thread pool, child pairs being allocated
+// atomically from the node array.
+class BVH_Builder {
+ public:
+  BVH_Builder(BVH &b, const std::vector<Aabb> &bounds, Thread_Pool *p,
+              int leafSize)
+      : bvh(b), pool(p), maxLeafSize(leafSize) {
+    int n = (int)bounds.size();
+
+    refs.resize(n);
+    for (int i = 0; i < n; i++) {
+      refs[i].bmin = bounds[i].m_min;
+      refs[i].bmax = bounds[i].m_max;
+      refs[i].prim = i;
+    }
+  }
+
+  void build() {
+    int n = (int)refs.size();
+
+    // a binary tree has at most 2n - 1 nodes, node 1 is left unused so that
+    // child pairs start at even indices
+    bvh.nodes.resize(2 * n + 1);
+    nodeCount = 2;
+
+    BVH_Bounds box, centroidBox;
+    computeBounds(0, n, box, centroidBox);
+    buildNode(0, 0, n, box, centroidBox, 0);
+    if (pool) pool->wait(group);
+
+    bvh.nodes.resize(nodeCount);
+    bvh.indices.resize(n);
+    for (int i = 0; i < n; i++) bvh.indices[i] = refs[i].prim;
+  }
+
+ private:
+  struct Bin {
+    BVH_Bounds box;
+    int count;
+  };
+
+  void computeBounds(int begin, int end, BVH_Bounds &box,
+                     BVH_Bounds &centroidBox) const {
+    for (int i = begin; i < end; i++) {
+      box.include(refs[i].bmin, refs[i].bmax);
+      centroidBox.include(0.5f * (refs[i].bmin + refs[i].bmax));
+    }
+  }
+
+  void computeCentroidBounds(int begin, int end,
+                             BVH_Bounds &centroidBox) const {
+    for (int i = begin; i < end; i++)
+      centroidBox.include(0.5f * (refs[i].bmin + refs[i].bmax));
+  }
+
+  static int binIndex(float c, float cmin, float scale) {
+    int bin = (int)((c - cmin) * scale);
+    return std::min(std::max(bin, 0), BVH_SAH_BINS - 1);
+  }
+
+  // Builds the node of the references in [begin, end), given their bounds
+  void buildNode(int nodeIndex, int begin, int end, const BVH_Bounds &box,
+                 const BVH_Bounds &centroidBox, int depth) {
+    BVH_Node &node = bvh.nodes[nodeIndex];
+    node.bmin = box.bmin;
+    node.bmax = box.bmax;
+
+    int count = end - begin;
+    if (count == 1) {
+      node.offset = begin;
+      node.count = count;
+      return;
+    }
+
+    // bin the references along every axis with a non empty centroid extent,
+    // unless the node is too deep for SAH splits
+    bool median = depth >= BVH_MAX_SAH_DEPTH;
+    Bin bins[3][BVH_SAH_BINS];
+    float cmin[3], scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+      float extent = centroidBox.extent(axis);
+      cmin[axis] = (&centroidBox.bmin.x)[axis];
+      scale[axis] = extent > 0.f && !median ? BVH_SAH_BINS / extent : 0.f;
+
+      for (int b = 0; b < BVH_SAH_BINS; b++) bins[axis][b].count = 0;
+    }
+
+    for (int i = begin; i < end && !median; i++) {
+      const BVH_Reference &ref = refs[i];
+      float3 centroid = 0.5f * (ref.bmin + ref.bmax);
+
+      for (int axis = 0; axis < 3; axis++) {
+        float c = (&centroid.x)[axis];
+        Bin &bin = bins[axis][binIndex(c, cmin[axis], scale[axis])];
+        bin.box.include(ref.bmin, ref.bmax);
+        bin.count++;
+      }
+    }
+
+    // find the cheapest split, keeping the bounds of both sides
+    float bestCost = FLT_MAX, area = box.area();
+    int bestAxis = 0, splitBin = 0;
+    BVH_Bounds bestBox[2];
+
+    for (int axis = 0; axis < 3 && area > 0.f; axis++) {
+      if (scale[axis] == 0.f) continue;
+
+      // sweep from the right, storing the bounds and counts of the right side
+      BVH_Bounds rightBox[BVH_SAH_BINS], accBox;
+      int rightCount[BVH_SAH_BINS], accCount = 0;
+      for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+        accBox.include(bins[axis][b].box);
+        accCount += bins[axis][b].count;
+        rightBox[b] = accBox;
+        rightCount[b] = accCount;
+      }
+
+      // sweep from the left, evaluating the split before every bin
+      BVH_Bounds leftBox;
+      int leftCount = 0;
+      for (int b = 1; b < BVH_SAH_BINS; b++) {
+        leftBox.include(bins[axis][b - 1].box);
+        leftCount += bins[axis][b - 1].count;
+        if (leftCount == 0 || rightCount[b] == 0) continue;
+
+        float cost = BVH_TRAVERSAL_COST +
+                     BVH_INTERSECTION_COST *
+                         (leftCount * leftBox.area() +
+                          rightCount[b] * rightBox[b].area()) /
+                         area;
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          splitBin = b;
+          bestBox[0] = leftBox;
+          bestBox[1] = rightBox[b];
+        }
+      }
+    }
+
+    // create a leaf if splitting doesn't pay off
+    float leafCost = BVH_INTERSECTION_COST * count;
+    if (count <= maxLeafSize && leafCost <= bestCost) {
+      node.offset = begin;
+      node.count = count;
+      return;
+    }
+
+    int mid;
+    BVH_Bounds centroidBoxes[2];
+    if (splitBin > 0) {
+      const float c0 = cmin[bestAxis], s = scale[bestAxis];
+      mid = (int)(std::partition(refs.begin() + begin, refs.begin() + end,
+                                 [&](const BVH_Reference &ref) {
+                                   return binIndex(ref.centroid(bestAxis), c0,
+                                                   s) < splitBin;
+                                 }) -
+                  refs.begin());
+
+      computeCentroidBounds(begin, mid, centroidBoxes[0]);
+      computeCentroidBounds(mid, end, centroidBoxes[1]);
+    } else {
+      // all centroids overlap, or the node is too deep, split in the middle
+      mid = (begin + end) / 2;
+      if (median) {
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+          if (centroidBox.extent(a) > centroidBox.extent(axis)) axis = a;
+
+        std::nth_element(refs.begin() + begin, refs.begin() + mid,
+                         refs.begin() + end,
+                         [axis](const BVH_Reference &a,
+                                const BVH_Reference &b) {
+                           return a.centroid(axis) < b.centroid(axis);
+                         });
+      }
+
+      bestBox[0] = bestBox[1] = BVH_Bounds();
+      computeBounds(begin, mid, bestBox[0], centroidBoxes[0]);
+      computeBounds(mid, end, bestBox[1], centroidBoxes[1]);
+    }
+
+    int child = nodeCount.fetch_add(2);
+    node.offset = child;
+    node.count = 0;
+
+    BVH_Bounds leftBox = bestBox[0], leftCentroidBox = centroidBoxes[0];
+    if (pool && count > BVH_TASK_THRESHOLD)
+      pool->run(group, [=]() {
+        buildNode(child, begin, mid, leftBox, leftCentroidBox, depth + 1);
+      });
+    else
+      buildNode(child, begin, mid, leftBox, leftCentroidBox, depth + 1);
+
+    buildNode(child + 1, mid, end, bestBox[1], centroidBoxes[1], depth + 1);
+  }
+
+  BVH &bvh;
+  std::vector<BVH_Reference> refs;
+  Thread_Pool *pool;
+  Task_Group group;
+  std::atomic<int> nodeCount;
+  int maxLeafSize;
+};
+
+// Builds a BVH over a list of primitive bounds. Subtrees are built in parallel
+// if a thread pool is given.
+void buildBVH(BVH &bvh, const std::vector<Aabb> &bounds,
+              Thread_Pool *pool = nullptr, int maxLeafSize = 4) {
+  bvh.nodes.clear();
+  bvh.indices.clear();
+  if (bounds.empty()) return;
+
+  BVH_Builder builder(bvh, bounds, pool, maxLeafSize);
+  builder.build();
+}
+
+// SAH cost of a built BVH, relative to the root surface area
+float computeSAHCost(const BVH &bvh) {
+  if (bvh.nodes.empty()) return 0.f;
+
+  const BVH_Node &root = bvh.nodes[0];
+  float rootArea = Aabb(root.bmin, root.bmax).area();
+  if (rootArea <= 0.f) return 0.f;
+
+  float cost = 0.f;
+  for (int i = 0; i < (int)bvh.nodes.size(); i++) {
+    if (i == 1) continue;  // unused padding node
+
+    const BVH_Node &node = bvh.nodes[i];
+    float area = Aabb(node.bmin, node.bmax).area() / rootArea;
+
+    if (node.count > 0)
+      cost += BVH_INTERSECTION_COST * node.count * area;
+    else
+      cost += BVH_TRAVERSAL_COST * area;
+  }
+
+  return cost;
+}
+
+// Ray-box slab test, returns the entry distance in 'tnear'
+inline bool intersectNode(const BVH_Node &node, const float3 &origin,
+                          const float3 &invDir, float tmin, float tmax,
+                          float &tnear) {
+  float3 t0 = (node.bmin - origin) * invDir;
+  float3 t1 = (node.bmax - origin) * invDir;
+
+  tnear = ffmax(tmin, max_component(min_vec(t0, t1)));
+  float tfar = ffmin(tmax, min_component(max_vec(t0, t1)));
+
+  return tnear <= tfar;
+}
+
+// Intersects the primitives of a leaf, at positions [first, first + count) of
+// the BVH index array, one at a time. Intersectors that can test a whole leaf
+// at once overload it.
+template <typename Intersector>
+inline bool intersectLeaf(Intersector &intersect,
+                          const std::vector<int> &indices, int first,
+                          int count, float &tmax) {
+  bool hit = false;
+  for (int i = 0; i < count; i++) hit |= intersect(indices[first + i], tmax);
+  return hit;
+}
+
+// Traversal counters, summed over the traced rays
+struct BVH_Stats {
+  BVH_Stats() : rays(0), nodes(0), primitives(0) {}
+
+  void add(const BVH_Stats &s) {
+    rays += s.rays;
+    nodes += s.nodes;
+    primitives += s.primitives;
+  }
+
+  long long rays, nodes, primitives;
+};
+
+// Traverses the BVH front to back, calling intersect(primitive, tmax) for the
+// primitives of every leaf the ray reaches. 'intersect' returns true and
+// shrinks tmax when it finds a closer hit. Visited nodes and primitive tests
+// are counted if 'stats' is given. Only the subtree of node 'root' is
+// traversed.
+template <typename Intersector>
+bool traverseBVH(const BVH &bvh, const float3 &origin, const float3 &direction,
+                 float tmin, float &tmax, Intersector &intersect,
+                 BVH_Stats *stats = nullptr, int root = 0) {
+  if (bvh.nodes.empty()) return false;
+
+  const float3 invDir = make_float3(1.f) / direction;
+
+  if (stats) stats->rays++;
+
+  float tnear;
+  if (!intersectNode(bvh.nodes[root], origin, invDir, tmin, tmax, tnear))
+    return false;
+
+  int stack[64];
+  int stackSize = 0;
+  int current = root;
+  bool hit = false;
+
+  while (true) {
+    const BVH_Node &node = bvh.nodes[current];
+
+    if (stats) {
+      stats->nodes++;
+      if (node.count > 0) stats->primitives += node.count;
+    }
+
+    if (node.count > 0) {
+      hit |= intersectLeaf(intersect, bvh.indices, node.offset, node.count,
+                           tmax);
+    } else {
+      // visit the closest child first, and postpone the other one
+      int left = node.offset, right = node.offset + 1;
+      float tLeft, tRight;
+      bool hitLeft = intersectNode(bvh.nodes[left], origin, invDir, tmin,
+                                   tmax, tLeft);
+      bool hitRight = intersectNode(bvh.nodes[right], origin, invDir, tmin,
+                                    tmax, tRight);
+
+      if (hitLeft && hitRight) {
+        if (tRight < tLeft) std::swap(left, right);
+        stack[stackSize++] = right;
+        current = left;
+        continue;
+      } else if (hitLeft) {
+        current = left;
+        continue;
+      } else if (hitRight) {
+        current = right;
+        continue;
+      }
+    }
+
+    if (stackSize == 0) break;
+    current = stack[--stackSize];
+  }
+
+  return hit;
+}
+
+#endif
@@ -0,0 +1,431 @@
+#ifndef CPUHITABLESH
+#define CPUHITABLESH
+
+// hitables.hpp: Define the CPU versions of the intersection, bounding box and
+// hit record programs of programs/hitables. Everything here works in object
+// space, instance transforms are applied by trace.hpp.
+
+#include "../../programs/prd.cuh"
+#include "scene.hpp"
+
+////////////////////////
+// Auxiliar functions //
+////////////////////////
+
+// Sphere intersection, returns the closest root in (tmin, tmax)
+inline bool hitSphere(const float3 &center, float radius, const float3 &origin,
+                      const float3 &direction, float tmin, float tmax,
+                      float &t) {
+  const float3 oc = origin - center;
+
+  // if the ray hits the sphere, the following equation has two roots:
+  // tdot(B, B) + 2tdot(B,A-C) + dot(A-C,A-C) - R = 0
+  const float a = dot(direction, direction);
+  const float b = dot(oc, direction);
+  const float c = dot(oc, oc) - radius * radius;
+  const float discriminant = b * b - a * c;
+
+  if (discriminant < 0.f) return false;
+
+  // first root of the sphere equation
+  t = (-b - sqrtf(discriminant)) / a;
+  if (t < tmax && t > tmin) return true;
+
+  // second root of the sphere equation
+  t = (-b + sqrtf(discriminant)) / a;
+  if (t < tmax && t > tmin) return true;
+
+  return false;
+}
+
+// Box slab test, returns the entry and exit distances
+inline bool hitBox(const float3 &boxmin, const float3 &boxmax,
+                   const float3 &origin, const float3 &direction, float &t0,
+                   float &t1) {
+  float3 tA = (boxmin - origin) / direction;
+  float3 tB = (boxmax - origin) / direction;
+
+  t0 = max_component(min_vec(tA, tB));
+  t1 = min_component(max_vec(tA, tB));
+
+  return t0 <= t1;
+}
+
+// Moving sphere center at the given time
+inline float3 movingCenter(const CPU_Primitive &prim, float time) {
+  return prim.p0 + ((time - prim.time0) / (prim.time1 - prim.time0)) *
+                       (prim.p1 - prim.p0);
+}
+
+// Exponentially distributed scattering distance inside a volume boundary
+inline bool hitVolume(float rec1, float rec2, float density,
+                      const float3 &direction, float tmin, float tmax,
+                      uint &seed, float &t) {
+  if (rec1 < tmin) rec1 = tmin;
+  if (rec2 > tmax) rec2 = tmax;
+  if (rec1 >= rec2) return false;
+  if (rec1 < 0.f) rec1 = 0.f;
+
+  float distance_inside_boundary = (rec2 - rec1) * length(direction);
+  float hit_distance = -(1.f / density) * logf(rnd(seed));
+
+  // ray went through the volume without scattering
+  if (hit_distance >= distance_inside_boundary) return false;
+
+  t = rec1 + hit_distance / length(direction);
+  return true;
+}
+
+// Triangle intersection, same algorithm as programs/hitables/triangle.cu
+inline bool hitTriangle(const float3 &a, const float3 &b, const float3 &c,
+                        const float3 &origin, const float3 &direction,
+                        float tmin, float tmax, float &t, float2 &bc) {
+  float3 e1 = b - a;
+  float3 e2 = c - a;
+
+  float3 P = cross(direction, e2);
+  float A = dot(P, e1);
+
+  // Backfacing / nearly parallel, or close to the limit of precision?
+  if (fabsf(A) < 1E-8) return false;
+
+  float3 R = origin - a;
+  float u = dot(P, R) / A;
+  if (u < 0.f || u > 1.f) return false;
+
+  float3 Q = cross(R, e1);
+  float v = dot(Q, direction) / A;
+  if (v < 0.f || u + v > 1.f) return false;
+
+  t = dot(Q, e2) / A;
+  if (t < tmax && t > tmin) {
+    bc = make_float2(u, v);
+    return true;
+  }
+
+  return false;
+}
+
+////////////////////////////
+// Intersection functions //
+////////////////////////////
+
+// Intersects an analytic primitive, shrinking tmax if there's a closer hit
+bool intersectPrimitive(const CPU_Primitive &prim, const float3 &origin,
+                        const float3 &direction, float tmin, float &tmax,
+                        float time, uint &seed, float2 &bc) {
+  float t = tmax, rec1, rec2;
+  bool hit = false;
+  bc = make_float2(0.f);
+
+  switch (prim.type) {
+    case SPHERE_PRIMITIVE:
+      hit = hitSphere(prim.p0, prim.radius, origin, direction, tmin, tmax, t);
+      break;
+
+    case MOVING_SPHERE_PRIMITIVE:
+      hit = hitSphere(movingCenter(prim, time), prim.radius, origin, direction,
+                      tmin, tmax, t);
+      break;
+
+    case VOLUME_SPHERE_PRIMITIVE:
+      if (hitSphere(prim.p0, prim.radius, origin, direction, -FLT_MAX, FLT_MAX,
+                    rec1))
+        if (hitSphere(prim.p0, prim.radius, origin, direction, rec1 + 0.0001f,
+                      FLT_MAX, rec2))
+          hit = hitVolume(rec1, rec2, prim.density, direction, tmin, tmax,
+                          seed, t);
+      break;
+
+    case AARECT_PRIMITIVE: {
+      const float *o = &origin.x, *d = &direction.x;
+      int k = prim.axis, a = (k == X_AXIS) ? 1 : 0, b = (k == Z_AXIS) ? 1 : 2;
+
+      t = (prim.k - o[k]) / d[k];
+      float pa = o[a] + t * d[a];
+      float pb = o[b] + t * d[b];
+
+      if (pa < prim.a0 || pa > prim.a1 || pb < prim.b0 || pb > prim.b1)
+        hit = false;
+      else
+        hit = t < tmax && t > tmin;
+    } break;
+
+    case BOX_PRIMITIVE:
+      if (hitBox(prim.p0, prim.p1, origin, direction, rec1, rec2)) {
+        if (rec1 < tmax && rec1 > tmin) {
+          t = rec1;
+          hit = true;
+        } else if (rec2 < tmax && rec2 > tmin) {
+          t = rec2;
+          hit = true;
+        }
+      }
+      break;
+
+    case VOLUME_BOX_PRIMITIVE:
+      if (hitBox(prim.p0, prim.p1, origin, direction, rec1, rec2))
+        if (rec2 - rec1 > 0.0001f)
+          hit = hitVolume(rec1, rec2, prim.density, direction, tmin, tmax,
+                          seed, t);
+      break;
+
+    case TRIANGLE_PRIMITIVE:
+      hit = hitTriangle(prim.p0, prim.p1, prim.p2, origin, direction, tmin,
+                        tmax, t, bc);
+      break;
+
+    case CYLINDER_PRIMITIVE: {
+      // lateral surface of a cylinder aligned with the Y axis
+      float3 P0 = origin - prim.p0;
+      float a = direction.x * direction.x + direction.z * direction.z;
+      float b = direction.x * P0.x + direction.z * P0.z;
+      float c = P0.x * P0.x + P0.z * P0.z - prim.radius * prim.radius;
+      float discriminant = b * b - a * c;
+
+      if (a == 0.f || discriminant < 0.f) break;
+
+      for (int i = 0; i < 2 && !hit; i++) {
+        t = (-b + (i == 0 ? -1.f : 1.f) * sqrtf(discriminant)) / a;
+        float y = P0.y + t * direction.y;
+        hit = t < tmax && t > tmin && y >= 0.f && y <= prim.length;
+      }
+    } break;
+  }
+
+  if (hit) tmax = t;
+  return hit;
+}
+
+// Intersects a mesh triangle, shrinking tmax if there's a closer hit
+bool intersectTriangle(const CPU_Mesh &mesh, int face, const float3 &origin,
+                       const float3 &direction, float tmin, float &tmax,
+                       float2 &bc) {
+  const uint3 v_idx = mesh.indices[face];
+
+  float t;
+  if (hitTriangle(mesh.vertices[v_idx.x], mesh.vertices[v_idx.y],
+                  mesh.vertices[v_idx.z], origin, direction, tmin, tmax, t,
+                  bc)) {
+    tmax = t;
+    return true;
+  }
+
+  return false;
+}
+
+////////////////////////////
+// Bounding box functions //
+////////////////////////////
+
+// Object space bounding box of an analytic primitive
+Aabb getBounds(const CPU_Primitive &prim) {
+  Aabb box;
+
+  switch (prim.type) {
+    case SPHERE_PRIMITIVE:
+    case VOLUME_SPHERE_PRIMITIVE:
+      box.include(prim.p0 - make_float3(prim.radius));
+      box.include(prim.p0 + make_float3(prim.radius));
+      break;
+
+    case MOVING_SPHERE_PRIMITIVE:
+      box.include(prim.p0 - make_float3(prim.radius));
+      box.include(prim.p0 + make_float3(prim.radius));
+      box.include(prim.p1 - make_float3(prim.radius));
+      box.include(prim.p1 + make_float3(prim.radius));
+      break;
+
+    case AARECT_PRIMITIVE: {
+      float lo[3], hi[3];
+      int k = prim.axis, a = (k == X_AXIS) ? 1 : 0, b = (k == Z_AXIS) ? 1 : 2;
+      lo[k] = prim.k - 0.0001f;
+      hi[k] = prim.k + 0.0001f;
+      lo[a] = prim.a0;
+      hi[a] = prim.a1;
+      lo[b] = prim.b0;
+      hi[b] = prim.b1;
+      box.include(make_float3(lo[0], lo[1], lo[2]));
+      box.include(make_float3(hi[0], hi[1], hi[2]));
+    } break;
+
+    case BOX_PRIMITIVE:
+    case VOLUME_BOX_PRIMITIVE:
+      box.include(prim.p0 - make_float3(0.001f));
+      box.include(prim.p1 + make_float3(0.001f));
+      break;
+
+    case TRIANGLE_PRIMITIVE:
+      box.include(prim.p0);
+      box.include(prim.p1);
+      box.include(prim.p2);
+      box.include(box.m_min - make_float3(0.0001f));
+      box.include(box.m_max + make_float3(0.0001f));
+      break;
+
+    case CYLINDER_PRIMITIVE:
+      box.include(prim.p0 - make_float3(prim.radius, 0.f, prim.radius));
+      box.include(prim.p0 +
+                  make_float3(prim.radius, prim.length, prim.radius));
+      break;
+  }
+
+  return box;
+}
+
+// Object space bounding box of a mesh triangle
+Aabb getBounds(const CPU_Mesh &mesh, int face) {
+  const uint3 v_idx = mesh.indices[face];
+
+  Aabb box;
+  box.include(mesh.vertices[v_idx.x]);
+  box.include(mesh.vertices[v_idx.y]);
+  box.include(mesh.vertices[v_idx.z]);
+  box.include(box.m_min - make_float3(0.0001f));
+  box.include(box.m_max + make_float3(0.0001f));
+
+  return box;
+}
+
+//////////////////////////
+// Hit record functions //
+//////////////////////////
+
+// Object space hit record of an analytic primitive
+HitRecord getHitRecord(const CPU_Primitive &prim, const float3 &origin,
+                       const float3 &direction, float t, float time,
+                       float2 bc) {
+  HitRecord rec;
+  rec.t = t;
+  rec.bc = bc;
+  rec.index = 0;
+  rec.u = rec.v = 0.f;
+  rec.dpdu = rec.dpdv = make_float3(0.f);
+  rec.P = origin + t * direction;
+
+  float3 normal = make_float3(1.f, 0.f, 0.f);
+
+  switch (prim.type) {
+    case SPHERE_PRIMITIVE:
+    case MOVING_SPHERE_PRIMITIVE: {
+      float3 center =
+          prim.type == SPHERE_PRIMITIVE ? prim.p0 : movingCenter(prim, time);
+      normal = (rec.P - center) / prim.radius;
+
+      float phi = atan2f(normal.z, normal.x);
+      float theta = asinf(normal.y);
+      rec.u = 1.f - (phi + PI_F) / (2.f * PI_F);
+      rec.v = (theta + PI_F / 2.f) / PI_F;
+      Sphere_Derivatives(normal, prim.radius, rec.dpdu, rec.dpdv);
+    } break;
+
+    case AARECT_PRIMITIVE: {
+      const float *p = &rec.P.x;
+      int k = prim.axis, a = (k == X_AXIS) ? 1 : 0, b = (k == Z_AXIS) ? 1 : 2;
+
+      float n[3] = {0.f, 0.f, 0.f};
+      n[k] = prim.flip ? -1.f : 1.f;
+      normal = make_float3(n[0], n[1], n[2]);
+
+      rec.u = (p[a] - prim.a0) / (prim.a1 - prim.a0);
+      rec.v = (p[b] - prim.b0) / (prim.b1 - prim.b0);
+      (&rec.dpdu.x)[a] = prim.a1 - prim.a0;
+      (&rec.dpdv.x)[b] = prim.b1 - prim.b0;
+    } break;
+
+    case BOX_PRIMITIVE: {
+      // same exact comparisons as boxnormal() in box.cu
+      float3 t0 = (prim.p0 - origin) / direction;
+      float3 t1 = (prim.p1 - origin) / direction;
+      float3 neg = make_float3(t == t0.x ? 1.f : 0.f, t == t0.y ? 1.f : 0.f,
+                               t == t0.z ? 1.f : 0.f);
+      float3 pos = make_float3(t == t1.x ? 1.f : 0.f, t == t1.y ? 1.f : 0.f,
+                               t == t1.z ? 1.f : 0.f);
+      normal = pos - neg;
+    } break;
+
+    case TRIANGLE_PRIMITIVE: {
+      normal = cross(prim.p1 - prim.p0, prim.p2 - prim.p0);
+
+      float b0 = 1.f - bc.x - bc.y, b1 = bc.x, b2 = bc.y;
+      rec.u = prim.uv0.x * b0 + prim.uv1.x * b1 + prim.uv2.x * b2;
+      rec.v = prim.uv0.y * b0 + prim.uv1.y * b1 + prim.uv2.y * b2;
+      Triangle_Derivatives(prim.p1 - prim.p0, prim.p2 - prim.p0,
+                           prim.uv1 - prim.uv0, prim.uv2 - prim.uv0, rec.dpdu,
+                           rec.dpdv);
+    } break;
+
+    case CYLINDER_PRIMITIVE:
+      normal = rec.P - make_float3(prim.p0.x, rec.P.y, prim.p0.z);
+      break;
+
+    // volumes don't have a meaningful normal
+    default:
+      break;
+  }
+
+  rec.geometric_normal = rec.shading_normal = normal;
+  return rec;
+}
+
+// Object space hit record of a mesh triangle
+HitRecord getHitRecord(const CPU_Mesh &mesh, int face, float t, float2 bc) {
+  HitRecord rec;
+  rec.t = t;
+  rec.bc = bc;
+
+  const uint3 v_idx = mesh.indices[face];
+  float3 a = mesh.vertices[v_idx.x];
+  float3 b = mesh.vertices[v_idx.y];
+  float3 c = mesh.vertices[v_idx.z];
+
+  // Triangle Barycentrics
+  float b0 = 1.f - bc.x - bc.y, b1 = bc.x, b2 = bc.y;
+
+  // Hit Point
+  rec.P = a * b0 + b * b1 + c * b2;
+
+  // Geometric Normal
+  rec.geometric_normal = cross(b - a, c - a);
+
+  // Shading Normal
+  if (!mesh.packedNormals.empty())
+    rec.shading_normal = Decode_Normal(mesh.packedNormals[v_idx.x]) * b0 +
+                         Decode_Normal(mesh.packedNormals[v_idx.y]) * b1 +
+                         Decode_Normal(mesh.packedNormals[v_idx.z]) * b2;
+  else if (mesh.normals.empty())
+    rec.shading_normal = rec.geometric_normal;
+  else
+    rec.shading_normal = mesh.normals[v_idx.x] * b0 +
+                         mesh.normals[v_idx.y] * b1 +
+                         mesh.normals[v_idx.z] * b2;
+
+  // Texture Coordinates and their derivatives
+  if (mesh.packedTexcoords.empty() && mesh.texcoords.empty()) {
+    rec.u = rec.v = 0.f;
+    rec.dpdu = rec.dpdv = make_float3(0.f);
+  } else {
+    float2 a_uv, b_uv, c_uv;
+    if (!mesh.packedTexcoords.empty()) {
+      a_uv = Decode_Texcoord(mesh.packedTexcoords[v_idx.x]);
+      b_uv = Decode_Texcoord(mesh.packedTexcoords[v_idx.y]);
+      c_uv = Decode_Texcoord(mesh.packedTexcoords[v_idx.z]);
+    } else {
+      a_uv = mesh.texcoords[v_idx.x];
+      b_uv = mesh.texcoords[v_idx.y];
+      c_uv = mesh.texcoords[v_idx.z];
+    }
+
+    rec.u = a_uv.x * b0 + b_uv.x * b1 + c_uv.x * b2;
+    rec.v = a_uv.y * b0 + b_uv.y * b1 + c_uv.y * b2;
+    Triangle_Derivatives(b - a, c - a, b_uv - a_uv, c_uv - a_uv, rec.dpdu,
+                         rec.dpdv);
+  }
+
+  // Texture Index
+  rec.index = mesh.textureIndices[face];
+
+  return rec;
+}
+
+#endif
@@ -0,0 +1,427 @@
+#ifndef LBVHH
+#define LBVHH
+
+// lbvh.hpp: Define the linear BVH builder of the CPU backend, trading tree
+// quality for build speed when scenes are rebuilt every frame
+
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "bvh.hpp"
+
+// Primitive count above which 63-bit Morton codes are used. 30-bit codes
+// quantize the centroids on a 1024^3 grid, fine enough for a few million
+// primitives, and take half the radix sort passes.
+#define LBVH_64BIT_THRESHOLD (1 << 22)
+
+// Number of indices processed by each parallel block
+#define LBVH_GRAIN_SIZE 16384
+
+// Bits sorted by every radix sort pass, 3 passes for 30-bit codes and 6
+// passes for 63-bit codes
+#define LBVH_RADIX_BITS 11
+#define LBVH_RADIX_SIZE (1 << LBVH_RADIX_BITS)
+
+inline int countLeadingZeros(uint32_t x) {
+  if (x == 0) return 32;
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanReverse(&index, x);
+  return 31 - (int)index;
+#else
+  return __builtin_clz(x);
+#endif
+}
+
+inline int countLeadingZeros(uint64_t x) {
+  uint32_t high = (uint32_t)(x >> 32);
+  if (high) return countLeadingZeros(high);
+  return 32 + countLeadingZeros((uint32_t)x);
+}
+
+// Spreads the lower 10 bits of x, two zero bits between each of them
+inline uint32_t expandBits(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+// Spreads the lower 21 bits of x, two zero bits between each of them
+inline uint64_t expandBits(uint64_t x) {
+  x &= 0x1fffff;
+  x = (x | (x << 32)) & 0x001f00000000ffffull;
+  x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+  x = (x | (x << 8)) & 0x100f00f00f00f00full;
+  x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+  x = (x | (x << 2)) & 0x1249249249249249ull;
+  return x;
+}
+
+// Interleaves the coordinates of a point normalized to [0, 1], 10 bits per
+// axis for 32-bit codes and 21 bits per axis for 64-bit codes
+template <typename Key>
+Key mortonCode(const float3 &p) {
+  const float cells = sizeof(Key) == 4 ? 1024.f : 2097152.f;
+  const float3 q = min_vec(max_vec(p * cells, make_float3(0.f)),
+                           make_float3(cells - 1.f));
+
+  return (expandBits((Key)q.x) << 2) | (expandBits((Key)q.y) << 1) |
+         expandBits((Key)q.z);
+}
+
+// Linear BVH builder. Primitives are sorted along a Morton curve through
+// their centroids, then every interior node of the resulting radix tree is
+// found independently from the sorted codes (Karras, "Maximizing Parallelism
+// in the Construction of BVHs, Octrees, and k-d Trees", 2012). Bounds are
+// computed bottom-up and the tree is written in the BVH_Node layout shared
+// with the SAH builder, subtrees of at most maxLeafSize primitives becoming
+// leaves.
+template <typename Key>
+class LBVH_Builder {
+ public:
+  LBVH_Builder(BVH &b, const std::vector<Aabb> &bounds, Thread_Pool *p,
+               int leafSize)
+      : bvh(b), boxes(bounds), pool(p), maxLeafSize(std::max(leafSize, 1)) {}
+
+  void build() {
+    int n = (int)boxes.size();
+
+    computeCodes();
+    sortCodes();
+
+    // gather the bounds in sorted order, so that the following passes read
+    // them sequentially
+    bvh.indices.resize(n);
+    leafBoxes.resize(n);
+    forBlocks(n, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        const Aabb &aabb = boxes[keys[i].prim];
+        bvh.indices[i] = keys[i].prim;
+        leafBoxes[i].include(aabb.m_min, aabb.m_max);
+      }
+    });
+
+    if (n <= maxLeafSize) {
+      // a single leaf, the padding node is kept for consistency
+      BVH_Bounds box;
+      for (int i = 0; i < n; i++) box.include(leafBoxes[i]);
+
+      bvh.nodes.resize(2);
+      bvh.nodes[0].bmin = box.bmin;
+      bvh.nodes[0].bmax = box.bmax;
+      bvh.nodes[0].offset = 0;
+      bvh.nodes[0].count = n;
+      bvh.nodes[1] = bvh.nodes[0];
+      return;
+    }
+
+    buildRadixTree();
+    computeNodeBounds();
+    writeNodes();
+  }
+
+ private:
+  struct Sort_Key {
+    Key code;
+    int prim;
+  };
+
+  // Interior node of the radix tree. Children are interior nodes, or sorted
+  // primitives if their index is flagged with LEAF_BIT.
+  struct Radix_Node {
+    int left, right;
+    int first, last;  // range of sorted primitives below the node
+    int parent;
+  };
+
+  static const int LEAF_BIT = 1 << 31;
+
+  void forBlocks(int count, const std::function<void(int, int)> &func) {
+    if (pool)
+      pool->parallel_blocks(count, LBVH_GRAIN_SIZE, func);
+    else
+      func(0, count);
+  }
+
+  int numBlocks(int count) const {
+    return (count + LBVH_GRAIN_SIZE - 1) / LBVH_GRAIN_SIZE;
+  }
+
+  // Quantizes the centroids in their bounding box
+  void computeCodes() {
+    int n = (int)boxes.size();
+    std::vector<BVH_Bounds> blockBoxes(numBlocks(n));
+
+    forBlocks(n, [&](int begin, int end) {
+      BVH_Bounds &box = blockBoxes[begin / LBVH_GRAIN_SIZE];
+      for (int i = begin; i < end; i++)
+        box.include(0.5f * (boxes[i].m_min + boxes[i].m_max));
+    });
+
+    BVH_Bounds centroidBox;
+    for (size_t b = 0; b < blockBoxes.size(); b++)
+      centroidBox.include(blockBoxes[b]);
+
+    const float3 origin = centroidBox.bmin;
+    const float3 extent = centroidBox.bmax - centroidBox.bmin;
+    const float3 scale =
+        make_float3(extent.x > 0.f ? 1.f / extent.x : 0.f,
+                    extent.y > 0.f ? 1.f / extent.y : 0.f,
+                    extent.z > 0.f ? 1.f / extent.z : 0.f);
+
+    keys.resize(n);
+    forBlocks(n, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        float3 centroid = 0.5f * (boxes[i].m_min + boxes[i].m_max);
+        keys[i].code = mortonCode<Key>((centroid - origin) * scale);
+        keys[i].prim = i;
+      }
+    });
+  }
+
+  // Parallel LSD radix sort of the codes. Every pass counts the digits of
+  // each block, turns the counts into per block output offsets, and scatters
+  // the keys. Passes over digits shared by every key are skipped.
+  void sortCodes() {
+    int n = (int)keys.size();
+    int blocks = numBlocks(n);
+    std::vector<Sort_Key> temp(n);
+    std::vector<int> histograms(blocks * LBVH_RADIX_SIZE);
+
+    const int bits = sizeof(Key) == 4 ? 30 : 63;
+    for (int shift = 0; shift < bits; shift += LBVH_RADIX_BITS) {
+      std::fill(histograms.begin(), histograms.end(), 0);
+
+      forBlocks(n, [&](int begin, int end) {
+        int *histogram = &histograms[(begin / LBVH_GRAIN_SIZE) *
+                                     LBVH_RADIX_SIZE];
+        for (int i = begin; i < end; i++)
+          histogram[(keys[i].code >> shift) & (LBVH_RADIX_SIZE - 1)]++;
+      });
+
+      // offsets ordered by digit, then by block, so the sort is stable
+      int offset = 0;
+      bool skip = false;
+      for (int d = 0; d < LBVH_RADIX_SIZE; d++) {
+        int start = offset;
+        for (int b = 0; b < blocks; b++) {
+          int count = histograms[b * LBVH_RADIX_SIZE + d];
+          histograms[b * LBVH_RADIX_SIZE + d] = offset;
+          offset += count;
+        }
+
+        // every key has this digit, the pass wouldn't change the order
+        if (offset - start == n) skip = true;
+      }
+      if (skip) continue;
+
+      forBlocks(n, [&](int begin, int end) {
+        int *offsets = &histograms[(begin / LBVH_GRAIN_SIZE) *
+                                   LBVH_RADIX_SIZE];
+        for (int i = begin; i < end; i++) {
+          int digit = (keys[i].code >> shift) & (LBVH_RADIX_SIZE - 1);
+          temp[offsets[digit]++] = keys[i];
+        }
+      });
+
+      keys.swap(temp);
+    }
+  }
+
+  // Length of the common prefix of two sorted keys, duplicate codes are
+  // told apart by their position
+  int delta(int i, int j) const {
+    int n = (int)keys.size();
+    if (j < 0 || j >= n) return -1;
+
+    Key a = keys[i].code, b = keys[j].code;
+    if (a == b)
+      return 8 * (int)sizeof(Key) +
+             countLeadingZeros((uint32_t)i ^ (uint32_t)j);
+
+    return countLeadingZeros(a ^ b);
+  }
+
+  // Finds the range and split of every interior node independently
+  void buildRadixTree() {
+    int n = (int)keys.size();
+    nodes.resize(n - 1);
+    leafParents.resize(n);
+    nodes[0].parent = -1;
+
+    forBlocks(n - 1, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        // direction of the range
+        int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+
+        // upper bound of the range length
+        int minDelta = delta(i, i - d);
+        int maxLength = 2;
+        while (delta(i, i + maxLength * d) > minDelta) maxLength *= 2;
+
+        // exact range end with a binary search
+        int length = 0;
+        for (int t = maxLength / 2; t >= 1; t /= 2)
+          if (delta(i, i + (length + t) * d) > minDelta) length += t;
+        int j = i + length * d;
+
+        // split position, where the common prefix gets longer
+        int nodeDelta = delta(i, j);
+        int split = 0;
+        for (int div = 2;; div *= 2) {
+          int t = (length + div - 1) / div;
+          if (delta(i, i + (split + t) * d) > nodeDelta) split += t;
+          if (t == 1) break;
+        }
+        int gamma = i + split * d + std::min(d, 0);
+
+        Radix_Node &node = nodes[i];
+        node.first = std::min(i, j);
+        node.last = std::max(i, j);
+        node.left = node.first == gamma ? (gamma | LEAF_BIT) : gamma;
+        node.right =
+            node.last == gamma + 1 ? ((gamma + 1) | LEAF_BIT) : gamma + 1;
+
+        if (node.left & LEAF_BIT)
+          leafParents[gamma] = i;
+        else
+          nodes[gamma].parent = i;
+
+        if (node.right & LEAF_BIT)
+          leafParents[gamma + 1] = i;
+        else
+          nodes[gamma + 1].parent = i;
+      }
+    });
+  }
+
+  // Bottom-up bounds: every primitive walks up the tree, and the second
+  // thread reaching a node merges the bounds of its children
+  void computeNodeBounds() {
+    int n = (int)keys.size();
+    nodeBoxes.resize(n - 1);
+    std::vector<std::atomic<int> > visits(n - 1);
+    for (int i = 0; i < n - 1; i++) visits[i] = 0;
+
+    forBlocks(n, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        int current = leafParents[i];
+
+        while (current >= 0) {
+          if (visits[current].fetch_add(1, std::memory_order_acq_rel) == 0)
+            break;
+
+          const Radix_Node &node = nodes[current];
+          BVH_Bounds box = childBounds(node.left);
+          box.include(childBounds(node.right));
+          nodeBoxes[current] = box;
+
+          current = node.parent;
+        }
+      }
+    });
+  }
+
+  const BVH_Bounds &childBounds(int child) const {
+    if (child & LEAF_BIT) return leafBoxes[child & ~LEAF_BIT];
+    return nodeBoxes[child];
+  }
+
+  int rangeSize(int child) const {
+    if (child & LEAF_BIT) return 1;
+    return nodes[child].last - nodes[child].first + 1;
+  }
+
+  // Interior nodes of the radix tree covering more than maxLeafSize
+  // primitives become interior BVH nodes, their child pairs being placed by
+  // a prefix sum over them. The others become leaves.
+  void writeNodes() {
+    int n = (int)keys.size();
+    int blocks = numBlocks(n - 1);
+    std::vector<int> slots(n - 1), blockSums(blocks + 1, 0);
+
+    forBlocks(n - 1, [&](int begin, int end) {
+      int sum = 0;
+      for (int i = begin; i < end; i++) {
+        slots[i] = sum;
+        if (rangeSize(i) > maxLeafSize) sum++;
+      }
+      blockSums[begin / LBVH_GRAIN_SIZE + 1] = sum;
+    });
+
+    for (int b = 0; b < blocks; b++) blockSums[b + 1] += blockSums[b];
+
+    forBlocks(n - 1, [&](int begin, int end) {
+      for (int i = begin; i < end; i++)
+        slots[i] += blockSums[begin / LBVH_GRAIN_SIZE];
+    });
+
+    // root, padding node, then a child pair per interior node
+    bvh.nodes.resize(2 + 2 * blockSums[blocks]);
+
+    auto writeNode = [&](int index, int child) {
+      BVH_Node &node = bvh.nodes[index];
+      const BVH_Bounds &box = childBounds(child);
+      node.bmin = box.bmin;
+      node.bmax = box.bmax;
+
+      if (child & LEAF_BIT) {
+        node.offset = child & ~LEAF_BIT;
+        node.count = 1;
+      } else if (rangeSize(child) <= maxLeafSize) {
+        node.offset = nodes[child].first;
+        node.count = rangeSize(child);
+      } else {
+        node.offset = 2 + 2 * slots[child];
+        node.count = 0;
+      }
+    };
+
+    writeNode(0, 0);
+    bvh.nodes[1] = bvh.nodes[0];
+
+    forBlocks(n - 1, [&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        if (rangeSize(i) <= maxLeafSize) continue;
+
+        writeNode(2 + 2 * slots[i], nodes[i].left);
+        writeNode(3 + 2 * slots[i], nodes[i].right);
+      }
+    });
+  }
+
+  BVH &bvh;
+  const std::vector<Aabb> &boxes;
+  Thread_Pool *pool;
+  int maxLeafSize;
+
+  std::vector<Sort_Key> keys;
+  std::vector<Radix_Node> nodes;
+  std::vector<int> leafParents;
+  std::vector<BVH_Bounds> leafBoxes, nodeBoxes;
+};
+
+// Builds a BVH over a list of primitive bounds with the linear builder, in
+// parallel if a thread pool is given. Same layout as buildBVH.
+void buildLBVH(BVH &bvh, const std::vector<Aabb> &bounds,
+               Thread_Pool *pool = nullptr, int maxLeafSize = 4) {
+  bvh.nodes.clear();
+  bvh.indices.clear();
+  if (bounds.empty()) return;
+
+  if (bounds.size() > LBVH_64BIT_THRESHOLD) {
+    LBVH_Builder<uint64_t> builder(bvh, bounds, pool, maxLeafSize);
+    builder.build();
+  } else {
+    LBVH_Builder<uint32_t> builder(bvh, bounds, pool, maxLeafSize);
+    builder.build();
+  }
+}
+
+#endif
@@ -0,0 +1,612 @@
+#ifndef CPUMATERIALSH
+#define CPUMATERIALSH
+
+// materials.hpp: Define the CPU versions of the programs/materials, light
+// sampling and miss programs. The BRDF headers are shared with the device
+// code. They declare functions named PDF, so this file should be included
+// after the host headers that use the PDF struct.
+
+#include "../../programs/materials/ashikhmin_shirley.cuh"
+#include "../../programs/materials/diffuse_light.cuh"
+#include "../../programs/materials/isotropic.cuh"
+#include "../../programs/materials/lambertian.cuh"
+#include "../../programs/materials/material.cuh"
+#include "../../programs/materials/oren_nayar.cuh"
+#include "../../programs/materials/torrance_sparrow.cuh"
+#include "../../programs/pdfs/environment.hpp"
+
+#include "textures.hpp"
+#include "trace.hpp"
+
+////////////
+// Lights //
+////////////
+
+// Rectangle intersection, same as the Intersect_X/Y/Z functions of rect_pdf.cu
+bool intersectLight(const CPU_Light &light, const float3 &P, const float3 &Wi,
+                    float tmin, float tmax, float3 &N, float &t) {
+  const float *o = &P.x, *d = &Wi.x;
+  int k = light.axis, a = (k == X_AXIS) ? 1 : 0, b = (k == Z_AXIS) ? 1 : 2;
+
+  t = (light.k - o[k]) / d[k];
+
+  float pa = o[a] + t * d[a];
+  float pb = o[b] + t * d[b];
+  if (pa < light.a0 || pa > light.a1 || pb < light.b0 || pb > light.b1)
+    return false;
+
+  if (t < tmax && t > tmin) {
+    float n[3] = {0.f, 0.f, 0.f};
+    n[k] = 1.f;
+    N = make_float3(n[0], n[1], n[2]);
+    return true;
+  }
+
+  return false;
+}
+
+// Mirrors the Light_Sample callable programs
+float3 lightSample(const CPU_Light &light, const float3 &P, uint &seed) {
+  if (light.type == RECT_LIGHT) {
+    float p[3];
+    int k = light.axis, a = (k == X_AXIS) ? 1 : 0, b = (k == Z_AXIS) ? 1 : 2;
+
+    p[k] = light.k;
+    p[a] = light.a0 + rnd(seed) * (light.a1 - light.a0);
+    p[b] = light.b0 + rnd(seed) * (light.b1 - light.b0);
+
+    return make_float3(p[0], p[1], p[2]) - P;
+  }
+
+  float r1 = rnd(seed);
+  float r2 = rnd(seed);
+
+  float distance_squared = squared_length(light.center - P);
+  float z = 1.f + r2 * (sqrtf(1.f - light.radius * light.radius /
+                                        distance_squared) -
+                        1.f);
+
+  float phi = 2.f * PI_F * r1;
+
+  float x = cosf(phi) * sqrtf(1.f - z * z);
+  float y = sinf(phi) * sqrtf(1.f - z * z);
+
+  float3 Wi = make_float3(x, y, z);
+
+  Onb uvw(normalize(Wi));
+  uvw.inverse_transform(Wi);
+
+  return Wi;
+}
+
+// Mirrors the Light_PDF callable programs
+float lightPDF(const CPU_Light &light, const float3 &P, const float3 &Wi) {
+  if (light.type == RECT_LIGHT) {
+    float t;
+    float3 rectNormal;
+
+    if (intersectLight(light, P, Wi, 0.001f, FLT_MAX, rectNormal, t)) {
+      float distance_squared = t * t * squared_length(Wi);
+      float cosine = fabsf(dot(Wi, rectNormal) / length(Wi));
+      float area = (light.a1 - light.a0) * (light.b1 - light.b0);
+      return distance_squared / (cosine * area);
+    } else
+      return 0.f;
+  }
+
+  float t;
+  if (hitSphere(light.center, light.radius, P, Wi, 0.001f, FLT_MAX, t)) {
+    float distance_squared = squared_length(light.center - P);
+    float cos_theta_max =
+        sqrtf(1.f - light.radius * light.radius / distance_squared);
+    float solid_angle = 2.f * PI_F * (1.f - cos_theta_max);
+
+    return 1.f / solid_angle;
+  } else
+    return 0.f;
+}
+
+// Traces a shadow ray, following the any hit program of the light materials:
+// only lights facing the shading normal don't occlude the ray, unless
+// 'lightsOcclude' is set for rays towards the environment
+bool inShadow(const CPU_Scene &scene, const float3 &P, const float3 &Wi,
+              const float3 &N, float time, uint &seed,
+              bool lightsOcclude = false) {
+  Ray shadowRay = make_Ray(/* origin   : */ P,
+                           /* direction: */ Wi,
+                           /* ray type : */ 1,
+                           /* tmin     : */ 1e-3f,
+                           /* tmax     : */ RT_DEFAULT_MAX);
+
+  CPU_Hit hit;
+  if (!traceScene(scene, shadowRay, time, seed, hit)) return false;
+  if (lightsOcclude) return true;
+
+  const CPU_Material &material = scene.materials[getMaterial(scene, hit)];
+  bool isLight = material.type == DIFFUSE_LIGHT_MATERIAL && material.flag;
+
+  return !(isLight && dot(N, Wi) > 0.f);
+}
+
+// Distribution accessor of the environment sampling functions
+struct CPU_Environment_Distribution {
+  CPU_Environment_Distribution(const CPU_Scene &scene)
+      : environment(scene.environment), spherical(scene.miss.isSpherical) {}
+
+  int width() const { return environment.width; }
+  int height() const { return environment.height; }
+  bool isSpherical() const { return spherical; }
+  float marginal(int i) const { return environment.marginal[i]; }
+
+  float conditional(int row, int i) const {
+    return environment.conditional[row * (environment.width + 1) + i];
+  }
+
+  const CPU_Environment &environment;
+  bool spherical;
+};
+
+// Mirrors Environment_Emission from light_sample.cuh
+float3 environmentEmission(const CPU_Scene &scene, const float3 &Wi,
+                           float spread) {
+  float2 uv = Environment_UV(Wi, scene.miss.isSpherical);
+  return 2.f * sampleTexture(scene, scene.miss.textures[0], uv.x, uv.y,
+                             make_float3(0.f), 0, Direction_Footprint(spread));
+}
+
+// Lights Direct_Light picks from, the environment counts as the last one
+inline int lightCount(const CPU_Scene &scene) {
+  return (int)scene.lights.size() + (scene.environment.enabled ? 1 : 0);
+}
+
+float PowerHeuristic(unsigned int numf, float fPdf, unsigned int numg,
+                     float gPdf) {
+  float f = numf * fPdf;
+  float g = numg * gPdf;
+
+  return (f * f) / (f * f + g * g);
+}
+
+// Light sample picked by Direct_Light, before its shadow ray is traced. The
+// light is an index in CPU_Scene::lights, its size for the environment, or -1
+// if there's nothing to shade.
+struct Light_Sample {
+  int light;
+  float3 Wi;
+  float pdf;  // 0 if an environment sample needs no shadow ray
+};
+
+// First half of Direct_Light: picks a light and a direction towards it, see
+// needsShadowRay for the samples that need a shadow ray. Media take
+// environment samples from behind N too.
+Light_Sample sampleLights(const CPU_Scene &scene, const float3 &P,
+                          const float3 &N, bool isLight, bool isMedium,
+                          uint &seed) {
+  Light_Sample sample;
+  sample.light = -1;
+
+  // return black if there's no light
+  int numLights = (int)scene.lights.size(), count = lightCount(scene);
+  if (count == 0) return sample;
+
+  // ramdomly pick one light and multiply the result by the number of lights
+  // it's the same as dividing by the PDF if they have the same probability
+  int index = ((int)(rnd(seed) * count)) % count;
+
+  // the environment is shaded even without a valid sample, for its BRDF one
+  if (index == numLights) {
+    float r1 = rnd(seed);
+    float r2 = rnd(seed);
+    sample.Wi = Sample_Environment(CPU_Environment_Distribution(scene), r1, r2,
+                                   sample.pdf);
+    if (!isMedium && dot(sample.Wi, N) < 0.f) sample.pdf = 0.f;
+
+    sample.light = index;
+    return sample;
+  }
+
+  // return black if there's just one light and we just hit it
+  if (isLight && numLights == 1) return sample;
+
+  // Sample Light
+  const CPU_Light &light = scene.lights[index];
+  sample.Wi = lightSample(light, P, seed);
+  sample.pdf = lightPDF(light, P, sample.Wi);
+
+  // only sample if surface normal is in the light direction
+  if (dot(sample.Wi, N) < 0.f) return sample;
+
+  sample.light = index;
+  return sample;
+}
+
+// Second half of Direct_Light: multiple importance sampling of an unoccluded
+// light sample and of a BRDF sample
+template <typename T>
+float3 shadeLightSample(const CPU_Scene &scene, T &surface, const float3 &P,
+                        const float3 &Wo, const float3 &N,
+                        const Light_Sample &sample, uint &seed) {
+  float3 directLight = make_float3(0.f);
+  const CPU_Light &light = scene.lights[sample.light];
+  float3 emission = light.emission;
+  float3 Wi = sample.Wi;
+  float lightPdf = sample.pdf;
+
+  // Sample light
+  if (lightPdf != 0.f && !isNull(emission)) {
+    float matPDF;
+    float3 matValue = Evaluate(surface, P, Wo, Wi, N, matPDF);
+
+    if (matPDF != 0.f && !isNull(matValue)) {
+      float weight = PowerHeuristic(1, lightPdf, 1, matPDF);
+      directLight += matValue * emission * weight / lightPdf;
+    }
+  }
+
+  // Sample BRDF
+  Wi = Sample(surface, P, Wo, N, seed);
+  float matPDF;
+  float3 matValue = Evaluate(surface, P, Wo, Wi, N, matPDF);
+
+  if (matPDF != 0.f && !isNull(matValue)) {
+    lightPdf = lightPDF(light, P, Wi);
+
+    // we didn't hit anything, ignore BRDF sample
+    if (!lightPdf || isNull(emission)) return lightCount(scene) * directLight;
+
+    float weight = PowerHeuristic(1, matPDF, 1, lightPdf);
+    directLight += matValue * emission * weight / matPDF;
+  }
+
+  return lightCount(scene) * directLight;
+}
+
+// Second half of Direct_Light for the environment, mirrors Direct_Environment
+// from light_sample.cuh. The shadow ray of the BRDF sample is traced here.
+template <typename T>
+float3 shadeEnvironmentSample(const CPU_Scene &scene, T &surface,
+                              const float3 &P, const float3 &Wo,
+                              const float3 &N, const Light_Sample &sample,
+                              bool occluded, float time, float spread,
+                              uint &seed) {
+  float3 directLight = make_float3(0.f);
+
+  // Sample environment
+  if (sample.pdf != 0.f && !occluded) {
+    float matPDF;
+    float3 matValue = Evaluate(surface, P, Wo, sample.Wi, N, matPDF);
+
+    if (matPDF != 0.f && !isNull(matValue)) {
+      float weight = PowerHeuristic(1, sample.pdf, 1, matPDF);
+      directLight += matValue * environmentEmission(scene, sample.Wi, spread) *
+                     weight / sample.pdf;
+    }
+  }
+
+  // Sample BRDF
+  float3 Wi = Sample(surface, P, Wo, N, seed);
+  float matPDF;
+  float3 matValue = Evaluate(surface, P, Wo, Wi, N, matPDF);
+
+  if (matPDF != 0.f && !isNull(matValue)) {
+    float lightPdf = Environment_PDF(CPU_Environment_Distribution(scene), Wi);
+
+    // black parts of the map have no density
+    if (lightPdf != 0.f && !inShadow(scene, P, Wi, N, time, seed, true)) {
+      float weight = PowerHeuristic(1, matPDF, 1, lightPdf);
+      directLight +=
+          matValue * environmentEmission(scene, Wi, spread) * weight / matPDF;
+    }
+  }
+
+  return lightCount(scene) * directLight;
+}
+
+// Whether a light sample is one of the environment
+inline bool isEnvironmentSample(const CPU_Scene &scene,
+                                const Light_Sample &sample) {
+  return sample.light == (int)scene.lights.size();
+}
+
+// Whether the shadow ray of a light sample has to be traced
+inline bool needsShadowRay(const CPU_Scene &scene, const Light_Sample &sample) {
+  if (sample.light < 0) return false;
+  return !isEnvironmentSample(scene, sample) || sample.pdf != 0.f;
+}
+
+// Traces the shadow ray of a light sample, every hit occludes the
+// environment
+bool sampleInShadow(const CPU_Scene &scene, const float3 &P, const float3 &N,
+                    const Light_Sample &sample, float time, uint &seed) {
+  return inShadow(scene, P, sample.Wi, N, time, seed,
+                  isEnvironmentSample(scene, sample));
+}
+
+// Shades a light sample whose shadow ray was traced, if it needed one
+template <typename T>
+float3 shadeSample(const CPU_Scene &scene, T &surface, const float3 &P,
+                   const float3 &Wo, const float3 &N,
+                   const Light_Sample &sample, bool occluded, float time,
+                   float spread, uint &seed) {
+  if (sample.light < 0) return make_float3(0.f);
+
+  if (isEnvironmentSample(scene, sample))
+    return shadeEnvironmentSample(scene, surface, P, Wo, N, sample, occluded,
+                                  time, spread, seed);
+
+  // if light is occluded, return black
+  if (occluded) return make_float3(0.f);
+
+  return shadeLightSample(scene, surface, P, Wo, N, sample, seed);
+}
+
+// Mirrors Direct_Light from light_sample.cuh
+template <typename T>
+float3 Direct_Light(const CPU_Scene &scene, T &surface, const float3 &P,
+                    const float3 &Wo, const float3 &N, bool isLight,
+                    float time, float spread, uint &seed) {
+  Light_Sample sample =
+      sampleLights(scene, P, N, isLight, Is_Medium(surface), seed);
+
+  bool occluded = needsShadowRay(scene, sample) &&
+                  sampleInShadow(scene, P, N, sample, time, seed);
+  return shadeSample(scene, surface, P, Wo, N, sample, occluded, time, spread,
+                     seed);
+}
+
+// Direct light of the per path integrator, shadow rays are traced right away
+struct Traced_Direct_Light {
+  const CPU_Scene &scene;
+
+  template <typename T>
+  float3 operator()(T &surface, const float3 &P, const float3 &Wo,
+                    const float3 &N, bool isLight, PerRayData &prd) const {
+    return Direct_Light(scene, surface, P, Wo, N, isLight, prd.time,
+                        prd.coneSpread, prd.seed);
+  }
+};
+
+///////////////
+// Materials //
+///////////////
+
+// Samples the BRDF and updates the PRD, shared by the BRDF based materials
+template <typename T, typename Direct_Light_Function>
+void scatterBRDF(T &surface, const HitRecord &rec, PerRayData &prd,
+                 bool directLight, bool clampAttenuation, bool divideByPDF,
+                 bool isSpecular, const Direct_Light_Function &direct_light) {
+  float3 P = rec.P;               // Hit Point
+  float3 Wo = rec.Wo;             // Ray view direction
+  float3 N = rec.shading_normal;  // normal
+
+  // Sample Direct Light
+  if (directLight) {
+    float3 direct = direct_light(surface, P, Wo, N, false, prd);
+    prd.radiance += prd.throughput * direct;
+  }
+
+  // Sample BRDF
+  float3 Wi = Sample(surface, P, Wo, N, prd.seed);
+  float pdf;  // calculated in the Evaluate function
+  float3 attenuation = Evaluate(surface, P, Wo, Wi, N, pdf);
+  if (divideByPDF) attenuation = attenuation / pdf;
+  if (clampAttenuation) attenuation = clamp(attenuation, 0.f, 1.f);
+
+  // Assign parameters to PRD
+  prd.scatterEvent = rayGotBounced;
+  prd.origin = P;
+  prd.direction = Wi;
+  prd.throughput *= attenuation;
+  prd.isSpecular = isSpecular;
+}
+
+// Materials whose closest hit program samples direct light
+inline bool samplesDirectLight(const CPU_Material &material) {
+  return material.type == LAMBERTIAN_MATERIAL ||
+         material.type == OREN_NAYAR_MATERIAL ||
+         material.type == ISOTROPIC_MATERIAL ||
+         material.type == DIFFUSE_LIGHT_MATERIAL;
+}
+
+// Mirrors the closest hit programs of programs/materials. Direct light is
+// computed by 'direct_light', so that the integrators can trace the shadow
+// rays at different times.
+template <typename Direct_Light_Function>
+void closestHit(const CPU_Scene &scene, const CPU_Material &material,
+                const HitRecord &rec, PerRayData &prd,
+                const Direct_Light_Function &direct_light) {
+  int index = rec.index;  // texture index
+  float3 P = rec.P;       // Hit Point
+  Texture_Footprint footprint = Hit_Footprint(rec, prd);
+
+  float3 color = make_float3(0.f);
+  if (material.type != NORMAL_MATERIAL)
+    color = sampleTexture(scene, material.textures[0], rec.u, rec.v, P, index,
+                          footprint);
+
+  switch (material.type) {
+    case LAMBERTIAN_MATERIAL: {
+      Lambertian_Parameters surface;
+      surface.color = color;
+      scatterBRDF(surface, rec, prd, true, true, true, false, direct_light);
+    } break;
+
+    case OREN_NAYAR_MATERIAL: {
+      Oren_Nayar_Parameters surface;
+      surface.color = color;
+      surface.rA = material.params[0];
+      surface.rB = material.params[1];
+      scatterBRDF(surface, rec, prd, true, true, true, false, direct_light);
+    } break;
+
+    case ISOTROPIC_MATERIAL: {
+      Isotropic_Parameters surface;
+      surface.color = color;
+      scatterBRDF(surface, rec, prd, true, false, true, false, direct_light);
+    } break;
+
+    case TORRANCE_MATERIAL: {
+      Torrance_Sparrow_Parameters surface;
+      surface.color = color;
+      surface.nu = material.params[0];
+      surface.nv = material.params[1];
+      scatterBRDF(surface, rec, prd, false, true, true, true, direct_light);
+    } break;
+
+    case ASHIKHMIN_MATERIAL: {
+      Ashikhmin_Shirley_Parameters surface;
+      surface.diffuse_color = color;
+      surface.specular_color = sampleTexture(
+          scene, material.textures[1], rec.u, rec.v, P, index, footprint);
+      surface.nu = material.params[0];
+      surface.nv = material.params[1];
+      scatterBRDF(surface, rec, prd, false, true, false, true, direct_light);
+    } break;
+
+    case DIFFUSE_LIGHT_MATERIAL: {
+      Diffuse_Light_Parameters surface;
+      surface.color = color;
+
+      // Sample Direct Light
+      float3 direct =
+          direct_light(surface, P, rec.Wo, rec.shading_normal, true, prd);
+      prd.radiance += prd.throughput * direct;
+
+      // Take Light emission into account
+      if (dot(rec.shading_normal, rec.Wo) < 0.f) prd.throughput *= color;
+
+      prd.scatterEvent = rayHitLight;
+    } break;
+
+    case METAL_MATERIAL: {
+      // reflect ray
+      float3 reflected = reflect(-rec.Wo, rec.shading_normal);
+      prd.direction =
+          reflected + material.params[0] * random_in_unit_sphere(prd.seed);
+
+      prd.scatterEvent = rayGotBounced;
+      prd.origin = P;
+      prd.throughput *= color;
+      prd.isSpecular = true;
+    } break;
+
+    case DIELECTRIC_MATERIAL: {
+      float3 Wo = -rec.Wo;
+      float3 N = rec.shading_normal;
+      float ref_idx = material.params[0];
+
+      float ni_over_nt;
+      float cosine = dot(Wo, N);
+
+      // Ray is exiting the object
+      if (cosine > 0.f) {
+        N = -N;
+        ni_over_nt = ref_idx;
+        cosine = ref_idx * cosine / length(Wo);
+      }
+
+      // Ray is entering the object
+      else {
+        ni_over_nt = 1.f / ref_idx;
+        cosine = -cosine / length(Wo);
+      }
+
+      // Importance sample the Fresnel term
+      float3 refracted;
+      float reflect_prob;
+      if (Refract(Wo, N, ni_over_nt, refracted))
+        reflect_prob = schlick(cosine, ref_idx);
+      else
+        reflect_prob = 1.f;
+
+      // Ray should be reflected or refracted
+      if (rnd(prd.seed) < reflect_prob)
+        prd.direction = reflect(Wo, N);
+      else
+        prd.direction = normalize(refracted);
+
+      prd.scatterEvent = rayGotBounced;
+      prd.origin = P;
+      prd.throughput *= color;
+      prd.isSpecular = true;
+    } break;
+
+    case NORMAL_MATERIAL:
+      // check if we should use geometric or shading normals
+      if (material.flag)
+        prd.radiance = rec.shading_normal * 0.5f + make_float3(0.5f);
+      else
+        prd.radiance = rec.geometric_normal * 0.5f + make_float3(0.5f);
+
+      prd.scatterEvent = rayGotCancelled;
+      break;
+  }
+}
+
+/////////////////
+// Miss shader //
+/////////////////
+
+// Mirrors the miss programs of programs/miss.cu
+void miss(const CPU_Scene &scene, const Ray &ray, PerRayData &prd) {
+  const CPU_Miss &miss = scene.miss;
+  const float3 p = make_float3(0.f);
+  float3 c = make_float3(0.f);
+
+  switch (miss.type) {
+    case GRADIENT_MISS: {
+      const float3 unit_direction = normalize(ray.direction);
+      const float t = 0.5f * (unit_direction.y + 1.f);
+
+      c = (1.f - t) * sampleTexture(scene, miss.textures[0], 0, 0, p, 0);
+      c += t * sampleTexture(scene, miss.textures[1], 0, 0, p, 0);
+    } break;
+
+    case CONSTANT_MISS:
+      if (miss.textures[0] >= 0)
+        c = sampleTexture(scene, miss.textures[0], 0, 0, p, 0);
+      break;
+
+    case IMAGE_MISS: {
+      float theta = atan2f(ray.direction.x, ray.direction.z);
+      float phi = M_PIf * 0.5f - acosf(ray.direction.y);
+      float u = (theta + M_PIf) * (0.5f * M_1_PIf);
+      float v = 0.5f * (1.f + sinf(phi));
+
+      c = sampleTexture(scene, miss.textures[0], u, v, p, 0,
+                        Direction_Footprint(prd.coneSpread));
+    } break;
+
+    case ENVIRONMENT_MISS: {
+      float u, v;
+
+      // spherical HDRI mapping
+      if (miss.isSpherical) {
+        float r = length(ray.direction);
+        float lon = atan2f(ray.direction.z, ray.direction.x);
+        float lat = acosf(ray.direction.y / r);
+
+        u = lon * (1.f / (PI_F * 2.f));
+        v = lat * (1.f / PI_F);
+      }
+
+      // cylindrical HDRI mapping
+      else {
+        float theta = atan2f(ray.direction.x, ray.direction.z);
+        theta = theta < 0.f ? theta + (2.f * PI_F) : theta;
+        float phi = acosf(ray.direction.y);
+
+        u = 1.f - (theta / (2.f * PI_F));
+        v = phi / PI_F;
+      }
+
+      c = 2.f * sampleTexture(scene, miss.textures[0], u, v, p, 0,
+                              Direction_Footprint(prd.coneSpread));
+    } break;
+  }
+
+  prd.throughput *= c;
+  prd.scatterEvent = rayMissed;
+}
+
+#endif
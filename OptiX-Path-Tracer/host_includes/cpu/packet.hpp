@@ -0,0 +1,462 @@
+#ifndef CPUPACKETH
+#define CPUPACKETH
+
+// packet.hpp: Define the packet traversal of the CPU backend. The camera rays
+// of a block of pixels go through the binary BVHs together: a node is tested
+// against the interval bounds of the whole packet first, then against each of
+// its rays, and the rays that are left finish a subtree on their own once the
+// packet has diverged.
+
+#include <bitset>
+
+#include "trace.hpp"
+
+// Packets hold the camera rays of PACKET_SIZE x PACKET_SIZE pixels
+#define PACKET_SIZE 8
+#define PACKET_RAYS (PACKET_SIZE * PACKET_SIZE)
+
+// A packet with fewer active rays than this has diverged
+#define PACKET_MIN_RAYS 8
+
+// Rays of a packet in SoA form. Sets of rays are bit masks, bit r is ray r.
+struct alignas(32) Ray_Packet {
+  float3 origin(int r) const { return make_float3(ox[r], oy[r], oz[r]); }
+  float3 direction(int r) const { return make_float3(dx[r], dy[r], dz[r]); }
+
+  void setRay(int r, const float3 &o, const float3 &d, float t0, float t1) {
+    ox[r] = o.x;
+    oy[r] = o.y;
+    oz[r] = o.z;
+    dx[r] = d.x;
+    dy[r] = d.y;
+    dz[r] = d.z;
+    tmin[r] = t0;
+    tmax[r] = t1;
+  }
+
+  // Computes the inverse directions and the interval bounds of the rays in
+  // 'mask'. Depth of field spreads the origins over the lens, that's fine as
+  // long as the directions keep their signs. The SIMD node tests load every
+  // lane, so the rays outside 'mask' are set to an empty interval.
+  void computeBounds(uint64_t mask) {
+    omin = imin = make_float3(FLT_MAX);
+    omax = imax = make_float3(-FLT_MAX);
+    tminLow = FLT_MAX;
+    coherent = true;
+
+    for (int r = 0; r < PACKET_RAYS; r++) {
+      if (!(mask >> r & 1)) {
+        ox[r] = oy[r] = oz[r] = 0.f;
+        ix[r] = iy[r] = iz[r] = 0.f;
+        tmin[r] = 0.f;
+        tmax[r] = -1.f;
+        continue;
+      }
+
+      ix[r] = 1.f / dx[r];
+      iy[r] = 1.f / dy[r];
+      iz[r] = 1.f / dz[r];
+
+      float3 o = origin(r), i = make_float3(ix[r], iy[r], iz[r]);
+      omin = min_vec(omin, o);
+      omax = max_vec(omax, o);
+      imin = min_vec(imin, i);
+      imax = max_vec(imax, i);
+      tminLow = ffmin(tminLow, tmin[r]);
+    }
+
+    // parallel or mixed sign directions make the intervals unbounded
+    for (int a = 0; a < 3; a++) {
+      float lo = (&imin.x)[a], hi = (&imax.x)[a];
+      if (!(lo > 0.f || hi < 0.f) || !(hi - lo < FLT_MAX)) coherent = false;
+    }
+  }
+
+  float ox[PACKET_RAYS], oy[PACKET_RAYS], oz[PACKET_RAYS];
+  float dx[PACKET_RAYS], dy[PACKET_RAYS], dz[PACKET_RAYS];
+  float ix[PACKET_RAYS], iy[PACKET_RAYS], iz[PACKET_RAYS];  // 1 / direction
+  float tmin[PACKET_RAYS], tmax[PACKET_RAYS];
+  float time[PACKET_RAYS];
+  uint seed[PACKET_RAYS];
+
+  // bounds of the origins and inverse directions
+  float3 omin, omax, imin, imax;
+  float tminLow;
+  bool coherent;  // directions have the same signs, the bounds can be used
+};
+
+// Packet traversal counters
+struct Packet_Stats {
+  Packet_Stats() : packets(0), nodes(0), singleRays(0) {}
+
+  void add(const Packet_Stats &s) {
+    packets += s.packets;
+    nodes += s.nodes;
+    singleRays += s.singleRays;
+  }
+
+  long long packets;
+  long long nodes;       // nodes tested by packets
+  long long singleRays;  // rays that left a packet to traverse a subtree
+};
+
+inline int countRays(uint64_t mask) {
+  return (int)std::bitset<64>(mask).count();
+}
+
+// Bounds of a * b, for a in [a0, a1] and b in [b0, b1]
+inline float intervalMin(float a0, float a1, float b0, float b1) {
+  return ffmin(ffmin(a0 * b0, a0 * b1), ffmin(a1 * b0, a1 * b1));
+}
+
+inline float intervalMax(float a0, float a1, float b0, float b1) {
+  return ffmax(ffmax(a0 * b0, a0 * b1), ffmax(a1 * b0, a1 * b1));
+}
+
+// Interval arithmetic version of the slab test: the latest entry and earliest
+// exit distances of any ray in the packet. If the entry is after the exit, no
+// ray of the packet can hit the node.
+inline bool intersectInterval(const BVH_Node &node, const Ray_Packet &packet) {
+  float entry = packet.tminLow, exit = FLT_MAX;
+
+  for (int a = 0; a < 3; a++) {
+    float o0 = (&packet.omin.x)[a], o1 = (&packet.omax.x)[a];
+    float i0 = (&packet.imin.x)[a], i1 = (&packet.imax.x)[a];
+    float lo = (&node.bmin.x)[a], hi = (&node.bmax.x)[a];
+    float nearPlane = i1 < 0.f ? hi : lo;
+    float farPlane = i1 < 0.f ? lo : hi;
+
+    entry = ffmax(entry, intervalMin(nearPlane - o1, nearPlane - o0, i0, i1));
+    exit = ffmin(exit, intervalMax(farPlane - o1, farPlane - o0, i0, i1));
+  }
+
+  return entry <= exit;
+}
+
+// Slab test of every ray in 'mask', returns the mask of the ones that hit the
+// node. Same operations as intersectNode, so both agree on every ray.
+inline uint64_t intersectRays(const BVH_Node &node, const Ray_Packet &packet,
+                              uint64_t mask) {
+  uint64_t hits = 0;
+
+#if defined(WIDE_BVH_AVX)
+  const __m256 bminX = _mm256_set1_ps(node.bmin.x);
+  const __m256 bminY = _mm256_set1_ps(node.bmin.y);
+  const __m256 bminZ = _mm256_set1_ps(node.bmin.z);
+  const __m256 bmaxX = _mm256_set1_ps(node.bmax.x);
+  const __m256 bmaxY = _mm256_set1_ps(node.bmax.y);
+  const __m256 bmaxZ = _mm256_set1_ps(node.bmax.z);
+
+  for (int r = 0; r < PACKET_RAYS; r += 8) {
+    if (!(mask >> r & 0xff)) continue;
+
+    __m256 ox = _mm256_load_ps(packet.ox + r);
+    __m256 oy = _mm256_load_ps(packet.oy + r);
+    __m256 oz = _mm256_load_ps(packet.oz + r);
+    __m256 ix = _mm256_load_ps(packet.ix + r);
+    __m256 iy = _mm256_load_ps(packet.iy + r);
+    __m256 iz = _mm256_load_ps(packet.iz + r);
+
+    __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(bminX, ox), ix);
+    __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(bminY, oy), iy);
+    __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(bminZ, oz), iz);
+    __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(bmaxX, ox), ix);
+    __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(bmaxY, oy), iy);
+    __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(bmaxZ, oz), iz);
+
+    __m256 tnear = _mm256_max_ps(
+        _mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)),
+        _mm256_min_ps(t0z, t1z));
+    __m256 tfar = _mm256_min_ps(
+        _mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)),
+        _mm256_max_ps(t0z, t1z));
+    tnear = _mm256_max_ps(_mm256_load_ps(packet.tmin + r), tnear);
+    tfar = _mm256_min_ps(_mm256_load_ps(packet.tmax + r), tfar);
+
+    __m256 hit = _mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ);
+    hits |= (uint64_t)_mm256_movemask_ps(hit) << r;
+  }
+#elif defined(WIDE_BVH_SSE)
+  const __m128 bminX = _mm_set1_ps(node.bmin.x);
+  const __m128 bminY = _mm_set1_ps(node.bmin.y);
+  const __m128 bminZ = _mm_set1_ps(node.bmin.z);
+  const __m128 bmaxX = _mm_set1_ps(node.bmax.x);
+  const __m128 bmaxY = _mm_set1_ps(node.bmax.y);
+  const __m128 bmaxZ = _mm_set1_ps(node.bmax.z);
+
+  for (int r = 0; r < PACKET_RAYS; r += 4) {
+    if (!(mask >> r & 0xf)) continue;
+
+    __m128 ox = _mm_load_ps(packet.ox + r);
+    __m128 oy = _mm_load_ps(packet.oy + r);
+    __m128 oz = _mm_load_ps(packet.oz + r);
+    __m128 ix = _mm_load_ps(packet.ix + r);
+    __m128 iy = _mm_load_ps(packet.iy + r);
+    __m128 iz = _mm_load_ps(packet.iz + r);
+
+    __m128 t0x = _mm_mul_ps(_mm_sub_ps(bminX, ox), ix);
+    __m128 t0y = _mm_mul_ps(_mm_sub_ps(bminY, oy), iy);
+    __m128 t0z = _mm_mul_ps(_mm_sub_ps(bminZ, oz), iz);
+    __m128 t1x = _mm_mul_ps(_mm_sub_ps(bmaxX, ox), ix);
+    __m128 t1y = _mm_mul_ps(_mm_sub_ps(bmaxY, oy), iy);
+    __m128 t1z = _mm_mul_ps(_mm_sub_ps(bmaxZ, oz), iz);
+
+    __m128 tnear = _mm_max_ps(
+        _mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+        _mm_min_ps(t0z, t1z));
+    __m128 tfar = _mm_min_ps(
+        _mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)),
+        _mm_max_ps(t0z, t1z));
+    tnear = _mm_max_ps(_mm_load_ps(packet.tmin + r), tnear);
+    tfar = _mm_min_ps(_mm_load_ps(packet.tmax + r), tfar);
+
+    hits |= (uint64_t)_mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << r;
+  }
+#else
+  for (int r = 0; r < PACKET_RAYS; r++) {
+    if (!(mask >> r & 1)) continue;
+
+    float tnear;
+    float3 invDir = make_float3(packet.ix[r], packet.iy[r], packet.iz[r]);
+    if (intersectNode(node, packet.origin(r), invDir, packet.tmin[r],
+                      packet.tmax[r], tnear))
+      hits |= 1ull << r;
+  }
+#endif
+
+  return hits & mask;
+}
+
+// Traverses the BVH with the rays of 'mask'. intersect(packet, mask, prim)
+// intersects a leaf primitive with a set of rays, and intersect(r, prim, tmax)
+// with a single ray, like the intersectors of traverseBVH. Children are
+// visited in the order of the first active ray.
+template <typename Intersector>
+void traversePacket(const BVH &bvh, Ray_Packet &packet, uint64_t mask,
+                    Intersector &intersect, Packet_Stats *stats = nullptr) {
+  if (bvh.nodes.empty()) return;
+
+  struct Entry {
+    int node;
+    uint64_t mask;
+  };
+
+  Entry stack[64];
+  int stackSize = 0;
+  stack[stackSize++] = {0, mask};
+
+  while (stackSize > 0) {
+    const Entry entry = stack[--stackSize];
+    const BVH_Node &node = bvh.nodes[entry.node];
+    if (stats) stats->nodes++;
+
+    if (packet.coherent && !intersectInterval(node, packet)) continue;
+
+    uint64_t active = intersectRays(node, packet, entry.mask);
+    if (!active) continue;
+
+    // the packet diverged, its rays finish the subtree alone
+    if (countRays(active) < PACKET_MIN_RAYS) {
+      for (int r = 0; r < PACKET_RAYS; r++) {
+        if (!(active >> r & 1)) continue;
+
+        auto single = [&](int prim, float &t) { return intersect(r, prim, t); };
+        traverseBVH(bvh, packet.origin(r), packet.direction(r),
+                    packet.tmin[r], packet.tmax[r], single, nullptr,
+                    entry.node);
+        if (stats) stats->singleRays++;
+      }
+      continue;
+    }
+
+    if (node.count > 0) {
+      for (int i = 0; i < node.count; i++)
+        intersect(packet, active, bvh.indices[node.offset + i]);
+      continue;
+    }
+
+    // split axis guessed from the child centers, the closest child is pushed
+    // last so it's popped first
+    int first = 0;
+    while (!(active >> first & 1)) first++;
+
+    const BVH_Node &left = bvh.nodes[node.offset];
+    const BVH_Node &right = bvh.nodes[node.offset + 1];
+    float3 d = (right.bmin + right.bmax) - (left.bmin + left.bmax);
+    float3 dir = packet.direction(first);
+    float side = fabsf(d.x) > fabsf(d.y)
+                     ? (fabsf(d.x) > fabsf(d.z) ? d.x * dir.x : d.z * dir.z)
+                     : (fabsf(d.y) > fabsf(d.z) ? d.y * dir.y : d.z * dir.z);
+
+    if (side < 0.f) {
+      stack[stackSize++] = {node.offset, active};
+      stack[stackSize++] = {node.offset + 1, active};
+    } else {
+      stack[stackSize++] = {node.offset + 1, active};
+      stack[stackSize++] = {node.offset, active};
+    }
+  }
+}
+
+// Intersects the rays of 'mask' with an analytic primitive that has a SIMD
+// kernel, several rays at a time. Returns the mask of the rays that found a
+// closer hit, their tmax is shrunk.
+inline uint64_t intersectPrimitiveRays(const CPU_Primitive_Lanes &lanes,
+                                       int prim, Ray_Packet &packet,
+                                       uint64_t mask) {
+  uint64_t hits = 0;
+
+#if defined(PRIMITIVE_LANES)
+  const Primitive_Group group = {lanes, prim, true};
+  const uint64_t laneBits = (1ull << PRIMITIVE_LANES) - 1;
+  alignas(32) float t[PRIMITIVE_LANES];
+
+  for (int r = 0; r < PACKET_RAYS; r += PRIMITIVE_LANES) {
+    if (!(mask >> r & laneBits)) continue;
+
+    Ray_Lanes ray;
+    ray.ox = laneLoad(packet.ox + r);
+    ray.oy = laneLoad(packet.oy + r);
+    ray.oz = laneLoad(packet.oz + r);
+    ray.dx = laneLoad(packet.dx + r);
+    ray.dy = laneLoad(packet.dy + r);
+    ray.dz = laneLoad(packet.dz + r);
+    ray.tmin = laneLoad(packet.tmin + r);
+    ray.tmax = laneLoad(packet.tmax + r);
+    ray.time = laneLoad(packet.time + r);
+
+    Lanes dist;
+    uint64_t hit = laneMask(intersectLanes(group, ray, dist)) & (mask >> r);
+    if (!hit) continue;
+
+    laneStore(t, dist);
+    for (int i = 0; i < PRIMITIVE_LANES; i++)
+      if (hit >> i & 1) packet.tmax[r + i] = t[i];
+    hits |= (hit & laneBits) << r;
+  }
+#endif
+
+  return hits;
+}
+
+// Intersects packet rays with the primitives of a geometry, in object space
+struct Geometry_Packet_Intersector {
+  bool operator()(int r, int prim, float &tmax) {
+    float2 bc;
+    bool found;
+    if (geometry.mesh >= 0)
+      found = intersectTriangle(scene.meshes[geometry.mesh], prim,
+                                packet.origin(r), packet.direction(r),
+                                packet.tmin[r], tmax, bc);
+    else
+      found = intersectPrimitive(geometry.primitives[prim], packet.origin(r),
+                                 packet.direction(r), packet.tmin[r], tmax,
+                                 packet.time[r], packet.seed[r], bc);
+
+    if (found) {
+      hits[r].instance = instance;
+      hits[r].primitive = prim;
+      hits[r].bc = bc;
+    }
+    return found;
+  }
+
+  // analytic primitives with a SIMD kernel test several rays at once
+  void operator()(Ray_Packet &, uint64_t mask, int prim) {
+#if defined(PRIMITIVE_LANES)
+    if (geometry.mesh < 0 && scene.primitiveLanes &&
+        hasLaneKernel(geometry.primitives[prim].type)) {
+      uint64_t found =
+          intersectPrimitiveRays(geometry.lanes, prim, packet, mask);
+
+      for (int r = 0; r < PACKET_RAYS; r++) {
+        if (!(found >> r & 1)) continue;
+
+        hits[r].instance = instance;
+        hits[r].primitive = prim;
+        hits[r].bc = make_float2(0.f);
+      }
+      return;
+    }
+#endif
+
+    for (int r = 0; r < PACKET_RAYS; r++)
+      if (mask >> r & 1) (*this)(r, prim, packet.tmax[r]);
+  }
+
+  const CPU_Scene &scene;
+  const CPU_Geometry &geometry;
+  Ray_Packet &packet;
+  CPU_Hit *hits;
+  int instance;
+};
+
+// Intersects packet rays with the instances of the top level BVH. Packets are
+// moved to the instance's object space, where they stay as coherent as they
+// were, and go on through the binary BVH of its geometry.
+struct Instance_Packet_Intersector {
+  bool operator()(int r, int i, float &tmax) {
+    Ray ray = make_Ray(packet.origin(r), packet.direction(r), 0,
+                       packet.tmin[r], tmax);
+    return intersectInstance(scene, i, ray, tmax, packet.time[r],
+                             packet.seed[r], hits[r]);
+  }
+
+  void operator()(Ray_Packet &, uint64_t mask, int i) {
+    const CPU_Instance &instance = scene.instances[i];
+    const CPU_Geometry &geometry = scene.geometries[instance.geometry];
+
+    if (instance.identity) {
+      Geometry_Packet_Intersector intersect = {scene, geometry, packet, hits,
+                                               i};
+      traversePacket(geometry.bvh, packet, mask, intersect, stats);
+      return;
+    }
+
+    Ray_Packet local;
+    for (int r = 0; r < PACKET_RAYS; r++) {
+      if (!(mask >> r & 1)) continue;
+
+      local.setRay(r, transformPoint(instance.toObject, packet.origin(r)),
+                   transformVector(instance.toObject, packet.direction(r)),
+                   packet.tmin[r], packet.tmax[r]);
+      local.time[r] = packet.time[r];
+      local.seed[r] = packet.seed[r];
+    }
+    local.computeBounds(mask);
+
+    Geometry_Packet_Intersector intersect = {scene, geometry, local, hits, i};
+    traversePacket(geometry.bvh, local, mask, intersect, stats);
+
+    for (int r = 0; r < PACKET_RAYS; r++) {
+      if (!(mask >> r & 1)) continue;
+
+      packet.tmax[r] = local.tmax[r];
+      packet.seed[r] = local.seed[r];
+    }
+  }
+
+  const CPU_Scene &scene;
+  Ray_Packet &packet;
+  CPU_Hit *hits;
+  Packet_Stats *stats;
+};
+
+// Finds the closest intersection of every ray of 'mask' with the scene, same
+// results as traceScene. Volumes draw random numbers in traversal order, so
+// scenes with volumes have to trace their rays one by one to get the same
+// random numbers.
+void tracePacket(const CPU_Scene &scene, Ray_Packet &packet, uint64_t mask,
+                 CPU_Hit *hits, Packet_Stats *stats = nullptr) {
+  for (int r = 0; r < PACKET_RAYS; r++) hits[r].instance = -1;
+
+  if (stats) stats->packets++;
+  packet.computeBounds(mask);
+
+  Instance_Packet_Intersector intersect = {scene, packet, hits, stats};
+  traversePacket(scene.topLevel, packet, mask, intersect, stats);
+
+  for (int r = 0; r < PACKET_RAYS; r++) hits[r].t = packet.tmax[r];
+}
+
+#endif
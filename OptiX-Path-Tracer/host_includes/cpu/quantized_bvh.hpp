@@ -0,0 +1,215 @@
+#ifndef QUANTIZEDBVHH
+#define QUANTIZEDBVHH
+
+// quantized_bvh.hpp: Define the compressed wide BVH of the CPU backend, with
+// child boxes quantized to 8 bits relative to their parent box
+
+#include <cstdint>
+#include <cstring>
+
+#include "wide_bvh.hpp"
+
+#define QBVH_INTERIOR 255  // meta of interior children, 0 marks empty slots
+
+// Compressed wide BVH node. Child boxes are stored as 8 bit steps from the
+// parent box min corner, with a power of two step size per axis, rounded
+// outwards so the decoded boxes always contain the original ones. Interior
+// children of a node are stored next to each other from 'childBase', and the
+// primitives of its leaves from 'primBase', so a 16 bit offset per child is
+// enough to find them.
+template <int N>
+struct alignas(32) Quantized_BVH_Node {
+  float3 origin;       // min corner of the parent box
+  int8_t exponent[3];  // step size of each axis is 2^exponent
+  uint8_t pad;
+  int childBase, primBase;
+  uint8_t meta[N];  // leaf primitive count, QBVH_INTERIOR or 0
+  uint16_t offset[N];
+  uint8_t qmin[3][N], qmax[3][N];
+};
+
+template <int N>
+struct Quantized_BVH {
+  std::vector<Quantized_BVH_Node<N>, Aligned_Allocator<Quantized_BVH_Node<N> > >
+      nodes;
+  std::vector<int> indices;  // primitive indices referenced by the leaves
+};
+
+// 2^exponent, built from the float bits since the exponent is in range
+inline float exponentScale(int exponent) {
+  uint32_t bits = uint32_t(exponent + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(float));
+  return scale;
+}
+
+// Quantizes [lo, hi] to steps from 'origin', rounding outwards with the same
+// float operations used to decode it. Returns false if hi is out of reach.
+inline bool quantizeRange(float lo, float hi, float origin, float scale,
+                          uint8_t &qlo, uint8_t &qhi) {
+  int a = (int)floorf((lo - origin) / scale);
+  a = std::min(std::max(a, 0), 255);
+  while (a > 0 && origin + float(a) * scale > lo) a--;
+
+  int b = (int)ceilf((hi - origin) / scale);
+  b = std::min(std::max(b, a), 255);
+  while (b < 255 && origin + float(b) * scale < hi) b++;
+
+  qlo = (uint8_t)a;
+  qhi = (uint8_t)b;
+  return origin + float(a) * scale <= lo && origin + float(b) * scale >= hi;
+}
+
+// Quantizes the child boxes of a wide node relative to their union
+template <int N>
+void quantizeChildren(Quantized_BVH_Node<N> &qnode,
+                      const Wide_BVH_Node<N> &node) {
+  const float *bmin[3] = {node.bminX, node.bminY, node.bminZ};
+  const float *bmax[3] = {node.bmaxX, node.bmaxY, node.bmaxZ};
+  float origin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+  float extent[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+  for (int i = 0; i < N; i++) {
+    if (node.count[i] < 0) continue;
+    for (int a = 0; a < 3; a++) {
+      origin[a] = ffmin(origin[a], bmin[a][i]);
+      extent[a] = ffmax(extent[a], bmax[a][i]);
+    }
+  }
+
+  for (int a = 0; a < 3; a++) {
+    extent[a] -= origin[a];
+
+    // smallest step size that covers the extent in 255 steps, grown if the
+    // rounding of the decode leaves a child max out of reach
+    int exponent = -126;
+    if (extent[a] > 0.f)
+      exponent = std::max((int)ceilf(log2f(extent[a] / 255.f)), -126);
+
+    bool fits = false;
+    while (!fits) {
+      fits = true;
+      float scale = exponentScale(exponent);
+
+      for (int i = 0; i < N; i++) {
+        if (node.count[i] < 0) {
+          // inverted box, the slot is skipped by its meta anyway
+          qnode.qmin[a][i] = 255;
+          qnode.qmax[a][i] = 0;
+        } else if (!quantizeRange(bmin[a][i], bmax[a][i], origin[a], scale,
+                                  qnode.qmin[a][i], qnode.qmax[a][i]))
+          fits = false;
+      }
+
+      if (!fits) exponent++;
+    }
+
+    qnode.exponent[a] = (int8_t)exponent;
+  }
+
+  qnode.origin = make_float3(origin[0], origin[1], origin[2]);
+  qnode.pad = 0;
+}
+
+// Compresses a wide BVH. Nodes are written breadth first, so that the interior
+// children of each node end up next to each other, and the leaf primitives of
+// each node are gathered into a contiguous range.
+template <int N>
+void buildQuantizedBVH(Quantized_BVH<N> &qbvh, const Wide_BVH<N> &wide) {
+  qbvh.nodes.clear();
+  qbvh.indices.clear();
+  if (wide.nodes.empty()) return;
+
+  std::vector<int> source(1, 0);  // wide node of every compressed node
+  for (size_t n = 0; n < source.size(); n++) {
+    const Wide_BVH_Node<N> &node = wide.nodes[source[n]];
+
+    Quantized_BVH_Node<N> qnode;
+    qnode.childBase = (int)source.size();
+    qnode.primBase = (int)qbvh.indices.size();
+    int interior = 0;
+
+    for (int i = 0; i < N; i++) {
+      if (node.count[i] < 0) {
+        qnode.meta[i] = 0;
+        qnode.offset[i] = 0;
+      } else if (node.count[i] == 0) {
+        qnode.meta[i] = QBVH_INTERIOR;
+        qnode.offset[i] = (uint16_t)interior++;
+        source.push_back(node.child[i]);
+      } else {
+        if (node.count[i] >= QBVH_INTERIOR)
+          throw "BVH leaf is too large to be compressed";
+
+        qnode.meta[i] = (uint8_t)node.count[i];
+        qnode.offset[i] = (uint16_t)(qbvh.indices.size() - qnode.primBase);
+        for (int p = 0; p < node.count[i]; p++)
+          qbvh.indices.push_back(wide.indices[node.child[i] + p]);
+      }
+    }
+
+    quantizeChildren(qnode, node);
+    qbvh.nodes.push_back(qnode);
+  }
+}
+
+// Decodes 4 steps of one axis, the product is exact so the result matches
+// the encoder's
+inline void decodeSteps(const uint8_t *q, float origin, float scale,
+                        float *out) {
+#if defined(WIDE_BVH_SSE)
+  int packed;
+  memcpy(&packed, q, sizeof(int));
+  const __m128i zero = _mm_setzero_si128();
+  __m128i bytes = _mm_cvtsi32_si128(packed);
+  __m128i steps = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+  __m128 decoded = _mm_mul_ps(_mm_cvtepi32_ps(steps), _mm_set1_ps(scale));
+  _mm_store_ps(out, _mm_add_ps(_mm_set1_ps(origin), decoded));
+#else
+  for (int i = 0; i < 4; i++) out[i] = origin + float(q[i]) * scale;
+#endif
+}
+
+// Decodes a compressed node into the wide node layout, so it can be tested
+// with intersectChildren
+template <int N>
+inline const Wide_BVH_Node<N> &fetchNode(const Quantized_BVH<N> &bvh,
+                                         int index,
+                                         Wide_BVH_Node<N> &scratch) {
+  const Quantized_BVH_Node<N> &node = bvh.nodes[index];
+  const float3 &o = node.origin;
+  const float sx = exponentScale(node.exponent[0]);
+  const float sy = exponentScale(node.exponent[1]);
+  const float sz = exponentScale(node.exponent[2]);
+
+  for (int i = 0; i < N; i += 4) {
+    decodeSteps(node.qmin[0] + i, o.x, sx, scratch.bminX + i);
+    decodeSteps(node.qmin[1] + i, o.y, sy, scratch.bminY + i);
+    decodeSteps(node.qmin[2] + i, o.z, sz, scratch.bminZ + i);
+    decodeSteps(node.qmax[0] + i, o.x, sx, scratch.bmaxX + i);
+    decodeSteps(node.qmax[1] + i, o.y, sy, scratch.bmaxY + i);
+    decodeSteps(node.qmax[2] + i, o.z, sz, scratch.bmaxZ + i);
+  }
+
+  for (int i = 0; i < N; i++) {
+    int meta = node.meta[i];
+    bool interior = meta == QBVH_INTERIOR;
+    scratch.count[i] = interior ? 0 : (meta ? meta : -1);
+    scratch.child[i] =
+        (interior ? node.childBase : node.primBase) + node.offset[i];
+  }
+
+  return scratch;
+}
+
+// Traverses the compressed BVH front to back, with the same interface as
+// traverseBVH. Decoded boxes are conservative, so only the hit order of
+// overlapping children can differ from the uncompressed BVH.
+template <int N, typename Intersector>
+bool traverseQuantizedBVH(const Quantized_BVH<N> &bvh, const float3 &origin,
+                          const float3 &direction, float tmin, float &tmax,
+                          Intersector &intersect) {
+  return traverseWide<N>(bvh, origin, direction, tmin, tmax, intersect);
+}
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef CPURENDERH
+#define CPURENDERH
+
+// render.hpp: Define the CPU version of the ray generation program in
+// programs/raygen.cu. Frames are split in tiles shared by the thread pool.
+
+#include "../../programs/accumulate.cuh"
+#include "materials.hpp"
+#include "packet.hpp"
+
+// Size in pixels of the square tiles handed to the threads
+#define CPU_TILE_SIZE 16
+
+Ray generateRay(const CPU_Camera &camera, float s, float t, uint &seed) {
+  const float3 rd = camera.lens_radius * random_in_unit_disk(seed);
+  const float3 lens_offset = camera.u * rd.x + camera.v * rd.y;
+  const float3 origin = camera.origin + lens_offset;
+  const float3 direction = camera.lower_left_corner + s * camera.horizontal +
+                           t * camera.vertical - origin;
+
+  return make_Ray(/* origin   : */ origin,
+                  /* direction: */ direction,
+                  /* ray type : */ 0,
+                  /* tmin     : */ 1e-6f,
+                  /* tmax     : */ RT_DEFAULT_MAX);
+}
+
+// Time of the rays of a path, drawn right after its camera ray
+inline float pathTime(const CPU_Camera &camera, uint &seed) {
+  return camera.time0 + rnd(seed) * (camera.time1 - camera.time0);
+}
+
+// Spread of the ray cones of a frame 'height' pixels high
+inline float pixelSpread(const CPU_Camera &camera, int height) {
+  return Pixel_Spread(camera.lower_left_corner, camera.horizontal,
+                      camera.vertical, camera.origin, height);
+}
+
+// Follows a path from its camera ray. The camera ray hit can be given if it
+// was already traced, in a packet for example.
+float3 color(const CPU_Scene &scene, Ray &ray, uint seed, float time,
+             float spread, const CPU_Hit *cameraHit) {
+  PerRayData prd;
+  prd.seed = seed;
+  prd.time = time;
+  prd.throughput = make_float3(1.f);
+  prd.radiance = make_float3(0.f);
+  prd.coneWidth = 0.f;
+  prd.coneSpread = spread;
+
+  bool previousHitSpecular = false;
+
+  // iterative version of recursion
+  for (int depth = 0; depth < scene.maxDepth; depth++) {
+    prd.origin = ray.origin;  // read by the texture footprints
+
+    // Trace a new ray
+    CPU_Hit hit;
+    bool found;
+    if (depth == 0 && cameraHit) {
+      hit = *cameraHit;
+      found = hit.instance >= 0;
+    } else
+      found = traceScene(scene, ray, prd.time, prd.seed, hit);
+
+    if (found) {
+      const CPU_Material &material = scene.materials[getMaterial(scene, hit)];
+      closestHit(scene, material, getHitRecord(scene, hit, ray, prd.time),
+                 prd, Traced_Direct_Light{scene});
+    } else
+      miss(scene, ray, prd);
+
+    // ray got 'lost' to the environment
+    // return attenuation set by miss shader
+    if (prd.scatterEvent == rayMissed) {
+      // a sampled environment already lit the previous, diffuse, bounce
+      if (scene.environment.enabled && depth > 0 && !previousHitSpecular)
+        return prd.radiance;
+
+      // HDR maps aren't clamped, like their light samples, so that sampling
+      // them converges to the same image
+      if (scene.miss.type == ENVIRONMENT_MISS)
+        return prd.radiance + prd.throughput;
+
+      return prd.radiance + clamp(prd.throughput, 0.f, 1.f);
+    }
+
+    // ray hit a light, return radiance
+    else if (prd.scatterEvent == rayHitLight) {
+      // Take care not to double dip
+      if (depth == 0 || previousHitSpecular) prd.radiance += prd.throughput;
+
+      return prd.radiance;
+    }
+
+    // ray was cancelled, return radiance
+    else if (prd.scatterEvent == rayGotCancelled)
+      return prd.radiance;
+
+    // ray is still alive, and got properly bounced
+    else {
+      // the cone keeps its spread, surfaces don't widen it
+      prd.coneWidth += prd.coneSpread * length(prd.origin - ray.origin);
+
+      // generate a new ray
+      ray = make_Ray(/* origin   : */ prd.origin,
+                     /* direction: */ prd.direction,
+                     /* ray type : */ 0,
+                     /* tmin     : */ 1e-3f,
+                     /* tmax     : */ RT_DEFAULT_MAX);
+
+      // updated specular flag
+      previousHitSpecular = prd.isSpecular;
+    }
+
+    // Russian Roulette Path Termination
+    if (scene.russian) {
+      float prob = max_component(prd.throughput);
+      if (depth > 10) {
+        if (rnd(prd.seed) >= prob)
+          return prd.radiance + prd.throughput;
+        else
+          prd.throughput *= 1.f / prob;
+      }
+    }
+  }
+
+  // recursion did not terminate - cancel it
+  return make_float3(0.f);
+}
+
+float3 color(const CPU_Scene &scene, Ray &ray, uint &seed, float spread) {
+  uint pathSeed = seed;
+  float time = pathTime(scene.camera, pathSeed);
+  return color(scene, ray, pathSeed, time, spread, nullptr);
+}
+
+// Color seen through the film coordinates (u, v)
+struct Pixel_Radiance {
+  const CPU_Scene &scene;
+  float spread;  // see pixelSpread
+
+  float3 operator()(float u, float v, uint &seed) const {
+    Ray ray = generateRay(scene.camera, u, v, seed);
+    return color(scene, ray, seed, spread);
+  }
+};
+
+// Adds a launch's samples of a pixel to the acc buffer, once
+inline void storePixel(const float4 &batch, int x, int y, int width,
+                       int height, int frame, int samples, float4 *acc_buffer,
+                       uchar4 *display_buffer) {
+  int index = (height - y - 1) * width + x;
+  float4 acc = add_Samples(acc_buffer[index], batch, frame);
+  acc_buffer[index] = acc;
+  display_buffer[index] = make_Color(acc, frame + samples);
+}
+
+// Renders a pixel, with the same RNG seeding and buffer layout as renderPixel
+void renderPixel(const CPU_Scene &scene, int x, int y, int width, int height,
+                 int frame, int samples, float4 *acc_buffer,
+                 uchar4 *display_buffer) {
+  // trace this launch's samples, summing them locally
+  Pixel_Radiance radiance = {scene, pixelSpread(scene.camera, height)};
+  float4 batch = accumulate(radiance, make_uint2(x, y),
+                            make_uint2(width, height), frame, samples);
+
+  storePixel(batch, x, y, width, height, frame, samples, acc_buffer,
+             display_buffer);
+}
+
+// Renders the pixels [x0, x1) x [y0, y1) of a packet, tracing the camera rays
+// of each sample together. Seeds are drawn as in accumulate and color(), so
+// the pixels are the same as renderPixel's.
+void renderPacket(const CPU_Scene &scene, int x0, int y0, int x1, int y1,
+                  int width, int height, int frame, int samples,
+                  float4 *acc_buffer, uchar4 *display_buffer) {
+  Ray_Packet packet;
+  Ray rays[PACKET_RAYS];
+  CPU_Hit hits[PACKET_RAYS];
+  float3 sums[PACKET_RAYS];
+  float spread = pixelSpread(scene.camera, height);
+
+  uint64_t mask = 0;
+  for (int y = y0; y < y1; y++)
+    for (int x = x0; x < x1; x++) {
+      int r = (y - y0) * PACKET_SIZE + (x - x0);
+      mask |= 1ull << r;
+      sums[r] = make_float3(0.f);
+    }
+
+  for (int i = 0; i < samples; i++) {
+    for (int y = y0; y < y1; y++)
+      for (int x = x0; x < x1; x++) {
+        int r = (y - y0) * PACKET_SIZE + (x - x0);
+        uint seed = tea<64>(width * y + x, frame + i);
+        float u = float(x + rnd(seed)) / width;
+        float v = float(y + rnd(seed)) / height;
+
+        rays[r] = generateRay(scene.camera, u, v, seed);
+        packet.setRay(r, rays[r].origin, rays[r].direction, rays[r].tmin,
+                      rays[r].tmax);
+        packet.time[r] = pathTime(scene.camera, seed);
+        packet.seed[r] = seed;
+      }
+
+    tracePacket(scene, packet, mask, hits);
+
+    for (int r = 0; r < PACKET_RAYS; r++)
+      if (mask >> r & 1)
+        sums[r] += de_nan(color(scene, rays[r], packet.seed[r],
+                                packet.time[r], spread, &hits[r]));
+  }
+
+  for (int y = y0; y < y1; y++)
+    for (int x = x0; x < x1; x++) {
+      const float3 &sum = sums[(y - y0) * PACKET_SIZE + (x - x0)];
+      storePixel(make_float4(sum.x, sum.y, sum.z, float(samples)), x, y,
+                 width, height, frame, samples, acc_buffer, display_buffer);
+    }
+}
+
+// Renders a full frame, 'samples' samples per pixel starting at sample 'frame'.
+// Camera rays are traced in packets if the scene asks for it and has no
+// volumes.
+void renderFrame(const CPU_Scene &scene, Thread_Pool &pool, int width,
+                 int height, int frame, int samples, float4 *acc_buffer,
+                 uchar4 *display_buffer) {
+  int tilesX = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  int tilesY = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+  bool packets = scene.packets && !scene.hasVolumes;
+
+  pool.parallel_for(tilesX * tilesY, [&](int tile) {
+    int x0 = (tile % tilesX) * CPU_TILE_SIZE;
+    int y0 = (tile / tilesX) * CPU_TILE_SIZE;
+    int x1 = std::min(x0 + CPU_TILE_SIZE, width);
+    int y1 = std::min(y0 + CPU_TILE_SIZE, height);
+
+    if (packets) {
+      for (int y = y0; y < y1; y += PACKET_SIZE)
+        for (int x = x0; x < x1; x += PACKET_SIZE)
+          renderPacket(scene, x, y, std::min(x + PACKET_SIZE, x1),
+                       std::min(y + PACKET_SIZE, y1), width, height, frame,
+                       samples, acc_buffer, display_buffer);
+      return;
+    }
+
+    for (int y = y0; y < y1; y++)
+      for (int x = x0; x < x1; x++)
+        renderPixel(scene, x, y, width, height, frame, samples, acc_buffer,
+                    display_buffer);
+  });
+}
+
+#endif
@@ -0,0 +1,471 @@
+#ifndef SBVHH
+#define SBVHH
+
+// sbvh.hpp: Define the spatial split BVH builder of the CPU backend, for
+// meshes whose large, thin triangles overlap badly in an object split BVH
+
+#include "bvh.hpp"
+
+// Number of bins per axis evaluated for spatial splits
+#define SBVH_SPATIAL_BINS 32
+
+// Spatial splits are only tried if the children of the best object split
+// overlap by more than this fraction of the root surface area
+#define SBVH_OVERLAP_THRESHOLD 1e-5f
+
+// Nodes this deep become leaves, so the traversal stack can't overflow
+#define SBVH_MAX_DEPTH 60
+
+// Default limit of extra triangle references, relative to the triangle count
+#define SBVH_DEFAULT_BUDGET 0.5f
+
+// Split BVH builder (Stich et al., "Spatial Splits in Bounding Volume
+// Hierarchies", 2009). Every node compares the best binned object split with
+// the best spatial split, which clips the triangles straddling the split
+// plane into both children. The mesh may hold up to (1 + budget) times its
+// triangle count in references. The spare room of a node is shared by its
+// children in proportion to their references, so that the budget isn't spent
+// by the first levels, and the room left by a subtree goes to the next one.
+// The tree uses the BVH_Node layout of the other builders, a triangle may
+// appear in several leaves.
+class SBVH_Builder {
+ public:
+  SBVH_Builder(BVH &b, const std::vector<float3> &v,
+               const std::vector<uint3> &i, float budget, int leafSize)
+      : bvh(b), vertices(v), faces(i), maxLeafSize(leafSize) {
+    maxReferences = (int)(faces.size() * (1.0 + std::max(budget, 0.f)));
+  }
+
+  void build() {
+    int n = (int)faces.size();
+
+    std::vector<BVH_Reference> refs(n);
+    BVH_Bounds box;
+    for (int f = 0; f < n; f++) {
+      BVH_Bounds triangle;
+      triangle.include(vertices[faces[f].x]);
+      triangle.include(vertices[faces[f].y]);
+      triangle.include(vertices[faces[f].z]);
+
+      refs[f].bmin = triangle.bmin;
+      refs[f].bmax = triangle.bmax;
+      refs[f].prim = f;
+      box.include(triangle);
+    }
+
+    rootArea = box.area();
+
+    // node 1 is left unused, as in the other builders
+    bvh.nodes.resize(2);
+    bvh.indices.reserve(n);
+    numReferences = buildNode(0, refs, box, 0, maxReferences);
+  }
+
+  // number of triangle references in the leaves
+  int references() const { return numReferences; }
+
+ private:
+  struct Split {
+    Split() : cost(FLT_MAX), axis(0), bin(0) { count[0] = count[1] = 0; }
+
+    float cost;
+    int axis, bin;
+    BVH_Bounds box[2];
+    int count[2];
+  };
+
+  static float coordinate(const float3 &p, int axis) {
+    return (&p.x)[axis];
+  }
+
+  static BVH_Bounds intersection(const BVH_Bounds &a, const BVH_Bounds &b) {
+    BVH_Bounds box;
+    box.bmin = max_vec(a.bmin, b.bmin);
+    box.bmax = min_vec(a.bmax, b.bmax);
+    return box;
+  }
+
+  static bool isEmpty(const BVH_Bounds &box) {
+    return box.bmin.x > box.bmax.x || box.bmin.y > box.bmax.y ||
+           box.bmin.z > box.bmax.z;
+  }
+
+  static BVH_Bounds bounds(const BVH_Reference &ref) {
+    BVH_Bounds box;
+    box.include(ref.bmin, ref.bmax);
+    return box;
+  }
+
+  float splitCost(float area, const Split &split) const {
+    return BVH_TRAVERSAL_COST +
+           BVH_INTERSECTION_COST *
+               (split.count[0] * split.box[0].area() +
+                split.count[1] * split.box[1].area()) /
+               area;
+  }
+
+  // Clips the triangle of a reference against an axis aligned plane,
+  // returning the bounds of both parts within the reference bounds
+  void splitReference(const BVH_Reference &ref, int axis, float plane,
+                      BVH_Bounds &left, BVH_Bounds &right) const {
+    const uint3 &face = faces[ref.prim];
+    const float3 v[3] = {vertices[face.x], vertices[face.y],
+                         vertices[face.z]};
+    left = right = BVH_Bounds();
+
+    for (int i = 0; i < 3; i++) {
+      const float3 &v0 = v[i], &v1 = v[(i + 1) % 3];
+      float p0 = coordinate(v0, axis), p1 = coordinate(v1, axis);
+
+      if (p0 <= plane) left.include(v0);
+      if (p0 >= plane) right.include(v0);
+
+      // edge crossing the plane
+      if ((p0 < plane && p1 > plane) || (p0 > plane && p1 < plane)) {
+        float t = ffmin(ffmax((plane - p0) / (p1 - p0), 0.f), 1.f);
+        float3 p = v0 + t * (v1 - v0);
+        left.include(p);
+        right.include(p);
+      }
+    }
+
+    (&left.bmax.x)[axis] = plane;
+    (&right.bmin.x)[axis] = plane;
+
+    left = intersection(left, bounds(ref));
+    right = intersection(right, bounds(ref));
+  }
+
+  // Binned SAH over the reference centroids, as in BVH_Builder
+  Split findObjectSplit(const std::vector<BVH_Reference> &refs,
+                        float area) const {
+    BVH_Bounds centroidBox;
+    for (size_t i = 0; i < refs.size(); i++)
+      centroidBox.include(0.5f * (refs[i].bmin + refs[i].bmax));
+
+    Split best;
+    for (int axis = 0; axis < 3; axis++) {
+      float extent = centroidBox.extent(axis);
+      if (extent <= 0.f) continue;
+
+      float cmin = coordinate(centroidBox.bmin, axis);
+      float scale = BVH_SAH_BINS / extent;
+
+      BVH_Bounds boxes[BVH_SAH_BINS];
+      int counts[BVH_SAH_BINS] = {0};
+      for (size_t i = 0; i < refs.size(); i++) {
+        int b = objectBin(refs[i].centroid(axis), cmin, scale);
+        boxes[b].include(refs[i].bmin, refs[i].bmax);
+        counts[b]++;
+      }
+
+      evaluateBins(boxes, counts, counts, BVH_SAH_BINS, axis, area, best);
+    }
+
+    return best;
+  }
+
+  // Bins the clipped references between the node bounds along every axis,
+  // counting where references enter and exit
+  Split findSpatialSplit(const std::vector<BVH_Reference> &refs,
+                         const BVH_Bounds &box, float area) const {
+    Split best;
+
+    for (int axis = 0; axis < 3; axis++) {
+      float extent = box.extent(axis);
+      if (extent <= 0.f) continue;
+
+      float origin = coordinate(box.bmin, axis);
+      float width = extent / SBVH_SPATIAL_BINS;
+
+      BVH_Bounds boxes[SBVH_SPATIAL_BINS];
+      int entries[SBVH_SPATIAL_BINS] = {0}, exits[SBVH_SPATIAL_BINS] = {0};
+
+      for (size_t i = 0; i < refs.size(); i++) {
+        int first = spatialBin(coordinate(refs[i].bmin, axis), origin, width);
+        int last = spatialBin(coordinate(refs[i].bmax, axis), origin, width);
+        entries[first]++;
+        exits[last]++;
+
+        // chop the reference into every bin it overlaps
+        BVH_Reference part = refs[i];
+        for (int b = first; b < last; b++) {
+          BVH_Bounds left, right;
+          splitReference(part, axis, origin + (b + 1) * width, left, right);
+          if (!isEmpty(left)) boxes[b].include(left);
+          part.bmin = right.bmin;
+          part.bmax = right.bmax;
+        }
+        if (!isEmpty(bounds(part))) boxes[last].include(part.bmin, part.bmax);
+      }
+
+      evaluateBins(boxes, entries, exits, SBVH_SPATIAL_BINS, axis, area,
+                   best);
+    }
+
+    return best;
+  }
+
+  static int objectBin(float c, float cmin, float scale) {
+    int bin = (int)((c - cmin) * scale);
+    return std::min(std::max(bin, 0), BVH_SAH_BINS - 1);
+  }
+
+  static int spatialBin(float c, float origin, float width) {
+    int bin = (int)((c - origin) / width);
+    return std::min(std::max(bin, 0), SBVH_SPATIAL_BINS - 1);
+  }
+
+  // Sweeps the bins from both sides, references being counted on the left
+  // of a boundary if they enter before it and on the right if they exit
+  // after it
+  void evaluateBins(const BVH_Bounds *boxes, const int *entries,
+                    const int *exits, int numBins, int axis, float area,
+                    Split &best) const {
+    BVH_Bounds rightBoxes[SBVH_SPATIAL_BINS], accBox;
+    int rightCounts[SBVH_SPATIAL_BINS], accCount = 0;
+    for (int b = numBins - 1; b > 0; b--) {
+      accBox.include(boxes[b]);
+      accCount += exits[b];
+      rightBoxes[b] = accBox;
+      rightCounts[b] = accCount;
+    }
+
+    Split split;
+    split.axis = axis;
+    split.count[0] = 0;
+    for (int b = 1; b < numBins; b++) {
+      split.box[0].include(boxes[b - 1]);
+      split.count[0] += entries[b - 1];
+      split.box[1] = rightBoxes[b];
+      split.count[1] = rightCounts[b];
+      if (split.count[0] == 0 || split.count[1] == 0) continue;
+
+      float cost = splitCost(area, split);
+      if (cost < best.cost) {
+        best = split;
+        best.cost = cost;
+        best.bin = b;
+      }
+    }
+  }
+
+  // Distributes the references of a spatial split. Straddling references
+  // are split, unless moving them entirely to one side is cheaper.
+  bool performSpatialSplit(const std::vector<BVH_Reference> &refs,
+                           const BVH_Bounds &box, Split &split,
+                           std::vector<BVH_Reference> &left,
+                           std::vector<BVH_Reference> &right) {
+    const int axis = split.axis;
+    const float plane = coordinate(box.bmin, axis) +
+                        split.bin * box.extent(axis) / SBVH_SPATIAL_BINS;
+
+    BVH_Bounds leftBox, rightBox;
+    std::vector<int> straddling;
+    for (int i = 0; i < (int)refs.size(); i++) {
+      if (coordinate(refs[i].bmax, axis) <= plane) {
+        left.push_back(refs[i]);
+        leftBox.include(refs[i].bmin, refs[i].bmax);
+      } else if (coordinate(refs[i].bmin, axis) >= plane) {
+        right.push_back(refs[i]);
+        rightBox.include(refs[i].bmin, refs[i].bmax);
+      } else
+        straddling.push_back(i);
+    }
+
+    int leftCount = (int)(left.size() + straddling.size());
+    int rightCount = (int)(right.size() + straddling.size());
+
+    for (size_t s = 0; s < straddling.size(); s++) {
+      const BVH_Reference &ref = refs[straddling[s]];
+      BVH_Bounds leftPart, rightPart;
+      splitReference(ref, axis, plane, leftPart, rightPart);
+
+      // the triangle doesn't reach one of the sides within its clipped bounds
+      if (isEmpty(leftPart) || isEmpty(rightPart)) {
+        BVH_Reference part = ref;
+        bool toLeft = isEmpty(rightPart);
+        const BVH_Bounds &partBox = toLeft ? leftPart : rightPart;
+        part.bmin = partBox.bmin;
+        part.bmax = partBox.bmax;
+
+        (toLeft ? left : right).push_back(part);
+        (toLeft ? leftBox : rightBox).include(partBox);
+        (toLeft ? rightCount : leftCount)--;
+        continue;
+      }
+
+      BVH_Bounds splitLeft = leftBox, splitRight = rightBox;
+      splitLeft.include(leftPart);
+      splitRight.include(rightPart);
+
+      BVH_Bounds unsplitLeft = leftBox, unsplitRight = rightBox;
+      unsplitLeft.include(ref.bmin, ref.bmax);
+      unsplitRight.include(ref.bmin, ref.bmax);
+
+      float splitCost = splitLeft.area() * leftCount +
+                        splitRight.area() * rightCount;
+      float leftCost = unsplitLeft.area() * leftCount +
+                       rightBox.area() * (rightCount - 1);
+      float rightCost = leftBox.area() * (leftCount - 1) +
+                        unsplitRight.area() * rightCount;
+
+      if (leftCost < splitCost && leftCost <= rightCost) {
+        left.push_back(ref);
+        leftBox = unsplitLeft;
+        rightCount--;
+      } else if (rightCost < splitCost) {
+        right.push_back(ref);
+        rightBox = unsplitRight;
+        leftCount--;
+      } else {
+        BVH_Reference leftRef = ref, rightRef = ref;
+        leftRef.bmin = leftPart.bmin;
+        leftRef.bmax = leftPart.bmax;
+        rightRef.bmin = rightPart.bmin;
+        rightRef.bmax = rightPart.bmax;
+
+        left.push_back(leftRef);
+        right.push_back(rightRef);
+        leftBox = splitLeft;
+        rightBox = splitRight;
+      }
+    }
+
+    split.box[0] = leftBox;
+    split.box[1] = rightBox;
+    return !left.empty() && !right.empty();
+  }
+
+  void performObjectSplit(const std::vector<BVH_Reference> &refs,
+                          const Split &split,
+                          std::vector<BVH_Reference> &left,
+                          std::vector<BVH_Reference> &right) const {
+    BVH_Bounds centroidBox;
+    for (size_t i = 0; i < refs.size(); i++)
+      centroidBox.include(0.5f * (refs[i].bmin + refs[i].bmax));
+
+    const int axis = split.axis;
+    const float cmin = coordinate(centroidBox.bmin, axis);
+    const float scale = BVH_SAH_BINS / centroidBox.extent(axis);
+
+    for (size_t i = 0; i < refs.size(); i++) {
+      if (objectBin(refs[i].centroid(axis), cmin, scale) < split.bin)
+        left.push_back(refs[i]);
+      else
+        right.push_back(refs[i]);
+    }
+  }
+
+  void makeLeaf(int nodeIndex, const std::vector<BVH_Reference> &refs) {
+    BVH_Node &node = bvh.nodes[nodeIndex];
+    node.offset = (int)bvh.indices.size();
+    node.count = (int)refs.size();
+
+    for (size_t i = 0; i < refs.size(); i++)
+      bvh.indices.push_back(refs[i].prim);
+  }
+
+  // Builds the node of the given references, with room for 'capacity'
+  // references in its subtree. Returns the number of references used.
+  int buildNode(int nodeIndex, std::vector<BVH_Reference> &refs,
+                 const BVH_Bounds &box, int depth, int capacity) {
+    bvh.nodes[nodeIndex].bmin = box.bmin;
+    bvh.nodes[nodeIndex].bmax = box.bmax;
+
+    int count = (int)refs.size();
+    float area = box.area();
+    if (count == 1 || depth >= SBVH_MAX_DEPTH || area <= 0.f) {
+      makeLeaf(nodeIndex, refs);
+      return count;
+    }
+
+    Split object = findObjectSplit(refs, area);
+
+    // only look for a spatial split if the object split children overlap
+    // and the subtree has room for more references
+    Split spatial;
+    if (object.cost < FLT_MAX && count < capacity) {
+      float overlap = intersection(object.box[0], object.box[1]).area();
+      if (overlap > SBVH_OVERLAP_THRESHOLD * rootArea)
+        spatial = findSpatialSplit(refs, box, area);
+    }
+
+    float bestCost = std::min(object.cost, spatial.cost);
+    float leafCost = BVH_INTERSECTION_COST * count;
+    if (count <= maxLeafSize && leafCost <= bestCost) {
+      makeLeaf(nodeIndex, refs);
+      return count;
+    }
+
+    std::vector<BVH_Reference> left, right;
+    bool split = false;
+
+    if (spatial.cost < object.cost &&
+        spatial.count[0] + spatial.count[1] <= capacity) {
+      split = performSpatialSplit(refs, box, spatial, left, right);
+      if (!split) left.clear(), right.clear();
+    }
+
+    if (!split && object.cost < FLT_MAX) {
+      performObjectSplit(refs, object, left, right);
+      split = !left.empty() && !right.empty();
+      if (!split) left.clear(), right.clear();
+    }
+
+    if (!split) {
+      // all centroids overlap, split in the middle
+      left.assign(refs.begin(), refs.begin() + count / 2);
+      right.assign(refs.begin() + count / 2, refs.end());
+    }
+
+    // the parent references aren't needed anymore
+    std::vector<BVH_Reference>().swap(refs);
+
+    BVH_Bounds childBoxes[2];
+    for (size_t i = 0; i < left.size(); i++)
+      childBoxes[0].include(left[i].bmin, left[i].bmax);
+    for (size_t i = 0; i < right.size(); i++)
+      childBoxes[1].include(right[i].bmin, right[i].bmax);
+
+    int child = (int)bvh.nodes.size();
+    bvh.nodes.resize(child + 2);
+    bvh.nodes[nodeIndex].offset = child;
+    bvh.nodes[nodeIndex].count = 0;
+
+    // share the spare room in proportion to the child references, the right
+    // child also getting what the left one didn't use
+    int leftCount = (int)left.size(), rightCount = (int)right.size();
+    int spare = std::max(capacity - leftCount - rightCount, 0);
+    int leftSpare = (int)((long long)spare * leftCount /
+                          (leftCount + rightCount));
+
+    int used = buildNode(child, left, childBoxes[0], depth + 1,
+                         leftCount + leftSpare);
+    used += buildNode(child + 1, right, childBoxes[1], depth + 1,
+                      std::max(capacity - used, rightCount));
+    return used;
+  }
+
+  BVH &bvh;
+  const std::vector<float3> &vertices;
+  const std::vector<uint3> &faces;
+  int maxLeafSize, numReferences, maxReferences;
+  float rootArea;
+};
+
+// Builds a spatial split BVH over a triangle mesh, allowing up to 'budget'
+// times the triangle count of extra references. Returns the reference count.
+int buildSBVH(BVH &bvh, const std::vector<float3> &vertices,
+              const std::vector<uint3> &faces,
+              float budget = SBVH_DEFAULT_BUDGET, int maxLeafSize = 4) {
+  bvh.nodes.clear();
+  bvh.indices.clear();
+  if (faces.empty()) return 0;
+
+  SBVH_Builder builder(bvh, vertices, faces, budget, maxLeafSize);
+  builder.build();
+  return builder.references();
+}
+
+#endif
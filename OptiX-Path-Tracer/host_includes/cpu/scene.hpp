@@ -0,0 +1,315 @@
+#ifndef CPUSCENEH
+#define CPUSCENEH
+
+// scene.hpp: Define the host-side scene description used by the CPU backend
+
+#include <vector>
+
+#include "../../programs/hitables/vertex_attributes.hpp"
+#include "../../programs/textures/texture_table.hpp"
+#include "../../programs/vec.hpp"
+#include "lbvh.hpp"
+#include "sbvh.hpp"
+#include "quantized_bvh.hpp"
+
+//////////////
+// Textures //
+//////////////
+
+// Texture entries are the Texture_Entry of the device texture table, their
+// children are listed in CPU_Scene::textureChildren
+
+// Perlin noise tables, generated by Noise_Texture
+struct CPU_Noise {
+  float3 ranvec[NOISE_TABLE_SIZE];
+  int perm[3][NOISE_TABLE_SIZE];  // x, y and z permutations
+};
+
+// Float image level stored in the same (bottom-up) row order as the device
+// buffers
+struct CPU_Image_Level {
+  int width, height;
+  std::vector<float4> texels;
+};
+
+// Image and its mip levels, levels[0] being the full resolution image
+struct CPU_Image {
+  CPU_Image() : maxAnisotropy(1.f) {}
+
+  std::vector<CPU_Image_Level> levels;
+  float maxAnisotropy;  // most trilinear probes of an anisotropic lookup
+};
+
+// Texture table accessor of Evaluate_Texture over the arrays of the scene,
+// set once by CPU_Scene::buildTextureTable
+struct CPU_Texture_Table {
+  CPU_Texture_Table()
+      : entries(NULL), children(NULL), images(NULL), noises(NULL) {}
+
+  const Texture_Entry &entry(int i) const { return entries[i]; }
+
+  int child(int i) const { return children[i]; }
+
+  // defined with the image samplers in cpu/textures.hpp
+  float4 image(int data, float u, float v,
+               const Texture_Footprint &footprint) const;
+
+  float3 noiseVector(int n, int i) const { return noises[n].ranvec[i]; }
+
+  int permutation(int n, int axis, int i) const {
+    return noises[n].perm[axis][i];
+  }
+
+  const Texture_Entry *entries;
+  const int *children;
+  const CPU_Image *images;
+  const CPU_Noise *noises;
+};
+
+///////////////
+// Materials //
+///////////////
+
+// Types of materials, one per closest hit program in programs/materials
+typedef enum {
+  LAMBERTIAN_MATERIAL,
+  METAL_MATERIAL,
+  DIELECTRIC_MATERIAL,
+  DIFFUSE_LIGHT_MATERIAL,
+  ISOTROPIC_MATERIAL,
+  NORMAL_MATERIAL,
+  ASHIKHMIN_MATERIAL,
+  OREN_NAYAR_MATERIAL,
+  TORRANCE_MATERIAL
+} CPU_Material_Type;
+
+struct CPU_Material {
+  CPU_Material_Type type;
+  int textures[2];  // texture indices, second one is only used by some types
+  float params[2];  // fuzz, ref_idx/density, nu/nv or rA/rB
+  bool flag;        // is_light for lights, useShadingNormal for normal shader
+};
+
+////////////////
+// Primitives //
+////////////////
+
+// Types of analytic primitives, one per program in programs/hitables
+typedef enum {
+  SPHERE_PRIMITIVE,
+  MOVING_SPHERE_PRIMITIVE,
+  VOLUME_SPHERE_PRIMITIVE,
+  AARECT_PRIMITIVE,
+  BOX_PRIMITIVE,
+  VOLUME_BOX_PRIMITIVE,
+  TRIANGLE_PRIMITIVE,
+  CYLINDER_PRIMITIVE
+} CPU_Primitive_Type;
+
+// Analytic primitive, the meaning of each field depends on the type:
+// - spheres: p0 is the center (p1 the center at time1 for moving spheres)
+// - boxes: p0 and p1 are the min and max corners
+// - triangles: p0, p1 and p2 are the vertices and uv0..uv2 the texcoords
+// - cylinders: p0 is the base center, length is measured along Y
+// - rectangles: a0, a1, b0, b1, k, axis and flip as in AARect
+struct CPU_Primitive {
+  CPU_Primitive_Type type;
+  int material;  // index in CPU_Scene::materials
+  float3 p0, p1, p2;
+  float2 uv0, uv1, uv2;
+  float radius, length, density, time0, time1;
+  float a0, a1, b0, b1, k;
+  int axis;
+  bool flip;
+};
+
+// SoA copy of the analytic primitives of a geometry, same fields as
+// CPU_Primitive, for the SIMD kernels of simd_hitables.hpp
+struct CPU_Primitive_Lanes {
+  std::vector<float> type, x0, y0, z0, x1, y1, z1;
+  std::vector<float> radius, time0, time1, length, k, a0, a1, b0, b1;
+  std::vector<float> axisK, axisA, axisB;  // rectangle axes as floats
+  int kernels;  // number of primitives with a SIMD kernel
+};
+
+// Triangle mesh, same layout as the device buffers of a Mesh. Compact
+// positions are kept decoded, the BVH builders and intersection kernels read
+// floats.
+struct CPU_Mesh {
+  std::vector<float3> vertices, normals;
+  std::vector<float2> texcoords;
+  std::vector<uint> packedNormals, packedTexcoords;  // used if not empty
+  std::vector<uint3> indices;
+  std::vector<int> textureIndices;  // per face texture index
+  int material;                     // index in CPU_Scene::materials
+};
+
+// Bottom level geometry: a set of analytic primitives or a triangle mesh,
+// with a BVH over them in object space. The wide BVHs are collapsed from the
+// binary one, only for the width selected in CPU_Scene::bvhWidth, and kept
+// either as is or compressed. Analytic primitives are stored in the order of
+// the BVH leaves, so each leaf tests a contiguous range of them.
+struct CPU_Geometry {
+  CPU_Geometry() : mesh(-1), splitBudget(0.f) {}
+
+  std::vector<CPU_Primitive> primitives;  // in BVH leaf order once built
+  CPU_Primitive_Lanes lanes;
+  int mesh;           // index in CPU_Scene::meshes, or -1
+  float splitBudget;  // extra references of a mesh SBVH, 0 disables it
+  BVH bvh;
+  Wide_BVH<4> bvh4;
+  Wide_BVH<8> bvh8;
+  Quantized_BVH<4> qbvh4;
+  Quantized_BVH<8> qbvh8;
+};
+
+// Geometry placed in the world with the collapsed transform chain. The last
+// row of an affine matrix is always (0, 0, 0, 1), so only 3x4 is kept.
+struct CPU_Instance {
+  int geometry;  // index in CPU_Scene::geometries
+  bool identity;
+  Matrix3x4 toWorld, toObject;
+};
+
+/////////////////////////////////
+// Lights, Background & Camera //
+/////////////////////////////////
+
+typedef enum { RECT_LIGHT, SPHERE_LIGHT } CPU_Light_Type;
+
+// Sampled light, mirrors the Light_Sample and Light_PDF callable programs
+struct CPU_Light {
+  CPU_Light_Type type;
+  float a0, a1, b0, b1, k;  // rectangle coordinates
+  int axis;                 // rectangle axis
+  float3 center;            // sphere center
+  float radius;             // sphere radius
+  float3 emission;
+};
+
+// Types of background, one per program in programs/miss.cu
+typedef enum {
+  GRADIENT_MISS,
+  CONSTANT_MISS,
+  IMAGE_MISS,
+  ENVIRONMENT_MISS
+} CPU_Miss_Type;
+
+struct CPU_Miss {
+  CPU_Miss_Type type;
+  int textures[2];
+  bool isSpherical;
+};
+
+// Importance sampling distribution of the environment map, see
+// programs/pdfs/environment.hpp. Also the host copy of the device buffers.
+struct CPU_Environment {
+  bool enabled;  // sampled as a light by Direct_Light
+  int width, height;
+  std::vector<float> marginal;     // height + 1 entries
+  std::vector<float> conditional;  // width + 1 entries per row
+};
+
+struct CPU_Camera {
+  float3 origin, lower_left_corner, horizontal, vertical, u, v;
+  float lens_radius, time0, time1;
+};
+
+///////////
+// Scene //
+///////////
+
+struct CPU_Scene {
+  CPU_Scene() { clear(); }
+
+  void clear() {
+    textures.clear();
+    textureChildren.clear();
+    noises.clear();
+    images.clear();
+    materials.clear();
+    meshes.clear();
+    geometries.clear();
+    instances.clear();
+    lights.clear();
+    topLevel = BVH();
+    textureTable = CPU_Texture_Table();
+
+    miss.type = CONSTANT_MISS;
+    miss.textures[0] = miss.textures[1] = -1;
+    miss.isSpherical = true;
+    environment = CPU_Environment();
+    environment.enabled = false;
+
+    maxDepth = 50;
+    russian = true;
+    bvhWidth = 2;
+    linearBVH = false;
+    compressedBVH = false;
+    reorderBatch = 0;
+    packets = false;
+    hasVolumes = false;
+    primitiveLanes = true;
+  }
+
+  // Adds a geometry to the scene, returns its index
+  int addGeometry(const CPU_Geometry &geometry) {
+    geometries.push_back(geometry);
+    return (int)geometries.size() - 1;
+  }
+
+  // Places an added geometry with the given transform, several instances may
+  // share the same geometry and its BVH
+  void addInstance(int geometry, const Matrix4x4 &toWorld) {
+    CPU_Instance instance;
+    instance.geometry = geometry;
+    instance.toWorld = Matrix3x4(toWorld.getData());
+    instance.toObject = Matrix3x4(toWorld.inverse().getData());
+    instance.identity = true;
+    for (int i = 0; i < 16; i++)
+      if (toWorld[i] != Matrix4x4::identity()[i]) instance.identity = false;
+
+    instances.push_back(instance);
+  }
+
+  // Adds a geometry to the scene and places it with the given transform
+  void addInstance(const CPU_Geometry &geometry, const Matrix4x4 &toWorld) {
+    addInstance(addGeometry(geometry), toWorld);
+  }
+
+  // Points the texture table at the texture arrays, once they are complete
+  void buildTextureTable() {
+    textureTable.entries = textures.data();
+    textureTable.children = textureChildren.data();
+    textureTable.images = images.data();
+    textureTable.noises = noises.data();
+  }
+
+  std::vector<Texture_Entry> textures;
+  std::vector<int> textureChildren;
+  std::vector<CPU_Noise> noises;
+  std::vector<CPU_Image> images;
+  CPU_Texture_Table textureTable;  // set by buildScene
+  std::vector<CPU_Material> materials;
+  std::vector<CPU_Mesh> meshes;
+  std::vector<CPU_Geometry> geometries;
+  std::vector<CPU_Instance> instances;
+  BVH topLevel;  // BVH over the world bounds of the instances
+
+  std::vector<CPU_Light> lights;
+  CPU_Miss miss;
+  CPU_Environment environment;
+  CPU_Camera camera;
+
+  int maxDepth;  // max ray depth
+  bool russian;  // russian roulette flag
+  int bvhWidth;     // branching factor of the geometry BVHs: 2, 4 or 8
+  bool linearBVH;   // build with the LBVH builder instead of binned SAH
+  bool compressedBVH;  // quantize the wide BVHs, ignored by binary ones
+  int reorderBatch;  // min wavefront rays sorted before tracing, 0 disables
+  bool packets;      // trace camera rays in packets
+  bool hasVolumes;   // set by buildScene, volume hits draw random numbers
+  bool primitiveLanes;  // intersect analytic leaves with SIMD
+};
+
+#endif
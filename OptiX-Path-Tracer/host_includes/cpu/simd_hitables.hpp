@@ -0,0 +1,377 @@
+#ifndef CPUSIMDHITABLESH
+#define CPUSIMDHITABLESH
+
+// simd_hitables.hpp: Define the SIMD versions of the sphere, moving sphere,
+// box, rectangle and cylinder intersections of hitables.hpp. The same kernels
+// test one ray against a leaf of primitives stored in SoA form, or several
+// rays of a packet against one primitive. They use the same float operations
+// as the scalar code, so the hits are the same.
+
+#include "hitables.hpp"
+
+//////////////////
+// SIMD helpers //
+//////////////////
+
+// Lanes wraps the SIMD register so that the kernels can be written with
+// operators, which can't be overloaded for the register types themselves
+#if defined(WIDE_BVH_AVX)
+#define PRIMITIVE_LANES 8
+
+struct Lanes {
+  Lanes() {}
+  Lanes(__m256 r) : v(r) {}
+  __m256 v;
+};
+
+inline Lanes laneSet(float f) { return _mm256_set1_ps(f); }
+inline Lanes laneLoad(const float *p) { return _mm256_loadu_ps(p); }
+inline void laneStore(float *p, Lanes a) { _mm256_storeu_ps(p, a.v); }
+inline Lanes operator+(Lanes a, Lanes b) { return _mm256_add_ps(a.v, b.v); }
+inline Lanes operator-(Lanes a, Lanes b) { return _mm256_sub_ps(a.v, b.v); }
+inline Lanes operator*(Lanes a, Lanes b) { return _mm256_mul_ps(a.v, b.v); }
+inline Lanes operator/(Lanes a, Lanes b) { return _mm256_div_ps(a.v, b.v); }
+inline Lanes operator&(Lanes a, Lanes b) { return _mm256_and_ps(a.v, b.v); }
+inline Lanes operator|(Lanes a, Lanes b) { return _mm256_or_ps(a.v, b.v); }
+inline Lanes laneSqrt(Lanes a) { return _mm256_sqrt_ps(a.v); }
+inline Lanes laneMin(Lanes a, Lanes b) { return _mm256_min_ps(a.v, b.v); }
+inline Lanes laneMax(Lanes a, Lanes b) { return _mm256_max_ps(a.v, b.v); }
+inline Lanes laneLess(Lanes a, Lanes b) {
+  return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ);
+}
+inline Lanes laneLessEqual(Lanes a, Lanes b) {
+  return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ);
+}
+inline Lanes laneEqual(Lanes a, Lanes b) {
+  return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ);
+}
+inline Lanes laneAndNot(Lanes a, Lanes b) {
+  return _mm256_andnot_ps(a.v, b.v);
+}
+inline Lanes laneNegate(Lanes a) {
+  return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.f));
+}
+inline Lanes laneSelect(Lanes mask, Lanes a, Lanes b) {
+  return _mm256_blendv_ps(b.v, a.v, mask.v);
+}
+inline int laneMask(Lanes a) { return _mm256_movemask_ps(a.v); }
+#elif defined(WIDE_BVH_SSE)
+#define PRIMITIVE_LANES 4
+
+struct Lanes {
+  Lanes() {}
+  Lanes(__m128 r) : v(r) {}
+  __m128 v;
+};
+
+inline Lanes laneSet(float f) { return _mm_set1_ps(f); }
+inline Lanes laneLoad(const float *p) { return _mm_loadu_ps(p); }
+inline void laneStore(float *p, Lanes a) { _mm_storeu_ps(p, a.v); }
+inline Lanes operator+(Lanes a, Lanes b) { return _mm_add_ps(a.v, b.v); }
+inline Lanes operator-(Lanes a, Lanes b) { return _mm_sub_ps(a.v, b.v); }
+inline Lanes operator*(Lanes a, Lanes b) { return _mm_mul_ps(a.v, b.v); }
+inline Lanes operator/(Lanes a, Lanes b) { return _mm_div_ps(a.v, b.v); }
+inline Lanes operator&(Lanes a, Lanes b) { return _mm_and_ps(a.v, b.v); }
+inline Lanes operator|(Lanes a, Lanes b) { return _mm_or_ps(a.v, b.v); }
+inline Lanes laneSqrt(Lanes a) { return _mm_sqrt_ps(a.v); }
+inline Lanes laneMin(Lanes a, Lanes b) { return _mm_min_ps(a.v, b.v); }
+inline Lanes laneMax(Lanes a, Lanes b) { return _mm_max_ps(a.v, b.v); }
+inline Lanes laneLess(Lanes a, Lanes b) { return _mm_cmplt_ps(a.v, b.v); }
+inline Lanes laneLessEqual(Lanes a, Lanes b) {
+  return _mm_cmple_ps(a.v, b.v);
+}
+inline Lanes laneEqual(Lanes a, Lanes b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline Lanes laneAndNot(Lanes a, Lanes b) { return _mm_andnot_ps(a.v, b.v); }
+inline Lanes laneNegate(Lanes a) {
+  return _mm_xor_ps(a.v, _mm_set1_ps(-0.f));
+}
+inline Lanes laneSelect(Lanes mask, Lanes a, Lanes b) {
+  return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+inline int laneMask(Lanes a) { return _mm_movemask_ps(a.v); }
+#endif
+
+#if defined(PRIMITIVE_LANES)
+
+// Rays tested by the kernels, the same ray in every lane or one ray per lane
+struct Ray_Lanes {
+  Lanes ox, oy, oz, dx, dy, dz, tmin, tmax, time;
+};
+
+// Primitives tested by the kernels: the PRIMITIVE_LANES primitives from
+// 'first', or primitive 'first' in every lane. Fields are read on demand, so
+// each kernel only loads what it uses.
+struct Primitive_Group {
+  Lanes operator()(const std::vector<float> &field) const {
+    return broadcast ? laneSet(field[first]) : laneLoad(&field[first]);
+  }
+
+  const CPU_Primitive_Lanes &lanes;
+  int first;
+  bool broadcast;
+};
+
+// Ray component along the axis of each lane, 0, 1 or 2
+inline Lanes laneAxis(Lanes axis, Lanes x, Lanes y, Lanes z) {
+  return laneSelect(laneEqual(axis, laneSet(2.f)), z,
+                    laneSelect(laneEqual(axis, laneSet(1.f)), y, x));
+}
+
+// t in (tmin, tmax)
+inline Lanes laneInRange(Lanes t, const Ray_Lanes &ray) {
+  return laneLess(t, ray.tmax) & laneLess(ray.tmin, t);
+}
+
+/////////////
+// Kernels //
+/////////////
+
+// Same as hitSphere
+inline Lanes hitSphereLanes(Lanes cx, Lanes cy, Lanes cz, Lanes radius,
+                            const Ray_Lanes &ray, Lanes &t) {
+  Lanes ocx = ray.ox - cx, ocy = ray.oy - cy, ocz = ray.oz - cz;
+
+  Lanes a = ray.dx * ray.dx + ray.dy * ray.dy + ray.dz * ray.dz;
+  Lanes b = ocx * ray.dx + ocy * ray.dy + ocz * ray.dz;
+  Lanes c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius * radius;
+  Lanes discriminant = b * b - a * c;
+  Lanes valid = laneLessEqual(laneSet(0.f), discriminant);
+
+  Lanes root = laneSqrt(discriminant);
+  Lanes minusB = laneNegate(b);
+  Lanes t0 = (minusB - root) / a;
+  Lanes t1 = (minusB + root) / a;
+
+  Lanes hit0 = laneInRange(t0, ray);
+  t = laneSelect(hit0, t0, t1);
+  return valid & (hit0 | laneInRange(t1, ray));
+}
+
+// Same as the box case of intersectPrimitive
+inline Lanes hitBoxLanes(const Primitive_Group &g, const Ray_Lanes &ray,
+                         Lanes &t) {
+  const CPU_Primitive_Lanes &p = g.lanes;
+  Lanes tAx = (g(p.x0) - ray.ox) / ray.dx, tBx = (g(p.x1) - ray.ox) / ray.dx;
+  Lanes tAy = (g(p.y0) - ray.oy) / ray.dy, tBy = (g(p.y1) - ray.oy) / ray.dy;
+  Lanes tAz = (g(p.z0) - ray.oz) / ray.dz, tBz = (g(p.z1) - ray.oz) / ray.dz;
+
+  Lanes t0 = laneMax(laneMax(laneMin(tAx, tBx), laneMin(tAy, tBy)),
+                     laneMin(tAz, tBz));
+  Lanes t1 = laneMin(laneMin(laneMax(tAx, tBx), laneMax(tAy, tBy)),
+                     laneMax(tAz, tBz));
+
+  Lanes hit0 = laneInRange(t0, ray);
+  t = laneSelect(hit0, t0, t1);
+  return laneLessEqual(t0, t1) & (hit0 | laneInRange(t1, ray));
+}
+
+// Same as the rectangle case of intersectPrimitive
+inline Lanes hitRectLanes(const Primitive_Group &g, const Ray_Lanes &ray,
+                          Lanes &t) {
+  const CPU_Primitive_Lanes &p = g.lanes;
+  Lanes axisK = g(p.axisK), axisA = g(p.axisA), axisB = g(p.axisB);
+  Lanes ok = laneAxis(axisK, ray.ox, ray.oy, ray.oz);
+  Lanes dk = laneAxis(axisK, ray.dx, ray.dy, ray.dz);
+  Lanes oa = laneAxis(axisA, ray.ox, ray.oy, ray.oz);
+  Lanes da = laneAxis(axisA, ray.dx, ray.dy, ray.dz);
+  Lanes ob = laneAxis(axisB, ray.ox, ray.oy, ray.oz);
+  Lanes db = laneAxis(axisB, ray.dx, ray.dy, ray.dz);
+
+  t = (g(p.k) - ok) / dk;
+  Lanes pa = oa + t * da;
+  Lanes pb = ob + t * db;
+
+  Lanes outside = laneLess(pa, g(p.a0)) | laneLess(g(p.a1), pa) |
+                  laneLess(pb, g(p.b0)) | laneLess(g(p.b1), pb);
+  return laneAndNot(outside, laneInRange(t, ray));
+}
+
+// Same as the cylinder case of intersectPrimitive
+inline Lanes hitCylinderLanes(const Primitive_Group &g, const Ray_Lanes &ray,
+                              Lanes &t) {
+  const CPU_Primitive_Lanes &p = g.lanes;
+  Lanes px = ray.ox - g(p.x0), py = ray.oy - g(p.y0), pz = ray.oz - g(p.z0);
+  Lanes radius = g(p.radius), length = g(p.length);
+  Lanes a = ray.dx * ray.dx + ray.dz * ray.dz;
+  Lanes b = ray.dx * px + ray.dz * pz;
+  Lanes c = (px * px + pz * pz) - radius * radius;
+  Lanes discriminant = b * b - a * c;
+  Lanes zero = laneSet(0.f);
+  Lanes valid = laneAndNot(laneEqual(a, zero) | laneLess(discriminant, zero),
+                           laneEqual(zero, zero));
+
+  Lanes root = laneSqrt(discriminant);
+  Lanes minusB = laneNegate(b);
+  Lanes t0 = (minusB - root) / a;
+  Lanes t1 = (minusB + root) / a;
+
+  Lanes y0 = py + t0 * ray.dy, y1 = py + t1 * ray.dy;
+  Lanes hit0 = laneInRange(t0, ray) & laneLessEqual(zero, y0) &
+               laneLessEqual(y0, length);
+  Lanes hit1 = laneInRange(t1, ray) & laneLessEqual(zero, y1) &
+               laneLessEqual(y1, length);
+
+  t = laneSelect(hit0, t0, t1);
+  return valid & (hit0 | hit1);
+}
+
+// Intersects the primitive and ray of each lane, returns the mask of the hit
+// lanes and their distances in 't'. Kernels only run if one of the lanes has
+// their primitive type. Volumes and triangles never hit.
+inline Lanes intersectLanes(const Primitive_Group &g, const Ray_Lanes &ray,
+                            Lanes &t) {
+  const CPU_Primitive_Lanes &p = g.lanes;
+  Lanes type = g(p.type);
+  Lanes hit = laneSet(0.f), kernelT;
+  t = ray.tmax;
+
+  Lanes sphere = laneEqual(type, laneSet((float)SPHERE_PRIMITIVE));
+  Lanes moving = laneEqual(type, laneSet((float)MOVING_SPHERE_PRIMITIVE));
+  if (laneMask(sphere | moving)) {
+    Lanes cx = g(p.x0), cy = g(p.y0), cz = g(p.z0);
+
+    // same operations as movingCenter
+    if (laneMask(moving)) {
+      Lanes s = (ray.time - g(p.time0)) / (g(p.time1) - g(p.time0));
+      cx = laneSelect(moving, cx + s * (g(p.x1) - cx), cx);
+      cy = laneSelect(moving, cy + s * (g(p.y1) - cy), cy);
+      cz = laneSelect(moving, cz + s * (g(p.z1) - cz), cz);
+    }
+
+    Lanes mask = (sphere | moving) &
+                 hitSphereLanes(cx, cy, cz, g(p.radius), ray, kernelT);
+    t = laneSelect(mask, kernelT, t);
+    hit = hit | mask;
+  }
+
+  Lanes box = laneEqual(type, laneSet((float)BOX_PRIMITIVE));
+  if (laneMask(box)) {
+    Lanes mask = box & hitBoxLanes(g, ray, kernelT);
+    t = laneSelect(mask, kernelT, t);
+    hit = hit | mask;
+  }
+
+  Lanes rect = laneEqual(type, laneSet((float)AARECT_PRIMITIVE));
+  if (laneMask(rect)) {
+    Lanes mask = rect & hitRectLanes(g, ray, kernelT);
+    t = laneSelect(mask, kernelT, t);
+    hit = hit | mask;
+  }
+
+  Lanes cylinder = laneEqual(type, laneSet((float)CYLINDER_PRIMITIVE));
+  if (laneMask(cylinder)) {
+    Lanes mask = cylinder & hitCylinderLanes(g, ray, kernelT);
+    t = laneSelect(mask, kernelT, t);
+    hit = hit | mask;
+  }
+
+  return hit;
+}
+
+#endif
+
+// Lanes loaded past the last primitive by a leaf of the widest SIMD width
+#define PRIMITIVE_LANES_PADDING 8
+
+// True if the SIMD kernels handle the primitive. Volumes draw random numbers
+// and triangles need barycentrics, they're left to intersectPrimitive.
+inline bool hasLaneKernel(CPU_Primitive_Type type) {
+  return type == SPHERE_PRIMITIVE || type == MOVING_SPHERE_PRIMITIVE ||
+         type == BOX_PRIMITIVE || type == AARECT_PRIMITIVE ||
+         type == CYLINDER_PRIMITIVE;
+}
+
+// Fills the SoA copy of the primitives of a geometry, padded so that groups of
+// lanes can be loaded past the last primitive
+void buildPrimitiveLanes(CPU_Primitive_Lanes &lanes,
+                         const std::vector<CPU_Primitive> &primitives) {
+  int n = (int)primitives.size();
+  std::vector<float> *arrays[] = {
+      &lanes.type,  &lanes.x0,    &lanes.y0,    &lanes.z0, &lanes.x1,
+      &lanes.y1,    &lanes.z1,    &lanes.radius, &lanes.time0,
+      &lanes.time1, &lanes.length, &lanes.k,    &lanes.a0, &lanes.a1,
+      &lanes.b0,    &lanes.b1,    &lanes.axisK, &lanes.axisA,
+      &lanes.axisB};
+  for (int a = 0; a < (int)(sizeof(arrays) / sizeof(arrays[0])); a++)
+    arrays[a]->assign(n > 0 ? n + PRIMITIVE_LANES_PADDING : 0, 0.f);
+
+  lanes.kernels = 0;
+  for (int i = 0; i < n; i++) {
+    const CPU_Primitive &prim = primitives[i];
+    lanes.type[i] = (float)prim.type;
+    lanes.x0[i] = prim.p0.x;
+    lanes.y0[i] = prim.p0.y;
+    lanes.z0[i] = prim.p0.z;
+    lanes.x1[i] = prim.p1.x;
+    lanes.y1[i] = prim.p1.y;
+    lanes.z1[i] = prim.p1.z;
+    lanes.radius[i] = prim.radius;
+    lanes.time0[i] = prim.time0;
+    lanes.time1[i] = prim.time1;
+    lanes.length[i] = prim.length;
+    lanes.k[i] = prim.k;
+    lanes.a0[i] = prim.a0;
+    lanes.a1[i] = prim.a1;
+    lanes.b0[i] = prim.b0;
+    lanes.b1[i] = prim.b1;
+
+    // same axes as the rectangle case of intersectPrimitive
+    int k = prim.axis;
+    lanes.axisK[i] = (float)k;
+    lanes.axisA[i] = (k == X_AXIS) ? 1.f : 0.f;
+    lanes.axisB[i] = (k == Z_AXIS) ? 1.f : 2.f;
+
+    if (hasLaneKernel(prim.type)) lanes.kernels++;
+  }
+}
+
+// Intersects a ray with the primitives [first, first + count), same result as
+// calling intersectPrimitive on each of them in order. Returns the closest hit
+// primitive and shrinks tmax, -1 if there's no closer hit, or -2 if the
+// primitives need the scalar code.
+inline int intersectPrimitiveLanes(const CPU_Primitive_Lanes &lanes,
+                                   int first, int count, const float3 &origin,
+                                   const float3 &direction, float tmin,
+                                   float &tmax, float time) {
+#if defined(PRIMITIVE_LANES)
+  if (lanes.kernels < (int)lanes.type.size() - PRIMITIVE_LANES_PADDING)
+    for (int i = first; i < first + count; i++)
+      if (!hasLaneKernel((CPU_Primitive_Type)(int)lanes.type[i])) return -2;
+
+  Ray_Lanes ray;
+  ray.ox = laneSet(origin.x);
+  ray.oy = laneSet(origin.y);
+  ray.oz = laneSet(origin.z);
+  ray.dx = laneSet(direction.x);
+  ray.dy = laneSet(direction.y);
+  ray.dz = laneSet(direction.z);
+  ray.tmin = laneSet(tmin);
+  ray.tmax = laneSet(tmax);
+  ray.time = laneSet(time);
+
+  int closest = -1;
+  alignas(32) float t[PRIMITIVE_LANES];
+
+  for (int g = first; g < first + count; g += PRIMITIVE_LANES) {
+    Lanes dist;
+    Primitive_Group group = {lanes, g, false};
+    int mask = laneMask(intersectLanes(group, ray, dist));
+    if (!mask) continue;
+
+    // in order, so the first of equally close primitives wins like in the
+    // scalar loop
+    laneStore(t, dist);
+    for (int i = 0; i < PRIMITIVE_LANES && g + i < first + count; i++)
+      if ((mask >> i & 1) && t[i] < tmax) {
+        tmax = t[i];
+        closest = g + i;
+      }
+  }
+
+  return closest;
+#else
+  return -2;
+#endif
+}
+
+#endif
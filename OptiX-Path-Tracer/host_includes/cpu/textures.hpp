@@ -0,0 +1,102 @@
+#ifndef CPUTEXTURESH
+#define CPUTEXTURESH
+
+// textures.hpp: Define the image lookups of the texture table accessor used
+// by the CPU backend to evaluate programs/textures/texture_table.hpp
+
+#include "scene.hpp"
+
+///////////////////
+// Image texture //
+///////////////////
+
+// Bilinear lookup with repeat wrapping, same as the device texture samplers
+float4 tex2D(const CPU_Image_Level &image, float u, float v) {
+  float x = u * image.width - 0.5f;
+  float y = v * image.height - 0.5f;
+  float fx = floorf(x), fy = floorf(y);
+  float wx = x - fx, wy = y - fy;
+
+  int x0 = ((int)fx % image.width + image.width) % image.width;
+  int y0 = ((int)fy % image.height + image.height) % image.height;
+  int x1 = (x0 + 1) % image.width;
+  int y1 = (y0 + 1) % image.height;
+
+  const float4 *row0 = &image.texels[y0 * image.width];
+  const float4 *row1 = &image.texels[y1 * image.width];
+
+  return (1.f - wy) * ((1.f - wx) * row0[x0] + wx * row0[x1]) +
+         wy * ((1.f - wx) * row1[x0] + wx * row1[x1]);
+}
+
+// Trilinear lookup, blending the bilinear lookups of the two levels around
+// 'lod'
+float4 tex2DLod(const CPU_Image &image, float u, float v, float lod) {
+  int last = (int)image.levels.size() - 1;
+  lod = fminf(fmaxf(lod, 0.f), (float)last);
+
+  int level = std::min((int)lod, last);
+  float t = lod - level;
+  float4 color = tex2D(image.levels[level], u, v);
+
+  if (t > 0.f)
+    color = (1.f - t) * color + t * tex2D(image.levels[level + 1], u, v);
+  return color;
+}
+
+// Reference of the anisotropic lookups of the device samplers. Up to
+// 'maxAnisotropy' trilinear probes are spread along the major axis of the
+// footprint, on the level where they are about a texel apart, so a single
+// probe is a plain trilinear lookup of the major axis. Images without mip
+// levels are read with a bilinear lookup, as the device does.
+float4 tex2DGrad(const CPU_Image &image, float u, float v, const float2 &ddx,
+                 const float2 &ddy) {
+  const CPU_Image_Level &base = image.levels[0];
+  if (image.levels.size() == 1) return tex2D(base, u, v);
+
+  // axis lengths in texels of the full resolution level
+  float2 size = make_float2((float)base.width, (float)base.height);
+  float lx = length(ddx * size), ly = length(ddy * size);
+  float major = fmaxf(lx, ly), minor = fminf(lx, ly);
+  if (!(major > 0.f)) return tex2D(base, u, v);
+
+  float ratio = minor > 0.f ? major / minor : image.maxAnisotropy;
+  int probes = (int)fminf(ceilf(ratio), fmaxf(image.maxAnisotropy, 1.f));
+  float lod = log2f(major / probes);
+  float2 axis = lx >= ly ? ddx : ddy;
+
+  float4 sum = make_float4(0.f);
+  for (int i = 0; i < probes; i++) {
+    float offset = (i + 0.5f) / probes - 0.5f;
+    sum += tex2DLod(image, u + offset * axis.x, v + offset * axis.y, lod);
+  }
+
+  return sum / (float)probes;
+}
+
+////////////////////////
+// Texture evaluation //
+////////////////////////
+
+float4 CPU_Texture_Table::image(int data, float u, float v,
+                                const Texture_Footprint &footprint) const {
+  return tex2DGrad(images[data], u, v, footprint.ddx, footprint.ddy);
+}
+
+// Evaluates the texture of the given index with the evaluator of the device
+// programs. The zero footprint is static so constant lookups need no stack.
+float3 sampleTexture(const CPU_Scene &scene, int index, float u, float v,
+                     const float3 &p, int i) {
+  static const Texture_Footprint zero = {};
+  return Evaluate_Texture(scene.textureTable, index, u, v, p, i, zero);
+}
+
+// Same, filtering the image lookups over 'footprint'
+float3 sampleTexture(const CPU_Scene &scene, int index, float u, float v,
+                     const float3 &p, int i,
+                     const Texture_Footprint &footprint) {
+  return Evaluate_Texture(scene.textureTable, index, u, v, p, i,
+                          footprint);
+}
+
+#endif
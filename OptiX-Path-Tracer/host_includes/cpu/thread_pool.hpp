@@ -0,0 +1,158 @@
+#ifndef THREADPOOLH
+#define THREADPOOLH
+
+// thread_pool.hpp: Define the worker pool used by the CPU backend
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counter of unfinished tasks that a caller can wait on
+struct Task_Group {
+  Task_Group() : pending(0) {}
+
+  std::atomic<int> pending;
+};
+
+// Fixed size pool of worker threads sharing a single task queue. Threads
+// waiting on a Task_Group execute queued tasks themselves, so tasks may spawn
+// and wait on nested tasks without deadlocking the pool.
+class Thread_Pool {
+ public:
+  // If numThreads is zero, one thread per hardware thread is used. The thread
+  // calling parallel_for/wait also executes tasks, so numThreads - 1 workers
+  // are created.
+  Thread_Pool(int numThreads = 0) : stop(false) {
+    if (numThreads <= 0) numThreads = (int)std::thread::hardware_concurrency();
+    if (numThreads <= 0) numThreads = 1;
+
+    for (int i = 1; i < numThreads; i++)
+      workers.push_back(std::thread(&Thread_Pool::workerLoop, this, i));
+  }
+
+  ~Thread_Pool() {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      stop = true;
+    }
+    condition.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+  }
+
+  // number of threads executing tasks, including the calling thread
+  int size() const { return (int)workers.size() + 1; }
+
+  // index of the current thread in [0, size()), 0 for the calling thread
+  static int threadIndex() { return currentThread(); }
+
+  // Queues a task as part of the given group
+  void run(Task_Group &group, const std::function<void()> &task) {
+    group.pending++;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      tasks.push_back(Task(&group, task));
+    }
+    condition.notify_one();
+  }
+
+  // Waits until all tasks of the group are done, executing queued tasks
+  // while waiting
+  void wait(Task_Group &group) {
+    while (group.pending > 0) {
+      Task task;
+      if (pop(task))
+        execute(task);
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  // Calls func(i) for every i in [0, count). Indices are handed out
+  // dynamically, one at a time, so uneven work items balance across threads.
+  void parallel_for(int count, const std::function<void(int)> &func) {
+    if (count <= 0) return;
+
+    std::atomic<int> next(0);
+    auto loop = [&]() {
+      for (int i = next++; i < count; i = next++) func(i);
+    };
+
+    Task_Group group;
+    int numTasks = std::min(size(), count) - 1;
+    for (int i = 0; i < numTasks; i++) run(group, loop);
+
+    loop();
+    wait(group);
+  }
+
+  // Calls func(begin, end) over blocks of at most 'grain' indices covering
+  // [0, count), for loops whose iterations are too cheap to hand out one at
+  // a time
+  void parallel_blocks(int count, int grain,
+                       const std::function<void(int, int)> &func) {
+    int blocks = (count + grain - 1) / grain;
+    parallel_for(blocks, [&](int b) {
+      func(b * grain, std::min((b + 1) * grain, count));
+    });
+  }
+
+ private:
+  struct Task {
+    Task() : group(nullptr) {}
+    Task(Task_Group *g, const std::function<void()> &f) : group(g), func(f) {}
+
+    Task_Group *group;
+    std::function<void()> func;
+  };
+
+  static int &currentThread() {
+    static thread_local int index = 0;
+    return index;
+  }
+
+  bool pop(Task &task) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (tasks.empty()) return false;
+
+    task = tasks.front();
+    tasks.pop_front();
+    return true;
+  }
+
+  void execute(Task &task) {
+    task.func();
+    task.group->pending--;
+  }
+
+  void workerLoop(int index) {
+    currentThread() = index;
+
+    while (true) {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return stop || !tasks.empty(); });
+
+        if (stop && tasks.empty()) return;
+
+        task = tasks.front();
+        tasks.pop_front();
+      }
+      execute(task);
+    }
+  }
+
+  bool stop;
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<Task> tasks;
+  std::vector<std::thread> workers;
+};
+
+#endif
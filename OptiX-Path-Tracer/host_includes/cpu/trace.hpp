@@ -0,0 +1,362 @@
+#ifndef CPUTRACEH
+#define CPUTRACEH
+
+// trace.hpp: Define the two level scene traversal of the CPU backend
+
+#include <chrono>
+
+#include "simd_hitables.hpp"
+#include "thread_pool.hpp"
+
+// Closest intersection found while tracing a ray through the scene
+struct CPU_Hit {
+  int instance;   // index in CPU_Scene::instances, -1 if nothing was hit
+  int primitive;  // primitive index, or face index for meshes
+  float t;        // hit distance
+  float2 bc;      // triangle barycentrics
+};
+
+// Matrices are stored row major
+inline float3 transformVector(const Matrix3x4 &m, const float3 &v) {
+  return make_float3(m[0] * v.x + m[1] * v.y + m[2] * v.z,
+                     m[4] * v.x + m[5] * v.y + m[6] * v.z,
+                     m[8] * v.x + m[9] * v.y + m[10] * v.z);
+}
+
+inline float3 transformPoint(const Matrix3x4 &m, const float3 &p) {
+  return transformVector(m, p) + make_float3(m[3], m[7], m[11]);
+}
+
+// normals are transformed by the inverse transpose of the world matrix
+inline float3 transformNormal(const Matrix3x4 &toObject, const float3 &n) {
+  const Matrix3x4 &m = toObject;
+  return make_float3(m[0] * n.x + m[4] * n.y + m[8] * n.z,
+                     m[1] * n.x + m[5] * n.y + m[9] * n.z,
+                     m[2] * n.x + m[6] * n.y + m[10] * n.z);
+}
+
+// Traverses the geometry BVH of the width and format selected for the scene
+template <typename Intersector>
+bool traverseGeometry(const CPU_Scene &scene, const CPU_Geometry &geometry,
+                      const float3 &origin, const float3 &direction,
+                      float tmin, float &tmax, Intersector &intersect) {
+  switch (scene.bvhWidth) {
+    case 4:
+      if (scene.compressedBVH)
+        return traverseQuantizedBVH(geometry.qbvh4, origin, direction, tmin,
+                                    tmax, intersect);
+      return traverseWideBVH(geometry.bvh4, origin, direction, tmin, tmax,
+                             intersect);
+    case 8:
+      if (scene.compressedBVH)
+        return traverseQuantizedBVH(geometry.qbvh8, origin, direction, tmin,
+                                    tmax, intersect);
+      return traverseWideBVH(geometry.bvh8, origin, direction, tmin, tmax,
+                             intersect);
+    default:
+      return traverseBVH(geometry.bvh, origin, direction, tmin, tmax,
+                         intersect);
+  }
+}
+
+// Intersects a ray with the analytic primitives of a geometry
+struct Primitive_Intersector {
+  bool operator()(int prim, float &t) {
+    float2 bc;
+    if (!intersectPrimitive(geometry.primitives[prim], origin, direction, tmin,
+                            t, time, seed, bc))
+      return false;
+
+    hit.primitive = prim;
+    hit.bc = bc;
+    return true;
+  }
+
+  const CPU_Scene &scene;
+  const CPU_Geometry &geometry;
+  const float3 &origin, &direction;
+  float tmin, time;
+  uint &seed;
+  CPU_Hit &hit;
+};
+
+// Primitives are stored in leaf order, so every leaf of every BVH format
+// references a contiguous range of them, tested together with SIMD when they
+// all have a kernel
+inline bool intersectLeaf(Primitive_Intersector &intersect,
+                          const std::vector<int> &indices, int first,
+                          int count, float &tmax) {
+  const CPU_Geometry &geometry = intersect.geometry;
+
+  if (count > 1 && intersect.scene.primitiveLanes &&
+      geometry.lanes.kernels > 0) {
+    int prim = intersectPrimitiveLanes(
+        geometry.lanes, indices[first], count, intersect.origin,
+        intersect.direction, intersect.tmin, tmax, intersect.time);
+
+    if (prim >= 0) {
+      intersect.hit.primitive = prim;
+      intersect.hit.bc = make_float2(0.f);
+    }
+    if (prim != -2) return prim >= 0;
+  }
+
+  bool hit = false;
+  for (int i = 0; i < count; i++) hit |= intersect(indices[first + i], tmax);
+  return hit;
+}
+
+// Intersects a ray with a geometry, in the geometry's object space
+bool intersectGeometry(const CPU_Scene &scene, const CPU_Geometry &geometry,
+                       const float3 &origin, const float3 &direction,
+                       float tmin, float &tmax, float time, uint &seed,
+                       CPU_Hit &hit) {
+  if (geometry.mesh >= 0) {
+    const CPU_Mesh &mesh = scene.meshes[geometry.mesh];
+
+    auto intersect = [&](int face, float &t) {
+      float2 bc;
+      if (!intersectTriangle(mesh, face, origin, direction, tmin, t, bc))
+        return false;
+
+      hit.primitive = face;
+      hit.bc = bc;
+      return true;
+    };
+
+    return traverseGeometry(scene, geometry, origin, direction, tmin, tmax,
+                            intersect);
+  }
+
+  Primitive_Intersector intersect = {scene, geometry, origin, direction,
+                                     tmin,  time,     seed,   hit};
+  return traverseGeometry(scene, geometry, origin, direction, tmin, tmax,
+                          intersect);
+}
+
+// Intersects a ray with an instance, moved to the instance's object space.
+// Ray directions aren't normalized when moved to object space, so distances
+// found in there are also valid in world space.
+bool intersectInstance(const CPU_Scene &scene, int i, const Ray &ray,
+                       float &tmax, float time, uint &seed, CPU_Hit &hit) {
+  const CPU_Instance &instance = scene.instances[i];
+  const CPU_Geometry &geometry = scene.geometries[instance.geometry];
+
+  bool found;
+  if (instance.identity)
+    found = intersectGeometry(scene, geometry, ray.origin, ray.direction,
+                              ray.tmin, tmax, time, seed, hit);
+  else
+    found = intersectGeometry(
+        scene, geometry, transformPoint(instance.toObject, ray.origin),
+        transformVector(instance.toObject, ray.direction), ray.tmin, tmax,
+        time, seed, hit);
+
+  if (found) hit.instance = i;
+  return found;
+}
+
+// Finds the closest intersection of a ray with the scene
+bool traceScene(const CPU_Scene &scene, const Ray &ray, float time,
+                uint &seed, CPU_Hit &hit) {
+  hit.instance = -1;
+  float tmax = ray.tmax;
+
+  auto intersect = [&](int i, float &t) {
+    return intersectInstance(scene, i, ray, t, time, seed, hit);
+  };
+
+  traverseBVH(scene.topLevel, ray.origin, ray.direction, ray.tmin, tmax,
+              intersect);
+
+  hit.t = tmax;
+  return hit.instance >= 0;
+}
+
+// Material index of the hit geometry
+int getMaterial(const CPU_Scene &scene, const CPU_Hit &hit) {
+  const CPU_Geometry &geometry =
+      scene.geometries[scene.instances[hit.instance].geometry];
+
+  if (geometry.mesh >= 0)
+    return scene.meshes[geometry.mesh].material;
+  else
+    return geometry.primitives[hit.primitive].material;
+}
+
+// World space hit record of the closest intersection
+HitRecord getHitRecord(const CPU_Scene &scene, const CPU_Hit &hit,
+                       const Ray &ray, float time) {
+  const CPU_Instance &instance = scene.instances[hit.instance];
+  const CPU_Geometry &geometry = scene.geometries[instance.geometry];
+
+  float3 origin = ray.origin, direction = ray.direction;
+  if (!instance.identity) {
+    origin = transformPoint(instance.toObject, origin);
+    direction = transformVector(instance.toObject, direction);
+  }
+
+  HitRecord rec;
+  if (geometry.mesh >= 0)
+    rec = getHitRecord(scene.meshes[geometry.mesh], hit.primitive, hit.t,
+                       hit.bc);
+  else
+    rec = getHitRecord(geometry.primitives[hit.primitive], origin, direction,
+                       hit.t, time, hit.bc);
+
+  if (!instance.identity) {
+    rec.P = transformPoint(instance.toWorld, rec.P);
+    rec.geometric_normal =
+        transformNormal(instance.toObject, rec.geometric_normal);
+    rec.shading_normal = transformNormal(instance.toObject, rec.shading_normal);
+    rec.dpdu = transformVector(instance.toWorld, rec.dpdu);
+    rec.dpdv = transformVector(instance.toWorld, rec.dpdv);
+  }
+
+  rec.geometric_normal = normalize(rec.geometric_normal);
+  rec.shading_normal = normalize(rec.shading_normal);
+  rec.Wo = normalize(-ray.direction);
+
+  return rec;
+}
+
+// Collapses the binary geometry BVHs into BVHs of the width selected for the
+// scene, compressed if requested. Wide BVHs of the other widths and formats
+// are released.
+void buildWideBVHs(CPU_Scene &scene, Thread_Pool &pool) {
+  int width = scene.bvhWidth;
+  bool compressed = scene.compressedBVH;
+
+  pool.parallel_for((int)scene.geometries.size(), [&](int g) {
+    CPU_Geometry &geometry = scene.geometries[g];
+    geometry.bvh4 = Wide_BVH<4>();
+    geometry.bvh8 = Wide_BVH<8>();
+    geometry.qbvh4 = Quantized_BVH<4>();
+    geometry.qbvh8 = Quantized_BVH<8>();
+
+    if (width == 4) {
+      buildWideBVH(geometry.bvh4, geometry.bvh);
+      if (compressed) {
+        buildQuantizedBVH(geometry.qbvh4, geometry.bvh4);
+        geometry.bvh4 = Wide_BVH<4>();
+      }
+    } else if (width == 8) {
+      buildWideBVH(geometry.bvh8, geometry.bvh);
+      if (compressed) {
+        buildQuantizedBVH(geometry.qbvh8, geometry.bvh8);
+        geometry.bvh8 = Wide_BVH<8>();
+      }
+    }
+  });
+}
+
+// Stores the analytic primitives of a geometry in the order its BVH leaves
+// reference them, then fills their SoA copy. Leaves of the wide and compressed
+// BVHs are collapsed from the binary ones, so their ranges stay contiguous.
+void sortPrimitives(CPU_Geometry &geometry) {
+  std::vector<CPU_Primitive> sorted(geometry.bvh.indices.size());
+  for (int i = 0; i < (int)sorted.size(); i++) {
+    sorted[i] = geometry.primitives[geometry.bvh.indices[i]];
+    geometry.bvh.indices[i] = i;
+  }
+
+  geometry.primitives.swap(sorted);
+  buildPrimitiveLanes(geometry.lanes, geometry.primitives);
+}
+
+// Builds the BVH of every geometry in parallel, then the top level BVH over
+// the world space bounds of the instances, with the builder selected for the
+// scene. Meshes with a split budget get a SBVH. Build time and SAH cost of the
+// mesh BVHs are reported. The texture table is set here too, the scene being
+// complete.
+void buildScene(CPU_Scene &scene, Thread_Pool &pool) {
+  std::vector<float> buildTimes(scene.geometries.size());
+
+  scene.buildTextureTable();
+
+  scene.hasVolumes = false;
+  for (int g = 0; g < (int)scene.geometries.size(); g++) {
+    const std::vector<CPU_Primitive> &primitives =
+        scene.geometries[g].primitives;
+    for (int i = 0; i < (int)primitives.size(); i++)
+      if (primitives[i].type == VOLUME_SPHERE_PRIMITIVE ||
+          primitives[i].type == VOLUME_BOX_PRIMITIVE)
+        scene.hasVolumes = true;
+  }
+
+  pool.parallel_for((int)scene.geometries.size(), [&](int g) {
+    CPU_Geometry &geometry = scene.geometries[g];
+    std::vector<Aabb> bounds;
+
+    if (geometry.mesh >= 0) {
+      const CPU_Mesh &mesh = scene.meshes[geometry.mesh];
+      bounds.resize(mesh.indices.size());
+      for (int i = 0; i < (int)bounds.size(); i++)
+        bounds[i] = getBounds(mesh, i);
+    } else {
+      bounds.resize(geometry.primitives.size());
+      for (int i = 0; i < (int)bounds.size(); i++)
+        bounds[i] = getBounds(geometry.primitives[i]);
+    }
+
+    auto t0 = std::chrono::system_clock::now();
+    if (geometry.mesh >= 0 && geometry.splitBudget > 0.f) {
+      const CPU_Mesh &mesh = scene.meshes[geometry.mesh];
+      buildSBVH(geometry.bvh, mesh.vertices, mesh.indices,
+                geometry.splitBudget);
+    } else if (scene.linearBVH)
+      buildLBVH(geometry.bvh, bounds, &pool);
+    else
+      buildBVH(geometry.bvh, bounds, &pool);
+    auto t1 = std::chrono::system_clock::now();
+    buildTimes[g] = std::chrono::duration<float>(t1 - t0).count();
+
+    if (geometry.mesh < 0) sortPrimitives(geometry);
+  });
+
+  for (int g = 0; g < (int)scene.geometries.size(); g++) {
+    const CPU_Geometry &geometry = scene.geometries[g];
+    if (geometry.mesh < 0) continue;
+
+    const char *builder = scene.linearBVH ? "LBVH" : "BVH";
+    if (geometry.splitBudget > 0.f) builder = "SBVH";
+
+    // spatial splits reference some triangles more than once
+    int triangles = (int)scene.meshes[geometry.mesh].indices.size();
+    int references = (int)geometry.bvh.indices.size();
+    printf("Mesh %s: %d triangles, %d references (+%.1f%%), %d nodes, "
+           "%.2f ms, SAH cost %.2f\n",
+           builder, triangles, references,
+           100.f * (references - triangles) / std::max(triangles, 1),
+           (int)geometry.bvh.nodes.size(), 1000.f * buildTimes[g],
+           computeSAHCost(geometry.bvh));
+  }
+
+  std::vector<Aabb> bounds(scene.instances.size());
+  for (int i = 0; i < (int)bounds.size(); i++) {
+    const CPU_Instance &instance = scene.instances[i];
+    const BVH &bvh = scene.geometries[instance.geometry].bvh;
+    if (bvh.nodes.empty()) continue;
+
+    // transform the corners of the object space bounds
+    const BVH_Node &root = bvh.nodes[0];
+    for (int c = 0; c < 8; c++) {
+      float3 corner = make_float3((c & 1) ? root.bmax.x : root.bmin.x,
+                                  (c & 2) ? root.bmax.y : root.bmin.y,
+                                  (c & 4) ? root.bmax.z : root.bmin.z);
+      bounds[i].include(transformPoint(instance.toWorld, corner));
+    }
+  }
+
+  if (scene.linearBVH)
+    buildLBVH(scene.topLevel, bounds, &pool, 1);
+  else
+    buildBVH(scene.topLevel, bounds, &pool, 1);
+
+  printf("Top level: %d instances of %d geometries\n",
+         (int)scene.instances.size(), (int)scene.geometries.size());
+
+  buildWideBVHs(scene, pool);
+}
+
+#endif
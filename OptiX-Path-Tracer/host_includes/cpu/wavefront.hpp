@@ -0,0 +1,437 @@
+#ifndef CPUWAVEFRONTH
+#define CPUWAVEFRONTH
+
+// wavefront.hpp: Define the wavefront integrator of the CPU backend. Instead
+// of following each path to the end, a wave of paths is advanced one bounce at
+// a time: all rays are intersected, hits are sorted by material type so each
+// material's code runs over a contiguous batch, shadow rays are traced in a
+// stage of their own, then the materials finish shading. Paths use the same
+// random numbers as in color(), so both integrators render the same image.
+
+#include "render.hpp"
+
+// Paths traced together, enough to fill the material batches while the
+// queues still fit in the cache
+#define WAVEFRONT_SIZE (1 << 12)
+
+// Paths handed to a thread at once by each stage
+#define WAVEFRONT_GRAIN 128
+
+// Queue of the rays that missed the scene, after the material type queues
+#define WAVEFRONT_MISS (TORRANCE_MATERIAL + 1)
+
+// Intersection counters of the rays from the second bounce on, the ones
+// affected by ray reordering
+struct Wavefront_Stats {
+  Wavefront_Stats() : rays(0), seconds(0.f), sortSeconds(0.f) {}
+
+  long long rays;
+  float seconds, sortSeconds;  // intersection and reordering times
+};
+
+// Path, ray, hit and shadow queues of a wave, in SoA form. All of them are
+// indexed by the path slot in the wave.
+struct Wavefront_State {
+  void resize(int size) {
+    seed.resize(size);
+    time.resize(size);
+    throughput.resize(size);
+    radiance.resize(size);
+    coneWidth.resize(size);
+    result.resize(size);
+    specular.resize(size);
+    origin.resize(size);
+    direction.resize(size);
+    tmin.resize(size);
+    instance.resize(size);
+    primitive.resize(size);
+    material.resize(size);
+    t.resize(size);
+    bc.resize(size);
+    records.resize(size);
+    lightSamples.resize(size);
+    occluded.resize(size);
+  }
+
+  // path state
+  std::vector<uint> seed;
+  std::vector<float> time;
+  std::vector<float3> throughput, radiance;
+  std::vector<float> coneWidth;  // see PerRayData
+  float coneSpread;
+  std::vector<float3> result;  // color of the finished paths
+  std::vector<char> specular;  // previous hit was specular
+
+  // ray queue
+  std::vector<float3> origin, direction;
+  std::vector<float> tmin;
+
+  // hit queue, material is -1 for rays that missed the scene
+  std::vector<int> instance, primitive, material;
+  std::vector<float> t;
+  std::vector<float2> bc;
+
+  // shading queue, filled in material order
+  std::vector<HitRecord> records;
+
+  // shadow queue
+  std::vector<Light_Sample> lightSamples;
+  std::vector<char> occluded;
+
+  std::vector<int> active;   // slots of the paths still alive
+  std::vector<int> sorted;   // active slots sorted by queue
+  std::vector<int> shadows;  // slots with a shadow ray to trace
+};
+
+// Direct light of the wavefront integrator, from the light sample and shadow
+// ray traced by the previous stages
+struct Queued_Direct_Light {
+  const CPU_Scene &scene;
+  const Light_Sample &sample;
+  bool occluded;
+
+  // isLight was already used by lightSampleStage to pick the light
+  template <typename T>
+  float3 operator()(T &surface, const float3 &P, const float3 &Wo,
+                    const float3 &N, bool /* isLight */,
+                    PerRayData &prd) const {
+    return shadeSample(scene, surface, P, Wo, N, sample, occluded, prd.time,
+                       prd.coneSpread, prd.seed);
+  }
+};
+
+// Starts the paths [begin, end) of the frame, path p being sample p % samples
+// of pixel p / samples. Seeds and camera rays match accumulate() and color().
+// Frames can have more than 2^31 paths, waves never more than WAVEFRONT_SIZE.
+void startPaths(const CPU_Scene &scene, Thread_Pool &pool,
+                Wavefront_State &state, size_t begin, size_t end, int width,
+                int height, int frame, int samples) {
+  state.coneSpread = pixelSpread(scene.camera, height);
+  int count = (int)(end - begin);
+
+  pool.parallel_blocks(count, WAVEFRONT_GRAIN, [&](int b, int e) {
+    for (int slot = b; slot < e; slot++) {
+      size_t path = begin + slot;
+      int pixel = (int)(path / samples);
+      int x = pixel % width, y = pixel / width;
+
+      uint seed = tea<64>(pixel, frame + (int)(path % samples));
+      float u = float(x + rnd(seed)) / width;
+      float v = float(y + rnd(seed)) / height;
+      Ray ray = generateRay(scene.camera, u, v, seed);
+
+      state.time[slot] = scene.camera.time0 +
+                         rnd(seed) * (scene.camera.time1 - scene.camera.time0);
+      state.seed[slot] = seed;
+      state.throughput[slot] = make_float3(1.f);
+      state.radiance[slot] = make_float3(0.f);
+      state.coneWidth[slot] = 0.f;
+      state.result[slot] = make_float3(0.f);
+      state.specular[slot] = false;
+      state.origin[slot] = ray.origin;
+      state.direction[slot] = ray.direction;
+      state.tmin[slot] = ray.tmin;
+    }
+  });
+
+  state.active.resize(count);
+  for (int slot = 0; slot < count; slot++) state.active[slot] = slot;
+}
+
+// Sort key of a ray: direction octant, then the Morton code of the origin
+// in the scene bounds, then the Morton code of the direction. Rays with
+// close keys start in the same region and go the same way, so they visit
+// mostly the same BVH nodes.
+inline uint64_t rayKey(const float3 &origin, const float3 &direction,
+                       const float3 &sceneMin, const float3 &sceneScale) {
+  float3 d = normalize(direction);
+  uint64_t octant = (d.x < 0.f ? 4 : 0) | (d.y < 0.f ? 2 : 0) |
+                    (d.z < 0.f ? 1 : 0);
+  uint64_t o = mortonCode<uint32_t>((origin - sceneMin) * sceneScale);
+  uint64_t w = mortonCode<uint32_t>(0.5f * d + make_float3(0.5f));
+
+  return (octant << 60) | (o << 30) | w;
+}
+
+// Sorts the active paths by the key of their rays, if there are at least
+// 'minBatch' of them. Only the order paths are traced in changes, so the
+// image stays the same.
+void reorderStage(const CPU_Scene &scene, Thread_Pool &pool,
+                  Wavefront_State &state, int minBatch) {
+  int count = (int)state.active.size();
+  if (count < std::max(minBatch, 2) || scene.topLevel.nodes.empty()) return;
+
+  const BVH_Node &root = scene.topLevel.nodes[0];
+  float3 extent = max_vec(root.bmax - root.bmin, make_float3(1e-6f));
+  float3 scale = make_float3(1.f) / extent;
+
+  std::vector<std::pair<uint64_t, int> > keys(count);
+  pool.parallel_blocks(count, WAVEFRONT_GRAIN, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int slot = state.active[i];
+      keys[i].first = rayKey(state.origin[slot], state.direction[slot],
+                             root.bmin, scale);
+      keys[i].second = slot;
+    }
+  });
+
+  std::sort(keys.begin(), keys.end());
+  for (int i = 0; i < count; i++) state.active[i] = keys[i].second;
+}
+
+inline Ray queuedRay(const Wavefront_State &state, int slot) {
+  return make_Ray(state.origin[slot], state.direction[slot], 0,
+                  state.tmin[slot], RT_DEFAULT_MAX);
+}
+
+// Intersects the rays of all the active paths
+void intersectStage(const CPU_Scene &scene, Thread_Pool &pool,
+                    Wavefront_State &state) {
+  pool.parallel_blocks((int)state.active.size(), WAVEFRONT_GRAIN,
+                       [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int slot = state.active[i];
+
+      CPU_Hit hit;
+      if (traceScene(scene, queuedRay(state, slot), state.time[slot],
+                     state.seed[slot], hit)) {
+        state.instance[slot] = hit.instance;
+        state.primitive[slot] = hit.primitive;
+        state.t[slot] = hit.t;
+        state.bc[slot] = hit.bc;
+        state.material[slot] = getMaterial(scene, hit);
+      } else
+        state.material[slot] = -1;
+    }
+  });
+}
+
+// Counting sort of the active paths by material type, misses last. Returns
+// the start of each queue in 'sorted', with an extra entry for the end.
+std::vector<int> sortStage(const CPU_Scene &scene, Wavefront_State &state) {
+  std::vector<int> offsets(WAVEFRONT_MISS + 2, 0);
+  std::vector<int> keys(state.active.size());
+
+  for (int i = 0; i < (int)state.active.size(); i++) {
+    int material = state.material[state.active[i]];
+    keys[i] = material < 0 ? WAVEFRONT_MISS : scene.materials[material].type;
+    offsets[keys[i] + 1]++;
+  }
+
+  for (int k = 0; k <= WAVEFRONT_MISS; k++) offsets[k + 1] += offsets[k];
+
+  std::vector<int> next(offsets.begin(), offsets.end() - 1);
+  state.sorted.resize(state.active.size());
+  for (int i = 0; i < (int)state.active.size(); i++)
+    state.sorted[next[keys[i]]++] = state.active[i];
+
+  return offsets;
+}
+
+// Computes the hit records of the sorted paths and picks the light samples of
+// the materials that need them, queueing their shadow rays
+void lightSampleStage(const CPU_Scene &scene, Thread_Pool &pool,
+                      Wavefront_State &state, int hits) {
+  pool.parallel_blocks(hits, WAVEFRONT_GRAIN, [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int slot = state.sorted[i];
+      const CPU_Material &material = scene.materials[state.material[slot]];
+
+      CPU_Hit hit;
+      hit.instance = state.instance[slot];
+      hit.primitive = state.primitive[slot];
+      hit.t = state.t[slot];
+      hit.bc = state.bc[slot];
+
+      HitRecord &rec = state.records[slot];
+      rec = getHitRecord(scene, hit, queuedRay(state, slot), state.time[slot]);
+
+      state.lightSamples[slot].light = -1;
+      state.occluded[slot] = false;
+      if (samplesDirectLight(material))
+        state.lightSamples[slot] = sampleLights(
+            scene, rec.P, rec.shading_normal,
+            material.type == DIFFUSE_LIGHT_MATERIAL,
+            material.type == ISOTROPIC_MATERIAL, state.seed[slot]);
+    }
+  });
+
+  state.shadows.clear();
+  for (int i = 0; i < hits; i++)
+    if (needsShadowRay(scene, state.lightSamples[state.sorted[i]]))
+      state.shadows.push_back(state.sorted[i]);
+}
+
+// Traces the queued shadow rays
+void shadowStage(const CPU_Scene &scene, Thread_Pool &pool,
+                 Wavefront_State &state) {
+  pool.parallel_blocks((int)state.shadows.size(), WAVEFRONT_GRAIN,
+                       [&](int b, int e) {
+    for (int i = b; i < e; i++) {
+      int slot = state.shadows[i];
+      const HitRecord &rec = state.records[slot];
+
+      state.occluded[slot] =
+          sampleInShadow(scene, rec.P, rec.shading_normal,
+                         state.lightSamples[slot], state.time[slot],
+                         state.seed[slot]);
+    }
+  });
+}
+
+// Shades the paths of the sorted range [begin, end), all of them in the same
+// queue, then spawns their next rays or finishes them, as in color()
+void shadeStage(const CPU_Scene &scene, Thread_Pool &pool,
+                Wavefront_State &state, int begin, int end, int depth,
+                std::vector<char> &alive) {
+  pool.parallel_blocks(end - begin, WAVEFRONT_GRAIN, [&](int b, int e) {
+    for (int i = begin + b; i < begin + e; i++) {
+      int slot = state.sorted[i];
+
+      PerRayData prd;
+      prd.seed = state.seed[slot];
+      prd.time = state.time[slot];
+      prd.throughput = state.throughput[slot];
+      prd.radiance = state.radiance[slot];
+      prd.coneWidth = state.coneWidth[slot];
+      prd.coneSpread = state.coneSpread;
+      prd.origin = state.origin[slot];
+
+      int material = state.material[slot];
+      if (material >= 0) {
+        Queued_Direct_Light direct = {scene, state.lightSamples[slot],
+                                      state.occluded[slot] != 0};
+        closestHit(scene, scene.materials[material], state.records[slot], prd,
+                   direct);
+      } else
+        miss(scene, queuedRay(state, slot), prd);
+
+      alive[slot] = false;
+      if (prd.scatterEvent == rayMissed) {
+        // a sampled environment already lit the previous, diffuse, bounce
+        if (scene.environment.enabled && depth > 0 && !state.specular[slot])
+          state.result[slot] = prd.radiance;
+        else if (scene.miss.type == ENVIRONMENT_MISS)  // HDR maps unclamped
+          state.result[slot] = prd.radiance + prd.throughput;
+        else
+          state.result[slot] = prd.radiance + clamp(prd.throughput, 0.f, 1.f);
+      } else if (prd.scatterEvent == rayHitLight) {
+        // Take care not to double dip
+        if (depth == 0 || state.specular[slot])
+          prd.radiance += prd.throughput;
+        state.result[slot] = prd.radiance;
+      } else if (prd.scatterEvent == rayGotCancelled)
+        state.result[slot] = prd.radiance;
+      else {
+        alive[slot] = true;
+        state.coneWidth[slot] +=
+            state.coneSpread * length(prd.origin - state.origin[slot]);
+        state.origin[slot] = prd.origin;
+        state.direction[slot] = prd.direction;
+        state.tmin[slot] = 1e-3f;
+        state.specular[slot] = prd.isSpecular;
+
+        // Russian Roulette Path Termination
+        if (scene.russian && depth > 10) {
+          float prob = max_component(prd.throughput);
+          if (rnd(prd.seed) >= prob) {
+            state.result[slot] = prd.radiance + prd.throughput;
+            alive[slot] = false;
+          } else
+            prd.throughput *= 1.f / prob;
+        }
+      }
+
+      state.seed[slot] = prd.seed;
+      state.throughput[slot] = prd.throughput;
+      state.radiance[slot] = prd.radiance;
+    }
+  });
+}
+
+// Traces the paths [begin, end) of the frame to the end. Secondary rays are
+// reordered before being intersected if the scene asks for it.
+void traceWave(const CPU_Scene &scene, Thread_Pool &pool,
+               Wavefront_State &state, size_t begin, size_t end, int width,
+               int height, int frame, int samples, Wavefront_Stats *stats) {
+  startPaths(scene, pool, state, begin, end, width, height, frame, samples);
+  std::vector<char> alive(end - begin);
+
+  for (int depth = 0; depth < scene.maxDepth && !state.active.empty();
+       depth++) {
+    // camera rays are already coherent
+    auto t0 = std::chrono::system_clock::now();
+    if (depth > 0 && scene.reorderBatch > 0)
+      reorderStage(scene, pool, state, scene.reorderBatch);
+
+    auto t1 = std::chrono::system_clock::now();
+    intersectStage(scene, pool, state);
+
+    if (stats && depth >= 2) {
+      auto t2 = std::chrono::system_clock::now();
+      stats->rays += state.active.size();
+      stats->sortSeconds += std::chrono::duration<float>(t1 - t0).count();
+      stats->seconds += std::chrono::duration<float>(t2 - t1).count();
+    }
+
+    std::vector<int> offsets = sortStage(scene, state);
+    int hits = offsets[WAVEFRONT_MISS];
+
+    lightSampleStage(scene, pool, state, hits);
+    shadowStage(scene, pool, state);
+
+    // one batch per material type, then the misses
+    for (int k = 0; k <= WAVEFRONT_MISS; k++)
+      if (offsets[k + 1] > offsets[k])
+        shadeStage(scene, pool, state, offsets[k], offsets[k + 1], depth,
+                   alive);
+
+    // compact the surviving paths, keeping their order
+    int count = 0;
+    for (int i = 0; i < (int)state.active.size(); i++)
+      if (alive[state.active[i]]) state.active[count++] = state.active[i];
+    state.active.resize(count);
+  }
+
+  // recursion did not terminate - cancel it
+  for (int i = 0; i < (int)state.active.size(); i++)
+    state.result[state.active[i]] = make_float3(0.f);
+}
+
+// Renders a full frame with the wavefront integrator, same arguments and
+// results as renderFrame. Intersection of the later bounces is measured in
+// 'stats', reordering included, if given.
+void renderWavefront(const CPU_Scene &scene, Thread_Pool &pool, int width,
+                     int height, int frame, int samples, float4 *acc_buffer,
+                     uchar4 *display_buffer, Wavefront_Stats *stats = nullptr) {
+  size_t paths = (size_t)width * height * samples;
+  std::vector<float3> sums(width * height, make_float3(0.f));
+
+  Wavefront_State state;
+  state.resize((int)std::min(paths, (size_t)WAVEFRONT_SIZE));
+
+  for (size_t begin = 0; begin < paths; begin += WAVEFRONT_SIZE) {
+    size_t end = std::min(begin + WAVEFRONT_SIZE, paths);
+    traceWave(scene, pool, state, begin, end, width, height, frame, samples,
+              stats);
+
+    // in path order, so the samples of a pixel are summed as in accumulate()
+    for (size_t path = begin; path < end; path++)
+      sums[path / samples] += de_nan(state.result[path - begin]);
+  }
+
+  pool.parallel_blocks(width * height, WAVEFRONT_GRAIN, [&](int b, int e) {
+    for (int pixel = b; pixel < e; pixel++) {
+      int x = pixel % width, y = pixel / width;
+      float3 sum = sums[pixel];
+      float4 batch = make_float4(sum.x, sum.y, sum.z, float(samples));
+
+      int index = (height - y - 1) * width + x;
+      float4 acc = add_Samples(acc_buffer[index], batch, frame);
+      acc_buffer[index] = acc;
+      display_buffer[index] = make_Color(acc, frame + samples);
+    }
+  });
+}
+
+#endif
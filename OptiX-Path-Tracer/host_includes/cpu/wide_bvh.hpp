@@ -0,0 +1,327 @@
+#ifndef WIDEBVHH
+#define WIDEBVHH
+
+// wide_bvh.hpp: Define the 4 and 8-wide BVHs of the CPU backend, collapsed
+// from the binary BVH, and their SIMD traversal
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#include <immintrin.h>
+#define WIDE_BVH_SSE
+#endif
+
+#if defined(__AVX__)
+#define WIDE_BVH_AVX
+#endif
+
+#include "bvh.hpp"
+
+// Wide BVH node, child boxes are stored in SoA form so that a ray can be
+// tested against all of them with a few SIMD instructions. Interior children
+// have a zero count and 'child' is their node index. Leaf children store their
+// first primitive position in the index array. Empty slots have a negative
+// count and an inverted box that no ray can hit.
+template <int N>
+struct alignas(32) Wide_BVH_Node {
+  float bminX[N], bminY[N], bminZ[N];
+  float bmaxX[N], bmaxY[N], bmaxZ[N];
+  int child[N];
+  int count[N];
+};
+
+template <int N>
+struct Wide_BVH {
+  std::vector<Wide_BVH_Node<N>, Aligned_Allocator<Wide_BVH_Node<N> > > nodes;
+  std::vector<int> indices;  // primitive indices referenced by the leaves
+};
+
+// Recursively collapses the binary subtree rooted at 'binaryIndex' into a wide
+// node, opening the largest interior child until all N slots are used
+template <int N>
+int collapseNode(Wide_BVH<N> &wide, const BVH &bvh, int binaryIndex) {
+  int children[N];
+  int numChildren = 2;
+  children[0] = bvh.nodes[binaryIndex].offset;
+  children[1] = bvh.nodes[binaryIndex].offset + 1;
+
+  while (numChildren < N) {
+    int largest = -1;
+    float largestArea = -1.f;
+
+    for (int i = 0; i < numChildren; i++) {
+      const BVH_Node &node = bvh.nodes[children[i]];
+      if (node.count > 0) continue;
+
+      float area = Aabb(node.bmin, node.bmax).area();
+      if (area > largestArea) {
+        largestArea = area;
+        largest = i;
+      }
+    }
+
+    if (largest < 0) break;  // only leaves left
+
+    int opened = children[largest];
+    children[largest] = bvh.nodes[opened].offset;
+    children[numChildren++] = bvh.nodes[opened].offset + 1;
+  }
+
+  int wideIndex = (int)wide.nodes.size();
+  wide.nodes.push_back(Wide_BVH_Node<N>());
+
+  for (int i = 0; i < N; i++) {
+    Wide_BVH_Node<N> &wideNode = wide.nodes[wideIndex];
+
+    if (i >= numChildren) {
+      wideNode.bminX[i] = wideNode.bminY[i] = wideNode.bminZ[i] = FLT_MAX;
+      wideNode.bmaxX[i] = wideNode.bmaxY[i] = wideNode.bmaxZ[i] = -FLT_MAX;
+      wideNode.child[i] = 0;
+      wideNode.count[i] = -1;
+      continue;
+    }
+
+    const BVH_Node &node = bvh.nodes[children[i]];
+    wideNode.bminX[i] = node.bmin.x;
+    wideNode.bminY[i] = node.bmin.y;
+    wideNode.bminZ[i] = node.bmin.z;
+    wideNode.bmaxX[i] = node.bmax.x;
+    wideNode.bmaxY[i] = node.bmax.y;
+    wideNode.bmaxZ[i] = node.bmax.z;
+    wideNode.count[i] = node.count;
+
+    if (node.count > 0)
+      wideNode.child[i] = node.offset;
+    else {
+      // the recursion may reallocate the node array
+      int child = collapseNode(wide, bvh, children[i]);
+      wide.nodes[wideIndex].child[i] = child;
+    }
+  }
+
+  return wideIndex;
+}
+
+// Builds a wide BVH out of a binary one, sharing its leaves
+template <int N>
+void buildWideBVH(Wide_BVH<N> &wide, const BVH &bvh) {
+  wide.nodes.clear();
+  wide.indices = bvh.indices;
+  if (bvh.nodes.empty()) return;
+
+  const BVH_Node &root = bvh.nodes[0];
+  if (root.count > 0) {
+    // single leaf, stored as the only child of the root
+    Wide_BVH_Node<N> node;
+    for (int i = 0; i < N; i++) {
+      node.bminX[i] = node.bminY[i] = node.bminZ[i] = FLT_MAX;
+      node.bmaxX[i] = node.bmaxY[i] = node.bmaxZ[i] = -FLT_MAX;
+      node.child[i] = 0;
+      node.count[i] = -1;
+    }
+
+    node.bminX[0] = root.bmin.x;
+    node.bminY[0] = root.bmin.y;
+    node.bminZ[0] = root.bmin.z;
+    node.bmaxX[0] = root.bmax.x;
+    node.bmaxY[0] = root.bmax.y;
+    node.bmaxZ[0] = root.bmax.z;
+    node.child[0] = root.offset;
+    node.count[0] = root.count;
+
+    wide.nodes.push_back(node);
+    return;
+  }
+
+  collapseNode(wide, bvh, 0);
+}
+
+// Ray data shared by all the box tests of a traversal. The near and far
+// planes of each axis are picked from the sign of the direction, so inverted
+// boxes are never hit.
+struct Wide_Ray {
+  Wide_Ray(const float3 &o, const float3 &d, float t) : origin(o), tmin(t) {
+    invDir = make_float3(1.f) / d;
+    negX = invDir.x < 0.f;
+    negY = invDir.y < 0.f;
+    negZ = invDir.z < 0.f;
+  }
+
+  float3 origin, invDir;
+  float tmin;
+  bool negX, negY, negZ;
+};
+
+// Tests the ray against all children of a node, returning a bit mask of the
+// hit ones and their entry distances in 'dist'
+template <int N>
+inline int intersectChildren(const Wide_BVH_Node<N> &node, const Wide_Ray &ray,
+                             float tmax, float *dist) {
+  const float *nearX = ray.negX ? node.bmaxX : node.bminX;
+  const float *nearY = ray.negY ? node.bmaxY : node.bminY;
+  const float *nearZ = ray.negZ ? node.bmaxZ : node.bminZ;
+  const float *farX = ray.negX ? node.bminX : node.bmaxX;
+  const float *farY = ray.negY ? node.bminY : node.bmaxY;
+  const float *farZ = ray.negZ ? node.bminZ : node.bmaxZ;
+  int mask = 0;
+
+#if defined(WIDE_BVH_AVX)
+  if (N % 8 == 0) {
+    const __m256 ox = _mm256_set1_ps(ray.origin.x);
+    const __m256 oy = _mm256_set1_ps(ray.origin.y);
+    const __m256 oz = _mm256_set1_ps(ray.origin.z);
+    const __m256 ix = _mm256_set1_ps(ray.invDir.x);
+    const __m256 iy = _mm256_set1_ps(ray.invDir.y);
+    const __m256 iz = _mm256_set1_ps(ray.invDir.z);
+    const __m256 t0 = _mm256_set1_ps(ray.tmin);
+    const __m256 t1 = _mm256_set1_ps(tmax);
+
+    for (int i = 0; i < N; i += 8) {
+      __m256 nx = _mm256_load_ps(nearX + i);
+      __m256 ny = _mm256_load_ps(nearY + i);
+      __m256 nz = _mm256_load_ps(nearZ + i);
+      __m256 fx = _mm256_load_ps(farX + i);
+      __m256 fy = _mm256_load_ps(farY + i);
+      __m256 fz = _mm256_load_ps(farZ + i);
+
+      __m256 tnx = _mm256_mul_ps(_mm256_sub_ps(nx, ox), ix);
+      __m256 tny = _mm256_mul_ps(_mm256_sub_ps(ny, oy), iy);
+      __m256 tnz = _mm256_mul_ps(_mm256_sub_ps(nz, oz), iz);
+      __m256 tfx = _mm256_mul_ps(_mm256_sub_ps(fx, ox), ix);
+      __m256 tfy = _mm256_mul_ps(_mm256_sub_ps(fy, oy), iy);
+      __m256 tfz = _mm256_mul_ps(_mm256_sub_ps(fz, oz), iz);
+
+      __m256 tnear =
+          _mm256_max_ps(_mm256_max_ps(tnx, tny), _mm256_max_ps(tnz, t0));
+      __m256 tfar =
+          _mm256_min_ps(_mm256_min_ps(tfx, tfy), _mm256_min_ps(tfz, t1));
+
+      _mm256_store_ps(dist + i, tnear);
+      __m256 hit = _mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ);
+      mask |= _mm256_movemask_ps(hit) << i;
+    }
+
+    return mask;
+  }
+#endif
+
+#if defined(WIDE_BVH_SSE)
+  const __m128 ox = _mm_set1_ps(ray.origin.x);
+  const __m128 oy = _mm_set1_ps(ray.origin.y);
+  const __m128 oz = _mm_set1_ps(ray.origin.z);
+  const __m128 ix = _mm_set1_ps(ray.invDir.x);
+  const __m128 iy = _mm_set1_ps(ray.invDir.y);
+  const __m128 iz = _mm_set1_ps(ray.invDir.z);
+  const __m128 t0 = _mm_set1_ps(ray.tmin);
+  const __m128 t1 = _mm_set1_ps(tmax);
+
+  for (int i = 0; i < N; i += 4) {
+    __m128 tnx = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX + i), ox), ix);
+    __m128 tny = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY + i), oy), iy);
+    __m128 tnz = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ + i), oz), iz);
+    __m128 tfx = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX + i), ox), ix);
+    __m128 tfy = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY + i), oy), iy);
+    __m128 tfz = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ + i), oz), iz);
+
+    __m128 tnear = _mm_max_ps(_mm_max_ps(tnx, tny), _mm_max_ps(tnz, t0));
+    __m128 tfar = _mm_min_ps(_mm_min_ps(tfx, tfy), _mm_min_ps(tfz, t1));
+
+    _mm_store_ps(dist + i, tnear);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << i;
+  }
+#else
+  for (int i = 0; i < N; i++) {
+    float tnear = ffmax(ffmax((nearX[i] - ray.origin.x) * ray.invDir.x,
+                              (nearY[i] - ray.origin.y) * ray.invDir.y),
+                        ffmax((nearZ[i] - ray.origin.z) * ray.invDir.z,
+                              ray.tmin));
+    float tfar = ffmin(ffmin((farX[i] - ray.origin.x) * ray.invDir.x,
+                             (farY[i] - ray.origin.y) * ray.invDir.y),
+                       ffmin((farZ[i] - ray.origin.z) * ray.invDir.z, tmax));
+
+    dist[i] = tnear;
+    if (tnear <= tfar) mask |= 1 << i;
+  }
+#endif
+
+  return mask;
+}
+
+// Wide BVH nodes are tested in place, the scratch node is only used by node
+// formats that have to be decoded first
+template <int N>
+inline const Wide_BVH_Node<N> &fetchNode(const Wide_BVH<N> &bvh, int index,
+                                         Wide_BVH_Node<N> & /* scratch */) {
+  return bvh.nodes[index];
+}
+
+// Front to back traversal shared by the wide node formats, with the same
+// interface as traverseBVH. Nodes are read through fetchNode.
+template <int N, typename Tree, typename Intersector>
+bool traverseWide(const Tree &bvh, const float3 &origin,
+                  const float3 &direction, float tmin, float &tmax,
+                  Intersector &intersect) {
+  if (bvh.nodes.empty()) return false;
+
+  const Wide_Ray ray(origin, direction, tmin);
+
+  // entries are node indices, or leaf ranges with their primitive count
+  struct Entry {
+    int child, count;
+    float dist;
+  };
+
+  Entry stack[64 * N];
+  int stackSize = 0;
+  int current = 0;
+  bool hit = false;
+
+  alignas(32) float dist[N];
+  Wide_BVH_Node<N> scratch;
+
+  while (true) {
+    const Wide_BVH_Node<N> &node = fetchNode(bvh, current, scratch);
+    int mask = intersectChildren(node, ray, tmax, dist);
+
+    // push the hit children, farthest first, so the closest is popped first
+    int first = stackSize;
+    for (int i = 0; i < N; i++) {
+      if (!(mask & (1 << i)) || node.count[i] < 0) continue;
+
+      Entry entry = {node.child[i], node.count[i], dist[i]};
+      int j = stackSize++;
+      while (j > first && stack[j - 1].dist < entry.dist) {
+        stack[j] = stack[j - 1];
+        j--;
+      }
+      stack[j] = entry;
+    }
+
+    // pop entries until an interior node that's still in range is found
+    current = -1;
+    while (stackSize > 0) {
+      const Entry &entry = stack[--stackSize];
+      if (entry.dist > tmax) continue;
+
+      if (entry.count > 0) {
+        hit |= intersectLeaf(intersect, bvh.indices, entry.child, entry.count,
+                             tmax);
+      } else {
+        current = entry.child;
+        break;
+      }
+    }
+
+    if (current < 0) break;
+  }
+
+  return hit;
+}
+
+// Traverses the wide BVH front to back, with the same interface as traverseBVH
+template <int N, typename Intersector>
+bool traverseWideBVH(const Wide_BVH<N> &bvh, const float3 &origin,
+                     const float3 &direction, float tmin, float &tmax,
+                     Intersector &intersect) {
+  return traverseWide<N>(bvh, origin, direction, tmin, tmax, intersect);
+}
+
+#endif
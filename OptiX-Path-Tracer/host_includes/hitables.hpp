@@ -6,6 +6,8 @@
 #include "programs.hpp"
 #include "transforms.hpp"
 
+#include <map>
+
 /*! The precompiled programs code (in ptx) that our cmake script
 will precompile (to ptx) and link to the generated executable */
 extern "C" const char Sphere_PTX[];
@@ -17,6 +19,87 @@ extern "C" const char Volume_Box_PTX[];
 extern "C" const char Triangle_PTX[];
 extern "C" const char Cylinder_PTX[];
 
+// Analytic primitives of the same type gathered in a single Geometry. Their
+// parameters are stored in buffers, one entry per primitive, and each one
+// reports the index of its own material in the GeometryInstance.
+class Hitable_Batch {
+ public:
+  Hitable_Batch() : ptx(nullptr) {}
+
+  Hitable_Batch(const char *ptx, std::string intersect, std::string bounds)
+      : ptx(ptx), intersect(intersect), bounds(bounds) {}
+
+  // Appends a primitive's material, shared materials are assigned once
+  void addMaterial(BRDF *material) {
+    std::map<BRDF *, int>::iterator it = materialIndex.find(material);
+
+    if (it == materialIndex.end()) {
+      it = materialIndex.insert(std::make_pair(material, (int)brdfs.size()))
+               .first;
+      brdfs.push_back(material);
+    }
+
+    materials.push_back(it->second);
+  }
+
+  // Creates a GeometryInstance holding all primitives of the batch
+  GeometryInstance getGeometryInstance(Context &g_context) {
+    // Create Geometry variable
+    Geometry geometry = g_context->createGeometry();
+    geometry->setPrimitiveCount((int)materials.size());
+
+    // Set intersection and bounding box programs
+    Program bb = getProgram(ptx, bounds, g_context);
+    geometry->setBoundingBoxProgram(bb);
+    Program hit = getProgram(ptx, intersect, g_context);
+    geometry->setIntersectionProgram(hit);
+
+    GeometryInstance gi = g_context->createGeometryInstance();
+    gi->setGeometry(geometry);
+
+    // set materials
+    gi->setMaterialCount((int)brdfs.size());
+    for (int i = 0; i < (int)brdfs.size(); i++)
+      gi->setMaterial(i, brdfs[i]->getMaterial(g_context));
+
+    // Create Geometry parameters callable program
+    Program prog = getProgram(ptx, "Get_HitRecord", g_context);
+    gi["Get_HitRecord"]->set(prog);
+
+    // Parameter buffers
+    gi["material_buffer"]->setBuffer(createBuffer(materials, g_context));
+    setBuffers(gi, ints, g_context);
+    setBuffers(gi, floats, g_context);
+    setBuffers(gi, float3s, g_context);
+    setBuffers(gi, float4s, g_context);
+
+    return gi;
+  }
+
+  const char *ptx;                // PTX of the primitive type
+  std::string intersect, bounds;  // program names
+
+  // parameter buffers, by variable name
+  std::map<std::string, std::vector<int> > ints;
+  std::map<std::string, std::vector<float> > floats;
+  std::map<std::string, std::vector<float3> > float3s;
+  std::map<std::string, std::vector<float4> > float4s;
+
+ protected:
+  std::vector<int> materials;  // material index of each primitive
+  std::vector<BRDF *> brdfs;   // materials of the GeometryInstance
+  std::map<BRDF *, int> materialIndex;
+
+  template <typename T>
+  static void setBuffers(GeometryInstance &gi,
+                         std::map<std::string, std::vector<T> > &buffers,
+                         Context &g_context) {
+    typename std::map<std::string, std::vector<T> >::iterator it;
+    for (it = buffers.begin(); it != buffers.end(); it++)
+      gi[it->first]->setBuffer(createBuffer(it->second, g_context));
+  }
+};
+
 // Base geometry primitve class
 class Hitable {
  public:
@@ -27,6 +110,16 @@ class Hitable {
   // Get GeometryInstance of Hitable element
   virtual GeometryInstance getGeometryInstance(Context &g_context) = 0;
 
+  // Creates an empty batch of the Hitable type, types that aren't batched
+  // return a batch without PTX
+  virtual Hitable_Batch createBatch() const { return Hitable_Batch(); }
+
+  // Appends the primitive to a batch of its type. Types that return a batch
+  // with PTX from createBatch must override it.
+  virtual void appendTo(Hitable_Batch & /* batch */) const {
+    throw "Hitable type creates batches but can't be appended to them";
+  }
+
   // Apply a rotation to the Hitable
   virtual void rotate(float angle, AXIS axis) {
     TransformParameter param(Rotate_Transform,   // Transform type
@@ -59,27 +152,60 @@ class Hitable {
 
   // Add the Hitable to the scene graph
   virtual void addTo(Group &d_world, Context &g_context) {
-    // reverse vector of transforms
-    std::reverse(transforms.begin(), transforms.end());
+    // the last transform applied is the outermost one
+    std::vector<TransformParameter> params(transforms.rbegin(),
+                                           transforms.rend());
 
     // create geometry instance
     GeometryInstance gi = getGeometryInstance(g_context);
 
     // apply transforms and add Hitable to the scene
-    addAndTransform(gi, d_world, g_context, transforms);
+    addAndTransform(gi, d_world, g_context, params);
+  }
+
+  // Get CPU primitive of Hitable element
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) = 0;
+
+  // Add the Hitable to the CPU scene
+  virtual void addTo(CPU_Scene &scene) {
+    // same transform order as the scene graph above
+    std::vector<TransformParameter> params(transforms.rbegin(),
+                                           transforms.rend());
+
+    CPU_Geometry geometry;
+    geometry.primitives.push_back(getPrimitive(scene));
+    scene.addInstance(geometry, collapseTransforms(params));
   }
 
  protected:
   Geometry geometry;  // Geometry object
   BRDF *material;     // Host side material object
 
+  // Creates CPU primitive and assigns the material to the CPU scene
+  CPU_Primitive createPrimitive(CPU_Primitive_Type type, CPU_Scene &scene) {
+    CPU_Primitive prim = CPU_Primitive();
+
+    prim.type = type;
+    prim.material = material->assignTo(scene);
+
+    return prim;
+  }
+
+  // Creates GeometryInstance of a batch holding only this primitive
+  GeometryInstance createBatchInstance(Context &g_context) const {
+    Hitable_Batch batch = createBatch();
+    appendTo(batch);
+
+    return batch.getGeometryInstance(g_context);
+  }
+
   // Creates GeometryInstance
   virtual GeometryInstance createGeometryInstance(Context &g_context) {
     GeometryInstance gi = g_context->createGeometryInstance();
 
     gi->setGeometry(geometry);
     gi->setMaterialCount(1);
-    gi->setMaterial(0, material->assignTo(g_context));
+    gi->setMaterial(0, material->getMaterial(g_context));
 
     return gi;
   }
@@ -93,33 +219,28 @@ class Sphere : public Hitable {
 
   // Creates a GeometryInstance object of a sphere primitive
   virtual GeometryInstance getGeometryInstance(Context &g_context) override {
-    GeometryInstance gi = g_context->createGeometryInstance();
-
-    // set material
-    gi->setMaterialCount(1);
-    gi->setMaterial(0, material->assignTo(g_context));
-
-    // Create Geometry parameters callable program
-    Program prog = createProgram(Sphere_PTX, "Get_HitRecord", g_context);
-
-    // Basic Parameters
-    gi["center"]->setFloat(center.x, center.y, center.z);
-    gi["radius"]->setFloat(radius);
-    gi["Get_HitRecord"]->set(prog);
+    return createBatchInstance(g_context);
+  }
 
-    // Create Geometry variable
-    Geometry geometry = g_context->createGeometry();
-    geometry->setPrimitiveCount(1);
+  // Creates an empty batch of spheres
+  virtual Hitable_Batch createBatch() const override {
+    return Hitable_Batch(Sphere_PTX, "hit_sphere", "get_bounds");
+  }
 
-    // Set intersection and bounding box programs
-    Program bb = createProgram(Sphere_PTX, "get_bounds", g_context);
-    geometry->setBoundingBoxProgram(bb);
-    Program hit = createProgram(Sphere_PTX, "hit_sphere", g_context);
-    geometry->setIntersectionProgram(hit);
+  // Appends the sphere to a batch of spheres
+  virtual void appendTo(Hitable_Batch &batch) const override {
+    batch.float3s["center_buffer"].push_back(center);
+    batch.floats["radius_buffer"].push_back(radius);
+    batch.addMaterial(material);
+  }
 
-    gi->setGeometry(geometry);
+  // Creates a CPU sphere primitive
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) override {
+    CPU_Primitive prim = createPrimitive(SPHERE_PRIMITIVE, scene);
+    prim.p0 = center;
+    prim.radius = radius;
 
-    return gi;
+    return prim;
   }
 
  protected:
@@ -146,11 +267,11 @@ class Moving_Sphere : public Hitable {
     geometry->setPrimitiveCount(1);
 
     // Set bounding box program
-    Program bb = createProgram(Moving_Sphere_PTX, "get_bounds", g_context);
+    Program bb = getProgram(Moving_Sphere_PTX, "get_bounds", g_context);
     geometry->setBoundingBoxProgram(bb);
 
     // Set intersection program
-    Program hit = createProgram(Moving_Sphere_PTX, "hit_sphere", g_context);
+    Program hit = getProgram(Moving_Sphere_PTX, "hit_sphere", g_context);
     geometry->setIntersectionProgram(hit);
 
     // Basic Parameters
@@ -165,6 +286,18 @@ class Moving_Sphere : public Hitable {
     return createGeometryInstance(g_context);
   }
 
+  // Creates a CPU motion blur sphere primitive
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) override {
+    CPU_Primitive prim = createPrimitive(MOVING_SPHERE_PRIMITIVE, scene);
+    prim.p0 = center0;
+    prim.p1 = center1;
+    prim.radius = radius;
+    prim.time0 = time0;
+    prim.time1 = time1;
+
+    return prim;
+  }
+
  protected:
   const float3 center0, center1;  // ending point of movement
   const float radius;             // radius of the sphere
@@ -185,11 +318,11 @@ class Volumetric_Sphere : public Hitable {
     geometry->setPrimitiveCount(1);
 
     // Set bounding box program
-    Program bound = createProgram(Volume_Sphere_PTX, "get_bounds", g_context);
+    Program bound = getProgram(Volume_Sphere_PTX, "get_bounds", g_context);
     geometry->setBoundingBoxProgram(bound);
 
     // Set intersection program
-    Program hit = createProgram(Volume_Sphere_PTX, "hit_sphere", g_context);
+    Program hit = getProgram(Volume_Sphere_PTX, "hit_sphere", g_context);
     geometry->setIntersectionProgram(hit);
 
     // Basic Parameters
@@ -202,6 +335,16 @@ class Volumetric_Sphere : public Hitable {
     return createGeometryInstance(g_context);
   }
 
+  // Creates a CPU volumetric sphere primitive
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) override {
+    CPU_Primitive prim = createPrimitive(VOLUME_SPHERE_PRIMITIVE, scene);
+    prim.p0 = center;
+    prim.radius = radius;
+    prim.density = density;
+
+    return prim;
+  }
+
  protected:
   const float3 center;  // center of the sphere
   const float radius;   // radius of the sphere
@@ -231,38 +374,35 @@ class AARect : public Hitable {
 
   // Creates a GeometryInstance object of a rectangle primitive
   virtual GeometryInstance getGeometryInstance(Context &g_context) override {
-    GeometryInstance gi = g_context->createGeometryInstance();
-
-    // set material
-    gi->setMaterialCount(1);
-    gi->setMaterial(0, material->assignTo(g_context));
-
-    // Create a Geometry object and set programs
-    Geometry geometry = g_context->createGeometry();
-    geometry->setPrimitiveCount(1);
-
-    // Create intersection and bounding box programs
-    Program bound = createProgram(AARect_PTX, "Get_Bounds", g_context);
-    geometry->setBoundingBoxProgram(bound);
-    Program intersect = createProgram(AARect_PTX, "Hit_Rect", g_context);
-    geometry->setIntersectionProgram(intersect);
-
-    // Create Geometry parameters callable program
-    Program prog = createProgram(AARect_PTX, "Get_HitRecord", g_context);
+    return createBatchInstance(g_context);
+  }
 
-    // Basic Parameters
-    gi["axis"]->setInt(int(axis));
-    gi["a0"]->setFloat(a0);
-    gi["a1"]->setFloat(a1);
-    gi["b0"]->setFloat(b0);
-    gi["b1"]->setFloat(b1);
-    gi["k"]->setFloat(k);
-    gi["flip"]->setInt(flip);
-    gi["Get_HitRecord"]->set(prog);
+  // Creates an empty batch of rectangles
+  virtual Hitable_Batch createBatch() const override {
+    return Hitable_Batch(AARect_PTX, "Hit_Rect", "Get_Bounds");
+  }
 
-    gi->setGeometry(geometry);
+  // Appends the rectangle to a batch of rectangles
+  virtual void appendTo(Hitable_Batch &batch) const override {
+    batch.ints["axis_buffer"].push_back(int(axis));
+    batch.float4s["rect_buffer"].push_back(make_float4(a0, a1, b0, b1));
+    batch.floats["k_buffer"].push_back(k);
+    batch.ints["flip_buffer"].push_back(flip);
+    batch.addMaterial(material);
+  }
 
-    return gi;
+  // Creates a CPU rectangle primitive
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) override {
+    CPU_Primitive prim = createPrimitive(AARECT_PRIMITIVE, scene);
+    prim.a0 = a0;
+    prim.a1 = a1;
+    prim.b0 = b0;
+    prim.b1 = b1;
+    prim.k = k;
+    prim.axis = axis;
+    prim.flip = flip;
+
+    return prim;
   }
 
  protected:
@@ -279,33 +419,28 @@ class Box : public Hitable {
 
   // Creates a GeometryInstance object of a Box primitive
   virtual GeometryInstance getGeometryInstance(Context &g_context) override {
-    GeometryInstance gi = g_context->createGeometryInstance();
-
-    // set material
-    gi->setMaterialCount(1);
-    gi->setMaterial(0, material->assignTo(g_context));
-
-    // Create a Geometry object and set programs
-    Geometry geometry = g_context->createGeometry();
-    geometry->setPrimitiveCount(1);
-
-    // Set bounding box program
-    Program bound = createProgram(Box_PTX, "Get_Bounds", g_context);
-    geometry->setBoundingBoxProgram(bound);
-    Program intersect = createProgram(Box_PTX, "Intersect", g_context);
-    geometry->setIntersectionProgram(intersect);
+    return createBatchInstance(g_context);
+  }
 
-    // Create Geometry parameters callable program
-    Program prog = createProgram(Box_PTX, "Get_HitRecord", g_context);
+  // Creates an empty batch of boxes
+  virtual Hitable_Batch createBatch() const override {
+    return Hitable_Batch(Box_PTX, "Intersect", "Get_Bounds");
+  }
 
-    // Basic parameters
-    gi["boxmin"]->setFloat(p0.x, p0.y, p0.z);
-    gi["boxmax"]->setFloat(p1.x, p1.y, p1.z);
-    gi["Get_HitRecord"]->set(prog);
+  // Appends the box to a batch of boxes
+  virtual void appendTo(Hitable_Batch &batch) const override {
+    batch.float3s["boxmin_buffer"].push_back(p0);
+    batch.float3s["boxmax_buffer"].push_back(p1);
+    batch.addMaterial(material);
+  }
 
-    gi->setGeometry(geometry);
+  // Creates a CPU Box primitive
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) override {
+    CPU_Primitive prim = createPrimitive(BOX_PRIMITIVE, scene);
+    prim.p0 = p0;
+    prim.p1 = p1;
 
-    return gi;
+    return prim;
   }
 
  protected:
@@ -326,11 +461,11 @@ class Volumetric_Box : public Hitable {
     geometry->setPrimitiveCount(1);
 
     // Set bounding box program
-    Program bound = createProgram(Volume_Box_PTX, "get_bounds", g_context);
+    Program bound = getProgram(Volume_Box_PTX, "get_bounds", g_context);
     geometry->setBoundingBoxProgram(bound);
 
     // Set intersection program
-    Program intersect = createProgram(Volume_Box_PTX, "hit_volume", g_context);
+    Program intersect = getProgram(Volume_Box_PTX, "hit_volume", g_context);
     geometry->setIntersectionProgram(intersect);
 
     // Basic parameters
@@ -343,6 +478,16 @@ class Volumetric_Box : public Hitable {
     return createGeometryInstance(g_context);
   }
 
+  // Creates a CPU Volumetric Box primitive
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) override {
+    CPU_Primitive prim = createPrimitive(VOLUME_BOX_PRIMITIVE, scene);
+    prim.p0 = p0;
+    prim.p1 = p1;
+    prim.density = density;
+
+    return prim;
+  }
+
  protected:
   const float3 p0, p1;  // box is built by projecting two points
   const float density;  // volumetric material density
@@ -369,11 +514,11 @@ class Triangle : public Hitable {
     geometry->setPrimitiveCount(1);
 
     // Set bounding box program
-    Program bound = createProgram(Triangle_PTX, "get_bounds", g_context);
+    Program bound = getProgram(Triangle_PTX, "get_bounds", g_context);
     geometry->setBoundingBoxProgram(bound);
 
     // Set intersection program
-    Program intersect = createProgram(Triangle_PTX, "hit_triangle", g_context);
+    Program intersect = getProgram(Triangle_PTX, "hit_triangle", g_context);
     geometry->setIntersectionProgram(intersect);
 
     // basic parameters
@@ -402,6 +547,19 @@ class Triangle : public Hitable {
     return createGeometryInstance(g_context);
   }
 
+  // Creates a CPU Triangle primitive
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) override {
+    CPU_Primitive prim = createPrimitive(TRIANGLE_PRIMITIVE, scene);
+    prim.p0 = a;
+    prim.p1 = b;
+    prim.p2 = c;
+    prim.uv0 = a_uv;
+    prim.uv1 = b_uv;
+    prim.uv2 = c_uv;
+
+    return prim;
+  }
+
  protected:
   const float3 a, b, c;           // vertex coordinates
   const float2 a_uv, b_uv, c_uv;  // vertex texture coordinates
@@ -419,22 +577,22 @@ class Cylinder : public Hitable {
 
     // set material
     gi->setMaterialCount(1);
-    gi->setMaterial(0, material->assignTo(g_context));
+    gi->setMaterial(0, material->getMaterial(g_context));
 
     // Create a Geometry object and set programs
     Geometry geometry = g_context->createGeometry();
     geometry->setPrimitiveCount(1);
 
     // Set bounding box program
-    Program bound = createProgram(Cylinder_PTX, "Get_Bounds", g_context);
+    Program bound = getProgram(Cylinder_PTX, "Get_Bounds", g_context);
     geometry->setBoundingBoxProgram(bound);
 
     // Set intersection program
-    Program intersect = createProgram(Cylinder_PTX, "Intersect", g_context);
+    Program intersect = getProgram(Cylinder_PTX, "Intersect", g_context);
     geometry->setIntersectionProgram(intersect);
 
     // Create Geometry parameters callable program
-    Program prog = createProgram(Cylinder_PTX, "Get_HitRecord", g_context);
+    Program prog = getProgram(Cylinder_PTX, "Get_HitRecord", g_context);
 
     // Basic Parameters
     gi["O"]->setFloat(O.x, O.y, O.z);
@@ -447,6 +605,16 @@ class Cylinder : public Hitable {
     return gi;
   }
 
+  // Creates a CPU cylinder primitive
+  virtual CPU_Primitive getPrimitive(CPU_Scene &scene) override {
+    CPU_Primitive prim = createPrimitive(CYLINDER_PRIMITIVE, scene);
+    prim.p0 = O;
+    prim.length = length;
+    prim.radius = radius;
+
+    return prim;
+  }
+
  protected:
   const float3 O;      // origin of the cylinder
   const float length;  // length of the cylinder
@@ -502,8 +670,7 @@ class Hitable_List {
     GeometryGroup gg = g_context->createGeometryGroup();
     gg->setAcceleration(g_context->createAcceleration("Trbvh"));
 
-    for (int i = 0; i < hitList.size(); i++)
-      gg->addChild(hitList[i]->getGeometryInstance(g_context));
+    addInstancesTo(gg, hitList, g_context);
 
     return gg;
   }
@@ -514,16 +681,96 @@ class Hitable_List {
     addAndTransform(gg, d_world, g_context, transforms);
   }
 
-  // adds and transforms each list element to the scene graph individually
+  // adds and transforms each list element to the scene graph individually.
+  // Elements without transforms share a single GeometryGroup, instead of
+  // getting an acceleration structure each.
   void addElementsTo(Group &d_world, Context &g_context) {
+    std::vector<Hitable *> shared;
+
     for (int i = 0; i < (int)hitList.size(); i++) {
+      if (hitList[i]->transforms.empty()) {
+        shared.push_back(hitList[i]);
+        continue;
+      }
+
       GeometryInstance gi = hitList[i]->getGeometryInstance(g_context);
       addAndTransform(gi, d_world, g_context, hitList[i]->transforms);
     }
+
+    if (!shared.empty()) {
+      GeometryGroup gg = g_context->createGeometryGroup();
+      gg->setAcceleration(g_context->createAcceleration("Trbvh"));
+
+      addInstancesTo(gg, shared, g_context);
+      addAndTransform(gg, d_world, g_context,
+                      std::vector<TransformParameter>());
+    }
+  }
+
+  // adds and transforms Hitable_List as a single geometry to the CPU scene
+  void addListTo(CPU_Scene &scene) {
+    CPU_Geometry geometry;
+    for (int i = 0; i < (int)hitList.size(); i++)
+      geometry.primitives.push_back(hitList[i]->getPrimitive(scene));
+
+    scene.addInstance(geometry, collapseTransforms(transforms));
+  }
+
+  // adds and transforms each list element to the CPU scene individually,
+  // elements without transforms share a single geometry. Volumes draw random
+  // numbers when intersected, so they keep their own instance and are tested
+  // in the same order whatever the geometry BVH width.
+  void addElementsTo(CPU_Scene &scene) {
+    CPU_Geometry shared;
+
+    for (int i = 0; i < (int)hitList.size(); i++) {
+      CPU_Primitive prim = hitList[i]->getPrimitive(scene);
+      bool volume = prim.type == VOLUME_SPHERE_PRIMITIVE ||
+                    prim.type == VOLUME_BOX_PRIMITIVE;
+
+      if (hitList[i]->transforms.empty() && !volume) {
+        shared.primitives.push_back(prim);
+        continue;
+      }
+
+      CPU_Geometry geometry;
+      geometry.primitives.push_back(prim);
+      scene.addInstance(geometry, collapseTransforms(hitList[i]->transforms));
+    }
+
+    if (!shared.primitives.empty())
+      scene.addInstance(shared, Matrix4x4::identity());
   }
 
  protected:
   std::vector<Hitable *> hitList;
+
+  // Adds the elements to a GeometryGroup. Elements of batched types share one
+  // GeometryInstance per type, the others get their own.
+  static void addInstancesTo(GeometryGroup &gg,
+                             const std::vector<Hitable *> &elements,
+                             Context &g_context) {
+    std::vector<Hitable_Batch> batches;
+    std::map<const char *, int> batchIndex;  // batch of each PTX
+
+    for (int i = 0; i < (int)elements.size(); i++) {
+      Hitable_Batch batch = elements[i]->createBatch();
+
+      if (!batch.ptx) {
+        gg->addChild(elements[i]->getGeometryInstance(g_context));
+        continue;
+      }
+
+      if (!batchIndex.count(batch.ptx)) {
+        batchIndex[batch.ptx] = (int)batches.size();
+        batches.push_back(batch);
+      }
+      elements[i]->appendTo(batches[batchIndex[batch.ptx]]);
+    }
+
+    for (int i = 0; i < (int)batches.size(); i++)
+      gg->addChild(batches[i].getGeometryInstance(g_context));
+  }
   std::vector<TransformParameter> transforms;
 };
 
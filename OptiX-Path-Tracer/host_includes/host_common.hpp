@@ -3,7 +3,9 @@
 #define _USE_MATH_DEFINES 1
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <cmath>
+#include <map>
 #include <random>
 #include <string>
 
@@ -17,13 +19,16 @@
 
 #include "../lib/HDRloader.h"
 
+#include "cpu/scene.hpp"
+#include "cpu/thread_pool.hpp"
+
 // Struct used to keep GUI state
 struct App_State {
   // Default Constructor
   App_State() {
-    context = Context::create();  // OptiX context
     W = H = 500;                  // image resolution
     samples = 500;                // number of samples
+    batch = 1;                    // number of samples per launch
     scene = 2;                    // counter to selection scene function
     model = 0;                    // model selection for mesh test scene
     frequency = 1;                // update preview at every sample
@@ -31,19 +36,58 @@ struct App_State {
     showProgress = true;          // display preview?
     RTX = true;                   // use RTX mode
     russian = true;               // use Russian Roulette
+    meshAttributes = 0;           // FULL_ATTRIBUTES, float mesh vertices
+    textureMemory = 0;            // no texture cache limit, in MB
+    mipmaps = 0;                  // NO_MIPMAPS, full resolution textures
+    anisotropy = 8;               // most probes of a mipmapped lookup
     depth = 50;                   // max ray repth
     start = done = false;         // hasn't started and it's not yet done
     fileType = 0;                 // PNG = 0, HDR = 1
     fileName = "out";             // file name without extension
+    CPU = false;                  // render with OptiX by default
+    threads = 0;                  // use all hardware threads
+    pool = NULL;                  // created with the scene
+    bvhWidth = 8;                 // 8-wide BVHs in CPU mode
+    linearBVH = false;            // SAH BVHs in CPU mode
+    compressedBVH = false;        // full precision wide BVHs in CPU mode
+    benchmark = false;            // render instead of measuring traversal
+    wavefront = false;            // per path integrator in CPU mode
+    reorderBatch = 0;             // wavefront rays traced in path order
+    packets = false;              // camera rays traced one by one
+    parseBenchmark = "";          // render instead of timing OBJ parsing
+    hdrBenchmark = "";            // render instead of timing HDR loading
+    attributeCheck = "";          // render instead of checking attributes
+    environmentSampling = true;   // sample HDR environments as lights
   }
 
   Context context;
-  int W, H, samples, scene, currentSample, model, frequency, fileType, depth;
-  bool done, start, showProgress, RTX, russian;
+  int W, H, samples, batch, scene, currentSample, model, frequency, fileType,
+      depth, meshAttributes, textureMemory, mipmaps, anisotropy;
+  bool done, start, showProgress, RTX, russian, environmentSampling;
   Buffer accBuffer, displayBuffer;
   std::string fileName;
+
+  // CPU backend state
+  bool CPU, benchmark, linearBVH, compressedBVH, wavefront, packets;
+  int threads, bvhWidth, reorderBatch;
+  Thread_Pool *pool;  // 'threads' workers, loading the scene & rendering it
+  std::string parseBenchmark;  // OBJ file to time the parsers on
+  std::string hdrBenchmark;    // HDR file to time the loaders on
+  std::string attributeCheck;  // OBJ file to check the compact attributes of
+  CPU_Scene cpuScene;
+  std::vector<float4> cpuAccBuffer;
+  std::vector<uchar4> cpuDisplayBuffer;
 };
 
+// false in headless batch mode, where nobody is there to close the console
+bool interactive = true;
+
+// Keeps the console open if running interactively, then exits
+void Exit_Program(int status) {
+  if (interactive) system("PAUSE");
+  exit(status);
+}
+
 // encapsulates PTX string program creation
 Program createProgram(const char file[], const std::string &name,
                       Context &g_context) {
@@ -56,17 +100,48 @@ Program createProgram(const char file[], const std::string &name,
   return program;
 }
 
+// Hit and miss counters of the Program and Material caches
+struct Cache_Stats {
+  Cache_Stats() : hits(0), misses(0) {}
+
+  int hits, misses;
+};
+
+// Programs without variables of their own, one per PTX entry point
+struct Program_Cache {
+  std::map<std::pair<const char *, std::string>, Program> programs;
+  Cache_Stats stats;
+};
+
+Program_Cache programCache;
+
+// Returns the Program of a PTX entry point, created on its first use. Only
+// for programs whose variables are set on the objects using them, as the
+// same Program is shared by all of them.
+Program getProgram(const char file[], const std::string &name,
+                   Context &g_context) {
+  std::pair<const char *, std::string> key(file, name);
+  std::map<std::pair<const char *, std::string>, Program>::iterator it =
+      programCache.programs.find(key);
+
+  if (it != programCache.programs.end()) {
+    programCache.stats.hits++;
+    return it->second;
+  }
+
+  programCache.stats.misses++;
+  Program program = createProgram(file, name, g_context);
+  programCache.programs[key] = program;
+
+  return program;
+}
+
 float rnd() {
   static std::mt19937 gen(0);
   static std::uniform_real_distribution<float> dis(0.f, 1.f);
   return dis(gen);
 }
 
-struct Light_Sampler {
-  std::vector<Program> sample, pdf;
-  std::vector<float3> emissions;
-};
-
 // returns smallest integer not less than a scalar or each vector component
 float saturate(float x) { return ffmax(0.f, ffmin(1.f, x)); }
 
@@ -3,13 +3,11 @@
 
 #include "gui.hpp"
 
-// Save OptiX output buffer to .PNG file
-int Save_PNG(App_State &app, Buffer &buffer) {
+// Save accumulated colors to .PNG file
+int Save_PNG(App_State &app, const float4 *cols) {
   unsigned char *arr;
   arr = (unsigned char *)malloc(app.W * app.H * 3 * sizeof(unsigned char));
 
-  const float4 *cols = (const float4 *)buffer->map();
-
   for (int j = app.H - 1; j >= 0; j--)
     for (int i = 0; i < app.W; i++) {
       int index = app.W * j + i;
@@ -28,22 +26,26 @@ int Save_PNG(App_State &app, Buffer &buffer) {
       arr[pixel_index + 2] = (int)col.z;  // B
     }
 
-  buffer->unmap();
-
   // Save .PNG file
   app.fileName += ".png";
   const char *name = (char *)app.fileName.c_str();
   return stbi_write_png(name, app.W, app.H, 3, arr, 0);
 }
 
-// Save OptiX output buffer to .HDR file
-int Save_HDR(App_State &app, Buffer &buffer) {
+// Save OptiX output buffer to .PNG file
+int Save_PNG(App_State &app, Buffer &buffer) {
+  int result = Save_PNG(app, (const float4 *)buffer->map());
+  buffer->unmap();
+
+  return result;
+}
+
+// Save accumulated colors to .HDR file
+int Save_HDR(App_State &app, const float4 *cols) {
   float *arr;
   arr = (float *)malloc(app.W * app.H * 3 * sizeof(float));
 
-  const float4 *cols = (const float4 *)buffer->map();
-
-  for (int j = app.W - 1; j >= 0; j--)
+  for (int j = app.H - 1; j >= 0; j--)
     for (int i = 0; i < app.W; i++) {
       int index = app.W * j + i;
       int pixel_index = 3 * (app.W * j + i);
@@ -62,8 +64,6 @@ int Save_HDR(App_State &app, Buffer &buffer) {
       arr[pixel_index + 2] = col.z;  // B
     }
 
-  buffer->unmap();
-
   // Save .HDR file
   app.fileName += ".hdr";
   const char *name = (char *)app.fileName.c_str();
@@ -72,4 +72,12 @@ int Save_HDR(App_State &app, Buffer &buffer) {
   return 0;
 }
 
+// Save OptiX output buffer to .HDR file
+int Save_HDR(App_State &app, Buffer &buffer) {
+  int result = Save_HDR(app, (const float4 *)buffer->map());
+  buffer->unmap();
+
+  return result;
+}
+
 #endif
\ No newline at end of file
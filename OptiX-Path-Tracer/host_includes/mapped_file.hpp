@@ -0,0 +1,109 @@
+#ifndef MAPPEDFILEH
+#define MAPPEDFILEH
+
+// mapped_file.hpp: Define read only memory mapped files and the hash used to
+// key caches by file contents
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read only view of a whole file
+class Mapped_File {
+ public:
+  Mapped_File() : data(nullptr), size(0) {}
+  ~Mapped_File() { close(); }
+
+  // Maps the file, returns false if it doesn't exist or is empty
+  bool open(const std::string &path) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+      mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) return false;
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (view == NULL) return false;
+
+    data = (const char *)view;
+    size = (size_t)fileSize.QuadPart;
+#else
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) return false;
+
+    struct stat info;
+    void *view = MAP_FAILED;
+    if (fstat(file, &info) == 0 && info.st_size > 0)
+      view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if (view == MAP_FAILED) return false;
+
+    data = (const char *)view;
+    size = (size_t)info.st_size;
+#endif
+
+    return true;
+  }
+
+  void close() {
+    if (data == nullptr) return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+
+    data = nullptr;
+    size = 0;
+  }
+
+  const char *data;
+  size_t size;
+
+ private:
+  Mapped_File(const Mapped_File &);
+  Mapped_File &operator=(const Mapped_File &);
+};
+
+// Initial value of hashBytes, the FNV-1a offset basis
+const uint64_t HASH_SEED = 14695981039346656037ull;
+
+// 64-bit FNV-1a over 8 byte words, used to key caches by file contents. Not
+// cryptographic, it only has to tell edited or different files apart.
+uint64_t hashBytes(const char *data, size_t size, uint64_t hash) {
+  const uint64_t prime = 1099511628211ull;
+  size_t words = size / 8;
+
+  for (size_t i = 0; i < words; i++) {
+    uint64_t word;
+    memcpy(&word, data + 8 * i, 8);
+    hash = (hash ^ word) * prime;
+  }
+
+  for (size_t i = 8 * words; i < size; i++)
+    hash = (hash ^ (unsigned char)data[i]) * prime;
+
+  return hash;
+}
+
+#endif
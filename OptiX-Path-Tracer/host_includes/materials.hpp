@@ -34,24 +34,96 @@ struct BRDF {
     Material mat = g_context->createMaterial();
     mat->setClosestHitProgram(0, closest);
     mat->setAnyHitProgram(1, any);
+    mat["is_light"]->setInt(false);
 
     return mat;
   }
+
+  // Returns the device material of the BRDF, assigned on its first use and
+  // shared by every primitive using the BRDF. The hit programs come from the
+  // Program cache, and the BRDF's variables and textures are set on the
+  // Material itself, so every use sees the same ones.
+  Material getMaterial(Context &g_context) const;
+
+  virtual int assignTo(CPU_Scene &scene) const = 0;
+
+  // Appends a material to the CPU scene and returns its index
+  static int createMaterial(CPU_Material_Type type,  // closest hit type
+                            CPU_Scene &scene,        // CPU scene
+                            int tex0 = -1, int tex1 = -1,  // textures
+                            float param0 = 0.f, float param1 = 0.f,
+                            bool flag = false) {
+    CPU_Material mat;
+    mat.type = type;
+    mat.textures[0] = tex0;
+    mat.textures[1] = tex1;
+    mat.params[0] = param0;
+    mat.params[1] = param1;
+    mat.flag = flag;
+
+    scene.materials.push_back(mat);
+    return (int)scene.materials.size() - 1;
+  }
 };
 
+// Device materials of the BRDFs assigned so far
+struct Material_Cache {
+  std::map<const BRDF *, Material> materials;
+  Cache_Stats stats;
+};
+
+Material_Cache materialCache;
+
+Material BRDF::getMaterial(Context &g_context) const {
+  std::map<const BRDF *, Material>::iterator it =
+      materialCache.materials.find(this);
+
+  if (it != materialCache.materials.end()) {
+    materialCache.stats.hits++;
+    return it->second;
+  }
+
+  materialCache.stats.misses++;
+  Material mat = assignTo(g_context);
+  materialCache.materials[this] = mat;
+
+  return mat;
+}
+
+// Forgets the Programs, Materials and texture table of the previous context,
+// called whenever a new context is created
+void clearDeviceCaches() {
+  programCache = Program_Cache();
+  materialCache = Material_Cache();
+  textureTable = Texture_Table();
+}
+
+// Reports the counters of the Program and Material caches
+void printCacheStats() {
+  printf("Program cache: %d hits, %d misses. ", programCache.stats.hits,
+         programCache.stats.misses);
+  printf("Material cache: %d hits, %d misses.\n", materialCache.stats.hits,
+         materialCache.stats.misses);
+}
+
 // Create Lambertian material
 struct Lambertian : public BRDF {
   Lambertian(const Texture *t) : texture(t) {}
 
   // Assign host side Lambertian material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables and textures
-    Program hit = createProgram(Lambertian_PTX, "closest_hit", g_context);
-    hit["sample_texture"]->setProgramId(texture->assignTo(g_context));
+    Program hit = getProgram(Lambertian_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
+    mat["sample_texture"]->setInt(texture->assignTo(g_context));
 
-    return createMaterial(hit, any, g_context);
+    return mat;
+  }
+
+  // Assign host side Lambertian material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return createMaterial(LAMBERTIAN_MATERIAL, scene, texture->assignTo(scene));
   }
 
   const Texture *texture;
@@ -63,14 +135,20 @@ struct Metal : public BRDF {
 
   // Assign host side Metal material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables and textures
-    Program hit = createProgram(Metal_PTX, "closest_hit", g_context);
-    hit["sample_texture"]->setProgramId(texture->assignTo(g_context));
-    hit["fuzz"]->setFloat(fuzz);
+    Program hit = getProgram(Metal_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
+    mat["sample_texture"]->setInt(texture->assignTo(g_context));
+    mat["fuzz"]->setFloat(fuzz);
 
-    return createMaterial(hit, any, g_context);
+    return mat;
+  }
+
+  // Assign host side Metal material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return createMaterial(METAL_MATERIAL, scene, texture->assignTo(scene), -1,
+                          fuzz);
   }
 
   const Texture *texture;
@@ -85,16 +163,24 @@ struct Dielectric : public BRDF {
 
   // Assign host side Dielectric material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables and textures
-    Program hit = createProgram(Dielectric_PTX, "closest_hit", g_context);
-    hit["base_texture"]->setProgramId(baseTex->assignTo(g_context));
-    hit["extinction_texture"]->setProgramId(extTex->assignTo(g_context));
-    hit["ref_idx"]->setFloat(ref_idx);
-    hit["density"]->setFloat(density);
+    Program hit = getProgram(Dielectric_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
+
+    mat["base_texture"]->setInt(baseTex->assignTo(g_context));
+    mat["extinction_texture"]->setInt(extTex->assignTo(g_context));
+    mat["ref_idx"]->setFloat(ref_idx);
+    mat["density"]->setFloat(density);
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
+    return mat;
+  }
 
-    return createMaterial(hit, any, g_context);
+  // Assign host side Dielectric material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    int base = baseTex->assignTo(scene);
+    int ext = extTex->assignTo(scene);
+    return createMaterial(DIELECTRIC_MATERIAL, scene, base, ext, ref_idx,
+                          density);
   }
 
   const Texture *baseTex, *extTex;
@@ -108,14 +194,20 @@ struct Diffuse_Light : public BRDF {
 
   // Assign host side Diffuse Light material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables and textures
-    Program hit = createProgram(Light_PTX, "closest_hit", g_context);
-    hit["sample_texture"]->setProgramId(texture->assignTo(g_context));
+    Program hit = getProgram(Light_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
-    any["is_light"]->setInt(true);
+    mat["sample_texture"]->setInt(texture->assignTo(g_context));
+    mat["is_light"]->setInt(true);
 
-    return createMaterial(hit, any, g_context);
+    return mat;
+  }
+
+  // Assign host side Diffuse Light material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return createMaterial(DIFFUSE_LIGHT_MATERIAL, scene,
+                          texture->assignTo(scene), -1, 0.f, 0.f, true);
   }
 
   const Texture *texture;
@@ -127,13 +219,18 @@ struct Isotropic : public BRDF {
 
   // Assign host side Isotropic material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables and textures
-    Program hit = createProgram(Isotropic_PTX, "closest_hit", g_context);
-    hit["sample_texture"]->setProgramId(texture->assignTo(g_context));
+    Program hit = getProgram(Isotropic_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
+    mat["sample_texture"]->setInt(texture->assignTo(g_context));
 
-    return createMaterial(hit, any, g_context);
+    return mat;
+  }
+
+  // Assign host side Isotropic material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return createMaterial(ISOTROPIC_MATERIAL, scene, texture->assignTo(scene));
   }
 
   const Texture *texture;
@@ -146,13 +243,19 @@ struct Normal_Shader : public BRDF {
 
   // Assign host side Normal Shader material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables
-    Program hit = createProgram(Normal_PTX, "closest_hit", g_context);
-    hit["useShadingNormal"]->setInt(useShadingNormal);
+    Program hit = getProgram(Normal_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
+
+    mat["useShadingNormal"]->setInt(useShadingNormal);
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
+    return mat;
+  }
 
-    return createMaterial(hit, any, g_context);
+  // Assign host side Normal Shader material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return createMaterial(NORMAL_MATERIAL, scene, -1, -1, 0.f, 0.f,
+                          useShadingNormal);
   }
 
   const bool useShadingNormal;
@@ -166,16 +269,24 @@ struct Ashikhmin_Shirley : public BRDF {
 
   // Assign host side Anisotropic material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables and textures
-    Program hit = createProgram(Ashikhmin_PTX, "closest_hit", g_context);
-    hit["diffuse_color"]->setProgramId(diffuse_tex->assignTo(g_context));
-    hit["specular_color"]->setProgramId(specular_tex->assignTo(g_context));
-    hit["nu"]->setFloat(fmaxf(1.f, nu));
-    hit["nv"]->setFloat(fmaxf(1.f, nv));
+    Program hit = getProgram(Ashikhmin_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
+    mat["diffuse_color"]->setInt(diffuse_tex->assignTo(g_context));
+    mat["specular_color"]->setInt(specular_tex->assignTo(g_context));
+    mat["nu"]->setFloat(fmaxf(1.f, nu));
+    mat["nv"]->setFloat(fmaxf(1.f, nv));
 
-    return createMaterial(hit, any, g_context);
+    return mat;
+  }
+
+  // Assign host side Anisotropic material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    int diffuse = diffuse_tex->assignTo(scene);
+    int specular = specular_tex->assignTo(scene);
+    return createMaterial(ASHIKHMIN_MATERIAL, scene, diffuse, specular,
+                          fmaxf(1.f, nu), fmaxf(1.f, nv));
   }
 
   float roughnessToAlpha(float roughness) const {
@@ -199,15 +310,21 @@ struct Oren_Nayar : public BRDF {
 
   // Assign host side Oren-Nayar material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables and textures
-    Program hit = createProgram(Oren_Nayar_PTX, "closest_hit", g_context);
-    hit["sample_texture"]->setProgramId(texture->assignTo(g_context));
-    hit["rA"]->setFloat(rA);
-    hit["rB"]->setFloat(rB);
+    Program hit = getProgram(Oren_Nayar_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
+    mat["sample_texture"]->setInt(texture->assignTo(g_context));
+    mat["rA"]->setFloat(rA);
+    mat["rB"]->setFloat(rB);
 
-    return createMaterial(hit, any, g_context);
+    return mat;
+  }
+
+  // Assign host side Oren-Nayar material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return createMaterial(OREN_NAYAR_MATERIAL, scene, texture->assignTo(scene),
+                          -1, rA, rB);
   }
 
   const Texture *texture;
@@ -221,15 +338,21 @@ struct Torrance_Sparrow : public BRDF {
 
   // Assign host side Torrance-Sparrow material to device Material object
   virtual Material assignTo(Context &g_context) const override {
-    // Creates closest hit programs and assigns variables and textures
-    Program hit = createProgram(Torrance_PTX, "closest_hit", g_context);
-    hit["sample_texture"]->setProgramId(texture->assignTo(g_context));
-    hit["nu"]->setFloat(roughnessToAlpha(nu));
-    hit["nv"]->setFloat(roughnessToAlpha(nv));
+    Program hit = getProgram(Torrance_PTX, "closest_hit", g_context);
+    Program any = getProgram(Hit_PTX, "any_hit", g_context);
+    Material mat = createMaterial(hit, any, g_context);
+
+    mat["sample_texture"]->setInt(texture->assignTo(g_context));
+    mat["nu"]->setFloat(roughnessToAlpha(nu));
+    mat["nv"]->setFloat(roughnessToAlpha(nv));
 
-    Program any = createProgram(Hit_PTX, "any_hit", g_context);
+    return mat;
+  }
 
-    return createMaterial(hit, any, g_context);
+  // Assign host side Torrance-Sparrow material to the CPU scene
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return createMaterial(TORRANCE_MATERIAL, scene, texture->assignTo(scene),
+                          -1, roughnessToAlpha(nu), roughnessToAlpha(nv));
   }
 
   float roughnessToAlpha(float roughness) const {
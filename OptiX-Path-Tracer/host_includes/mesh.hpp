@@ -2,9 +2,14 @@
 #define MESHH
 
 #include "hitables.hpp"
+#include "mesh_attributes.hpp"
+#include "mesh_cache.hpp"
+#include "mesh_weld.hpp"
+#include "obj_parser.hpp"
 
 #include "../lib/tiny_obj_loader.h"
 
+#include <chrono>
 #include <map>
 
 extern "C" const char Mesh_PTX[];
@@ -24,18 +29,27 @@ class Mesh {
       : fileName(fileName),
         assetsFolder(""),
         givenMaterial(nullptr),
+        splitBudget(0.f),
+        attributes(FULL_ATTRIBUTES),
+        pool(nullptr),
         RTX_MODE(RTX) {}
 
   Mesh(std::string fileName, std::string assetsFolder, bool RTX)
       : fileName(fileName),
         assetsFolder(assetsFolder),
         givenMaterial(nullptr),
+        splitBudget(0.f),
+        attributes(FULL_ATTRIBUTES),
+        pool(nullptr),
         RTX_MODE(RTX) {}
 
   Mesh(std::string fileName, BRDF *givenMaterial, bool RTX)
       : fileName(fileName),
         assetsFolder(""),
         givenMaterial(givenMaterial),
+        splitBudget(0.f),
+        attributes(FULL_ATTRIBUTES),
+        pool(nullptr),
         RTX_MODE(RTX) {}
 
   Mesh(std::string fileName, std::string assetsFolder, BRDF *givenMaterial,
@@ -43,123 +57,62 @@ class Mesh {
       : fileName(fileName),
         assetsFolder(assetsFolder),
         givenMaterial(givenMaterial),
+        splitBudget(0.f),
+        attributes(FULL_ATTRIBUTES),
+        pool(nullptr),
         RTX_MODE(RTX) {}
 
   // Get GeometryInstance of Mesh
   GeometryInstance getGeometryInstance(Context &g_context) {
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string warn;
-    std::string err;
-
-    // load obj & mtl files
-    bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
-                                (assetsFolder + fileName).c_str(),
-                                assetsFolder.c_str(), true);
-
-    // Check if there was a warning while reading the file
-    if (!warn.empty()) std::cout << "WARN: " << warn << std::endl;
-
-    // Check if there was an error while reading the file
-    if (!err.empty()) std::cerr << "ERR: " << err << std::endl;
-
-    // If file wasn't read successfully, close
-    if (!ret) {
-      printf("Failed to load/parse .obj.");
-      system("PAUSE");
-      exit(0);
-    }
-
-    // Convert Materials from MTL file
-    std::map<std::string, int> material_map;  // [Name, index] map
-    BRDF *host_material;
-    if (givenMaterial == nullptr) {
-      Texture_List textures;
-
-      // for each material in the MTL file
-      for (int m = 0; m < materials.size(); m++) {
-        tinyobj::material_t *mp = &materials[m];
-
-        // Create Texture from image file or color value
-        Texture *tex;
-        if (mp->diffuse_texname.length() > 0)
-          tex = new Image_Texture(assetsFolder + mp->diffuse_texname);
-        else
-          tex = new Constant_Texture(mp->ambient[0],   // R
-                                     mp->ambient[1],   // G
-                                     mp->ambient[2]);  // B
-
-        // Assign texture index to the Material's name
-        material_map[mp->name] = textures.push(tex);
-      }
-
-      // Create a vector of textures
-      host_material = new Lambertian(new Vector_Texture(textures.texList));
-    } else {
-      // Use given material object
-      host_material = givenMaterial;
-    }
-
-    // Convert Geoemtry
-    std::vector<int> mat_vector;             // material index vector
-    std::vector<uint3> i_vector;             // face index vector
-    std::vector<float2> t_vector;            // texcoord vector
-    std::vector<float3> v_vector, n_vector;  // vertex and normal vector
-
-    int index = 0, n_faces = 0;
-    std::vector<tinyobj::shape_t>::const_iterator it;
-    for (it = shapes.begin(); it < shapes.end(); ++it) {
-      const tinyobj::shape_t &shape = *it;
-
-      // for each face of the current mesh
-      for (size_t f = 0; f < shape.mesh.indices.size() / 3; f++) {
-        // Get the three indexes of the face (all faces are triangular)
-        tinyobj::index_t idx0 = shape.mesh.indices[3 * f + 0];
-        tinyobj::index_t idx1 = shape.mesh.indices[3 * f + 1];
-        tinyobj::index_t idx2 = shape.mesh.indices[3 * f + 2];
-
-        // get the vertex coordinates
-        make_Vertex3(v_vector, attrib.vertices, idx0.vertex_index);
-        make_Vertex3(v_vector, attrib.vertices, idx1.vertex_index);
-        make_Vertex3(v_vector, attrib.vertices, idx2.vertex_index);
-
-        // get the normal coordinates
-        make_Vertex3(n_vector, attrib.normals, idx0.normal_index);
-        make_Vertex3(n_vector, attrib.normals, idx1.normal_index);
-        make_Vertex3(n_vector, attrib.normals, idx2.normal_index);
-
-        // get the vertex tex coordinates
-        make_Vertex2(t_vector, attrib.texcoords, idx0.texcoord_index);
-        make_Vertex2(t_vector, attrib.texcoords, idx1.texcoord_index);
-        make_Vertex2(t_vector, attrib.texcoords, idx2.texcoord_index);
-
-        // set index vector
-        i_vector.push_back(make_uint3(index++, index++, index++));
-
-        // set material index vector
-        if (givenMaterial == nullptr) {
-          int m = material_map[materials[shape.mesh.material_ids[f]].name];
-          mat_vector.push_back(m);
-        } else
-          mat_vector.push_back(0);  // uses the material given as parameter
-
-        n_faces++;
-      }
-    }
+    // parse files or map the mesh cache
+    Mesh_Data mesh;
+    loadMesh(mesh);
+    BRDF *host_material = createMaterial(mesh);
+
+    // RTX mode geometry triangles need float positions
+    Packed_Attributes packed;
+    if (RTX_MODE && attributes == COMPACT_POSITIONS)
+      packAttributes(mesh, COMPACT_ATTRIBUTES, packed, *pool);
+    else
+      packAttributes(mesh, attributes, packed, *pool);
 
     // create GeometryInstance
     GeometryInstance gi = g_context->createGeometryInstance();
 
     // Create Geometry parameters callable program
-    Program prog = createProgram(Triangle_PTX, "Get_HitRecord", g_context);
-
-    // create and set buffers
-    Buffer v_buffer = createBuffer(v_vector, g_context);
-    Buffer n_buffer = createBuffer(n_vector, g_context);
-    Buffer t_buffer = createBuffer(t_vector, g_context);
-    Buffer i_buffer = createBuffer(i_vector, g_context);
-    Buffer m_buffer = createBuffer(mat_vector, g_context);
+    Program prog = getProgram(Triangle_PTX, "Get_HitRecord", g_context);
+
+    // create and set buffers, straight from the mapped cache if there is
+    // one, and left empty for the attributes that were packed
+    Buffer v_buffer = createBuffer(
+        mesh.vertices, packed.vertices.empty() ? mesh.numVertices : 0,
+        RT_FORMAT_FLOAT3, g_context);
+    Buffer n_buffer = createBuffer(
+        mesh.normals, packed.normals.empty() ? mesh.numNormals : 0,
+        RT_FORMAT_FLOAT3, g_context);
+    Buffer t_buffer = createBuffer(
+        mesh.texcoords, packed.texcoords.empty() ? mesh.numTexcoords : 0,
+        RT_FORMAT_FLOAT2, g_context);
+    Buffer pv_buffer =
+        createBuffer(packed.vertices.data(), (int)packed.vertices.size(),
+                     RT_FORMAT_UNSIGNED_SHORT4, g_context);
+    Buffer pn_buffer =
+        createBuffer(packed.normals.data(), (int)packed.normals.size(),
+                     RT_FORMAT_UNSIGNED_INT, g_context);
+    Buffer pt_buffer =
+        createBuffer(packed.texcoords.data(), (int)packed.texcoords.size(),
+                     RT_FORMAT_UNSIGNED_INT, g_context);
+    Buffer i_buffer = createBuffer(mesh.indices, mesh.numFaces,
+                                   RT_FORMAT_UNSIGNED_INT3, g_context);
+    Buffer m_buffer;
+    if (givenMaterial == nullptr)
+      m_buffer = createBuffer(mesh.materialIndices, mesh.numFaces,
+                              RT_FORMAT_INT, g_context);
+    else {
+      // uses the material given as parameter
+      std::vector<int> mat_vector(mesh.numFaces, 0);
+      m_buffer = createBuffer(mat_vector, g_context);
+    }
 
     // assign programs and paramters to GeometryInstance
     gi["vertex_buffer"]->setBuffer(v_buffer);
@@ -167,34 +120,39 @@ class Mesh {
     gi["texcoord_buffer"]->setBuffer(t_buffer);
     gi["index_buffer"]->setBuffer(i_buffer);
     gi["material_buffer"]->setBuffer(m_buffer);
+    gi["packed_vertex_buffer"]->setBuffer(pv_buffer);
+    gi["packed_normal_buffer"]->setBuffer(pn_buffer);
+    gi["packed_texcoord_buffer"]->setBuffer(pt_buffer);
+    gi["vertex_origin"]->setFloat(packed.origin);
+    gi["vertex_scale"]->setFloat(packed.scale);
     gi["Get_HitRecord"]->set(prog);
 
     // set material
     gi->setMaterialCount(1);
-    gi->setMaterial(0, host_material->assignTo(g_context));
+    gi->setMaterial(0, host_material->getMaterial(g_context));
 
     if (RTX_MODE) {
       // Create a GeometryTriangles object
       GeometryTriangles geometry = g_context->createGeometryTriangles();
-      geometry->setPrimitiveCount((int)i_vector.size());
+      geometry->setPrimitiveCount(mesh.numFaces);
       geometry->setTriangleIndices(i_buffer, RT_FORMAT_UNSIGNED_INT3);
-      geometry->setVertices((int)v_vector.size(), v_buffer, RT_FORMAT_FLOAT3);
+      geometry->setVertices(mesh.numVertices, v_buffer, RT_FORMAT_FLOAT3);
       geometry->setBuildFlags(RTgeometrybuildflags(0));
 
       // Set attribute program
-      Program att = createProgram(Triangle_PTX, "Attributes", g_context);
+      Program att = getProgram(Triangle_PTX, "Attributes", g_context);
       geometry->setAttributeProgram(att);
 
       gi->setGeometryTriangles(geometry);
     } else {
       // Create a Geometry object
       Geometry geometry = g_context->createGeometry();
-      geometry->setPrimitiveCount(n_faces);
+      geometry->setPrimitiveCount(mesh.numFaces);
 
       // Set intersection and bounding box programs
-      Program bound = createProgram(Triangle_PTX, "Get_Bounds", g_context);
+      Program bound = getProgram(Triangle_PTX, "Get_Bounds", g_context);
       geometry->setBoundingBoxProgram(bound);
-      Program inter = createProgram(Triangle_PTX, "Intersect", g_context);
+      Program inter = getProgram(Triangle_PTX, "Intersect", g_context);
       geometry->setIntersectionProgram(inter);
 
       gi->setGeometry(geometry);
@@ -233,39 +191,218 @@ class Mesh {
     arr.push_back(param);
   }
 
+  // Builds the mesh BVH with spatial splits, for meshes with long, thin
+  // triangles. 'budget' limits the extra triangle references, relative to the
+  // triangle count.
+  void useSpatialSplits(float budget = SBVH_DEFAULT_BUDGET) {
+    splitBudget = budget;
+  }
+
+  // Stores the vertex attributes in the given format, see
+  // vertex_attributes.hpp. RTX mode keeps float positions.
+  void setAttributes(Mesh_Attributes format) { attributes = format; }
+
+  // Sets the workers parsing and converting the OBJ file, needed before the
+  // mesh is added to a scene
+  void setThreadPool(Thread_Pool *workers) { pool = workers; }
+
   // Adds Hitable to the scene graph
   void addTo(Group &d_world, Context &g_context) {
-    // reverse vector of transforms
-    std::reverse(arr.begin(), arr.end());
+    // the last transform applied is the outermost one
+    std::vector<TransformParameter> params(arr.rbegin(), arr.rend());
     GeometryInstance gi = getGeometryInstance(g_context);
-    addAndTransform(gi, d_world, g_context, arr);
+
+    // OptiX has its own spatial split builder, but RTX mode geometry
+    // triangles always use the built-in BVH. It can't read compact positions,
+    // it splits the bounding boxes of the triangles then.
+    if (splitBudget > 0.f && !RTX_MODE) {
+      Acceleration acceleration = g_context->createAcceleration("Sbvh");
+      if (attributes != COMPACT_POSITIONS) {
+        acceleration->setProperty("vertex_buffer_name", "vertex_buffer");
+        acceleration->setProperty("index_buffer_name", "index_buffer");
+      }
+
+      GeometryGroup gg = g_context->createGeometryGroup();
+      gg->setAcceleration(acceleration);
+      gg->addChild(gi);
+      addAndTransform(gg, d_world, g_context, params);
+    } else
+      addAndTransform(gi, d_world, g_context, params);
+  }
+
+  // Adds Mesh to the CPU scene
+  void addTo(CPU_Scene &scene) {
+    Mesh_Data data;
+    loadMesh(data);
+
+    Packed_Attributes packed;
+    packAttributes(data, attributes, packed, *pool);
+
+    // same attributes as the device buffers, compact positions decoded
+    CPU_Mesh mesh;
+    if (packed.vertices.empty())
+      mesh.vertices.assign(data.vertices, data.vertices + data.numVertices);
+    else {
+      mesh.vertices.resize(data.numVertices);
+      for (int i = 0; i < data.numVertices; i++)
+        mesh.vertices[i] = Decode_Position(packed.vertices[i], packed.origin,
+                                           packed.scale);
+    }
+
+    if (packed.normals.empty())
+      mesh.normals.assign(data.normals, data.normals + data.numNormals);
+    else
+      mesh.packedNormals.swap(packed.normals);
+
+    if (packed.texcoords.empty())
+      mesh.texcoords.assign(data.texcoords,
+                            data.texcoords + data.numTexcoords);
+    else
+      mesh.packedTexcoords.swap(packed.texcoords);
+    mesh.indices.assign(data.indices, data.indices + data.numFaces);
+    if (givenMaterial == nullptr)
+      mesh.textureIndices.assign(data.materialIndices,
+                                 data.materialIndices + data.numFaces);
+    else
+      mesh.textureIndices.assign(data.numFaces, 0);
+
+    mesh.material = createMaterial(data)->assignTo(scene);
+    scene.meshes.push_back(std::move(mesh));
+
+    // same transform order as the scene graph above
+    std::vector<TransformParameter> params(arr.rbegin(), arr.rend());
+
+    CPU_Geometry geometry;
+    geometry.mesh = (int)scene.meshes.size() - 1;
+    geometry.splitBudget = splitBudget;
+    scene.addInstance(geometry, collapseTransforms(params));
   }
 
  private:
-  // Make a float3 vertex out of a vector and an index
-  void make_Vertex3(std::vector<float3> &vertex_list,
-                    std::vector<tinyobj::real_t> &attribs, int index) {
-    if (index >= 0) {
-      float x = attribs[3 * index + 0];
-      float y = attribs[3 * index + 1];
-      float z = attribs[3 * index + 2];
-      vertex_list.push_back(make_float3(x, y, z));
+  // Loads the converted mesh from its cache file, or parses the OBJ & MTL
+  // files and writes the cache for the next run
+  void loadMesh(Mesh_Data &mesh) {
+    auto t0 = std::chrono::system_clock::now();
+    std::string path = assetsFolder + fileName;
+    std::string cachePath = path + MESH_CACHE_EXTENSION;
+
+    uint64_t hash;
+    if (!hashOBJ(path, assetsFolder, hash)) {
+      printf("Failed to open .obj file '%s'.\n", path.c_str());
+      Exit_Program(EXIT_FAILURE);
+    }
+
+    if (loadMeshCache(cachePath, hash, mesh)) {
+      auto t1 = std::chrono::system_clock::now();
+      float loadTime = std::chrono::duration<float>(t1 - t0).count();
+      printf("Loaded '%s' from its cache in %.3f seconds, parsing took %.3f "
+             "seconds.\n",
+             fileName.c_str(), loadTime, mesh.parseTime);
+      return;
     }
+
+    int corners = parseOBJ(mesh);
+    mesh.useVectors();
+
+    auto t1 = std::chrono::system_clock::now();
+    mesh.parseTime = std::chrono::duration<float>(t1 - t0).count();
+    printf("Parsed '%s' in %.3f seconds, welded %d face corners into %d "
+           "vertices.\n",
+           fileName.c_str(), mesh.parseTime, corners, mesh.numVertices);
+
+    if (!saveMeshCache(cachePath, hash, mesh))
+      printf("WARN: couldn't write mesh cache '%s'.\n", cachePath.c_str());
   }
 
-  // Make a float2 vertex out of a vector and an index
-  void make_Vertex2(std::vector<float2> &vertex_list,
-                    std::vector<tinyobj::real_t> &attribs, int index) {
-    if (index >= 0) {
-      float x = attribs[2 * index + 0];
-      float y = attribs[2 * index + 1];
-      vertex_list.push_back(make_float2(x, y));
+  // Creates the host material of the mesh, a vector of the MTL textures
+  // unless a material was given as parameter
+  BRDF *createMaterial(const Mesh_Data &mesh) {
+    if (givenMaterial != nullptr) return givenMaterial;
+
+    Texture_List textures;
+    for (int m = 0; m < (int)mesh.materials.size(); m++) {
+      const Mesh_Material &material = mesh.materials[m];
+
+      // Create Texture from image file or color value
+      if (material.texture.length() > 0)
+        textures.push(new Image_Texture(assetsFolder + material.texture));
+      else
+        textures.push(new Constant_Texture(material.color.x,    // R
+                                           material.color.y,    // G
+                                           material.color.z));  // B
     }
+
+    return new Lambertian(new Vector_Texture(textures.texList));
+  }
+
+  // Parse the OBJ & MTL files into the vectors used by the device buffers,
+  // returns the number of face corners
+  int parseOBJ(Mesh_Data &mesh) {
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string warn;
+    std::string err;
+
+    // load obj & mtl files, in parallel if possible
+    bool ret = loadOBJ(assetsFolder + fileName, assetsFolder, attrib, shapes,
+                       materials, warn, err, *pool);
+
+    // Check if there was a warning while reading the file
+    if (!warn.empty()) std::cout << "WARN: " << warn << std::endl;
+
+    // Check if there was an error while reading the file
+    if (!err.empty()) std::cerr << "ERR: " << err << std::endl;
+
+    // If file wasn't read successfully, close
+    if (!ret) {
+      printf("Failed to load/parse .obj.");
+      Exit_Program(EXIT_FAILURE);
+    }
+
+    // Convert Materials from MTL file, the cache keeps them even if a
+    // material is given as parameter
+    std::map<std::string, int> material_map;  // [Name, index] map
+    for (int m = 0; m < materials.size(); m++) {
+      tinyobj::material_t *mp = &materials[m];
+
+      // Diffuse image or ambient color
+      Mesh_Material material;
+      material.texture = mp->diffuse_texname;
+      material.color = make_float3(mp->ambient[0],   // R
+                                   mp->ambient[1],   // G
+                                   mp->ambient[2]);  // B
+
+      // Assign texture index to the Material's name
+      material_map[mp->name] = (int)mesh.materials.size();
+      mesh.materials.push_back(material);
+    }
+
+    // per face material index
+    std::vector<int> mat_vector;
+    for (int s = 0; s < (int)shapes.size(); s++) {
+      const tinyobj::shape_t &shape = shapes[s];
+
+      // faces without material use the first
+      for (size_t f = 0; f < shape.mesh.indices.size() / 3; f++) {
+        int id = shape.mesh.material_ids[f];
+        if (id >= 0 && id < (int)materials.size())
+          mat_vector.push_back(material_map[materials[id].name]);
+        else
+          mat_vector.push_back(0);
+      }
+    }
+
+    // Convert Geometry into shared vertices and a face index vector
+    return weldMesh(attrib, shapes, mat_vector, mesh, *pool);
   }
 
-  bool RTX_MODE;
-  BRDF *givenMaterial;
   const std::string fileName, assetsFolder;
+  BRDF *givenMaterial;
+  float splitBudget;  // SBVH reference budget, 0 if spatial splits are off
+  Mesh_Attributes attributes;  // vertex attribute storage
+  Thread_Pool *pool;           // loader workers, set by setThreadPool
+  bool RTX_MODE;
   std::vector<TransformParameter> arr;
 };
 
@@ -339,6 +476,11 @@ class Mesh_List {
       list[i]->addTo(d_world, g_context);
   }
 
+  // adds and transforms each list element to the CPU scene individually
+  void addElementsTo(CPU_Scene &scene) {
+    for (int i = 0; i < (int)list.size(); i++) list[i]->addTo(scene);
+  }
+
  private:
   std::vector<Mesh *> list;
   std::vector<TransformParameter> arr;
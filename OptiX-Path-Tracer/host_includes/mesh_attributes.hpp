@@ -0,0 +1,209 @@
+#ifndef MESHATTRIBUTESH
+#define MESHATTRIBUTESH
+
+// mesh_attributes.hpp: Define the packing of mesh vertex attributes into the
+// compact formats of vertex_attributes.hpp, and the check of their decoding
+// error
+
+#include "mesh_cache.hpp"
+#include "mesh_weld.hpp"
+#include "obj_parser.hpp"
+#include "cpu/thread_pool.hpp"
+
+#include "../programs/hitables/vertex_attributes.hpp"
+
+// Compact attributes of a mesh, the arrays of the attributes kept as floats
+// are empty
+struct Packed_Attributes {
+  Packed_Attributes() : origin(make_float3(0.f)), scale(make_float3(0.f)) {}
+
+  std::vector<ushort4> vertices;
+  std::vector<uint> normals, texcoords;
+  float3 origin, scale;  // position decoding, see Decode_Position
+};
+
+// Packs the attributes of 'mesh' that the format stores in compact form,
+// with the threads of 'pool'
+void packAttributes(const Mesh_Data &mesh, Mesh_Attributes format,
+                    Packed_Attributes &packed, Thread_Pool &pool) {
+  if (format == FULL_ATTRIBUTES) return;
+
+  if (format == COMPACT_POSITIONS && mesh.numVertices > 0) {
+    float3 lo = mesh.vertices[0], hi = mesh.vertices[0];
+    for (int i = 1; i < mesh.numVertices; i++) {
+      lo = fminf(lo, mesh.vertices[i]);
+      hi = fmaxf(hi, mesh.vertices[i]);
+    }
+
+    packed.origin = lo;
+    packed.scale = (hi - lo) / 65535.f;
+    packed.vertices.resize(mesh.numVertices);
+  }
+
+  packed.normals.resize(mesh.numNormals);
+  packed.texcoords.resize(mesh.numTexcoords);
+
+  pool.parallel_blocks(mesh.numVertices, 4096, [&](int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      if (!packed.vertices.empty())
+        packed.vertices[i] =
+            Encode_Position(mesh.vertices[i], packed.origin, packed.scale);
+
+      if (i < mesh.numNormals)
+        packed.normals[i] = Encode_Normal(mesh.normals[i]);
+
+      if (i < mesh.numTexcoords)
+        packed.texcoords[i] = Encode_Texcoord(mesh.texcoords[i]);
+    }
+  });
+}
+
+// Bounds of the decoding errors of the compact formats: normals within two
+// steps of the octahedral grid, since the closest grid point can be a cell
+// diagonal away, texcoords within half a unit in the last place of a half
+// float, and positions within half a quantization step per axis
+#define NORMAL_ERROR_BOUND (2.f / 32767.f)   // radians
+#define TEXCOORD_ERROR_BOUND (1.f / 2048.f)  // relative to the texcoord
+#define POSITION_ERROR_BOUND 0.5f            // quantization steps
+
+// Ratio of an error to its bound, over 1 if the bound is exceeded
+float errorRatio(float error, float bound) {
+  if (bound > 0.f) return error / bound;
+  return error > 0.f ? FLT_MAX : 0.f;
+}
+
+// Largest decoding error of each packed attribute, and the largest ratio of
+// an error to its bound
+struct Attribute_Errors {
+  Attribute_Errors()
+      : normal(0.f),
+        texcoord(0.f),
+        position(0.f),
+        normalRatio(0.f),
+        texcoordRatio(0.f),
+        positionRatio(0.f) {}
+
+  float normal;    // angle in radians
+  float texcoord;  // distance along an axis
+  float position;  // distance relative to the diagonal of the mesh bounds
+  float normalRatio, texcoordRatio, positionRatio;
+};
+
+Attribute_Errors measureAttributes(const Mesh_Data &mesh,
+                                   const Packed_Attributes &packed) {
+  Attribute_Errors errors;
+
+  for (int i = 0; i < (int)packed.normals.size(); i++) {
+    float3 n = mesh.normals[i];
+    if (isNull(n)) continue;
+    // acos loses the small angles to float rounding
+    float3 d = Decode_Normal(packed.normals[i]), u = n / length(n);
+    float angle = atan2f(length(cross(d, u)), dot(d, u));
+
+    errors.normal = fmaxf(errors.normal, angle);
+    errors.normalRatio = fmaxf(errors.normalRatio,
+                               errorRatio(angle, NORMAL_ERROR_BOUND));
+  }
+
+  for (int i = 0; i < (int)packed.texcoords.size(); i++) {
+    float2 t = mesh.texcoords[i];
+    float2 d = Decode_Texcoord(packed.texcoords[i]) - t;
+    float e[2] = {fabsf(d.x), fabsf(d.y)}, c[2] = {fabsf(t.x), fabsf(t.y)};
+
+    for (int k = 0; k < 2; k++) {
+      // half float denormals are 2^-24 apart
+      float bound = fmaxf(c[k] * TEXCOORD_ERROR_BOUND, 1.f / 33554432.f);
+      // infinities, of texcoords out of the half float range, fail too
+      float ratio = e[k] == e[k] && e[k] <= FLT_MAX ? errorRatio(e[k], bound)
+                                                    : FLT_MAX;
+
+      errors.texcoord = fmaxf(errors.texcoord, e[k]);
+      errors.texcoordRatio = fmaxf(errors.texcoordRatio, ratio);
+    }
+  }
+
+  const float3 &scale = packed.scale, &origin = packed.origin;
+  for (int i = 0; i < (int)packed.vertices.size(); i++) {
+    float3 p = mesh.vertices[i];
+    float3 d = abs(Decode_Position(packed.vertices[i], origin, scale) - p);
+    // the decoder rounds the float sum too
+    float3 slack = 2.f * FLT_EPSILON * fmaxf(abs(origin), abs(p));
+    float3 bound = POSITION_ERROR_BOUND * scale + slack;
+
+    errors.position = fmaxf(errors.position, length(d));
+    errors.positionRatio =
+        fmaxf(errors.positionRatio,
+              fmaxf(errorRatio(d.x, bound.x),
+                    fmaxf(errorRatio(d.y, bound.y), errorRatio(d.z, bound.z))));
+  }
+
+  float diagonal = length(scale) * 65535.f;
+  if (diagonal > 0.f) errors.position /= diagonal;
+
+  return errors;
+}
+
+// Parses an OBJ file, packs all its attributes and checks their decoding
+// errors against the bounds of the compact formats. Prints the attribute
+// memory and the largest errors, returns false if any bound is exceeded.
+bool checkAttributes(const std::string &path, Thread_Pool &pool) {
+  size_t slash = path.find_last_of("/\\");
+  std::string folder = slash == std::string::npos ? "" : path.substr(0, slash);
+
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string warn, err;
+  if (!loadOBJ(path, folder, attrib, shapes, materials, warn, err, pool)) {
+    printf("Failed to load/parse '%s'.\n", path.c_str());
+    return false;
+  }
+
+  size_t numFaces = 0;
+  for (int s = 0; s < (int)shapes.size(); s++)
+    numFaces += shapes[s].mesh.indices.size() / 3;
+
+  Mesh_Data mesh;
+  weldMesh(attrib, shapes, std::vector<int>(numFaces, 0), mesh, pool);
+  mesh.useVectors();
+
+  Packed_Attributes packed;
+  packAttributes(mesh, COMPACT_POSITIONS, packed, pool);
+  Attribute_Errors errors = measureAttributes(mesh, packed);
+
+  size_t before = mesh.numNormals * sizeof(float3) +
+                  mesh.numTexcoords * sizeof(float2) +
+                  mesh.numVertices * sizeof(float3);
+  size_t after = (packed.normals.size() + packed.texcoords.size()) *
+                     sizeof(uint) +
+                 packed.vertices.size() * sizeof(ushort4);
+  printf("Compact attributes of '%s': %d vertices, %.1f MB packed to %.1f "
+         "MB\n",
+         path.c_str(), mesh.numVertices, before / 1048576.f,
+         after / 1048576.f);
+
+  bool passed = true;
+  if (mesh.numNormals > 0) {
+    printf("Normals  : largest error %.4f degrees, %.2f of the bound, %s\n",
+           Degrees(errors.normal), errors.normalRatio,
+           errors.normalRatio <= 1.f ? "ok" : "FAILED");
+    passed = passed && errors.normalRatio <= 1.f;
+  }
+  if (mesh.numTexcoords > 0) {
+    printf("Texcoords: largest error %.2g, %.2f of the bound, %s\n",
+           errors.texcoord, errors.texcoordRatio,
+           errors.texcoordRatio <= 1.f ? "ok" : "FAILED");
+    passed = passed && errors.texcoordRatio <= 1.f;
+  }
+  if (mesh.numVertices > 0) {
+    printf("Positions: largest error %.2g of the bounds, %.2f of the bound, "
+           "%s\n",
+           errors.position, errors.positionRatio,
+           errors.positionRatio <= 1.f ? "ok" : "FAILED");
+    passed = passed && errors.positionRatio <= 1.f;
+  }
+
+  return passed;
+}
+
+#endif
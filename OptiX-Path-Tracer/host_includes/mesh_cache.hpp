@@ -0,0 +1,265 @@
+#ifndef MESHCACHEH
+#define MESHCACHEH
+
+// mesh_cache.hpp: Define the binary cache of converted OBJ meshes. The cache
+// is written next to the OBJ file and memory mapped on load, so its arrays
+// go straight into the device buffers.
+
+#include "host_common.hpp"
+#include "mapped_file.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// Bump it whenever the layout of the cache or the mesh conversion changes
+#define MESH_CACHE_VERSION 3
+
+// Extension appended to the OBJ file name
+#define MESH_CACHE_EXTENSION ".meshcache"
+
+// Hashes an OBJ file along with the MTL files it references, since the cache
+// also stores the converted materials. Returns false if the OBJ is missing.
+bool hashOBJ(const std::string &path, const std::string &assetsFolder,
+             uint64_t &hash) {
+  Mapped_File obj;
+  if (!obj.open(path)) return false;
+
+  hash = hashBytes(obj.data, obj.size, HASH_SEED);
+
+  // 'mtllib' statements may list several files
+  const char *end = obj.data + obj.size;
+  const std::string keyword = "mtllib";
+  const char *it = std::search(obj.data, end, keyword.begin(), keyword.end());
+  while (it != end) {
+    bool lineStart = (it == obj.data) || (it[-1] == '\n') || (it[-1] == '\r');
+    it += keyword.size();
+
+    while (lineStart && it < end && *it != '\n' && *it != '\r') {
+      while (it < end && (*it == ' ' || *it == '\t')) it++;
+
+      const char *name = it;
+      while (it < end && !isspace((unsigned char)*it)) it++;
+      if (it == name) break;
+
+      Mapped_File mtl;
+      if (mtl.open(assetsFolder + std::string(name, it)))
+        hash = hashBytes(mtl.data, mtl.size, hash);
+    }
+
+    it = std::search(it, end, keyword.begin(), keyword.end());
+  }
+
+  return true;
+}
+
+/////////////////
+// Cache files //
+/////////////////
+
+// MTL material converted to the texture it's rendered with
+struct Mesh_Material {
+  std::string texture;  // diffuse image, relative to the assets folder
+  float3 color;         // ambient color, used if there is no image
+};
+
+// Converted mesh arrays, either owned by the vectors below after parsing the
+// OBJ, or pointing into the mapped cache file
+struct Mesh_Data {
+  Mesh_Data()
+      : vertices(nullptr),
+        normals(nullptr),
+        texcoords(nullptr),
+        indices(nullptr),
+        materialIndices(nullptr),
+        numVertices(0),
+        numNormals(0),
+        numTexcoords(0),
+        numFaces(0),
+        parseTime(0.f) {}
+
+  // Points the arrays at the vectors filled by the parser
+  void useVectors() {
+    vertices = v_vector.data();
+    normals = n_vector.data();
+    texcoords = t_vector.data();
+    indices = i_vector.data();
+    materialIndices = mat_vector.data();
+    numVertices = (int)v_vector.size();
+    numNormals = (int)n_vector.size();
+    numTexcoords = (int)t_vector.size();
+    numFaces = (int)i_vector.size();
+  }
+
+  const float3 *vertices, *normals;
+  const float2 *texcoords;
+  const uint3 *indices;
+  const int *materialIndices;  // per face index in 'materials'
+  int numVertices, numNormals, numTexcoords, numFaces;
+
+  std::vector<Mesh_Material> materials;
+  float parseTime;  // seconds taken to parse the OBJ into these arrays
+
+  std::vector<float3> v_vector, n_vector;
+  std::vector<float2> t_vector;
+  std::vector<uint3> i_vector;
+  std::vector<int> mat_vector;
+  Mapped_File file;
+};
+
+// Header of a cache file, followed by the vertex, normal, texcoord, index and
+// material index arrays, each aligned to 16 bytes, and then by the materials
+struct Mesh_Cache_Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t numMaterials;
+  uint64_t hash;  // hash of the OBJ and MTL files
+  uint64_t numVertices, numNormals, numTexcoords, numFaces;
+  float parseTime;
+  uint32_t padding;
+};
+
+const char MESH_CACHE_MAGIC[8] = {'R', 'T', 'O', 'W', 'M', 'E', 'S', 'H'};
+
+// Byte offset of each cache section, and the total size of the arrays
+struct Mesh_Cache_Layout {
+  Mesh_Cache_Layout(const Mesh_Cache_Header &h) {
+    vertices = align(sizeof(Mesh_Cache_Header));
+    normals = align(vertices + h.numVertices * sizeof(float3));
+    texcoords = align(normals + h.numNormals * sizeof(float3));
+    indices = align(texcoords + h.numTexcoords * sizeof(float2));
+    materialIndices = align(indices + h.numFaces * sizeof(uint3));
+    materials = align(materialIndices + h.numFaces * sizeof(int));
+  }
+
+  static uint64_t align(uint64_t offset) { return (offset + 15) & ~15ull; }
+
+  uint64_t vertices, normals, texcoords, indices, materialIndices, materials;
+};
+
+// Maps a cache file, returns false if it's missing, from another version or
+// from other source files
+bool loadMeshCache(const std::string &path, uint64_t hash, Mesh_Data &mesh) {
+  if (!mesh.file.open(path)) return false;
+
+  const char *data = mesh.file.data;
+  size_t size = mesh.file.size;
+  Mesh_Cache_Header header;
+  if (size < sizeof(header)) return false;
+  memcpy(&header, data, sizeof(header));
+
+  if (memcmp(header.magic, MESH_CACHE_MAGIC, 8) != 0 ||
+      header.version != MESH_CACHE_VERSION || header.hash != hash) {
+    mesh.file.close();
+    return false;
+  }
+
+  Mesh_Cache_Layout layout(header);
+  if (layout.materials > size) {
+    mesh.file.close();
+    return false;
+  }
+
+  mesh.vertices = (const float3 *)(data + layout.vertices);
+  mesh.normals = (const float3 *)(data + layout.normals);
+  mesh.texcoords = (const float2 *)(data + layout.texcoords);
+  mesh.indices = (const uint3 *)(data + layout.indices);
+  mesh.materialIndices = (const int *)(data + layout.materialIndices);
+  mesh.numVertices = (int)header.numVertices;
+  mesh.numNormals = (int)header.numNormals;
+  mesh.numTexcoords = (int)header.numTexcoords;
+  mesh.numFaces = (int)header.numFaces;
+  mesh.parseTime = header.parseTime;
+
+  // materials: ambient color, texture name length and texture name
+  const char *it = data + layout.materials;
+  const char *end = data + size;
+  for (uint32_t m = 0; m < header.numMaterials; m++) {
+    Mesh_Material material;
+    uint32_t length;
+    if (it + sizeof(float3) + sizeof(length) > end) break;
+    memcpy(&material.color, it, sizeof(float3));
+    memcpy(&length, it + sizeof(float3), sizeof(length));
+    it += sizeof(float3) + sizeof(length);
+
+    if (it + length > end) break;
+    material.texture.assign(it, length);
+    it += length;
+
+    mesh.materials.push_back(material);
+  }
+
+  if (mesh.materials.size() != header.numMaterials) {
+    mesh.materials.clear();
+    mesh.file.close();
+    return false;
+  }
+
+  return true;
+}
+
+// Writes the arrays of a parsed mesh to a cache file, returns false on
+// failure, e.g. if the assets folder is read only
+bool saveMeshCache(const std::string &path, uint64_t hash,
+                   const Mesh_Data &mesh) {
+  Mesh_Cache_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MESH_CACHE_MAGIC, 8);
+  header.version = MESH_CACHE_VERSION;
+  header.numMaterials = (uint32_t)mesh.materials.size();
+  header.hash = hash;
+  header.numVertices = mesh.numVertices;
+  header.numNormals = mesh.numNormals;
+  header.numTexcoords = mesh.numTexcoords;
+  header.numFaces = mesh.numFaces;
+  header.parseTime = mesh.parseTime;
+
+  // write to a temporary file first, so a failed write never leaves a
+  // truncated cache behind
+  std::string temporary = path + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  Mesh_Cache_Layout layout(header);
+  bool ok = true;
+  uint64_t offset = 0;
+  const char zeros[16] = {};
+
+  // pads the file up to 'start' and writes 'bytes' there
+  auto section = [&](uint64_t start, const void *data, uint64_t bytes) {
+    if (ok && start > offset)
+      ok = fwrite(zeros, 1, (size_t)(start - offset), file) == start - offset;
+    if (ok && bytes > 0) ok = fwrite(data, 1, (size_t)bytes, file) == bytes;
+    offset = start + bytes;
+  };
+
+  section(0, &header, sizeof(header));
+  section(layout.vertices, mesh.vertices, header.numVertices * sizeof(float3));
+  section(layout.normals, mesh.normals, header.numNormals * sizeof(float3));
+  section(layout.texcoords, mesh.texcoords,
+          header.numTexcoords * sizeof(float2));
+  section(layout.indices, mesh.indices, header.numFaces * sizeof(uint3));
+  section(layout.materialIndices, mesh.materialIndices,
+          header.numFaces * sizeof(int));
+
+  for (int m = 0; m < (int)mesh.materials.size(); m++) {
+    const Mesh_Material &material = mesh.materials[m];
+    uint32_t length = (uint32_t)material.texture.size();
+    section(offset, &material.color, sizeof(float3));
+    section(offset, &length, sizeof(length));
+    section(offset, material.texture.data(), length);
+  }
+
+  ok = (fclose(file) == 0) && ok;
+
+  remove(path.c_str());
+  if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+    remove(temporary.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef MESHWELDH
+#define MESHWELDH
+
+// mesh_weld.hpp: Define the conversion of parsed OBJ shapes into indexed
+// vertex arrays, welding the face corners that share the same position,
+// normal and texcoord indices
+
+#include "mesh_cache.hpp"
+#include "cpu/thread_pool.hpp"
+
+#include "../lib/tiny_obj_loader.h"
+
+#include <unordered_map>
+
+// OBJ indices of a face corner, -1 for the attributes the mesh doesn't use
+struct Vertex_Key {
+  int v, n, t;
+
+  bool operator==(const Vertex_Key &other) const {
+    return v == other.v && n == other.n && t == other.t;
+  }
+};
+
+struct Vertex_Key_Hash {
+  size_t operator()(const Vertex_Key &key) const {
+    uint64_t hash = (uint64_t)(uint32_t)key.v * 0x9E3779B97F4A7C15ull;
+    hash ^= ((uint64_t)(uint32_t)key.n + (hash << 6) + (hash >> 2));
+    hash ^= ((uint64_t)(uint32_t)key.t * 0xC2B2AE3D27D4EB4Full);
+    return (size_t)(hash ^ (hash >> 29));
+  }
+};
+
+// Fills the vertex, normal, texcoord and index vectors of 'mesh' with one
+// vertex per distinct corner of the shapes. Corners are bucketed by position
+// index into one range per thread of 'pool', so each range is welded with its
+// own hash map, even for models made of a single shape, and corners of
+// different shapes sharing a vertex are still welded. Corners without a
+// normal or texcoord get the average normal of their faces and a zero
+// texcoord, if other corners have them. 'materialIndices' holds the material
+// index of every face, in shape order. Returns the number of corners.
+int weldMesh(const tinyobj::attrib_t &attrib,
+             const std::vector<tinyobj::shape_t> &shapes,
+             const std::vector<int> &materialIndices, Mesh_Data &mesh,
+             Thread_Pool &pool) {
+  // corners of every shape, in face order
+  std::vector<const tinyobj::index_t *> corners;
+  int numPositions = (int)attrib.vertices.size() / 3;
+  bool hasNormals = false, hasTexcoords = false;
+  bool missingNormals = false;
+  for (int s = 0; s < (int)shapes.size(); s++) {
+    const std::vector<tinyobj::index_t> &indices = shapes[s].mesh.indices;
+
+    for (int c = 0; c < (int)indices.size(); c++) {
+      corners.push_back(&indices[c]);
+      hasNormals = hasNormals || indices[c].normal_index >= 0;
+      hasTexcoords = hasTexcoords || indices[c].texcoord_index >= 0;
+      missingNormals = missingNormals || indices[c].normal_index < 0;
+    }
+  }
+  hasNormals = hasNormals && !attrib.normals.empty();
+  hasTexcoords = hasTexcoords && !attrib.texcoords.empty();
+
+  int numCorners = (int)corners.size();
+  int numRanges = std::max(std::min(pool.size(), numPositions), 1);
+  auto rangeOf = [&](int v) {
+    return (int)((int64_t)v * numRanges / std::max(numPositions, 1));
+  };
+
+  // bucket the corners by range, keeping their order within a range
+  std::vector<int> bucketStart(numRanges + 1, 0);
+  for (int c = 0; c < numCorners; c++)
+    bucketStart[rangeOf(corners[c]->vertex_index) + 1]++;
+  for (int r = 0; r < numRanges; r++) bucketStart[r + 1] += bucketStart[r];
+
+  std::vector<int> bucket(numCorners);
+  std::vector<int> next(bucketStart.begin(), bucketStart.end() - 1);
+  for (int c = 0; c < numCorners; c++)
+    bucket[next[rangeOf(corners[c]->vertex_index)]++] = c;
+
+  // first pass: corners are welded within their range, in order of first
+  // appearance
+  std::vector<int> cornerVertex(numCorners);
+  std::vector<std::vector<Vertex_Key> > rangeVertices(numRanges);
+  pool.parallel_for(numRanges, [&](int r) {
+    std::unordered_map<Vertex_Key, int, Vertex_Key_Hash> map;
+    std::vector<Vertex_Key> &keys = rangeVertices[r];
+    map.reserve((bucketStart[r + 1] - bucketStart[r]) / 2);
+
+    for (int b = bucketStart[r]; b < bucketStart[r + 1]; b++) {
+      int c = bucket[b];
+      Vertex_Key key = {corners[c]->vertex_index,
+                        hasNormals ? corners[c]->normal_index : -1,
+                        hasTexcoords ? corners[c]->texcoord_index : -1};
+      auto it = map.insert(std::make_pair(key, (int)keys.size()));
+      if (it.second) keys.push_back(key);
+
+      cornerVertex[c] = it.first->second;
+    }
+  });
+
+  // ranges are laid out one after the other
+  std::vector<int> rangeStart(numRanges + 1, 0);
+  for (int r = 0; r < numRanges; r++)
+    rangeStart[r + 1] = rangeStart[r] + (int)rangeVertices[r].size();
+
+  int numVertices = rangeStart[numRanges];
+  mesh.v_vector.resize(numVertices);
+  mesh.n_vector.resize(hasNormals ? numVertices : 0);
+  mesh.t_vector.resize(hasTexcoords ? numVertices : 0);
+
+  // second pass: copy the vertex attributes of every range, the missing
+  // normals are summed over their faces below
+  pool.parallel_for(numRanges, [&](int r) {
+    const std::vector<Vertex_Key> &keys = rangeVertices[r];
+
+    for (int i = 0; i < (int)keys.size(); i++) {
+      const Vertex_Key &key = keys[i];
+      int vertex = rangeStart[r] + i;
+
+      const float *p = &attrib.vertices[3 * key.v];
+      mesh.v_vector[vertex] = make_float3(p[0], p[1], p[2]);
+
+      if (hasNormals && key.n >= 0) {
+        const float *n = &attrib.normals[3 * key.n];
+        mesh.n_vector[vertex] = make_float3(n[0], n[1], n[2]);
+      } else if (hasNormals)
+        mesh.n_vector[vertex] = make_float3(0.f);
+
+      if (hasTexcoords && key.t >= 0) {
+        const float *t = &attrib.texcoords[2 * key.t];
+        mesh.t_vector[vertex] = make_float2(t[0], t[1]);
+      } else if (hasTexcoords)
+        mesh.t_vector[vertex] = make_float2(0.f);
+    }
+  });
+
+  // third pass: offset the corner indices by the start of their range
+  int numFaces = numCorners / 3;
+  mesh.i_vector.resize(numFaces);
+  pool.parallel_blocks(numFaces, 4096, [&](int begin, int end) {
+    for (int f = begin; f < end; f++) {
+      int index[3];
+      for (int k = 0; k < 3; k++) {
+        int c = 3 * f + k;
+        int r = rangeOf(corners[c]->vertex_index);
+        index[k] = rangeStart[r] + cornerVertex[c];
+      }
+
+      mesh.i_vector[f] = make_uint3(index[0], index[1], index[2]);
+    }
+  });
+
+  // corners without a normal get the area weighted normal of their faces
+  if (hasNormals && missingNormals) {
+    for (int f = 0; f < numFaces; f++) {
+      const uint3 &face = mesh.i_vector[f];
+      uint index[3] = {face.x, face.y, face.z};
+      float3 a = mesh.v_vector[face.x];
+      float3 normal =
+          cross(mesh.v_vector[face.y] - a, mesh.v_vector[face.z] - a);
+
+      for (int k = 0; k < 3; k++)
+        if (corners[3 * f + k]->normal_index < 0)
+          mesh.n_vector[index[k]] += normal;
+    }
+
+    pool.parallel_for(numRanges, [&](int r) {
+      const std::vector<Vertex_Key> &keys = rangeVertices[r];
+
+      for (int i = 0; i < (int)keys.size(); i++) {
+        float3 &normal = mesh.n_vector[rangeStart[r] + i];
+        if (keys[i].n < 0 && length(normal) > 0.f)
+          normal = normalize(normal);
+      }
+    });
+  }
+
+  mesh.mat_vector = materialIndices;
+
+  return numCorners;
+}
+
+#endif
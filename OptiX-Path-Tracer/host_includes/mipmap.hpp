@@ -0,0 +1,264 @@
+#ifndef MIPMAPH
+#define MIPMAPH
+
+// mipmap.hpp: Define the mip pyramids of the image textures, downsampled on
+// the host with a box or a Kaiser windowed sinc filter, and the device
+// samplers reading them
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#include <immintrin.h>
+#define MIPMAP_SSE
+#endif
+
+#include "cpu/thread_pool.hpp"
+#include "host_common.hpp"
+
+// Filters of the mip levels
+typedef enum {
+  NO_MIPMAPS,     // a single, full resolution level
+  BOX_MIPMAPS,    // average of the texels each texel covers
+  KAISER_MIPMAPS  // Kaiser windowed sinc, sharper than the box
+} Mip_Filter;
+
+// The Kaiser filter spans KAISER_RADIUS texels of the level it builds on each
+// side of a texel, KAISER_ALPHA is the window's shape parameter
+#define KAISER_RADIUS 3.f
+#define KAISER_ALPHA 4.f
+
+// Size of a level of a pyramid, each level halves the previous one
+inline int mipSize(int size, int level) { return std::max(size >> level, 1); }
+
+// Number of levels of a pyramid, down to a single texel
+inline int mipLevelCount(int width, int height) {
+  int levels = 1;
+  while ((std::max(width, height) >> levels) > 0) levels++;
+  return levels;
+}
+
+// Texel of a level and its weight in a texel of the next level
+struct Mip_Tap {
+  int index;
+  float weight;
+};
+
+// Zeroth order modified Bessel function of the first kind
+inline float besselI0(float x) {
+  float sum = 1.f, term = 1.f;
+  for (int k = 1; k < 32 && term > 1e-7f * sum; k++) {
+    term *= (x * x) / (4.f * k * k);
+    sum += term;
+  }
+  return sum;
+}
+
+// Kaiser windowed sinc, 'x' in texels of the level being built
+inline float kaiserWeight(float x) {
+  if (fabsf(x) >= KAISER_RADIUS) return 0.f;
+
+  float t = x / KAISER_RADIUS;
+  float sinc = x == 0.f ? 1.f : sinf(PI_F * x) / (PI_F * x);
+  return sinc * besselI0(KAISER_ALPHA * sqrtf(1.f - t * t)) /
+         besselI0(KAISER_ALPHA);
+}
+
+// Taps filtering a row or column of 'size' texels into the 'next' texels of
+// the next level. The taps of texel j are [first[j], first[j + 1]), indices
+// wrap around like the samplers do.
+void mipTaps(int size, int next, Mip_Filter filter, std::vector<int> &first,
+             std::vector<Mip_Tap> &taps) {
+  float scale = (float)size / next;
+  first.resize(next + 1);
+  taps.clear();
+
+  for (int j = 0; j < next; j++) {
+    first[j] = (int)taps.size();
+    float center = (j + 0.5f) * scale;
+
+    if (filter == BOX_MIPMAPS) {
+      // coverage of the source texels, odd sizes have partial ones
+      float lo = center - 0.5f * scale, hi = center + 0.5f * scale;
+      for (int i = (int)floorf(lo); i < (int)ceilf(hi); i++) {
+        float overlap = fminf(hi, i + 1.f) - fmaxf(lo, (float)i);
+        if (overlap > 0.f) taps.push_back({i, overlap / scale});
+      }
+    } else {
+      float reach = KAISER_RADIUS * scale, sum = 0.f;
+      int begin = (int)taps.size();
+
+      int lo = (int)floorf(center - reach), hi = (int)ceilf(center + reach);
+      for (int i = lo; i <= hi; i++) {
+        float weight = kaiserWeight((i + 0.5f - center) / scale);
+        if (weight == 0.f) continue;
+
+        taps.push_back({((i % size) + size) % size, weight});
+        sum += weight;
+      }
+
+      for (int t = begin; t < (int)taps.size(); t++) taps[t].weight /= sum;
+    }
+  }
+
+  first[next] = (int)taps.size();
+}
+
+// Weighted sum of the texels of a row or column, 'stride' texels apart.
+// Negative results, from the lobes of the Kaiser filter, are clamped.
+inline float4 filterTexels(const float4 *line, int stride, const Mip_Tap *tap,
+                           const Mip_Tap *end) {
+#ifdef MIPMAP_SSE
+  __m128 sum = _mm_setzero_ps();
+  for (; tap < end; tap++) {
+    __m128 texel = _mm_loadu_ps(&line[tap->index * stride].x);
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(tap->weight), texel));
+  }
+
+  float4 result;
+  _mm_storeu_ps(&result.x, _mm_max_ps(sum, _mm_setzero_ps()));
+  return result;
+#else
+  float4 sum = make_float4(0.f);
+  for (; tap < end; tap++) sum += tap->weight * line[tap->index * stride];
+  return make_float4(fmaxf(sum.x, 0.f), fmaxf(sum.y, 0.f), fmaxf(sum.z, 0.f),
+                     fmaxf(sum.w, 0.f));
+#endif
+}
+
+// Filters a level into the next one, the rows first and then the columns,
+// both split among the pool's threads
+void downsample(const CPU_Image_Level &level, CPU_Image_Level &next,
+                Mip_Filter filter, Thread_Pool &pool) {
+  next.width = mipSize(level.width, 1);
+  next.height = mipSize(level.height, 1);
+  next.texels.resize(next.width * next.height);
+
+  std::vector<int> firstX, firstY;
+  std::vector<Mip_Tap> tapsX, tapsY;
+  mipTaps(level.width, next.width, filter, firstX, tapsX);
+  mipTaps(level.height, next.height, filter, firstY, tapsY);
+
+  // rows of the level, narrowed to the width of the next one
+  std::vector<float4> rows(next.width * level.height);
+  pool.parallel_blocks(level.height, 16, [&](int begin, int end) {
+    for (int y = begin; y < end; y++)
+      for (int x = 0; x < next.width; x++)
+        rows[y * next.width + x] = filterTexels(
+            &level.texels[y * level.width], 1, &tapsX[firstX[x]],
+            tapsX.data() + firstX[x + 1]);
+  });
+
+  pool.parallel_blocks(next.height, 16, [&](int begin, int end) {
+    for (int y = begin; y < end; y++)
+      for (int x = 0; x < next.width; x++)
+        next.texels[y * next.width + x] =
+            filterTexels(&rows[x], next.width, &tapsY[firstY[y]],
+                         tapsY.data() + firstY[y + 1]);
+  });
+}
+
+// Builds the levels of 'image' below the full resolution one, or drops them
+// for NO_MIPMAPS. Every level is filtered from the previous one, with the
+// threads of 'pool'.
+void buildMipmaps(CPU_Image &image, Mip_Filter filter, Thread_Pool &pool) {
+  image.levels.resize(1);
+  if (filter == NO_MIPMAPS) return;
+
+  const CPU_Image_Level &base = image.levels[0];
+  int count = mipLevelCount(base.width, base.height);
+  image.levels.resize(count);
+
+  for (int i = 1; i < count; i++)
+    downsample(image.levels[i - 1], image.levels[i], filter, pool);
+}
+
+// Converts bytes to floats in [0, 1]
+void expandTexels(const uchar4 *texels, float4 *result, int count) {
+#ifdef MIPMAP_SSE
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 scale = _mm_set1_ps(255.f);
+
+  for (int i = 0; i < count; i++) {
+    int packed;
+    memcpy(&packed, &texels[i], sizeof(int));
+    __m128i bytes = _mm_cvtsi32_si128(packed);
+    __m128i words = _mm_unpacklo_epi8(bytes, zero);
+    __m128 values = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+    _mm_storeu_ps(&result[i].x, _mm_div_ps(values, scale));
+  }
+#else
+  for (int i = 0; i < count; i++) {
+    const uchar4 &t = texels[i];
+    result[i] = make_float4(t.x / 255.f, t.y / 255.f, t.z / 255.f, t.w / 255.f);
+  }
+#endif
+}
+
+// Converts floats to bytes, clamped to [0, 1] and rounded to nearest
+void quantizeTexels(const float4 *texels, uchar4 *result, int count) {
+  int i = 0;
+
+#ifdef MIPMAP_SSE
+  const __m128 scale = _mm_set1_ps(255.f), zero = _mm_setzero_ps();
+
+  // four texels per iteration, packed to 16 bytes with saturation
+  for (; i + 4 <= count; i += 4) {
+    __m128i q[4];
+    for (int k = 0; k < 4; k++) {
+      __m128 v = _mm_mul_ps(_mm_loadu_ps(&texels[i + k].x), scale);
+      q[k] = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(v, zero), scale));
+    }
+
+    __m128i words0 = _mm_packs_epi32(q[0], q[1]);
+    __m128i words1 = _mm_packs_epi32(q[2], q[3]);
+    _mm_storeu_si128((__m128i *)&result[i], _mm_packus_epi16(words0, words1));
+  }
+#endif
+
+  for (; i < count; i++) {
+    const float4 &t = texels[i];
+    result[i] = make_uchar4(
+        (unsigned char)rintf(fminf(fmaxf(t.x * 255.f, 0.f), 255.f)),
+        (unsigned char)rintf(fminf(fmaxf(t.y * 255.f, 0.f), 255.f)),
+        (unsigned char)rintf(fminf(fmaxf(t.z * 255.f, 0.f), 255.f)),
+        (unsigned char)rintf(fminf(fmaxf(t.w * 255.f, 0.f), 255.f)));
+  }
+}
+
+// Creates a repeat wrapping sampler over the levels of an image, 'width' x
+// 'height' texels of type T at the full resolution. Lookups are linearly
+// filtered within the levels, and between them when there are several.
+template <typename T>
+TextureSampler createImageSampler(Context &g_context, RTformat format,
+                                  int width, int height,
+                                  const std::vector<const T *> &levels,
+                                  float maxAnisotropy) {
+  TextureSampler sampler = g_context->createTextureSampler();
+  sampler->setWrapMode(0, RT_WRAP_REPEAT);
+  sampler->setWrapMode(1, RT_WRAP_REPEAT);
+  sampler->setWrapMode(2, RT_WRAP_REPEAT);
+  sampler->setIndexingMode(RT_TEXTURE_INDEX_NORMALIZED_COORDINATES);
+  sampler->setReadMode(RT_TEXTURE_READ_NORMALIZED_FLOAT);
+  sampler->setArraySize(1u);
+
+  // the level count is a property of the buffer
+  unsigned int count = (unsigned int)levels.size();
+  Buffer buffer =
+      count > 1 ? g_context->createMipmappedBuffer(RT_BUFFER_INPUT, format,
+                                                   width, height, count)
+                : g_context->createBuffer(RT_BUFFER_INPUT, format, width,
+                                          height);
+
+  for (unsigned int i = 0; i < count; i++) {
+    size_t texels = (size_t)mipSize(width, i) * mipSize(height, i);
+    memcpy(buffer->map(i), levels[i], texels * sizeof(T));
+    buffer->unmap(i);
+  }
+
+  sampler->setBuffer(0u, 0u, buffer);
+  sampler->setMaxAnisotropy(count > 1 ? maxAnisotropy : 1.f);
+  sampler->setFilteringModes(RT_FILTER_LINEAR, RT_FILTER_LINEAR,
+                             count > 1 ? RT_FILTER_LINEAR : RT_FILTER_NONE);
+
+  return sampler;
+}
+
+#endif
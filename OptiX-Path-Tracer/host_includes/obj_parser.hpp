@@ -0,0 +1,871 @@
+#ifndef OBJPARSERH
+#define OBJPARSERH
+
+// obj_parser.hpp: Define a multi-threaded OBJ parser giving the same result
+// as tinyobj::LoadObj with triangulation. The file is memory mapped and split
+// in line aligned chunks, which are parsed concurrently into per chunk arrays
+// and then merged in file order. MTL files are still read by tinyobj.
+// Statements are interpreted like lib/tiny_obj_loader.h does, so both parsers
+// read the same values.
+
+#include "mesh_cache.hpp"
+#include "cpu/thread_pool.hpp"
+
+#include "../lib/tiny_obj_loader.h"
+
+#include <chrono>
+#include <limits>
+#include <sstream>
+
+// Chunks per thread, so threads balance chunks of uneven cost
+#define OBJ_CHUNKS_PER_THREAD 4
+
+// Chunks aren't made smaller than this many bytes
+#define OBJ_MIN_CHUNK_SIZE 65536
+
+// Smoothing group of the faces before the first 's' statement of a chunk,
+// which is only known once the previous chunks are parsed
+#define OBJ_INHERITED_SMOOTHING 0xFFFFFFFFu
+
+// Face corner as written in the file. Negative indices are resolved against
+// the attributes of the chunk, the bits of 'relative' (1 vertex, 2 texcoord,
+// 4 normal) mark those that still need the counts of the previous chunks.
+struct OBJ_Corner {
+  int v, vt, vn;
+  int relative;
+};
+
+struct OBJ_Face {
+  int first, count;  // range of corners
+  unsigned int smoothing;
+};
+
+// Statements changing the material or shape of the following faces
+enum OBJ_Statement_Type { OBJ_USEMTL, OBJ_MTLLIB, OBJ_GROUP, OBJ_OBJECT };
+
+struct OBJ_Statement {
+  int type;
+  int faces;         // number of faces of the chunk before the statement
+  int vertices;      // number of 'v' values of the chunk before it
+  std::string text;  // material, MTL file list or shape name
+};
+
+// Everything parsed from one chunk of the file
+struct OBJ_Chunk {
+  OBJ_Chunk() : smoothing(OBJ_INHERITED_SMOOTHING), supported(true) {
+    for (int i = 0; i < 3; i++) maxIndex[i] = maxRelative[i] = -1;
+  }
+
+  std::vector<tinyobj::real_t> v, vn, vt, vc;
+  std::vector<OBJ_Corner> corners;
+  std::vector<OBJ_Face> faces;
+  std::vector<OBJ_Statement> statements;
+
+  unsigned int smoothing;  // smoothing group at the end of the chunk
+  bool supported;          // false if tinyobj has to parse the file
+
+  // greatest vertex, texcoord and normal indices, the relative ones are
+  // still local to the chunk
+  int maxIndex[3], maxRelative[3];
+};
+
+//////////////////
+// Line parsing //
+//////////////////
+
+#define OBJ_IS_SPACE(x) (((x) == ' ') || ((x) == '\t'))
+#define OBJ_IS_DIGIT(x) \
+  (static_cast<unsigned int>((x) - '0') < static_cast<unsigned int>(10))
+#define OBJ_IS_NEW_LINE(x) (((x) == '\r') || ((x) == '\n') || ((x) == '\0'))
+
+// Same algorithm as tinyobj's tryParseDouble, so the floats are bit exact
+bool parseOBJDouble(const char *s, const char *s_end, double *result) {
+  if (s >= s_end) return false;
+
+  double mantissa = 0.0;
+  int exponent = 0;  // base 10 exponent, applied with ldexp and pow(5)
+  char sign = '+', exp_sign = '+';
+  const char *curr = s;
+  int read = 0;
+  bool end_not_reached = false;
+
+  if (*curr == '+' || *curr == '-') {
+    sign = *curr;
+    curr++;
+  } else if (!OBJ_IS_DIGIT(*curr))
+    return false;
+
+  // integer part
+  end_not_reached = (curr != s_end);
+  while (end_not_reached && OBJ_IS_DIGIT(*curr)) {
+    mantissa *= 10;
+    mantissa += static_cast<int>(*curr - 0x30);
+    curr++;
+    read++;
+    end_not_reached = (curr != s_end);
+  }
+
+  if (read == 0) return false;
+
+  if (end_not_reached) {
+    bool exponentPart = true;
+
+    // decimal part
+    if (*curr == '.') {
+      curr++;
+      read = 1;
+      end_not_reached = (curr != s_end);
+      while (end_not_reached && OBJ_IS_DIGIT(*curr)) {
+        static const double pow_lut[] = {
+            1.0, 0.1, 0.01, 0.001, 0.0001, 0.00001, 0.000001, 0.0000001,
+        };
+        const int lut_entries = sizeof pow_lut / sizeof pow_lut[0];
+
+        mantissa += static_cast<int>(*curr - 0x30) *
+                    (read < lut_entries ? pow_lut[read]
+                                        : std::pow(10.0, -read));
+        read++;
+        curr++;
+        end_not_reached = (curr != s_end);
+      }
+    } else if (*curr != 'e' && *curr != 'E')
+      exponentPart = false;
+
+    // exponent part
+    if (exponentPart && end_not_reached && (*curr == 'e' || *curr == 'E')) {
+      curr++;
+      end_not_reached = (curr != s_end);
+      if (end_not_reached && (*curr == '+' || *curr == '-')) {
+        exp_sign = *curr;
+        curr++;
+      } else if (!OBJ_IS_DIGIT(*curr))
+        return false;
+
+      read = 0;
+      end_not_reached = (curr != s_end);
+      while (end_not_reached && OBJ_IS_DIGIT(*curr)) {
+        exponent *= 10;
+        exponent += static_cast<int>(*curr - 0x30);
+        curr++;
+        read++;
+        end_not_reached = (curr != s_end);
+      }
+      exponent *= (exp_sign == '+' ? 1 : -1);
+      if (read == 0) return false;
+    }
+  }
+
+  *result = (sign == '+' ? 1 : -1) *
+            (exponent ? std::ldexp(mantissa * std::pow(5.0, exponent), exponent)
+                      : mantissa);
+  return true;
+}
+
+// Parses the next number of the line, returns false if it isn't one
+bool parseOBJReal(const char **token, tinyobj::real_t *out) {
+  (*token) += strspn((*token), " \t");
+  const char *end = (*token) + strcspn((*token), " \t\r");
+  double val;
+  bool ret = parseOBJDouble((*token), end, &val);
+  if (ret) (*out) = static_cast<tinyobj::real_t>(val);
+  (*token) = end;
+  return ret;
+}
+
+// Parses the next number of the line, or returns the default value
+tinyobj::real_t parseOBJReal(const char **token, double default_value) {
+  tinyobj::real_t value;
+  if (!parseOBJReal(token, &value))
+    value = static_cast<tinyobj::real_t>(default_value);
+  return value;
+}
+
+// Makes an OBJ index zero based. Negative indices are relative to the 'n'
+// attributes read so far, which sets 'relative'.
+bool fixOBJIndex(int idx, int n, int *ret, bool *relative) {
+  *relative = idx < 0;
+  if (idx > 0) *ret = idx - 1;
+  if (idx < 0) *ret = n + idx;
+  return idx != 0;  // zero is not allowed according to the spec
+}
+
+// Parses a face corner: i, i/j/k, i//k or i/j
+bool parseOBJTriple(const char **token, const OBJ_Chunk &chunk,
+                    OBJ_Corner &corner) {
+  int vsize = (int)chunk.v.size() / 3;
+  int vnsize = (int)chunk.vn.size() / 3;
+  int vtsize = (int)chunk.vt.size() / 2;
+  bool relative;
+
+  corner.v = corner.vt = corner.vn = -1;
+  corner.relative = 0;
+
+  if (!fixOBJIndex(atoi((*token)), vsize, &corner.v, &relative)) return false;
+  corner.relative |= relative ? 1 : 0;
+
+  (*token) += strcspn((*token), "/ \t\r");
+  if ((*token)[0] != '/') return true;
+  (*token)++;
+
+  // i//k
+  if ((*token)[0] == '/') {
+    (*token)++;
+    if (!fixOBJIndex(atoi((*token)), vnsize, &corner.vn, &relative))
+      return false;
+    corner.relative |= relative ? 4 : 0;
+    (*token) += strcspn((*token), "/ \t\r");
+    return true;
+  }
+
+  // i/j/k or i/j
+  if (!fixOBJIndex(atoi((*token)), vtsize, &corner.vt, &relative))
+    return false;
+  corner.relative |= relative ? 2 : 0;
+
+  (*token) += strcspn((*token), "/ \t\r");
+  if ((*token)[0] != '/') return true;
+
+  // i/j/k
+  (*token)++;
+  if (!fixOBJIndex(atoi((*token)), vnsize, &corner.vn, &relative))
+    return false;
+  corner.relative |= relative ? 4 : 0;
+  (*token) += strcspn((*token), "/ \t\r");
+
+  return true;
+}
+
+// Parses a line of the file, without its line break. Lines tinyobj would
+// warn or fail about, and 'l' and 't' statements, mark the chunk as not
+// supported.
+void parseOBJLine(const char *token, OBJ_Chunk &chunk,
+                  unsigned int &smoothing) {
+  token += strspn(token, " \t");
+  if (token[0] == '\0' || token[0] == '#') return;
+
+  // vertex, with optional color
+  if (token[0] == 'v' && OBJ_IS_SPACE(token[1])) {
+    token += 2;
+    tinyobj::real_t x = parseOBJReal(&token, 0.0);
+    tinyobj::real_t y = parseOBJReal(&token, 0.0);
+    tinyobj::real_t z = parseOBJReal(&token, 0.0);
+
+    tinyobj::real_t r, g, b;
+    if (!(parseOBJReal(&token, &r) && parseOBJReal(&token, &g) &&
+          parseOBJReal(&token, &b)))
+      r = g = b = 1.0;
+
+    chunk.v.push_back(x);
+    chunk.v.push_back(y);
+    chunk.v.push_back(z);
+    chunk.vc.push_back(r);
+    chunk.vc.push_back(g);
+    chunk.vc.push_back(b);
+    return;
+  }
+
+  // normal
+  if (token[0] == 'v' && token[1] == 'n' && OBJ_IS_SPACE(token[2])) {
+    token += 3;
+    chunk.vn.push_back(parseOBJReal(&token, 0.0));
+    chunk.vn.push_back(parseOBJReal(&token, 0.0));
+    chunk.vn.push_back(parseOBJReal(&token, 0.0));
+    return;
+  }
+
+  // texcoord
+  if (token[0] == 'v' && token[1] == 't' && OBJ_IS_SPACE(token[2])) {
+    token += 3;
+    chunk.vt.push_back(parseOBJReal(&token, 0.0));
+    chunk.vt.push_back(parseOBJReal(&token, 0.0));
+    return;
+  }
+
+  // lines are left to tinyobj
+  if (token[0] == 'l' && OBJ_IS_SPACE(token[1])) {
+    chunk.supported = false;
+    return;
+  }
+
+  // face
+  if (token[0] == 'f' && OBJ_IS_SPACE(token[1])) {
+    token += 2;
+    token += strspn(token, " \t");
+
+    OBJ_Face face;
+    face.first = (int)chunk.corners.size();
+    face.smoothing = smoothing;
+
+    while (!OBJ_IS_NEW_LINE(token[0])) {
+      OBJ_Corner corner;
+      if (!parseOBJTriple(&token, chunk, corner)) {
+        chunk.supported = false;
+        return;
+      }
+
+      int indices[3] = {corner.v, corner.vt, corner.vn};
+      for (int i = 0; i < 3; i++) {
+        int &greatest = (corner.relative & (1 << i)) ? chunk.maxRelative[i]
+                                                     : chunk.maxIndex[i];
+        greatest = std::max(greatest, indices[i]);
+      }
+
+      chunk.corners.push_back(corner);
+      token += strspn(token, " \t\r");
+    }
+
+    face.count = (int)chunk.corners.size() - face.first;
+    chunk.faces.push_back(face);
+    return;
+  }
+
+  OBJ_Statement statement;
+  statement.faces = (int)chunk.faces.size();
+  statement.vertices = (int)chunk.v.size();
+
+  // use mtl
+  if ((0 == strncmp(token, "usemtl", 6)) && OBJ_IS_SPACE(token[6])) {
+    statement.type = OBJ_USEMTL;
+    statement.text = token + 7;
+    chunk.statements.push_back(statement);
+    return;
+  }
+
+  // load mtl, tinyobj warns about empty file lists
+  if ((0 == strncmp(token, "mtllib", 6)) && OBJ_IS_SPACE(token[6])) {
+    statement.type = OBJ_MTLLIB;
+    statement.text = token + 7;
+    chunk.statements.push_back(statement);
+    chunk.supported = chunk.supported && !statement.text.empty();
+    return;
+  }
+
+  // group name, multiple names are joined with spaces
+  if (token[0] == 'g' && OBJ_IS_SPACE(token[1])) {
+    std::vector<std::string> names;
+    while (!OBJ_IS_NEW_LINE(token[0])) {
+      token += strspn(token, " \t");
+      size_t e = strcspn(token, " \t\r");
+      names.push_back(std::string(token, token + e));
+      token += e;
+      token += strspn(token, " \t\r");
+    }
+
+    // names[0] is 'g', tinyobj warns about nameless groups
+    if (names.size() < 2) {
+      chunk.supported = false;
+      return;
+    }
+
+    statement.type = OBJ_GROUP;
+    statement.text = names[1];
+    for (size_t i = 2; i < names.size(); i++) statement.text += " " + names[i];
+    chunk.statements.push_back(statement);
+    return;
+  }
+
+  // object name
+  if (token[0] == 'o' && OBJ_IS_SPACE(token[1])) {
+    statement.type = OBJ_OBJECT;
+    statement.text = token + 2;
+    chunk.statements.push_back(statement);
+    return;
+  }
+
+  // tags are left to tinyobj
+  if (token[0] == 't' && OBJ_IS_SPACE(token[1])) {
+    chunk.supported = false;
+    return;
+  }
+
+  // smoothing group id
+  if (token[0] == 's' && OBJ_IS_SPACE(token[1])) {
+    token += 2;
+    token += strspn(token, " \t");
+
+    if (token[0] == '\0') return;
+    if (token[0] == '\r' || token[1] == '\n') return;
+
+    if (strlen(token) >= 3) {
+      if (token[0] == 'o' && token[1] == 'f' && token[2] == 'f') smoothing = 0;
+    } else {
+      int id = atoi(token);
+      smoothing = id < 0 ? 0 : (unsigned int)id;
+    }
+  }
+
+  // unknown statements are ignored
+}
+
+// Parses the lines of [begin, end), which start and end at line breaks
+void parseOBJChunk(const char *begin, const char *end, OBJ_Chunk &chunk) {
+  std::string line;
+  unsigned int smoothing = OBJ_INHERITED_SMOOTHING;
+
+  // '\r', '\n' and "\r\n" all end lines, empty lines are skipped anyway
+  for (const char *it = begin; it < end && chunk.supported;) {
+    const char *lineEnd = it;
+    while (lineEnd < end && *lineEnd != '\n' && *lineEnd != '\r') lineEnd++;
+
+    line.assign(it, lineEnd);
+    parseOBJLine(line.c_str(), chunk, smoothing);
+
+    it = lineEnd + 1;
+  }
+
+  chunk.smoothing = smoothing;
+}
+
+///////////////////
+// Chunk merging //
+///////////////////
+
+// Point in polygon test used by tinyobj's ear clipping
+bool objPointInTriangle(const tinyobj::real_t *vx, const tinyobj::real_t *vy,
+                        tinyobj::real_t tx, tinyobj::real_t ty) {
+  bool c = false;
+  for (int i = 0, j = 2; i < 3; j = i++) {
+    if (((vy[i] > ty) != (vy[j] > ty)) &&
+        (tx < (vx[j] - vx[i]) * (ty - vy[i]) / (vy[j] - vy[i]) + vx[i]))
+      c = !c;
+  }
+  return c;
+}
+
+// Appends a face to the shape, triangulated by ear clipping like tinyobj
+// does, which consumes the corners of 'face'. Only the first 'vSize' values
+// of 'v' were read when tinyobj triangulates the face, the others count as
+// invalid.
+void addOBJFace(tinyobj::shape_t &shape, std::vector<tinyobj::index_t> &face,
+                int material, unsigned int smoothing,
+                const std::vector<tinyobj::real_t> &vertices, size_t vSize) {
+  typedef tinyobj::real_t real_t;
+  const real_t *v = vertices.data();
+  size_t npolys = face.size();
+  if (npolys < 3) return;
+
+  // find the two axes to work in
+  size_t axes[2] = {1, 2};
+  for (size_t k = 0; k < npolys && npolys > 3; ++k) {
+    size_t vi0 = size_t(face[(k + 0) % npolys].vertex_index);
+    size_t vi1 = size_t(face[(k + 1) % npolys].vertex_index);
+    size_t vi2 = size_t(face[(k + 2) % npolys].vertex_index);
+
+    if (((3 * vi0 + 2) >= vSize) || ((3 * vi1 + 2) >= vSize) ||
+        ((3 * vi2 + 2) >= vSize))
+      continue;
+
+    real_t e0x = v[vi1 * 3 + 0] - v[vi0 * 3 + 0];
+    real_t e0y = v[vi1 * 3 + 1] - v[vi0 * 3 + 1];
+    real_t e0z = v[vi1 * 3 + 2] - v[vi0 * 3 + 2];
+    real_t e1x = v[vi2 * 3 + 0] - v[vi1 * 3 + 0];
+    real_t e1y = v[vi2 * 3 + 1] - v[vi1 * 3 + 1];
+    real_t e1z = v[vi2 * 3 + 2] - v[vi1 * 3 + 2];
+    real_t cx = std::fabs(e0y * e1z - e0z * e1y);
+    real_t cy = std::fabs(e0z * e1x - e0x * e1z);
+    real_t cz = std::fabs(e0x * e1y - e0y * e1x);
+    const real_t epsilon = std::numeric_limits<real_t>::epsilon();
+    if (cx > epsilon || cy > epsilon || cz > epsilon) {
+      // found a corner
+      if (!(cx > cy && cx > cz)) {
+        axes[0] = 0;
+        if (cz > cx && cz > cy) axes[1] = 1;
+      }
+      break;
+    }
+  }
+
+  real_t area = 0;
+  for (size_t k = 0; k < npolys && npolys > 3; ++k) {
+    size_t vi0 = size_t(face[(k + 0) % npolys].vertex_index);
+    size_t vi1 = size_t(face[(k + 1) % npolys].vertex_index);
+    if (((vi0 * 3 + axes[0]) >= vSize) || ((vi0 * 3 + axes[1]) >= vSize) ||
+        ((vi1 * 3 + axes[0]) >= vSize) || ((vi1 * 3 + axes[1]) >= vSize))
+      continue;
+
+    real_t v0x = v[vi0 * 3 + axes[0]];
+    real_t v0y = v[vi0 * 3 + axes[1]];
+    real_t v1x = v[vi1 * 3 + axes[0]];
+    real_t v1y = v[vi1 * 3 + axes[1]];
+    area += (v0x * v1y - v0y * v1x) * static_cast<real_t>(0.5);
+  }
+
+  size_t guess_vert = 0;
+  tinyobj::index_t ind[3];
+  real_t vx[3], vy[3];
+
+  // How many iterations can we do without decreasing the remaining vertices
+  size_t remainingIterations = face.size();
+  size_t previousRemainingVertices = face.size();
+
+  while (face.size() > 3 && remainingIterations > 0) {
+    npolys = face.size();
+    if (guess_vert >= npolys) guess_vert -= npolys;
+
+    if (previousRemainingVertices != npolys) {
+      // The number of remaining vertices decreased, reset the counters
+      previousRemainingVertices = npolys;
+      remainingIterations = npolys;
+    } else
+      remainingIterations--;
+
+    for (size_t k = 0; k < 3; k++) {
+      ind[k] = face[(guess_vert + k) % npolys];
+      size_t vi = size_t(ind[k].vertex_index);
+      if (((vi * 3 + axes[0]) >= vSize) || ((vi * 3 + axes[1]) >= vSize)) {
+        vx[k] = static_cast<real_t>(0.0);
+        vy[k] = static_cast<real_t>(0.0);
+      } else {
+        vx[k] = v[vi * 3 + axes[0]];
+        vy[k] = v[vi * 3 + axes[1]];
+      }
+    }
+
+    real_t e0x = vx[1] - vx[0];
+    real_t e0y = vy[1] - vy[0];
+    real_t e1x = vx[2] - vx[1];
+    real_t e1y = vy[2] - vy[1];
+    real_t cross = e0x * e1y - e0y * e1x;
+
+    // if an internal angle
+    if (cross * area < static_cast<real_t>(0.0)) {
+      guess_vert += 1;
+      continue;
+    }
+
+    // check all other verts in case they are inside this triangle
+    bool overlap = false;
+    for (size_t otherVert = 3; otherVert < npolys; ++otherVert) {
+      size_t idx = (guess_vert + otherVert) % npolys;
+      size_t ovi = size_t(face[idx].vertex_index);
+      if (((ovi * 3 + axes[0]) >= vSize) || ((ovi * 3 + axes[1]) >= vSize))
+        continue;
+
+      real_t tx = v[ovi * 3 + axes[0]];
+      real_t ty = v[ovi * 3 + axes[1]];
+      if (objPointInTriangle(vx, vy, tx, ty)) {
+        overlap = true;
+        break;
+      }
+    }
+
+    if (overlap) {
+      guess_vert += 1;
+      continue;
+    }
+
+    // this triangle is an ear
+    for (int k = 0; k < 3; k++) shape.mesh.indices.push_back(ind[k]);
+    shape.mesh.num_face_vertices.push_back(3);
+    shape.mesh.material_ids.push_back(material);
+    shape.mesh.smoothing_group_ids.push_back(smoothing);
+
+    // remove v1 from the list
+    face.erase(face.begin() + (guess_vert + 1) % npolys);
+  }
+
+  if (face.size() == 3) {
+    for (int k = 0; k < 3; k++) shape.mesh.indices.push_back(face[k]);
+    shape.mesh.num_face_vertices.push_back(3);
+    shape.mesh.material_ids.push_back(material);
+    shape.mesh.smoothing_group_ids.push_back(smoothing);
+  }
+}
+
+// Parses an OBJ file with the threads of 'pool'. Returns false if the file
+// has to be parsed by tinyobj instead, to get its warnings or error messages,
+// or for statements it doesn't handle.
+bool parseOBJParallel(const std::string &path, const std::string &mtlBaseDir,
+                      Thread_Pool &pool, tinyobj::attrib_t &attrib,
+                      std::vector<tinyobj::shape_t> &shapes,
+                      std::vector<tinyobj::material_t> &materials,
+                      std::string &warn) {
+  Mapped_File file;
+  if (!file.open(path)) return false;
+
+  // line aligned chunks
+  size_t size = file.size;
+  int numChunks = (int)std::min((size_t)pool.size() * OBJ_CHUNKS_PER_THREAD,
+                                size / OBJ_MIN_CHUNK_SIZE + 1);
+  std::vector<size_t> starts(numChunks + 1, size);
+  for (int c = 0; c < numChunks; c++) {
+    size_t start = c == 0 ? 0 : std::max(c * (size / numChunks), starts[c - 1]);
+    while (start > 0 && start < size && file.data[start - 1] != '\n' &&
+           file.data[start - 1] != '\r')
+      start++;
+    starts[c] = start;
+  }
+
+  std::vector<OBJ_Chunk> chunks(numChunks);
+  pool.parallel_for(numChunks, [&](int c) {
+    parseOBJChunk(file.data + starts[c], file.data + starts[c + 1], chunks[c]);
+  });
+
+  // attribute counts before each chunk, and the smoothing group each chunk
+  // starts with
+  std::vector<int> vOffset(numChunks + 1, 0), vtOffset(numChunks + 1, 0),
+      vnOffset(numChunks + 1, 0);
+  std::vector<unsigned int> smoothing(numChunks, 0);
+  for (int c = 0; c < numChunks; c++) {
+    const OBJ_Chunk &chunk = chunks[c];
+    if (!chunk.supported) return false;
+
+    vOffset[c + 1] = vOffset[c] + (int)chunk.v.size() / 3;
+    vtOffset[c + 1] = vtOffset[c] + (int)chunk.vt.size() / 2;
+    vnOffset[c + 1] = vnOffset[c] + (int)chunk.vn.size() / 3;
+
+    if (c + 1 < numChunks)
+      smoothing[c + 1] = chunk.smoothing == OBJ_INHERITED_SMOOTHING
+                             ? smoothing[c]
+                             : chunk.smoothing;
+  }
+
+  // out of bounds indices make tinyobj warn
+  for (int c = 0; c < numChunks; c++) {
+    const OBJ_Chunk &chunk = chunks[c];
+    int offsets[3] = {vOffset[c], vtOffset[c], vnOffset[c]};
+    int counts[3] = {vOffset[numChunks], vtOffset[numChunks],
+                     vnOffset[numChunks]};
+
+    for (int i = 0; i < 3; i++) {
+      int greatest = std::max(chunk.maxIndex[i],
+                              chunk.maxRelative[i] + offsets[i]);
+      if (greatest >= counts[i]) return false;
+    }
+  }
+
+  // concatenate the attributes
+  attrib.vertices.resize(3 * vOffset[numChunks]);
+  attrib.colors.resize(3 * vOffset[numChunks]);
+  attrib.texcoords.resize(2 * vtOffset[numChunks]);
+  attrib.normals.resize(3 * vnOffset[numChunks]);
+  pool.parallel_for(numChunks, [&](int c) {
+    const OBJ_Chunk &chunk = chunks[c];
+    std::copy(chunk.v.begin(), chunk.v.end(),
+              attrib.vertices.begin() + 3 * vOffset[c]);
+    std::copy(chunk.vc.begin(), chunk.vc.end(),
+              attrib.colors.begin() + 3 * vOffset[c]);
+    std::copy(chunk.vt.begin(), chunk.vt.end(),
+              attrib.texcoords.begin() + 2 * vtOffset[c]);
+    std::copy(chunk.vn.begin(), chunk.vn.end(),
+              attrib.normals.begin() + 3 * vnOffset[c]);
+  });
+
+  // replay the statements in file order, like tinyobj::LoadObj
+  std::string baseDir = mtlBaseDir;
+#ifndef _WIN32
+  const char dirsep = '/';
+#else
+  const char dirsep = '\\';
+#endif
+  if (!baseDir.empty() && baseDir[baseDir.length() - 1] != dirsep)
+    baseDir += dirsep;
+  tinyobj::MaterialFileReader readMaterials(baseDir);
+
+  std::map<std::string, int> material_map;
+  int material = -1;
+  std::string name;
+  tinyobj::shape_t shape;
+  shapes.clear();
+
+  // faces waiting for a material or shape change, as [chunk, first, last)
+  std::vector<int3> faceGroup;
+
+  // appends the waiting faces to the shape, returns false if there were none
+  auto exportGroup = [&](size_t vSize) {
+    if (faceGroup.empty()) return false;
+
+    std::vector<tinyobj::index_t> face;
+    for (int g = 0; g < (int)faceGroup.size(); g++) {
+      const OBJ_Chunk &chunk = chunks[faceGroup[g].x];
+      int c = faceGroup[g].x;
+
+      for (int f = faceGroup[g].y; f < faceGroup[g].z; f++) {
+        const OBJ_Face &objFace = chunk.faces[f];
+        face.resize(objFace.count);
+
+        for (int k = 0; k < objFace.count; k++) {
+          const OBJ_Corner &corner = chunk.corners[objFace.first + k];
+          face[k].vertex_index =
+              corner.v + ((corner.relative & 1) ? vOffset[c] : 0);
+          face[k].texcoord_index =
+              corner.vt + ((corner.relative & 2) ? vtOffset[c] : 0);
+          face[k].normal_index =
+              corner.vn + ((corner.relative & 4) ? vnOffset[c] : 0);
+        }
+
+        unsigned int group = objFace.smoothing == OBJ_INHERITED_SMOOTHING
+                                 ? smoothing[c]
+                                 : objFace.smoothing;
+        addOBJFace(shape, face, material, group, attrib.vertices, vSize);
+      }
+    }
+
+    shape.name = name;
+    shape.mesh.tags.clear();
+    faceGroup.clear();
+    return true;
+  };
+
+  for (int c = 0; c < numChunks; c++) {
+    const OBJ_Chunk &chunk = chunks[c];
+    int next = 0;  // first face of the chunk not in the group yet
+
+    for (int s = 0; s < (int)chunk.statements.size(); s++) {
+      const OBJ_Statement &statement = chunk.statements[s];
+      if (statement.faces > next)
+        faceGroup.push_back(make_int3(c, next, statement.faces));
+      next = statement.faces;
+
+      // 'v' values read when tinyobj reaches the statement
+      size_t vSize = 3 * (size_t)vOffset[c] + statement.vertices;
+
+      if (statement.type == OBJ_USEMTL) {
+        std::map<std::string, int>::iterator it =
+            material_map.find(statement.text);
+        int newMaterial = it == material_map.end() ? -1 : it->second;
+
+        if (newMaterial != material) {
+          exportGroup(vSize);
+          material = newMaterial;
+        }
+      } else if (statement.type == OBJ_MTLLIB) {
+        std::vector<std::string> filenames;
+        std::stringstream ss(statement.text);
+        std::string item;
+        while (std::getline(ss, item, ' ')) filenames.push_back(item);
+
+        bool found = false;
+        for (size_t f = 0; f < filenames.size() && !found; f++) {
+          std::string warn_mtl, err_mtl;
+          found = readMaterials(filenames[f].c_str(), &materials,
+                                &material_map, &warn_mtl, &err_mtl);
+          warn += warn_mtl;
+        }
+
+        if (!found)
+          warn += "Failed to load material file(s). Use default material.\n";
+      } else if (statement.type == OBJ_GROUP) {
+        exportGroup(vSize);
+        if (shape.mesh.indices.size() > 0) shapes.push_back(shape);
+        shape = tinyobj::shape_t();
+        name = statement.text;
+      } else {
+        if (exportGroup(vSize)) shapes.push_back(shape);
+        shape = tinyobj::shape_t();
+        name = statement.text;
+      }
+    }
+
+    if ((int)chunk.faces.size() > next)
+      faceGroup.push_back(make_int3(c, next, (int)chunk.faces.size()));
+  }
+
+  if (exportGroup(attrib.vertices.size()) || shape.mesh.indices.size())
+    shapes.push_back(shape);
+
+  return true;
+}
+
+// Parses an OBJ file and its MTL files, same as tinyobj::LoadObj with
+// triangulation, in parallel unless the file needs tinyobj
+bool loadOBJ(const std::string &path, const std::string &mtlBaseDir,
+             tinyobj::attrib_t &attrib, std::vector<tinyobj::shape_t> &shapes,
+             std::vector<tinyobj::material_t> &materials, std::string &warn,
+             std::string &err, Thread_Pool &pool) {
+  if (parseOBJParallel(path, mtlBaseDir, pool, attrib, shapes, materials,
+                       warn))
+    return true;
+
+  // the parallel parser may have read some of the MTL files
+  materials.clear();
+  warn.clear();
+  return tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
+                          path.c_str(), mtlBaseDir.c_str(), true);
+}
+
+///////////////
+// Benchmark //
+///////////////
+
+// True if both parsers returned the same arrays
+bool sameOBJ(const tinyobj::attrib_t &a, const std::vector<tinyobj::shape_t> &s,
+             const tinyobj::attrib_t &b,
+             const std::vector<tinyobj::shape_t> &t) {
+  if (a.vertices != b.vertices || a.normals != b.normals ||
+      a.texcoords != b.texcoords || a.colors != b.colors ||
+      s.size() != t.size())
+    return false;
+
+  for (int i = 0; i < (int)s.size(); i++) {
+    const tinyobj::mesh_t &m = s[i].mesh, &n = t[i].mesh;
+    if (s[i].name != t[i].name || m.indices.size() != n.indices.size() ||
+        m.num_face_vertices != n.num_face_vertices ||
+        m.material_ids != n.material_ids ||
+        m.smoothing_group_ids != n.smoothing_group_ids)
+      return false;
+
+    for (int k = 0; k < (int)m.indices.size(); k++)
+      if (m.indices[k].vertex_index != n.indices[k].vertex_index ||
+          m.indices[k].normal_index != n.indices[k].normal_index ||
+          m.indices[k].texcoord_index != n.indices[k].texcoord_index)
+        return false;
+  }
+
+  return true;
+}
+
+// Times tinyobj and the parallel parser for 1, 2, 4... threads, up to the
+// hardware threads, and checks that they give the same result
+void benchmarkOBJParser(const std::string &path) {
+  size_t slash = path.find_last_of("/\\");
+  std::string folder = slash == std::string::npos ? "" : path.substr(0, slash);
+
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string warn, err;
+
+  auto t0 = std::chrono::system_clock::now();
+  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
+                              path.c_str(), folder.c_str(), true);
+  auto t1 = std::chrono::system_clock::now();
+  float tinyobjTime = std::chrono::duration<float>(t1 - t0).count();
+
+  if (!ret) {
+    printf("Failed to load/parse '%s'.\n", path.c_str());
+    return;
+  }
+  printf("OBJ parse, %-10s: %.3f seconds\n", "tinyobj", tinyobjTime);
+
+  int maxThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+  for (int threads = 1;; threads = std::min(2 * threads, maxThreads)) {
+    tinyobj::attrib_t pAttrib;
+    std::vector<tinyobj::shape_t> pShapes;
+    std::vector<tinyobj::material_t> pMaterials;
+    std::string pWarn;
+    Thread_Pool pool(threads);
+
+    auto t2 = std::chrono::system_clock::now();
+    bool parallel = parseOBJParallel(path, folder, pool, pAttrib, pShapes,
+                                     pMaterials, pWarn);
+    auto t3 = std::chrono::system_clock::now();
+    float time = std::chrono::duration<float>(t3 - t2).count();
+
+    if (!parallel) {
+      printf("OBJ parse, %-10s: file left to tinyobj\n", "parallel");
+      return;
+    }
+
+    printf("OBJ parse, %2d threads: %.3f seconds, %.2fx, %s\n", threads, time,
+           tinyobjTime / time,
+           sameOBJ(attrib, shapes, pAttrib, pShapes) &&
+                   materials.size() == pMaterials.size()
+               ? "identical"
+               : "DIFFERENT");
+
+    if (threads == maxThreads) break;
+  }
+}
+
+#endif
@@ -1,8 +1,8 @@
 #ifndef PDFSH
 #define PDFSH
 
+#include "cpu/thread_pool.hpp"
 #include "host_common.hpp"
-#include "programs.hpp"
 
 /*! The precompiled programs code (in ptx) that our cmake script
 will precompile (to ptx) and link to the generated executable */
@@ -12,6 +12,7 @@ extern "C" const char Sphere_PDF_PTX[];
 struct PDF {
   virtual Program createSample(Context &g_context) const = 0;
   virtual Program createPDF(Context &g_context) const = 0;
+  virtual CPU_Light createLight(const float3 &emission) const = 0;
 };
 
 struct Rectangle_PDF : public PDF {
@@ -75,6 +76,21 @@ struct Rectangle_PDF : public PDF {
     return pdf;
   }
 
+  virtual CPU_Light createLight(const float3 &emission) const override {
+    CPU_Light light;
+
+    light.type = RECT_LIGHT;
+    light.a0 = a0;
+    light.a1 = a1;
+    light.b0 = b0;
+    light.b1 = b1;
+    light.k = k;
+    light.axis = ax;
+    light.emission = emission;
+
+    return light;
+  }
+
   float a0, a1, b0, b1, k;
   AXIS ax;
 };
@@ -104,8 +120,99 @@ struct Sphere_PDF : public PDF {
     return pdf;
   }
 
+  virtual CPU_Light createLight(const float3 &emission) const override {
+    CPU_Light light;
+
+    light.type = SPHERE_LIGHT;
+    light.center = center;
+    light.radius = radius;
+    light.emission = emission;
+
+    return light;
+  }
+
   float radius;
   float3 center;
 };
 
+// Light sampling PDFs of the scene, with the emission of each light
+struct Light_Sampler {
+  void push(PDF *pdf, const float3 &emission) {
+    pdfs.push_back(pdf);
+    emissions.push_back(emission);
+  }
+
+  std::vector<PDF *> pdfs;
+  std::vector<float3> emissions;
+};
+
+// Widest sampling distribution of an environment map, the cells of wider maps
+// average blocks of texels
+#define ENVIRONMENT_MAX_WIDTH 1024
+
+// Builds the sampling distribution of an environment map, proportional to the
+// luminance of its texels times sin(theta), the rows split among the threads
+// of 'pool'. It's left disabled if the map is black.
+void buildEnvironment(const CPU_Image_Level &map, CPU_Environment &env,
+                      Thread_Pool &pool) {
+  int width = map.width, height = map.height;
+  while (width > ENVIRONMENT_MAX_WIDTH) {
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+
+  env.width = width;
+  env.height = height;
+  env.marginal.assign(height + 1, 0.f);
+  env.conditional.assign((size_t)height * (width + 1), 0.f);
+  std::vector<double> rows(height);
+
+  // cells of each row, and the CDF of the row
+  pool.parallel_for(height, [&](int row) {
+    std::vector<double> cells(width, 0.0);
+    std::vector<int> counts(width, 0);
+
+    int y0 = row * map.height / height;
+    int y1 = std::max((row + 1) * map.height / height, y0 + 1);
+    for (int y = y0; y < y1; y++)
+      for (int x = 0; x < map.width; x++) {
+        const float4 &t = map.texels[(size_t)y * map.width + x];
+        int cell = x * width / map.width;
+        cells[cell] += 0.2126f * t.x + 0.7152f * t.y + 0.0722f * t.z;
+        counts[cell]++;
+      }
+
+    double sum = 0.0;
+    for (int col = 0; col < width; col++) {
+      if (counts[col] > 0) cells[col] /= counts[col];
+      sum += cells[col];
+    }
+
+    // rows without light are never picked, their cells stay uniform
+    float *cdf = &env.conditional[(size_t)row * (width + 1)];
+    double partial = 0.0;
+    for (int col = 0; col < width; col++) {
+      partial += cells[col];
+      cdf[col + 1] = sum > 0.0 ? (float)(partial / sum)
+                               : (float)(col + 1) / width;
+    }
+    cdf[width] = 1.f;
+
+    rows[row] = sum * sinf(PI_F * (row + 0.5f) / height);
+  });
+
+  double total = 0.0;
+  for (int row = 0; row < height; row++) total += rows[row];
+
+  env.enabled = total > 0.0;
+  if (!env.enabled) return;
+
+  double partial = 0.0;
+  for (int row = 0; row < height; row++) {
+    partial += rows[row];
+    env.marginal[row + 1] = (float)(partial / total);
+  }
+  env.marginal[height] = 1.f;
+}
+
 #endif
\ No newline at end of file
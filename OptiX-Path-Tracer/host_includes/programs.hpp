@@ -18,9 +18,16 @@ void setRayGenerationProgram(Context &g_context, Light_Sampler &lights) {
   // create raygen program of the scene
   Program raygen = createProgram(Raygen_PTX, "renderPixel", g_context);
 
+  // create the light sampling callable programs
+  std::vector<Program> sample, pdf;
+  for (int i = 0; i < (int)lights.pdfs.size(); i++) {
+    sample.push_back(lights.pdfs[i]->createSample(g_context));
+    pdf.push_back(lights.pdfs[i]->createPDF(g_context));
+  }
+
   // Light sampling params and buffers
-  g_context["Light_Sample"]->setBuffer(createBuffer(lights.sample, g_context));
-  g_context["Light_PDF"]->setBuffer(createBuffer(lights.pdf, g_context));
+  g_context["Light_Sample"]->setBuffer(createBuffer(sample, g_context));
+  g_context["Light_PDF"]->setBuffer(createBuffer(pdf, g_context));
   g_context["Light_Emissions"]->setBuffer(
       createBuffer(lights.emissions, g_context));
   g_context["numLights"]->setInt((int)lights.emissions.size());
@@ -29,19 +36,58 @@ void setRayGenerationProgram(Context &g_context, Light_Sampler &lights) {
   g_context->setRayGenerationProgram(/*program ID:*/ 0, raygen);
 }
 
+void setRayGenerationProgram(CPU_Scene &scene, Light_Sampler &lights) {
+  scene.lights.clear();
+
+  for (int i = 0; i < (int)lights.pdfs.size(); i++)
+    scene.lights.push_back(lights.pdfs[i]->createLight(lights.emissions[i]));
+}
+
+void setRayGenerationProgram(App_State &app, Light_Sampler &lights) {
+  if (app.CPU)
+    setRayGenerationProgram(app.cpuScene, lights);
+  else
+    setRayGenerationProgram(app.context, lights);
+}
+
 typedef enum { GRADIENT, CONSTANT, IMG, HDR } Miss_Programs;
 
-// Image Miss Programs
+// Sets the environment light sampled by Direct_Light, disabled environments
+// get single entry buffers. 'texture' is the HDR map's, -1 without one.
+void setEnvironmentLight(Context &g_context, CPU_Environment environment,
+                         int texture, bool isSpherical) {
+  if (!environment.enabled) {
+    environment.width = environment.height = 1;
+    environment.marginal.assign(2, 0.f);
+    environment.conditional.assign(2, 0.f);
+  }
+
+  g_context["Environment_Marginal"]->setBuffer(
+      createBuffer(environment.marginal, g_context));
+  g_context["Environment_Conditional"]->setBuffer(
+      createBuffer(environment.conditional, g_context));
+  g_context["environmentLight"]->setInt(environment.enabled);
+  g_context["environmentTexture"]->setInt(texture);
+  g_context["environmentSpherical"]->setInt(isSpherical);
+  g_context["environmentWidth"]->setInt(environment.width);
+  g_context["environmentHeight"]->setInt(environment.height);
+}
+
+// Image Miss Programs. HDR environments are sampled as lights if 'isSampled'
+// is set.
 void setMissProgram(Context &g_context, Miss_Programs id, std::string fileName,
-                    bool isSpherical = true) {
+                    bool isSpherical = true, bool isSampled = true) {
   Program missProgram;
+  CPU_Environment environment;
+  environment.enabled = false;
+  int environmentTexture = -1;
 
   // LDR image background
   if (id == IMG) {
     missProgram = createProgram(Miss_PTX, "image_background", g_context);
 
     Image_Texture img(fileName);
-    missProgram["sample_texture"]->setProgramId(img.assignTo(g_context));
+    missProgram["sample_texture"]->setInt(img.assignTo(g_context));
   }
 
   // HDR image background
@@ -49,7 +95,12 @@ void setMissProgram(Context &g_context, Miss_Programs id, std::string fileName,
     missProgram = createProgram(Miss_PTX, "environmental_mapping", g_context);
 
     HDR_Texture img(fileName);
-    missProgram["sample_texture"]->setProgramId(img.assignTo(g_context));
+    CPU_Image image = img.loadHDRImage(fileName);
+    environmentTexture = img.assignTo(g_context, image);
+    missProgram["sample_texture"]->setInt(environmentTexture);
+    if (isSampled)
+      buildEnvironment(image.levels[0], environment,
+                       textureCache.getThreadPool());
 
     // set to false if it's a cylindrical map
     missProgram["isSpherical"]->setInt(isSpherical);
@@ -59,6 +110,7 @@ void setMissProgram(Context &g_context, Miss_Programs id, std::string fileName,
     throw "Parameters invalid, miss program unknown or not yet implemented";
 
   g_context->setMissProgram(/*program ID:*/ 0, missProgram);
+  setEnvironmentLight(g_context, environment, environmentTexture, isSpherical);
 }
 
 // Color Miss Programs
@@ -73,8 +125,8 @@ void setMissProgram(Context &g_context, Miss_Programs id,
 
     Constant_Texture color1(colorValue1);
     Constant_Texture color2(colorValue2);
-    missProgram["sample_color1"]->setProgramId(color1.assignTo(g_context));
-    missProgram["sample_color2"]->setProgramId(color2.assignTo(g_context));
+    missProgram["sample_color1"]->setInt(color1.assignTo(g_context));
+    missProgram["sample_color2"]->setInt(color2.assignTo(g_context));
   }
 
   // constant color background
@@ -82,13 +134,89 @@ void setMissProgram(Context &g_context, Miss_Programs id,
     missProgram = createProgram(Miss_PTX, "constant_color", g_context);
 
     Constant_Texture color(colorValue1);
-    missProgram["sample_texture"]->setProgramId(color.assignTo(g_context));
+    missProgram["sample_texture"]->setInt(color.assignTo(g_context));
   }
 
   else
     throw "Parameters invalid, miss program unknown or not yet implemented";
 
   g_context->setMissProgram(/*program ID:*/ 0, missProgram);
+  setEnvironmentLight(g_context, CPU_Environment(), -1, true);
+}
+
+// Image Miss Programs for the CPU backend
+void setMissProgram(CPU_Scene &scene, Miss_Programs id, std::string fileName,
+                    bool isSpherical = true, bool isSampled = true) {
+  scene.environment = CPU_Environment();
+  scene.environment.enabled = false;
+
+  // LDR image background
+  if (id == IMG) {
+    Image_Texture img(fileName);
+    scene.miss.type = IMAGE_MISS;
+    scene.miss.textures[0] = img.assignTo(scene);
+  }
+
+  // HDR image background
+  else if (id == HDR) {
+    HDR_Texture img(fileName);
+    CPU_Image image = img.loadHDRImage(fileName);
+    scene.miss.type = ENVIRONMENT_MISS;
+    scene.miss.textures[0] = img.assignTo(scene, image);
+    scene.miss.isSpherical = isSpherical;
+    if (isSampled)
+      buildEnvironment(image.levels[0], scene.environment,
+                       textureCache.getThreadPool());
+  }
+
+  else
+    throw "Parameters invalid, miss program unknown or not yet implemented";
+}
+
+// Color Miss Programs for the CPU backend
+void setMissProgram(CPU_Scene &scene, Miss_Programs id,
+                    float3 colorValue1 = make_float3(0.f),
+                    float3 colorValue2 = make_float3(0.f)) {
+  scene.environment = CPU_Environment();
+  scene.environment.enabled = false;
+
+  // gradient pattern background
+  if (id == GRADIENT) {
+    Constant_Texture color1(colorValue1);
+    Constant_Texture color2(colorValue2);
+    scene.miss.type = GRADIENT_MISS;
+    scene.miss.textures[0] = color1.assignTo(scene);
+    scene.miss.textures[1] = color2.assignTo(scene);
+  }
+
+  // constant color background
+  else if (id == CONSTANT) {
+    Constant_Texture color(colorValue1);
+    scene.miss.type = CONSTANT_MISS;
+    scene.miss.textures[0] = color.assignTo(scene);
+  }
+
+  else
+    throw "Parameters invalid, miss program unknown or not yet implemented";
+}
+
+void setMissProgram(App_State &app, Miss_Programs id, std::string fileName,
+                    bool isSpherical = true) {
+  if (app.CPU)
+    setMissProgram(app.cpuScene, id, fileName, isSpherical,
+                   app.environmentSampling);
+  else
+    setMissProgram(app.context, id, fileName, isSpherical,
+                   app.environmentSampling);
+}
+
+void setMissProgram(App_State &app, Miss_Programs id,
+                    float3 colorValue1 = make_float3(0.f),
+                    float3 colorValue2 = make_float3(0.f)) {
+  if (app.CPU)
+    setMissProgram(app.cpuScene, id, colorValue1, colorValue2);
+  else
+    setMissProgram(app.context, id, colorValue1, colorValue2);
 }
 
 void setExceptionProgram(Context &g_context) {
@@ -96,4 +224,9 @@ void setExceptionProgram(Context &g_context) {
   g_context->setExceptionProgram(/*program ID:*/ 0, prog);
 }
 
+// the CPU backend has no exception program
+void setExceptionProgram(App_State &app) {
+  if (!app.CPU) setExceptionProgram(app.context);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,262 @@
+#ifndef RGBELOADERH
+#define RGBELOADERH
+
+// rgbe_loader.hpp: Define the reader of Radiance RGBE (.hdr) images. Files are
+// memory mapped, their run length encoded scanlines decoded in parallel blocks
+// and converted to floats with SSE, straight into float4 texels.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define RGBE_SSE
+#endif
+
+#include "cpu/thread_pool.hpp"
+#include "host_common.hpp"
+#include "mapped_file.hpp"
+
+#include <chrono>
+
+// Reads the header of an RGBE image and its resolution, leaving 'offset' at
+// the first scanline. Only the usual top to bottom, left to right scanlines
+// are supported.
+bool parseRGBEHeader(const char *data, size_t size, int &width, int &height,
+                     size_t &offset) {
+  if (size < 2 || data[0] != '#' || data[1] != '?') return false;
+
+  // lines up to the empty one ending the header, then the resolution
+  size_t pos = 0;
+  for (bool header = true;;) {
+    size_t eol = pos;
+    while (eol < size && data[eol] != '\n') eol++;
+    if (eol == size) return false;
+
+    std::string line(data + pos, eol - pos);
+    pos = eol + 1;
+
+    if (!header) {
+      if (sscanf(line.c_str(), "-Y %d +X %d", &height, &width) != 2)
+        return false;
+      break;
+    }
+
+    if (line.empty())
+      header = false;
+    else if (!line.compare(0, 7, "FORMAT=") &&
+             line != "FORMAT=32-bit_rle_rgbe")
+      return false;
+  }
+
+  offset = pos;
+  return width > 0 && height > 0;
+}
+
+// Whether a scanline starts with the marker of the run length encoding of
+// separate channels
+inline bool isRLEScanline(const unsigned char *p, const unsigned char *end,
+                          int width) {
+  return width >= 8 && width < 32768 && end - p >= 4 && p[0] == 2 &&
+         p[1] == 2 && ((p[2] << 8) | p[3]) == width;
+}
+
+// Decodes a scanline whose channels are run length encoded one after the
+// other, or only finds its end if 'rgbe' is null. Returns the end of the
+// scanline, or null if it's corrupt.
+const unsigned char *decodeRLEScanline(const unsigned char *p,
+                                       const unsigned char *end, int width,
+                                       unsigned char *rgbe) {
+  p += 4;
+
+  for (int c = 0; c < 4; c++)
+    for (int x = 0; x < width;) {
+      if (p >= end) return nullptr;
+      int code = *p++;
+
+      if (code > 128) {  // run of a single value
+        code &= 127;
+        if (p >= end || x + code > width) return nullptr;
+        if (rgbe)
+          for (int i = 0; i < code; i++) rgbe[(x + i) * 4 + c] = *p;
+        p++;
+      } else {  // literal values
+        if (code == 0 || end - p < code || x + code > width) return nullptr;
+        if (rgbe)
+          for (int i = 0; i < code; i++) rgbe[(x + i) * 4 + c] = p[i];
+        p += code;
+      }
+
+      x += code;
+    }
+
+  return p;
+}
+
+// Decodes a flat scanline, where (1, 1, 1, n) texels repeat the previous one,
+// n shifted by 8 more bits for each consecutive repeat. Returns the end of the
+// scanline, or null if it's corrupt.
+const unsigned char *decodeFlatScanline(const unsigned char *p,
+                                        const unsigned char *end, int width,
+                                        unsigned char *rgbe) {
+  int shift = 0;
+
+  for (int x = 0; x < width;) {
+    if (end - p < 4) return nullptr;
+
+    if (p[0] == 1 && p[1] == 1 && p[2] == 1) {
+      if (x == 0 || shift > 16) return nullptr;
+      int count = std::min(p[3] << shift, width - x);
+      for (int i = 0; i < count; i++, x++)
+        memcpy(&rgbe[x * 4], &rgbe[(x - 1) * 4], 4);
+      shift += 8;
+    } else {
+      memcpy(&rgbe[x * 4], p, 4);
+      x++;
+      shift = 0;
+    }
+
+    p += 4;
+  }
+
+  return p;
+}
+
+// Converts RGBE texels to floats, value * 2^(exponent - 136), with a zero
+// alpha. Exponents below 2, which give values under 1e-38, decode to 0.
+inline void convertRGBE(const unsigned char *rgbe, float4 *texels, int width) {
+  int i = 0;
+
+#ifdef RGBE_SSE
+  const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi32(1);
+  const __m128 scale = _mm_set1_ps(1.f / 256.f);
+  const __m128 rgb = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+
+  // four texels per iteration, widened to one 32 bit lane per channel
+  for (; i + 4 <= width; i += 4) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)&rgbe[i * 4]);
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+    __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+    __m128i texel[4] = {
+        _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+        _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+
+    for (int k = 0; k < 4; k++) {
+      // 2^(exponent - 128) from its float exponent bits
+      __m128i e = _mm_shuffle_epi32(texel[k], 0xff);
+      __m128i bits = _mm_slli_epi32(_mm_sub_epi32(e, one), 23);
+      __m128 power = _mm_castsi128_ps(
+          _mm_and_si128(bits, _mm_cmpgt_epi32(e, one)));
+
+      __m128 value = _mm_mul_ps(
+          _mm_mul_ps(_mm_cvtepi32_ps(texel[k]), scale), power);
+      _mm_storeu_ps(&texels[i + k].x, _mm_and_ps(value, rgb));
+    }
+  }
+#endif
+
+  for (; i < width; i++) {
+    const unsigned char *p = &rgbe[i * 4];
+    float f = p[3] > 1 ? ldexpf(1.f, p[3] - 128) : 0.f;
+    texels[i] = make_float4(p[0] / 256.f * f, p[1] / 256.f * f,
+                            p[2] / 256.f * f, 0.f);
+  }
+}
+
+// Loads an RGBE image into float4 texels with a zero alpha, top row first like
+// the file. The run length encoded scanlines are found with a walk over their
+// run codes and decoded in blocks of rows split among the pool's threads.
+// Returns false if the file isn't a valid RGBE image.
+bool loadRGBE(const std::string &path, CPU_Image_Level &level,
+              Thread_Pool &pool) {
+  Mapped_File file;
+  size_t offset;
+  int width, height;
+  if (!file.open(path) ||
+      !parseRGBEHeader(file.data, file.size, width, height, offset))
+    return false;
+
+  const unsigned char *end = (const unsigned char *)file.data + file.size;
+  const unsigned char *p = (const unsigned char *)file.data + offset;
+
+  // starts of the scanlines, up to the first one that isn't run length
+  // encoded, which are rare and decoded in order afterwards
+  std::vector<const unsigned char *> rows;
+  while ((int)rows.size() < height && isRLEScanline(p, end, width)) {
+    rows.push_back(p);
+    p = decodeRLEScanline(p, end, width, nullptr);
+    if (!p) return false;
+  }
+
+  level.width = width;
+  level.height = height;
+  level.texels.resize((size_t)width * height);
+
+  std::atomic<bool> valid(true);
+  pool.parallel_blocks((int)rows.size(), 16, [&](int first, int last) {
+    std::vector<unsigned char> rgbe(width * 4);
+    for (int y = first; y < last; y++) {
+      if (!decodeRLEScanline(rows[y], end, width, rgbe.data())) valid = false;
+      convertRGBE(rgbe.data(), &level.texels[(size_t)y * width], width);
+    }
+  });
+
+  std::vector<unsigned char> rgbe(width * 4);
+  for (int y = (int)rows.size(); y < height && p; y++) {
+    if (isRLEScanline(p, end, width))
+      p = decodeRLEScanline(p, end, width, rgbe.data());
+    else
+      p = decodeFlatScanline(p, end, width, rgbe.data());
+    if (p) convertRGBE(rgbe.data(), &level.texels[(size_t)y * width], width);
+  }
+
+  return valid && p;
+}
+
+// Times HDRLoader and the RGBE reader for 1, 2, 4... threads, up to the
+// hardware threads, and checks that they give the same texels. Values under
+// 1e-37, which the RGBE reader flushes to 0, are considered equal.
+void benchmarkRGBELoader(const std::string &path) {
+  HDRImage reference;
+  auto t0 = std::chrono::system_clock::now();
+  bool ret = HDRLoader::load(path.c_str(), reference);
+  auto t1 = std::chrono::system_clock::now();
+  float loaderTime = std::chrono::duration<float>(t1 - t0).count();
+
+  if (!ret) {
+    printf("Failed to load '%s'.\n", path.c_str());
+    return;
+  }
+  printf("HDR load, %-10s: %.3f seconds\n", "HDRLoader", loaderTime);
+
+  int maxThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+  for (int threads = 1;; threads = std::min(2 * threads, maxThreads)) {
+    Thread_Pool pool(threads);
+    CPU_Image_Level level;
+
+    auto t2 = std::chrono::system_clock::now();
+    bool loaded = loadRGBE(path, level, pool);
+    auto t3 = std::chrono::system_clock::now();
+    float time = std::chrono::duration<float>(t3 - t2).count();
+
+    if (!loaded) {
+      printf("HDR load, %-10s: invalid file\n", "RGBE");
+      break;
+    }
+
+    bool same = level.width == reference.width &&
+                level.height == reference.height;
+    for (int i = 0; same && i < level.width * level.height; i++) {
+      const float *a = &level.texels[i].x, *b = &reference.colors[i * 3];
+      for (int c = 0; c < 3; c++)
+        same &= a[c] == b[c] || (fabsf(a[c]) < 1e-37f && fabsf(b[c]) < 1e-37f);
+      same &= level.texels[i].w == 0.f;
+    }
+
+    printf("HDR load, %2d threads: %.3f seconds, %.2fx, %s\n", threads, time,
+           loaderTime / time, same ? "identical" : "DIFFERENT");
+
+    if (threads == maxThreads) break;
+  }
+
+  delete[] reference.colors;
+}
+
+#endif
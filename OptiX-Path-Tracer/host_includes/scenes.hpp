@@ -10,6 +10,37 @@
 #include "mesh.hpp"
 #include "pdfs.hpp"
 
+// Creates the scene group of the OptiX backend, the CPU one doesn't need it
+Group createGroup(App_State& app) {
+  if (app.CPU) return Group();
+
+  Group group = app.context->createGroup();
+  group->setAcceleration(app.context->createAcceleration("Trbvh"));
+  return group;
+}
+
+// Transforms list elements, one by one, and adds them to the scene of the
+// selected backend
+void addToScene(App_State& app, Hitable_List& list, Group& group) {
+  if (app.CPU)
+    list.addElementsTo(app.cpuScene);
+  else {
+    list.addElementsTo(group, app.context);
+    app.context["world"]->set(group);
+  }
+}
+
+// Adds a transformed mesh to the scene of the selected backend
+void addToScene(App_State& app, Mesh& model, Group& group) {
+  model.setAttributes((Mesh_Attributes)app.meshAttributes);
+  model.setThreadPool(app.pool);
+
+  if (app.CPU)
+    model.addTo(app.cpuScene);
+  else
+    model.addTo(group, app.context);
+}
+
 // TODO: convert pointers to smart/shared pointers
 // TODO: add lights separately from raygen, and after all materials are
 // created(we may need to add back the material type to the materials)
@@ -21,15 +52,14 @@ void InOneWeekend(App_State& app) {
   Light_Sampler lights;
 
   // Set the exception, ray generation and miss shader programs
-  setRayGenerationProgram(app.context, lights);
-  setMissProgram(app.context, GRADIENT,          // gradient sky pattern
+  setRayGenerationProgram(app, lights);
+  setMissProgram(app, GRADIENT,                  // gradient sky pattern
                  make_float3(1.f),               // white
                  make_float3(0.5f, 0.7f, 1.f));  // light blue
-  setExceptionProgram(app.context);
+  setExceptionProgram(app);
 
-  // Set acceleration structure
-  Group group = app.context->createGroup();
-  group->setAcceleration(app.context->createAcceleration("Trbvh"));
+  // create scene group, only used by the OptiX backend
+  Group group = createGroup(app);
 
   // create geometries
   Hitable_List list;
@@ -73,8 +103,7 @@ void InOneWeekend(App_State& app) {
   list.push(new Sphere(make_float3(-4.f, 1.f, 1.f), 1.f, mt3));
 
   // transforms list elements, one by one, and adds them to the graph
-  list.addElementsTo(group, app.context);
-  app.context["world"]->set(group);
+  addToScene(app, list, group);
 
   // configure camera
   const float3 lookfrom = make_float3(13.f, 2.f, 3.f);
@@ -85,7 +114,7 @@ void InOneWeekend(App_State& app) {
   const float aperture(0.1f);
   const float dist(10.f);
   Camera camera(lookfrom, lookat, up, fovy, aspect, aperture, dist, 0.0, 1.0);
-  camera.set(app.context);
+  camera.set(app);
 
   auto t1 = std::chrono::system_clock::now();
   auto sceneTime = std::chrono::duration<float>(t1 - t0).count();
@@ -98,18 +127,15 @@ void MovingSpheres(App_State& app) {
   // add light parameters and programs
   Light_Sampler lights;
   Rectangle_PDF rect_pdf(3.f, 5.f, 1.f, 3.f, -0.5f, Z_AXIS);
-  lights.pdf.push_back(rect_pdf.createPDF(app.context));
-  lights.sample.push_back(rect_pdf.createSample(app.context));
-  lights.emissions.push_back(make_float3(4.f));
+  lights.push(&rect_pdf, make_float3(4.f));
 
   // Set the exception, ray generation and miss shader programs
-  setRayGenerationProgram(app.context, lights);
-  setMissProgram(app.context, CONSTANT);  // dark background
-  setExceptionProgram(app.context);
+  setRayGenerationProgram(app, lights);
+  setMissProgram(app, CONSTANT);  // dark background
+  setExceptionProgram(app);
 
-  // Set acceleration structure
-  Group group = app.context->createGroup();
-  group->setAcceleration(app.context->createAcceleration("Trbvh"));
+  // create scene group, only used by the OptiX backend
+  Group group = createGroup(app);
 
   // create scene
   Hitable_List list;
@@ -166,8 +192,7 @@ void MovingSpheres(App_State& app) {
   list.push(new AARect(3.f, 5.f, 1.f, 3.f, -0.5f, false, Z_AXIS, lmt));
 
   // transforms list elements, one by one, and adds them to the graph
-  list.addElementsTo(group, app.context);
-  app.context["world"]->set(group);
+  addToScene(app, list, group);
 
   // configure camera
   const float3 lookfrom = make_float3(13, 2, 3);
@@ -178,7 +203,7 @@ void MovingSpheres(App_State& app) {
   const float aperture(0.1f);
   const float dist(10.f);
   Camera camera(lookfrom, lookat, up, fovy, aspect, aperture, dist, 0.0, 1.0);
-  camera.set(app.context);
+  camera.set(app);
 
   auto t1 = std::chrono::system_clock::now();
   auto sceneTime = std::chrono::duration<float>(t1 - t0).count();
@@ -191,18 +216,15 @@ void Cornell(App_State& app) {
   // add light parameters and programs
   Light_Sampler lights;
   Rectangle_PDF rect_pdf(213.f, 343.f, 227.f, 332.f, 554.f, Y_AXIS);
-  lights.pdf.push_back(rect_pdf.createPDF(app.context));
-  lights.sample.push_back(rect_pdf.createSample(app.context));
-  lights.emissions.push_back(make_float3(7.f));
+  lights.push(&rect_pdf, make_float3(7.f));
 
   // Set the exception, ray generation and miss shader programs
-  setRayGenerationProgram(app.context, lights);
-  setMissProgram(app.context, CONSTANT);  // dark background
-  setExceptionProgram(app.context);
+  setRayGenerationProgram(app, lights);
+  setMissProgram(app, CONSTANT);  // dark background
+  setExceptionProgram(app);
 
-  // create scene group
-  Group group = app.context->createGroup();
-  group->setAcceleration(app.context->createAcceleration("Trbvh"));
+  // create scene group, only used by the OptiX backend
+  Group group = createGroup(app);
 
   // create textures
   Texture* redTx = new Constant_Texture(0.65f, 0.05f, 0.05f);
@@ -240,8 +262,7 @@ void Cornell(App_State& app) {
   list.push(&box1);*/
 
   // transforms list elements, one by one, and adds them to the scene graph
-  list.addElementsTo(group, app.context);
-  app.context["world"]->set(group);
+  addToScene(app, list, group);
 
   // configure camera
   const float3 lookfrom = make_float3(278.f, 278.f, -800.f);
@@ -252,7 +273,7 @@ void Cornell(App_State& app) {
   const float aperture(0.f);
   const float dist(10.f);
   Camera camera(lookfrom, lookat, up, fovy, aspect, aperture, dist, 0.0, 1.0);
-  camera.set(app.context);
+  camera.set(app);
 
   auto t1 = std::chrono::system_clock::now();
   auto sceneTime = std::chrono::duration<float>(t1 - t0).count();
@@ -265,17 +286,15 @@ void Final_Next_Week(App_State& app) {
 
   Light_Sampler lights;
   Rectangle_PDF rect_pdf(113.f, 443.f, 127.f, 432.f, 554.f, Y_AXIS);
-  lights.pdf.push_back(rect_pdf.createPDF(app.context));
-  lights.sample.push_back(rect_pdf.createSample(app.context));
-  lights.emissions.push_back(make_float3(7.f));
+  lights.push(&rect_pdf, make_float3(7.f));
 
   // Set the exception, ray generation and miss shader programs
-  setRayGenerationProgram(app.context, lights);
-  setMissProgram(app.context, CONSTANT);  // dark background
-  setExceptionProgram(app.context);
+  setRayGenerationProgram(app, lights);
+  setMissProgram(app, CONSTANT);  // dark background
+  setExceptionProgram(app);
 
-  Group group = app.context->createGroup();
-  group->setAcceleration(app.context->createAcceleration("Trbvh"));
+  // create scene group, only used by the OptiX backend
+  Group group = createGroup(app);
 
   Hitable_List list;
 
@@ -352,11 +371,13 @@ void Final_Next_Week(App_State& app) {
   }
   spheres.translate(make_float3(-100.f, 270.f, 395.f));
   spheres.rotate(15.f, Y_AXIS);
-  spheres.addListTo(group, app.context);
+  if (app.CPU)
+    spheres.addListTo(app.cpuScene);
+  else
+    spheres.addListTo(group, app.context);
 
   // transforms list elements, one by one, and adds them to the graph
-  list.addElementsTo(group, app.context);
-  app.context["world"]->set(group);
+  addToScene(app, list, group);
 
   // configure camera
   const float3 lookfrom = make_float3(478.f, 278.f, -600.f);
@@ -367,7 +388,7 @@ void Final_Next_Week(App_State& app) {
   const float aperture(0.f);
   const float dist(10.f);
   Camera camera(lookfrom, lookat, up, fovy, aspect, aperture, dist, 0.0, 1.0);
-  camera.set(app.context);
+  camera.set(app);
 
   auto t1 = std::chrono::system_clock::now();
   auto sceneTime = std::chrono::duration<float>(t1 - t0).count();
@@ -381,16 +402,15 @@ void Test_Scene(App_State& app) {
   Light_Sampler lights;
 
   // Set the exception, ray generation and miss shader programs
-  setRayGenerationProgram(app.context, lights);
+  setRayGenerationProgram(app, lights);
   // setMissProgram(app.context, HDR, "../../../assets/hdr/ennis.hdr");
-  setMissProgram(app.context, GRADIENT,          // gradient sky pattern
+  setMissProgram(app, GRADIENT,                  // gradient sky pattern
                  make_float3(1.f),               // white
                  make_float3(0.5f, 0.7f, 1.f));  // light blue
-  setExceptionProgram(app.context);
+  setExceptionProgram(app);
 
-  // create scene group
-  Group group = app.context->createGroup();
-  group->setAcceleration(app.context->createAcceleration("Trbvh"));
+  // create scene group, only used by the OptiX backend
+  Group group = createGroup(app);
 
   // create textures
   Texture* whiteTx = new Constant_Texture(0.73f);
@@ -428,8 +448,13 @@ void Test_Scene(App_State& app) {
     model2.scale(make_float3(100.f));
     model2.rotate(-90.f, Y_AXIS);
     model2.translate(make_float3(80.f, -500.f, 80.f));
+    model2.setAttributes((Mesh_Attributes)app.meshAttributes);
+    model2.setThreadPool(app.pool);
     meshList.push(&model2);
-    meshList.addElementsTo(group, app.context);
+    if (app.CPU)
+      meshList.addElementsTo(app.cpuScene);
+    else
+      meshList.addElementsTo(group, app.context);
 
     list.push(new Sphere(make_float3(0.f, -400.f, 0.f), 150.f, whiteMt));
     list.push(new AARect(-1000.f, 1000.f, -500.f, 500.f, -600.f, false, Y_AXIS,
@@ -441,7 +466,7 @@ void Test_Scene(App_State& app) {
     Mesh model = Mesh("Lucy1M.obj", "../../../assets/lucy/", glassMt, app.RTX);
     model.scale(make_float3(150.f));
     model.translate(make_float3(0.f, -550.f, 0.f));
-    model.addTo(group, app.context);
+    addToScene(app, model, group);
 
     list.push(new AARect(-1000.f, 1000.f, -500.f, 500.f, -600.f, false, Y_AXIS,
                          whiteMt));
@@ -453,7 +478,7 @@ void Test_Scene(App_State& app) {
     model.scale(make_float3(350.f));
     model.rotate(180.f, Y_AXIS);
     model.translate(make_float3(0.f, -500.f, 200.f));
-    model.addTo(group, app.context);
+    addToScene(app, model, group);
 
     list.push(new AARect(-1000.f, 1000.f, -500.f, 500.f, -600.f, false, Y_AXIS,
                          whiteMt));
@@ -475,7 +500,7 @@ void Test_Scene(App_State& app) {
     Mesh model = Mesh("pie.obj", "../../../assets/pie/", app.RTX);
     model.scale(make_float3(150.f));
     model.translate(make_float3(0.f, -550.f, 0.f));
-    model.addTo(group, app.context);
+    addToScene(app, model, group);
 
     list.push(new AARect(-1000.f, 1000.f, -500.f, 500.f, -600.f, false, Y_AXIS,
                          whiteMt));
@@ -484,15 +509,15 @@ void Test_Scene(App_State& app) {
   // sponza
   else {
     Mesh model = Mesh("sponza.obj", "../../../assets/sponza/", app.RTX);
+    model.useSpatialSplits();  // long, thin architectural triangles
     model.scale(make_float3(0.5f));
     model.rotate(90.f, Y_AXIS);
     model.translate(make_float3(300.f, 5.f, -400.f));
-    model.addTo(group, app.context);
+    addToScene(app, model, group);
   }
 
   // transforms list elements, one by one, and adds them to the graph
-  list.addElementsTo(group, app.context);
-  app.context["world"]->set(group);
+  addToScene(app, list, group);
 
   // configure camera
   if ((app.model >= 0) && (app.model < 5)) {
@@ -504,7 +529,7 @@ void Test_Scene(App_State& app) {
     const float aperture(0.f);
     const float dist(0.8f);
     Camera camera(lookfrom, lookat, up, fovy, aspect, aperture, dist, 0.0, 1.0);
-    camera.set(app.context);
+    camera.set(app);
   }
 
   // for sponza
@@ -517,7 +542,7 @@ void Test_Scene(App_State& app) {
     const float aperture(0.f);
     const float dist(10.f);
     Camera camera(lookfrom, lookat, up, fovy, aspect, aperture, dist, 0.0, 1.0);
-    camera.set(app.context);
+    camera.set(app);
   }
 
   auto t1 = std::chrono::system_clock::now();
@@ -0,0 +1,390 @@
+#ifndef TEXTURECACHEH
+#define TEXTURECACHEH
+
+// texture_cache.hpp: Define the process wide cache of decoded images. Images
+// are keyed by the hash of their file contents, so every texture of the same
+// file, or of identical files, shares one decoded image, one device sampler
+// and one CPU image.
+
+#include "host_common.hpp"
+#include "mapped_file.hpp"
+#include "mipmap.hpp"
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include <chrono>
+#include <map>
+
+// Expands a row of 'width' texels of 'channels' bytes to RGBA. Images without
+// alpha are opaque, grey ones are replicated to RGB.
+inline void expandRow(const unsigned char *src, int channels, uchar4 *dst,
+                      int width) {
+  if (channels == 4) {
+    memcpy(dst, src, width * sizeof(uchar4));
+    return;
+  }
+
+  int i = 0;
+#ifdef __SSSE3__
+  if (channels == 3) {
+    const __m128i shuffle =
+        _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+    // four texels per iteration, the 16 byte loads stay within the row
+    for (; i + 6 <= width; i += 4) {
+      __m128i rgb = _mm_loadu_si128((const __m128i *)&src[i * 3]);
+      _mm_storeu_si128((__m128i *)&dst[i],
+                       _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha));
+    }
+  }
+#endif
+
+  for (; i < width; i++) {
+    const unsigned char *p = &src[i * channels];
+    if (channels >= 3)
+      dst[i] = make_uchar4(p[0], p[1], p[2], 255);
+    else
+      dst[i] = make_uchar4(p[0], p[0], p[0], channels == 2 ? p[1] : 255);
+  }
+}
+
+// Decoded image, in the bottom-up row order of the device buffers
+struct Cached_Image {
+  int width, height, channels;
+  std::vector<uchar4> texels;
+  std::vector<std::vector<uchar4> > mips;  // levels below the full image
+  int mipFilter;                           // filter the mips were built with
+  int references;   // textures of the current scene using it
+  bool ingested;    // decoded for the current scene and not acquired yet
+  uint64_t lastUse;  // eviction order of the unreferenced images
+
+  // per scene objects, created on first use
+  TextureSampler sampler;
+  int cpuImage;  // index in CPU_Scene::images, or -1
+};
+
+class Texture_Cache {
+ public:
+  Texture_Cache()
+      : memoryLimit(0), bytes(0), clock(0), decodes(0), shares(0), evictions(0),
+        savedBytes(0), mipFilter(NO_MIPMAPS), maxAnisotropy(1.f),
+        pool(nullptr) {}
+
+  // Images that aren't used by the current scene are evicted, least recently
+  // used first, while the cache holds more than 'limit' bytes. 0 disables
+  // the limit. Images of the current scene are never evicted.
+  void setMemoryLimit(size_t limit) {
+    memoryLimit = limit;
+    evict();
+  }
+
+  // Filter of the mip levels of the images, built on first use, and the most
+  // probes of their anisotropic lookups. Takes effect with the next scene.
+  void setMipmaps(Mip_Filter filter, float anisotropy) {
+    mipFilter = filter;
+    maxAnisotropy = anisotropy;
+  }
+
+  Mip_Filter getMipFilter() const { return mipFilter; }
+  float getMaxAnisotropy() const { return maxAnisotropy; }
+
+  // Threads decoding the images and building their mip levels, set before
+  // each scene
+  void setThreadPool(Thread_Pool *workers) { pool = workers; }
+  Thread_Pool &getThreadPool() const { return *pool; }
+
+  // Queues a file for the next ingestion. Scenes request the files of their
+  // textures when creating them, so they are all decoded together by the
+  // first acquire.
+  void request(const std::string &path) { pending.push_back(path); }
+
+  // Releases the images of the previous scene, along with its device samplers
+  // and CPU images, and resets the counters
+  void beginScene() {
+    for (std::map<Image_Key, Cached_Image>::iterator it = images.begin();
+         it != images.end(); ++it) {
+      it->second.references = 0;
+      it->second.sampler = TextureSampler();
+      it->second.cpuImage = -1;
+      it->second.ingested = false;
+    }
+
+    paths.clear();
+    pending.clear();
+    decodes = shares = evictions = 0;
+    savedBytes = 0;
+    evict();
+  }
+
+  // Returns the decoded image of a file, decoded only if no cached image has
+  // the same contents
+  Cached_Image *acquire(const std::string &path) {
+    if (!isCached(path)) {
+      pending.push_back(path);
+      ingest();
+    }
+
+    Cached_Image *image = &images.find(paths[path])->second;
+    if (image->ingested)
+      image->ingested = false;
+    else {
+      shares++;
+      savedBytes += image->texels.size() * sizeof(uchar4);
+    }
+
+    image->references++;
+    image->lastUse = clock++;
+    evict();
+
+    return image;
+  }
+
+  // Device sampler of an image, shared by every texture of the scene using it
+  TextureSampler getSampler(Cached_Image *image, Context &g_context) {
+    if (image->sampler.get() != nullptr) return image->sampler;
+    buildMips(image);
+
+    std::vector<const uchar4 *> levels(1, image->texels.data());
+    for (int i = 0; i < (int)image->mips.size(); i++)
+      levels.push_back(image->mips[i].data());
+
+    image->sampler =
+        createImageSampler(g_context, RT_FORMAT_UNSIGNED_BYTE4, image->width,
+                           image->height, levels, maxAnisotropy);
+    return image->sampler;
+  }
+
+  // Index of the float copy of an image in the CPU scene, shared by every
+  // texture of the scene using it
+  int getImage(Cached_Image *image, CPU_Scene &scene) {
+    if (image->cpuImage >= 0) return image->cpuImage;
+    buildMips(image);
+
+    CPU_Image cpu;
+    cpu.maxAnisotropy = maxAnisotropy;
+    cpu.levels.resize(image->mips.size() + 1);
+
+    for (int l = 0; l < (int)cpu.levels.size(); l++) {
+      const std::vector<uchar4> &texels =
+          l > 0 ? image->mips[l - 1] : image->texels;
+      CPU_Image_Level &level = cpu.levels[l];
+      level.width = mipSize(image->width, l);
+      level.height = mipSize(image->height, l);
+      level.texels.resize(texels.size());
+      expandTexels(texels.data(), level.texels.data(), (int)texels.size());
+    }
+
+    scene.images.push_back(cpu);
+    image->cpuImage = (int)scene.images.size() - 1;
+    return image->cpuImage;
+  }
+
+  // Reports the decodes and sharing of the current scene
+  void printStats() const {
+    printf("Texture cache: %d images decoded, %d shared, %.1f MB not "
+           "decoded again, %d evicted, %.1f MB held",
+           decodes, shares, savedBytes / 1048576.f, evictions,
+           bytes / 1048576.f);
+
+    if (memoryLimit > 0 && bytes > memoryLimit)
+      printf(", over the %.1f MB limit", memoryLimit / 1048576.f);
+    printf(".\n");
+  }
+
+ private:
+  typedef std::pair<uint64_t, size_t> Image_Key;  // content hash and size
+
+  // Whether the image of a file is held, files are hashed once per scene
+  bool isCached(const std::string &path) const {
+    std::map<std::string, Image_Key>::const_iterator known = paths.find(path);
+    return known != paths.end() && images.count(known->second) > 0;
+  }
+
+  // Hashes the queued files and decodes the images of new contents, each
+  // file on its own task, and reports the time each decode took
+  void ingest() {
+    std::vector<std::string> files;
+    for (int i = 0; i < (int)pending.size(); i++)
+      if (!isCached(pending[i]) &&
+          std::find(files.begin(), files.end(), pending[i]) == files.end())
+        files.push_back(pending[i]);
+    pending.clear();
+    if (files.empty()) return;
+
+    auto t0 = std::chrono::system_clock::now();
+    Thread_Pool &workers = *pool;
+
+    std::vector<Image_Key> keys(files.size());
+    std::vector<char> found(files.size(), 0);
+    workers.parallel_for((int)files.size(), [&](int i) {
+      Mapped_File file;
+      if (!file.open(files[i])) return;
+
+      uint64_t hash = hashBytes(file.data, file.size, HASH_SEED);
+      keys[i] = Image_Key(hash, file.size);
+      found[i] = 1;
+    });
+
+    // a single decode per contents, identical files share it
+    std::vector<int> owners;
+    for (int i = 0; i < (int)files.size(); i++) {
+      if (!found[i]) {
+        printf("Image '%s' is invalid or hasn't been found.\n",
+               files[i].c_str());
+        Exit_Program(EXIT_FAILURE);
+      }
+
+      paths[files[i]] = keys[i];
+      bool owned = images.count(keys[i]) > 0;
+      for (int k = 0; k < (int)owners.size() && !owned; k++)
+        owned = keys[owners[k]] == keys[i];
+      if (!owned) owners.push_back(i);
+    }
+
+    std::vector<Cached_Image> decoded(owners.size());
+    std::vector<float> decodeTimes(owners.size()), convertTimes(owners.size());
+    std::vector<char> valid(owners.size(), 0);
+    workers.parallel_for((int)owners.size(), [&](int k) {
+      valid[k] = decode(files[owners[k]], decoded[k], workers, decodeTimes[k],
+                        convertTimes[k]);
+    });
+
+    for (int k = 0; k < (int)owners.size(); k++) {
+      const std::string &path = files[owners[k]];
+      if (!valid[k]) {
+        printf("Image '%s' is invalid or hasn't been found.\n", path.c_str());
+        Exit_Program(EXIT_FAILURE);
+      }
+
+      Cached_Image &image = decoded[k];
+      printf("Decoded '%s' (%dx%d, %d channels) in %.1f ms, converted in "
+             "%.1f ms.\n",
+             path.c_str(), image.width, image.height, image.channels,
+             decodeTimes[k] * 1000.f, convertTimes[k] * 1000.f);
+
+      image.ingested = true;
+      image.lastUse = clock++;
+      bytes += imageBytes(image);
+      decodes++;
+      images.insert(std::make_pair(keys[owners[k]], std::move(image)));
+    }
+
+    auto t1 = std::chrono::system_clock::now();
+    if (!owners.empty())
+      printf("Ingested %d of %d texture files on %d threads in %.1f ms.\n",
+             (int)owners.size(), (int)files.size(), workers.size(),
+             std::chrono::duration<float>(t1 - t0).count() * 1000.f);
+  }
+
+  // Memory held by an image, its mip levels included
+  static size_t imageBytes(const Cached_Image &image) {
+    size_t texels = image.texels.size();
+    for (int i = 0; i < (int)image.mips.size(); i++)
+      texels += image.mips[i].size();
+    return texels * sizeof(uchar4);
+  }
+
+  // Builds the mip levels of an image with the current filter. The levels are
+  // filtered as floats and stored as bytes, like the full image.
+  void buildMips(Cached_Image *image) {
+    if (image->mipFilter == mipFilter) return;
+    bytes -= imageBytes(*image);
+
+    CPU_Image levels;
+    levels.levels.resize(1);
+    CPU_Image_Level &base = levels.levels[0];
+    base.width = image->width;
+    base.height = image->height;
+    base.texels.resize(image->texels.size());
+    expandTexels(image->texels.data(), base.texels.data(),
+                 (int)image->texels.size());
+
+    buildMipmaps(levels, mipFilter, *pool);
+    image->mips.resize(levels.levels.size() - 1);
+    for (int i = 0; i < (int)image->mips.size(); i++) {
+      const CPU_Image_Level &level = levels.levels[i + 1];
+      image->mips[i].resize(level.texels.size());
+      quantizeTexels(level.texels.data(), image->mips[i].data(),
+                     (int)level.texels.size());
+    }
+
+    image->mipFilter = mipFilter;
+    bytes += imageBytes(*image);
+  }
+
+  // Decodes an image file with stb_image, and converts it to RGBA rows split
+  // among the pool's threads. Returns false if the file isn't an image.
+  static bool decode(const std::string &path, Cached_Image &image,
+                     Thread_Pool &pool, float &decodeTime,
+                     float &convertTime) {
+    auto t0 = std::chrono::system_clock::now();
+    int nx, ny, nn;
+    unsigned char *data = stbi_load(path.c_str(), &nx, &ny, &nn, 0);
+    if (!data) return false;
+
+    auto t1 = std::chrono::system_clock::now();
+    image.width = nx;
+    image.height = ny;
+    image.channels = nn;
+    image.references = 0;
+    image.ingested = false;
+    image.lastUse = 0;
+    image.cpuImage = -1;
+    image.mipFilter = NO_MIPMAPS;
+    image.texels.resize(nx * ny);
+
+    // flip the rows, the device buffers start at the bottom
+    pool.parallel_blocks(ny, 16, [&](int begin, int end) {
+      for (int j = begin; j < end; j++)
+        expandRow(&data[(size_t)(ny - j - 1) * nx * nn], nn,
+                  &image.texels[(size_t)j * nx], nx);
+    });
+
+    stbi_image_free(data);
+
+    auto t2 = std::chrono::system_clock::now();
+    decodeTime = std::chrono::duration<float>(t1 - t0).count();
+    convertTime = std::chrono::duration<float>(t2 - t1).count();
+    return true;
+  }
+
+  // Evicts the least recently used unreferenced images over the limit. Images
+  // decoded for the current scene but not acquired yet are kept too, the
+  // next acquires of the batch would decode them again.
+  void evict() {
+    while (memoryLimit > 0 && bytes > memoryLimit) {
+      std::map<Image_Key, Cached_Image>::iterator victim = images.end();
+
+      for (std::map<Image_Key, Cached_Image>::iterator it = images.begin();
+           it != images.end(); ++it)
+        if (it->second.references == 0 && !it->second.ingested &&
+            (victim == images.end() ||
+             it->second.lastUse < victim->second.lastUse))
+          victim = it;
+
+      if (victim == images.end()) return;
+
+      bytes -= imageBytes(victim->second);
+      images.erase(victim);
+      evictions++;
+    }
+  }
+
+  std::map<Image_Key, Cached_Image> images;
+  std::map<std::string, Image_Key> paths;  // files hashed in this scene
+  std::vector<std::string> pending;        // files queued for ingestion
+  size_t memoryLimit, bytes;
+  uint64_t clock;
+  int decodes, shares, evictions;
+  size_t savedBytes;
+  Mip_Filter mipFilter;
+  float maxAnisotropy;
+  Thread_Pool *pool;  // app workers, set by setThreadPool
+};
+
+Texture_Cache textureCache;
+
+#endif
@@ -3,18 +3,88 @@
 
 #include "buffers.hpp"
 #include "host_common.hpp"
+#include "rgbe_loader.hpp"
+#include "texture_cache.hpp"
+
+// Host copy of the device texture table, see texture_table.hpp
+struct Texture_Table {
+  std::vector<Texture_Entry> entries;
+  std::vector<int> children;
+  std::vector<float3> noiseVectors;
+  std::vector<int> noisePermutations;
+  std::vector<TextureSampler> samplers;  // samplers of the image entries
+};
+
+Texture_Table textureTable;
+
+// Creates a texture table buffer of a user defined type
+template <typename T>
+Buffer createTableBuffer(const std::vector<T> &list, Context &g_context) {
+  Buffer buffer = g_context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_USER);
+  buffer->setElementSize(sizeof(T));
+  buffer->setSize(list.size());
 
-/*! The precompiled programs code (in ptx) that our cmake script
-will precompile (to ptx) and link to the generated executable */
-extern "C" const char Color_PTX[];
-extern "C" const char Checker_PTX[];
-extern "C" const char Noise_PTX[];
-extern "C" const char Image_PTX[];
-extern "C" const char Gradient_PTX[];
-extern "C" const char Vector_Tex_PTX[];
+  if (!list.empty()) {
+    T *data = static_cast<T *>(buffer->map());
+    for (int i = 0; i < (int)list.size(); i++) data[i] = list[i];
+    buffer->unmap();
+  }
 
+  return buffer;
+}
+
+// Uploads the texture table to the context, once every texture is assigned
+void uploadTextureTable(Context &g_context) {
+  g_context["texture_table"]->setBuffer(
+      createTableBuffer(textureTable.entries, g_context));
+  g_context["texture_children"]->setBuffer(
+      createBuffer(textureTable.children, g_context));
+  g_context["noise_vectors"]->setBuffer(
+      createBuffer(textureTable.noiseVectors, g_context));
+  g_context["noise_permutations"]->setBuffer(
+      createBuffer(textureTable.noisePermutations, g_context));
+}
+
+// Textures are assigned to the texture table of the selected backend, and
+// referenced by their index in it
 struct Texture {
-  virtual Program assignTo(Context &g_context) const = 0;
+  virtual int assignTo(Context &g_context) const = 0;
+  virtual int assignTo(CPU_Scene &scene) const = 0;
+
+  // Creates a texture table entry of the given type
+  static Texture_Entry entry(Texture_Type type) {
+    Texture_Entry tex;
+    tex.type = type;
+    tex.data = -1;
+    tex.first = tex.count = 0;
+    tex.scale = 0.f;
+    tex.colors[0] = tex.colors[1] = tex.colors[2] = make_float3(0.f);
+    return tex;
+  }
+
+  // Appends a texture and its children to the CPU scene, returns its index
+  static int push(CPU_Scene &scene, Texture_Entry tex,
+                  const std::vector<int> &children = std::vector<int>()) {
+    tex.first = (int)scene.textureChildren.size();
+    tex.count = (int)children.size();
+    scene.textureChildren.insert(scene.textureChildren.end(),
+                                 children.begin(), children.end());
+
+    scene.textures.push_back(tex);
+    return (int)scene.textures.size() - 1;
+  }
+
+  // Appends a texture and its children to the device texture table
+  static int push(Context & /* g_context */, Texture_Entry tex,
+                  const std::vector<int> &children = std::vector<int>()) {
+    tex.first = (int)textureTable.children.size();
+    tex.count = (int)children.size();
+    textureTable.children.insert(textureTable.children.end(),
+                                 children.begin(), children.end());
+
+    textureTable.entries.push_back(tex);
+    return (int)textureTable.entries.size() - 1;
+  }
 };
 
 struct Constant_Texture : public Texture {
@@ -25,12 +95,18 @@ struct Constant_Texture : public Texture {
   Constant_Texture(const float &r, const float &g, const float &b)
       : color(make_float3(r, g, b)) {}
 
-  virtual Program assignTo(Context &g_context) const override {
-    Program prog = createProgram(Color_PTX, "sample_texture", g_context);
+  virtual int assignTo(Context &g_context) const override {
+    return push(g_context, createEntry());
+  }
 
-    prog["color"]->set3fv(&color.x);
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return push(scene, createEntry());
+  }
 
-    return prog;
+  Texture_Entry createEntry() const {
+    Texture_Entry tex = entry(CONSTANT_TEXTURE);
+    tex.colors[0] = color;
+    return tex;
   }
 
   const float3 color;
@@ -39,13 +115,21 @@ struct Constant_Texture : public Texture {
 struct Checker_Texture : public Texture {
   Checker_Texture(const Texture *o, const Texture *e) : odd(o), even(e) {}
 
-  virtual Program assignTo(Context &g_context) const override {
-    Program textProg = createProgram(Checker_PTX, "sample_texture", g_context);
+  virtual int assignTo(Context &g_context) const override {
+    return assign(g_context);
+  }
 
-    textProg["odd"]->setProgramId(odd->assignTo(g_context));
-    textProg["even"]->setProgramId(even->assignTo(g_context));
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return assign(scene);
+  }
 
-    return textProg;
+  // Assigns the odd and even textures, then the checker entry
+  template <typename Backend>
+  int assign(Backend &backend) const {
+    std::vector<int> children;
+    children.push_back(odd->assignTo(backend));
+    children.push_back(even->assignTo(backend));
+    return push(backend, entry(CHECKER_TEXTURE), children);
   }
 
   const Texture *odd;
@@ -71,104 +155,73 @@ struct Noise_Texture : public Texture {
     }
   }
 
-  void perlin_generate_perm(Buffer &perm_buffer, Context &g_context) const {
-    perm_buffer = g_context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_INT, 256);
-    int *perm_map = static_cast<int *>(perm_buffer->map());
+  // Generates the noise tables, the order of the rnd() calls matters
+  CPU_Noise generate() const {
+    CPU_Noise noise;
 
-    for (int i = 0; i < 256; i++) perm_map[i] = i;
-    permute(perm_map);
-    perm_buffer->unmap();
-  }
-
-  virtual Program assignTo(Context &g_context) const override {
-    Buffer ranvec =
-        g_context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT3, 256);
-    float3 *ranvec_map = static_cast<float3 *>(ranvec->map());
-
-    for (int i = 0; i < 256; ++i)
-      ranvec_map[i] =
+    for (int i = 0; i < NOISE_TABLE_SIZE; ++i)
+      noise.ranvec[i] =
           unit_float3(-1 + 2 * rnd(), -1 + 2 * rnd(), -1 + 2 * rnd());
-    ranvec->unmap();
 
-    Buffer perm_x, perm_y, perm_z;
-    perlin_generate_perm(perm_x, g_context);
-    perlin_generate_perm(perm_y, g_context);
-    perlin_generate_perm(perm_z, g_context);
+    for (int p = 0; p < 3; p++) {
+      for (int i = 0; i < NOISE_TABLE_SIZE; i++) noise.perm[p][i] = i;
+      permute(noise.perm[p]);
+    }
 
-    Program textProg = createProgram(Noise_PTX, "sample_texture", g_context);
+    return noise;
+  }
 
-    textProg["ranvec"]->set(ranvec);
-    textProg["perm_x"]->set(perm_x);
-    textProg["perm_y"]->set(perm_y);
-    textProg["perm_z"]->set(perm_z);
-    textProg["scale"]->setFloat(scale);
-    textProg["axis"]->setInt(ax);
+  virtual int assignTo(Context &g_context) const override {
+    CPU_Noise noise = generate();
+
+    int index = (int)textureTable.noiseVectors.size() / NOISE_TABLE_SIZE;
+    textureTable.noiseVectors.insert(textureTable.noiseVectors.end(),
+                                     noise.ranvec,
+                                     noise.ranvec + NOISE_TABLE_SIZE);
+    for (int p = 0; p < 3; p++)
+      textureTable.noisePermutations.insert(
+          textureTable.noisePermutations.end(), noise.perm[p],
+          noise.perm[p] + NOISE_TABLE_SIZE);
+
+    Texture_Entry tex = entry(NOISE_TEXTURE);
+    tex.scale = scale;
+    tex.data = index;
+    return push(g_context, tex);
+  }
+
+  virtual int assignTo(CPU_Scene &scene) const override {
+    scene.noises.push_back(generate());
 
-    return textProg;
+    Texture_Entry tex = entry(NOISE_TEXTURE);
+    tex.scale = scale;
+    tex.data = (int)scene.noises.size() - 1;
+    return push(scene, tex);
   }
 
   const float scale;
   const AXIS ax;
 };
 
+// Image file texture, decoded once per file contents by the texture cache
 struct Image_Texture : public Texture {
-  Image_Texture(const std::string f) : fileName(f) {}
-
-  TextureSampler loadTexture(Context context,
-                             const std::string fileName) const {
-    int nx, ny, nn;
-    unsigned char *tex_data =
-        stbi_load((char *)fileName.c_str(), &nx, &ny, &nn, 0);
-
-    if (!tex_data) {
-      printf("Image is invalid or hasn't been found.\n");
-      system("PAUSE");
-      exit(0);
-    }
-
-    TextureSampler sampler = context->createTextureSampler();
-    sampler->setWrapMode(0, RT_WRAP_REPEAT);
-    sampler->setWrapMode(1, RT_WRAP_REPEAT);
-    sampler->setWrapMode(2, RT_WRAP_REPEAT);
-    sampler->setIndexingMode(RT_TEXTURE_INDEX_NORMALIZED_COORDINATES);
-    sampler->setReadMode(RT_TEXTURE_READ_NORMALIZED_FLOAT);
-    sampler->setMaxAnisotropy(1.f);
-    sampler->setMipLevelCount(1u);
-    sampler->setArraySize(1u);
-
-    Buffer buffer = context->createBuffer(RT_BUFFER_INPUT,
-                                          RT_FORMAT_UNSIGNED_BYTE4, nx, ny);
-    unsigned char *buffer_data = static_cast<unsigned char *>(buffer->map());
-
-    for (int i = 0; i < nx; ++i)
-      for (int j = 0; j < ny; ++j) {
-        int bindex = (j * nx + i) * 4;
-        int iindex = ((ny - j - 1) * nx + i) * nn;
-
-        buffer_data[bindex + 0] = tex_data[iindex + 0];
-        buffer_data[bindex + 1] = tex_data[iindex + 1];
-        buffer_data[bindex + 2] = tex_data[iindex + 2];
-
-        if (nn == 4)
-          buffer_data[bindex + 3] = tex_data[iindex + 3];
-        else  // 3-channel images
-          buffer_data[bindex + 3] = (unsigned char)1.f;
-      }
+  Image_Texture(const std::string f) : fileName(f) {
+    textureCache.request(fileName);
+  }
 
-    buffer->unmap();
-    sampler->setBuffer(0u, 0u, buffer);
-    sampler->setFilteringModes(RT_FILTER_LINEAR, RT_FILTER_LINEAR,
-                               RT_FILTER_NONE);
+  virtual int assignTo(Context &g_context) const override {
+    Cached_Image *image = textureCache.acquire(fileName);
 
-    return sampler;
+    Texture_Entry tex = entry(IMAGE_TEXTURE);
+    tex.data = textureCache.getSampler(image, g_context)->getId();
+    return push(g_context, tex);
   }
 
-  virtual Program assignTo(Context &g_context) const override {
-    Program textProg = createProgram(Image_PTX, "sample_texture", g_context);
-
-    textProg["data"]->setTextureSampler(loadTexture(g_context, fileName));
+  virtual int assignTo(CPU_Scene &scene) const override {
+    Cached_Image *image = textureCache.acquire(fileName);
 
-    return textProg;
+    Texture_Entry tex = entry(IMAGE_TEXTURE);
+    tex.data = textureCache.getImage(image, scene);
+    return push(scene, tex);
   }
 
   const std::string fileName;
@@ -177,53 +230,59 @@ struct Image_Texture : public Texture {
 struct HDR_Texture : public Texture {
   HDR_Texture(const std::string f) : fileName(f) {}
 
-  TextureSampler loadHDRTexture(Context context,
-                                const std::string fileName) const {
-    TextureSampler sampler = context->createTextureSampler();
-    sampler->setWrapMode(0, RT_WRAP_REPEAT);
-    sampler->setWrapMode(1, RT_WRAP_REPEAT);
-    sampler->setIndexingMode(RT_TEXTURE_INDEX_NORMALIZED_COORDINATES);
-    sampler->setReadMode(RT_TEXTURE_READ_NORMALIZED_FLOAT);
-    sampler->setMaxAnisotropy(1.f);
-    sampler->setMipLevelCount(1u);
-    sampler->setArraySize(1u);
-
-    HDRImage HDRresult;
-    if (!HDRLoader::load((char *)fileName.c_str(), HDRresult)) {
+  // Loads the image, with the mip levels selected in the texture cache, on
+  // the threads of the cache
+  CPU_Image loadHDRImage(const std::string fileName) const {
+    CPU_Image image;
+    image.maxAnisotropy = textureCache.getMaxAnisotropy();
+    image.levels.resize(1);
+
+    auto t0 = std::chrono::system_clock::now();
+    Thread_Pool &pool = textureCache.getThreadPool();
+    if (!loadRGBE(fileName, image.levels[0], pool)) {
       printf("HDR Image is invalid or hasn't been found.\n");
-      system("PAUSE");
-      exit(0);
+      Exit_Program(EXIT_FAILURE);
     }
 
-    Buffer buffer = context->createBuffer(RT_BUFFER_INPUT, RT_FORMAT_FLOAT4,
-                                          HDRresult.width, HDRresult.height);
-    float *buffer_data = static_cast<float *>(buffer->map());
+    auto t1 = std::chrono::system_clock::now();
+    printf("Decoded '%s' (%dx%d) in %.1f ms.\n", fileName.c_str(),
+           image.levels[0].width, image.levels[0].height,
+           std::chrono::duration<float>(t1 - t0).count() * 1000.f);
 
-    for (int i = 0; i < HDRresult.width; i++)
-      for (int j = 0; j < HDRresult.height; j++) {
-        int bindex = (j * HDRresult.width + i) * 4;
-        int iindex = (j * HDRresult.width + i) * 3;
-
-        buffer_data[bindex + 0] = HDRresult.colors[iindex + 0];
-        buffer_data[bindex + 1] = HDRresult.colors[iindex + 1];
-        buffer_data[bindex + 2] = HDRresult.colors[iindex + 2];
-        buffer_data[bindex + 3] = 0.f;
-      }
+    buildMipmaps(image, textureCache.getMipFilter(), pool);
+    return image;
+  }
 
-    buffer->unmap();
-    sampler->setBuffer(0u, 0u, buffer);
-    sampler->setFilteringModes(RT_FILTER_LINEAR, RT_FILTER_LINEAR,
-                               RT_FILTER_NONE);
+  virtual int assignTo(Context &g_context) const override {
+    return assignTo(g_context, loadHDRImage(fileName));
+  }
 
-    return sampler;
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return assignTo(scene, loadHDRImage(fileName));
   }
 
-  virtual Program assignTo(Context &g_context) const override {
-    Program textProg = createProgram(Image_PTX, "sample_texture", g_context);
+  // Same, with the image already loaded by loadHDRImage
+  int assignTo(Context &g_context, const CPU_Image &image) const {
+    std::vector<const float4 *> levels;
+    for (int i = 0; i < (int)image.levels.size(); i++)
+      levels.push_back(image.levels[i].texels.data());
+
+    TextureSampler sampler = createImageSampler(
+        g_context, RT_FORMAT_FLOAT4, image.levels[0].width,
+        image.levels[0].height, levels, image.maxAnisotropy);
+    textureTable.samplers.push_back(sampler);
+
+    Texture_Entry tex = entry(IMAGE_TEXTURE);
+    tex.data = sampler->getId();
+    return push(g_context, tex);
+  }
 
-    textProg["data"]->setTextureSampler(loadHDRTexture(g_context, fileName));
+  int assignTo(CPU_Scene &scene, const CPU_Image &image) const {
+    scene.images.push_back(image);
 
-    return textProg;
+    Texture_Entry tex = entry(IMAGE_TEXTURE);
+    tex.data = (int)scene.images.size() - 1;
+    return push(scene, tex);
   }
 
   const std::string fileName;
@@ -234,14 +293,20 @@ struct Gradient_Texture : public Texture {
   Gradient_Texture(const float3 &cA, const float3 &cB, const float3 &cC)
       : colorA(cA), colorB(cB), colorC(cC) {}
 
-  virtual Program assignTo(Context &g_context) const override {
-    Program textProg = createProgram(Gradient_PTX, "sample_texture", g_context);
+  virtual int assignTo(Context &g_context) const override {
+    return push(g_context, createEntry());
+  }
 
-    textProg["colorA"]->set3fv(&colorA.x);
-    textProg["colorB"]->set3fv(&colorB.x);
-    textProg["colorC"]->set3fv(&colorC.x);
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return push(scene, createEntry());
+  }
 
-    return textProg;
+  Texture_Entry createEntry() const {
+    Texture_Entry tex = entry(GRADIENT_TEXTURE);
+    tex.colors[0] = colorA;
+    tex.colors[1] = colorB;
+    tex.colors[2] = colorC;
+    return tex;
   }
 
   const float3 colorA;
@@ -253,18 +318,22 @@ struct Gradient_Texture : public Texture {
 struct Vector_Texture : public Texture {
   Vector_Texture(const std::vector<Texture *> &tv) : texture_vector(tv) {}
 
-  virtual Program assignTo(Context &g_context) const override {
-    Program prog = createProgram(Vector_Tex_PTX, "sample_texture", g_context);
+  virtual int assignTo(Context &g_context) const override {
+    return assign(g_context);
+  }
 
-    std::vector<Program> programs;
-    for (int i = 0; i < texture_vector.size(); i++) {
-      programs.push_back(texture_vector[i]->assignTo(g_context));
-    }
+  virtual int assignTo(CPU_Scene &scene) const override {
+    return assign(scene);
+  }
 
-    prog["size"]->setInt((int)programs.size());
-    prog["texture_vector"]->setBuffer(createBuffer(programs, g_context));
+  // Assigns the vector elements, then the vector entry
+  template <typename Backend>
+  int assign(Backend &backend) const {
+    std::vector<int> children;
+    for (int i = 0; i < (int)texture_vector.size(); i++)
+      children.push_back(texture_vector[i]->assignTo(backend));
 
-    return prog;
+    return push(backend, entry(VECTOR_TEXTURE), children);
   }
 
   const std::vector<Texture *> texture_vector;
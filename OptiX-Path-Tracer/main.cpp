@@ -21,8 +21,12 @@
 
 // Host side constructors and functions
 #include "host_includes/gui.hpp"
+#include "host_includes/arguments.hpp"
 #include "host_includes/image_save.hpp"
 
+// CPU backend, includes device code so it has to come after the host headers
+#include "host_includes/cpu/benchmark.hpp"
+
 float renderFrame(Context &g_context, int Nx, int Ny) {
   auto t0 = std::chrono::system_clock::now();
 
@@ -38,30 +42,46 @@ float renderFrame(Context &g_context, int Nx, int Ny) {
   return (float)time;
 }
 
-int Optix_Config(App_State &app) {
-  // Set RTX global attribute(should be done before creating the context)
-  if (app.RTX) {
-    int RTX = true;
-    RTresult res;
-    res = rtGlobalSetAttribute(RT_GLOBAL_ATTRIBUTE_ENABLE_RTX, sizeof(RTX),
-                               &(RTX));
-    if (res != RT_SUCCESS) {
-      printf("Error: RTX mode is required for this application, exiting. \n");
-      system("PAUSE");
-      exit(0);
-    } else
-      printf("OptiX RTX execution mode is ON.\n");
-  }
+float renderFrame(App_State &app, Thread_Pool &pool, int samples) {
+  auto t0 = std::chrono::system_clock::now();
 
-  // Create an OptiX context
-  app.context->setRayTypeCount(2);  // radiance rays and shadow rays
-  app.context->setMaxTraceDepth(5);
+  // the reordering batch can change between frames, it doesn't need a rebuild
+  app.cpuScene.reorderBatch = app.reorderBatch;
+  app.cpuScene.packets = app.packets;
 
-  // Set samples, ray depth and russian roulette variables
-  app.context["samples"]->setInt(app.samples);
-  app.context["russian"]->setInt(app.russian);
-  app.context["maxDepth"]->setInt(app.depth);
+  if (app.wavefront)
+    renderWavefront(app.cpuScene, pool, app.W, app.H, app.currentSample,
+                    samples, app.cpuAccBuffer.data(),
+                    app.cpuDisplayBuffer.data());
+  else
+    renderFrame(app.cpuScene, pool, app.W, app.H, app.currentSample, samples,
+                app.cpuAccBuffer.data(), app.cpuDisplayBuffer.data());
+
+  auto t1 = std::chrono::system_clock::now();
+  auto time = std::chrono::duration<float>(t1 - t0).count();
+
+  return (float)time;
+}
+
+// Renders the next batch of samples with the selected backend, then updates
+// the number of rendered samples. Returns the render time of the batch.
+float renderBatch(App_State &app, Thread_Pool *pool) {
+  int samples = std::min(app.batch, app.samples - app.currentSample);
+  float time;
+
+  if (app.CPU)
+    time = renderFrame(app, *pool, samples);
+  else {
+    app.context["frame"]->setInt(app.currentSample);
+    app.context["samples"]->setInt(samples);
+    time = renderFrame(app.context, app.W, app.H);
+  }
+
+  app.currentSample += samples;
+  return time;
+}
 
+void Scene_Config(App_State &app) {
   // Create and set the world
   switch (app.scene) {
     case 0:  // Peter Shirley's "In One Weekend" scene
@@ -87,6 +107,43 @@ int Optix_Config(App_State &app) {
     default:
       throw "Selected scene is unknown";
   }
+}
+
+int Optix_Config(App_State &app) {
+  // Set RTX global attribute(should be done before creating the context)
+  if (app.RTX) {
+    int RTX = true;
+    RTresult res;
+    res = rtGlobalSetAttribute(RT_GLOBAL_ATTRIBUTE_ENABLE_RTX, sizeof(RTX),
+                               &(RTX));
+    if (res != RT_SUCCESS) {
+      printf("Error: RTX mode is required for this application, exiting. \n");
+      Exit_Program(EXIT_FAILURE);
+    } else
+      printf("OptiX RTX execution mode is ON.\n");
+  }
+
+  // Create an OptiX context
+  app.context = Context::create();
+  clearDeviceCaches();
+  textureCache.setMemoryLimit((size_t)app.textureMemory << 20);
+  textureCache.setMipmaps((Mip_Filter)app.mipmaps, (float)app.anisotropy);
+  textureCache.setThreadPool(app.pool);
+  textureCache.beginScene();
+  app.context->setRayTypeCount(2);  // radiance rays and shadow rays
+  app.context->setMaxTraceDepth(5);
+
+  // Set samples per launch, ray depth and russian roulette variables
+  app.context["frame"]->setInt(0);
+  app.context["samples"]->setInt(app.batch);
+  app.context["russian"]->setInt(app.russian);
+  app.context["maxDepth"]->setInt(app.depth);
+
+  // Create and set the world
+  Scene_Config(app);
+  uploadTextureTable(app.context);
+  printCacheStats();
+  textureCache.printStats();
 
   // Create an output buffer
   app.accBuffer = createFrameBuffer(app.W, app.H, app.context);
@@ -101,7 +158,153 @@ int Optix_Config(App_State &app) {
   return 0;
 }
 
+int CPU_Config(App_State &app, Thread_Pool &pool) {
+  printf("CPU execution mode is ON, using %d threads.\n", pool.size());
+
+  // Set ray depth and russian roulette variables
+  app.cpuScene.clear();
+  app.cpuScene.maxDepth = app.depth;
+  app.cpuScene.russian = app.russian;
+  app.cpuScene.bvhWidth = app.bvhWidth;
+  app.cpuScene.linearBVH = app.linearBVH;
+  app.cpuScene.compressedBVH = app.compressedBVH;
+  app.cpuScene.reorderBatch = app.reorderBatch;
+  textureCache.setMemoryLimit((size_t)app.textureMemory << 20);
+  textureCache.setMipmaps((Mip_Filter)app.mipmaps, (float)app.anisotropy);
+  textureCache.setThreadPool(&pool);
+  textureCache.beginScene();
+
+  // Create and set the world
+  Scene_Config(app);
+  textureCache.printStats();
+
+  // Create the output and display buffers
+  app.cpuAccBuffer.assign(app.W * app.H, make_float4(0.f));
+  app.cpuDisplayBuffer.assign(app.W * app.H, make_uchar4(0, 0, 0, 255));
+
+  // Build the acceleration structures
+  auto t0 = std::chrono::system_clock::now();
+  buildScene(app.cpuScene, pool);
+  auto t1 = std::chrono::system_clock::now();
+  auto time = std::chrono::duration<float>(t1 - t0).count();
+  printf("CPU Building Time: %.2f\n", time);
+
+  return 0;
+}
+
+// Renders the image set by the command line without creating a window, then
+// returns the exit status of the program
+int Batch_Render(App_State &app) {
+  float renderTime = 0.f;
+
+  // time the OBJ parsers instead of rendering, no scene needed
+  if (!app.parseBenchmark.empty()) {
+    benchmarkOBJParser(app.parseBenchmark);
+    return EXIT_OK;
+  }
+
+  // time the HDR loaders instead of rendering
+  if (!app.hdrBenchmark.empty()) {
+    benchmarkRGBELoader(app.hdrBenchmark);
+    return EXIT_OK;
+  }
+
+  // loads the scene with either backend, then renders in CPU mode
+  app.pool = new Thread_Pool(app.threads);
+
+  // check the decoding errors of the compact mesh attributes instead of
+  // rendering, failing if they exceed the bounds of their formats
+  if (!app.attributeCheck.empty()) {
+    bool passed = checkAttributes(app.attributeCheck, *app.pool);
+    delete app.pool;
+    return passed ? EXIT_OK : EXIT_CHECK_FAILED;
+  }
+
+  try {
+    // Configure OptiX context or CPU backend & scene
+    if (app.CPU) {
+      CPU_Config(app, *app.pool);
+
+      // measure the traversal and integrators instead of rendering
+      if (app.benchmark) {
+        benchmarkTraversal(app.cpuScene, *app.pool, app.W, app.H);
+        benchmarkIntegrators(app.cpuScene, *app.pool, app.W, app.H, app.batch);
+        delete app.pool;
+        return EXIT_OK;
+      }
+    } else
+      Optix_Config(app);
+
+    // render all samples, 'batch' samples per launch
+    int step = std::max(app.samples / 10, 1), nextReport = step;
+    for (app.currentSample = 0; app.currentSample < app.samples;) {
+      renderTime += renderBatch(app, app.pool);
+
+      if (app.currentSample >= nextReport || app.currentSample == app.samples) {
+        printf("sample = %d / %d\n", app.currentSample, app.samples);
+        nextReport = app.currentSample + step;
+      }
+    }
+  } catch (const char *e) {
+    fprintf(stderr, "Error: %s\n", e);
+    delete app.pool;
+    return EXIT_RENDER_ERROR;
+  } catch (const std::string &e) {
+    fprintf(stderr, "Error: %s\n", e.c_str());
+    delete app.pool;
+    return EXIT_RENDER_ERROR;
+  } catch (const Exception &e) {
+    fprintf(stderr, "OptiX Error: %s\n", e.getErrorString().c_str());
+    delete app.pool;
+    return EXIT_RENDER_ERROR;
+  }
+
+  delete app.pool;
+  printf("Render time: %.2fs\n", renderTime);
+
+  // Save to file type selected in the command line
+  int saved;
+  if (app.CPU) {
+    if (app.fileType == 0)
+      saved = Save_PNG(app, app.cpuAccBuffer.data());
+    else
+      saved = Save_HDR(app, app.cpuAccBuffer.data());
+  } else {
+    if (app.fileType == 0)
+      saved = Save_PNG(app, app.accBuffer);
+    else
+      saved = Save_HDR(app, app.accBuffer);
+  }
+
+  if (!saved) {
+    fprintf(stderr, "Error: failed to write %s\n", app.fileName.c_str());
+    return EXIT_RENDER_ERROR;
+  }
+
+  printf("Saved %s\n", app.fileName.c_str());
+  return EXIT_OK;
+}
+
 int main(int ac, char **av) {
+  // any command line argument selects the headless batch mode
+  if (ac > 1) {
+    App_State app;
+    bool help;
+    interactive = false;
+
+    if (!Parse_Arguments(app, ac, av, help)) {
+      Print_Usage(av[0]);
+      return EXIT_USAGE_ERROR;
+    }
+
+    if (help) {
+      Print_Usage(av[0]);
+      return EXIT_OK;
+    }
+
+    return Batch_Render(app);
+  }
+
   ImVec4 clear_color = ImVec4(0.43f, 0.43f, 0.43f, 1.00f);
 
   // Setup window
@@ -189,8 +392,74 @@ int main(int ac, char **av) {
 
         ImGui::InputInt("Samples Per Pixel", &app.samples, 1, 100);
 
+        ImGui::InputInt("Samples Per Launch", &app.batch, 1, 10);
+        ImGui::SameLine();
+        ShowHelpMarker(
+            "Higher values render faster, but update the preview less often.");
+
         ImGui::Checkbox("RTX Mode", &app.RTX);
 
+        ImGui::Combo("Mesh Attributes", &app.meshAttributes,
+                     "Full Precision\0Compact\0Compact Positions\0");
+        ImGui::SameLine();
+        ShowHelpMarker("Compact normals and texcoords take 8 bytes per vertex "
+                       "instead of 20, compact positions 8 instead of 12. RTX "
+                       "mode keeps float positions.");
+
+        ImGui::Combo("Mipmaps", &app.mipmaps, "Off\0Box\0Kaiser\0");
+        ImGui::SameLine();
+        ShowHelpMarker("Filters image textures over the pixel footprint, "
+                       "from a box or a sharper Kaiser filtered pyramid.");
+
+        if (app.mipmaps != NO_MIPMAPS) {
+          ImGui::InputInt("Max Anisotropy", &app.anisotropy, 1, 4);
+          app.anisotropy = std::min(std::max(app.anisotropy, 1), 16);
+          ImGui::SameLine();
+          ShowHelpMarker("Most lookups along the footprint of surfaces seen "
+                         "at grazing angles.");
+        }
+
+        ImGui::InputInt("Threads", &app.threads, 1, 4);
+        ImGui::SameLine();
+        ShowHelpMarker("Threads loading the scene, and rendering it in CPU "
+                       "mode. Use 0 for all hardware threads.");
+
+        ImGui::Checkbox("CPU Mode", &app.CPU);
+
+        if (app.CPU) {
+          int width = app.bvhWidth == 8 ? 2 : (app.bvhWidth == 4 ? 1 : 0);
+          ImGui::Combo("CPU BVH", &width, "Binary\0BVH4\0BVH8\0");
+          app.bvhWidth = 2 << width;
+
+          if (app.bvhWidth > 2) {
+            ImGui::Checkbox("Compressed BVH", &app.compressedBVH);
+            ImGui::SameLine();
+            ShowHelpMarker("Uses less memory, traces a bit slower.");
+          } else
+            app.compressedBVH = false;
+
+          ImGui::Checkbox("Wavefront Integrator", &app.wavefront);
+          ImGui::SameLine();
+          ShowHelpMarker("Shades paths in batches sorted by material.");
+
+          if (app.wavefront) {
+            ImGui::InputInt("Ray Reordering", &app.reorderBatch, 64, 1024);
+            app.reorderBatch = std::max(app.reorderBatch, 0);
+            ImGui::SameLine();
+            ShowHelpMarker("Min rays sorted by origin and direction before "
+                           "each bounce, 0 disables.");
+          } else {
+            ImGui::Checkbox("Packet Camera Rays", &app.packets);
+            ImGui::SameLine();
+            ShowHelpMarker("Traces the camera rays of 8x8 pixels together, "
+                           "unless the scene has volumes.");
+          }
+
+          ImGui::Checkbox("Linear BVH Builder", &app.linearBVH);
+          ImGui::SameLine();
+          ShowHelpMarker("Faster to build, slower to trace than SAH BVHs.");
+        }
+
         ImGui::Checkbox("Russian Roulette", &app.russian);
 
         ImGui::InputInt("Max Depth", &app.depth, 1, 100);
@@ -215,9 +484,13 @@ int main(int ac, char **av) {
 
         // check if render button has been pressed
         if (ImGui::Button("Render")) {
-          if (app.W > 0 && app.H > 0 && app.samples > 0) {
-            // Configure OptiX context & scene
-            Optix_Config(app);
+          if (app.W > 0 && app.H > 0 && app.samples > 0 && app.batch > 0) {
+            // Configure OptiX context or CPU backend & scene
+            app.pool = new Thread_Pool(app.threads);
+            if (app.CPU)
+              CPU_Config(app, *app.pool);
+            else
+              Optix_Config(app);
 
             // start flag
             app.start = true;
@@ -245,6 +518,9 @@ int main(int ac, char **av) {
             if (app.samples <= 0)
               printf("- 'samples' should be a positive integer.\n");
 
+            if (app.batch <= 0)
+              printf("- 'samples per launch' should be a positive integer.\n");
+
             if (app.W <= 0) printf("- 'width' should be a positive integer.\n");
 
             if (app.H <= 0)
@@ -260,15 +536,20 @@ int main(int ac, char **av) {
         // Create and append program params window
         ImGui::Begin("Progress");
 
-        // render a frame
-        app.context["frame"]->setInt(app.currentSample);
-        renderTime += renderFrame(app.context, app.W, app.H);
+        // render a batch of samples, also updating the number of rendered
+        // samples
+        renderTime += renderBatch(app, app.pool);
 
         // copy stream buffer content
         if (app.showProgress) {
-          uchar1 *copyArr = (uchar1 *)app.displayBuffer->map();
-          memcpy(imageData, copyArr, app.W * app.H * sizeof(uchar4));
-          app.displayBuffer->unmap();
+          if (app.CPU)
+            memcpy(imageData, app.cpuDisplayBuffer.data(),
+                   app.W * app.H * sizeof(uchar4));
+          else {
+            uchar1 *copyArr = (uchar1 *)app.displayBuffer->map();
+            memcpy(imageData, copyArr, app.W * app.H * sizeof(uchar4));
+            app.displayBuffer->unmap();
+          }
         }
 
         ImGui::Text("sample = %d / %d", app.currentSample, app.samples);
@@ -288,9 +569,6 @@ int main(int ac, char **av) {
 
           return 0;
         }
-
-        // update number of rendered samples
-        app.currentSample++;
       }
 
       ImGui::End();
@@ -339,10 +617,17 @@ int main(int ac, char **av) {
           printf("Done rendering, output file will be saved.\n");
 
           // Save to file type selected in the initial setup
-          if (app.fileType == 0)
-            Save_PNG(app, app.accBuffer);
-          else
-            Save_HDR(app, app.accBuffer);
+          if (app.CPU) {
+            if (app.fileType == 0)
+              Save_PNG(app, app.cpuAccBuffer.data());
+            else
+              Save_HDR(app, app.cpuAccBuffer.data());
+          } else {
+            if (app.fileType == 0)
+              Save_PNG(app, app.accBuffer);
+            else
+              Save_HDR(app, app.accBuffer);
+          }
 
           printf("Render time: %.2fs\n", renderTime);
 
@@ -356,6 +641,8 @@ int main(int ac, char **av) {
   glfwDestroyWindow(window);
   glfwTerminate();
 
+  delete app.pool;
+
   system("PAUSE");
 
   return 0;
@@ -0,0 +1,78 @@
+#pragma once
+
+// Pixel sample accumulation, shared by the ray generation program and the CPU
+// backend so the host can be used as a reference of the device results.
+
+#include "random.cuh"
+#include "vec.hpp"
+
+// Remove NaN values
+RT_FUNCTION __host__ float3 de_nan(const float3& c) {
+  float3 temp = c;
+
+  if (!(temp.x == temp.x)) temp.x = 0.f;
+  if (!(temp.y == temp.y)) temp.y = 0.f;
+  if (!(temp.z == temp.z)) temp.z = 0.f;
+
+  return temp;
+}
+
+// Converts an accumulated color into a display color, 'count' being the
+// total number of accumulated samples
+RT_FUNCTION __host__ uchar4 make_Color(float4 col, int count) {
+  float3 temp = sqrt(make_float3(col.x, col.y, col.z) / float(count));
+  temp = clamp(temp, 0.f, 1.f);
+
+  int r = int(255.99 * temp.x);  // R
+  int g = int(255.99 * temp.y);  // G
+  int b = int(255.99 * temp.z);  // B
+  int a = int(255.99 * 1.f);     // A
+
+  return make_uchar4(r, g, b, a);
+}
+
+// Angle between the camera rays of neighbouring pixels, the spread of the ray
+// cones of the texture footprints. The film spans 'vertical' over 'height'
+// pixels, at the distance of its center from the camera origin.
+RT_FUNCTION __host__ float Pixel_Spread(const float3& lower_left_corner,
+                                        const float3& horizontal,
+                                        const float3& vertical,
+                                        const float3& origin, int height) {
+  float3 center = lower_left_corner + 0.5f * (horizontal + vertical);
+  return length(vertical) / (height * length(center - origin));
+}
+
+// Sums 'samples' jittered samples of a pixel, starting at sample 'frame'.
+// Every sample gets its own seed, so the result doesn't depend on how the
+// samples are split among launches. 'radiance' is a functor returning the
+// color seen through the given (u, v) film coordinates.
+template <typename Radiance_Function>
+RT_FUNCTION __host__ float4 accumulate(const Radiance_Function& radiance,
+                                       uint2 pixel, uint2 dim, int frame,
+                                       int samples) {
+  float3 sum = make_float3(0.f);
+
+  for (int i = 0; i < samples; i++) {
+    // get RNG seed
+    uint seed = tea<64>(dim.x * pixel.y + pixel.x, frame + i);
+
+    // Subpixel jitter: send the ray through a different position inside the
+    // pixel each time, to provide antialiasing.
+    float u = float(pixel.x + rnd(seed)) / dim.x;
+    float v = float(pixel.y + rnd(seed)) / dim.y;
+
+    sum += de_nan(radiance(u, v, seed));
+  }
+
+  return make_float4(sum.x, sum.y, sum.z, float(samples));
+}
+
+// Adds a batch of samples to the accumulated value, which is reset by the
+// first batch
+RT_FUNCTION __host__ float4 add_Samples(const float4& acc, const float4& batch,
+                                        int frame) {
+  if (frame == 0)
+    return batch;
+  else
+    return acc + batch;
+}
@@ -8,63 +8,64 @@ rtDeclareVariable(Ray, ray, rtCurrentRay, );
 rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
-// Primitive Parameters
-rtDeclareVariable(int, axis, , );
-rtDeclareVariable(float, a0, , );
-rtDeclareVariable(float, a1, , );
-rtDeclareVariable(float, b0, , );
-rtDeclareVariable(float, b1, , );
-rtDeclareVariable(float, k, , );
-rtDeclareVariable(int, flip, , );
-
-RT_FUNCTION bool Hit_X(float& t) {
+// Primitive Parameters, one entry per rectangle of the batch
+rtBuffer<int> axis_buffer;
+rtBuffer<float4> rect_buffer;  // a0, a1, b0, b1
+rtBuffer<float> k_buffer;
+rtBuffer<int> flip_buffer;
+rtBuffer<int> material_buffer;  // GeometryInstance material index
+
+RT_FUNCTION bool Hit_X(float& t, const float4& r, float k) {
   t = (k - ray.origin.x) / ray.direction.x;
   float a = ray.origin.y + t * ray.direction.y;
   float b = ray.origin.z + t * ray.direction.z;
-  if (a < a0 || a > a1 || b < b0 || b > b1) return false;
+  if (a < r.x || a > r.y || b < r.z || b > r.w) return false;
 
   return true;
 }
 
-RT_FUNCTION bool Hit_Y(float& t) {
+RT_FUNCTION bool Hit_Y(float& t, const float4& r, float k) {
   t = (k - ray.origin.y) / ray.direction.y;
   float a = ray.origin.x + t * ray.direction.x;
   float b = ray.origin.z + t * ray.direction.z;
-  if (a < a0 || a > a1 || b < b0 || b > b1) return false;
+  if (a < r.x || a > r.y || b < r.z || b > r.w) return false;
 
   return true;
 }
 
-RT_FUNCTION bool Hit_Z(float& t) {
+RT_FUNCTION bool Hit_Z(float& t, const float4& r, float k) {
   t = (k - ray.origin.z) / ray.direction.z;
   float a = ray.origin.x + t * ray.direction.x;
   float b = ray.origin.y + t * ray.direction.y;
-  if (a < a0 || a > a1 || b < b0 || b > b1) return false;
+  if (a < r.x || a > r.y || b < r.z || b > r.w) return false;
 
   return true;
 }
 
 RT_PROGRAM void Hit_Rect(int pid) {
+  const float4 r = rect_buffer[pid];
+  const float k = k_buffer[pid];
+
   bool hit = false;
   float t;
-  switch (AXIS(axis)) {
+  switch (AXIS(axis_buffer[pid])) {
     case X_AXIS:
-      hit = Hit_X(t);
+      hit = Hit_X(t, r, k);
       break;
     case Y_AXIS:
-      hit = Hit_Y(t);
+      hit = Hit_Y(t, r, k);
       break;
     case Z_AXIS:
-      hit = Hit_Z(t);
+      hit = Hit_Z(t, r, k);
       break;
     default:
       printf("Error: invalid axis");
   }
 
   if (hit && rtPotentialIntersection(t)) {
-    geo_index = 0;
+    geo_index = pid;
     bc = make_float2(0);
-    rtReportIntersection(0);
+    rtReportIntersection(material_buffer[pid]);
   }
 }
 
@@ -81,35 +82,48 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
   float3 hit_point = ray.origin + t_hit * ray.direction;
   rec.P = rtTransformPoint(RT_OBJECT_TO_WORLD, hit_point);
 
-  // Get normal and texture coordinates depending on axis
+  // Rectangle coordinates
+  const float a0 = rect_buffer[index].x, a1 = rect_buffer[index].y;
+  const float b0 = rect_buffer[index].z, b1 = rect_buffer[index].w;
+
+  // Get normal, texture coordinates and their derivatives depending on axis
   float3 normal;
-  switch (AXIS(axis)) {
+  rec.dpdu = rec.dpdv = make_float3(0.f);
+  switch (AXIS(axis_buffer[index])) {
     case X_AXIS:
       normal = make_float3(1.f, 0.f, 0.f);
       rec.u = (hit_point.y - a0) / (a1 - a0);
       rec.v = (hit_point.z - b0) / (b1 - b0);
+      rec.dpdu.y = a1 - a0;
+      rec.dpdv.z = b1 - b0;
       break;
     case Y_AXIS:
       normal = make_float3(0.f, 1.f, 0.f);
       rec.u = (hit_point.x - a0) / (a1 - a0);
       rec.v = (hit_point.z - b0) / (b1 - b0);
+      rec.dpdu.x = a1 - a0;
+      rec.dpdv.z = b1 - b0;
       break;
     case Z_AXIS:
       normal = make_float3(0.f, 0.f, 1.f);
       rec.u = (hit_point.x - a0) / (a1 - a0);
       rec.v = (hit_point.y - b0) / (b1 - b0);
+      rec.dpdu.x = a1 - a0;
+      rec.dpdv.y = b1 - b0;
       break;
     default:
       printf("Error: invalid axis");
   }
+  rec.dpdu = rtTransformVector(RT_OBJECT_TO_WORLD, rec.dpdu);
+  rec.dpdv = rtTransformVector(RT_OBJECT_TO_WORLD, rec.dpdv);
 
   // Normal
-  normal = flip ? -normal : normal;
+  normal = flip_buffer[index] ? -normal : normal;
   normal = normalize(rtTransformNormal(RT_OBJECT_TO_WORLD, normal));
   rec.shading_normal = rec.geometric_normal = normal;
 
-  // Texture Index
-  rec.index = index;
+  // Texture Index, rectangles have a single texture
+  rec.index = 0;
 
   return rec;
 }
@@ -117,7 +131,11 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
 RT_PROGRAM void Get_Bounds(int pid, float result[6]) {
   Aabb* aabb = (Aabb*)result;
 
-  switch (AXIS(axis)) {
+  const float a0 = rect_buffer[pid].x, a1 = rect_buffer[pid].y;
+  const float b0 = rect_buffer[pid].z, b1 = rect_buffer[pid].w;
+  const float k = k_buffer[pid];
+
+  switch (AXIS(axis_buffer[pid])) {
     case X_AXIS:
       aabb->m_min = make_float3(k - 0.0001f, a0, b0);
       aabb->m_max = make_float3(k + 0.0001f, a1, b1);
@@ -17,11 +17,12 @@ rtDeclareVariable(Ray, ray, rtCurrentRay, );
 rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
-// Primitive Parameters
-rtDeclareVariable(float3, boxmin, , );
-rtDeclareVariable(float3, boxmax, , );
+// Primitive Parameters, one entry per box of the batch
+rtBuffer<float3> boxmin_buffer;
+rtBuffer<float3> boxmax_buffer;
+rtBuffer<int> material_buffer;  // GeometryInstance material index
 
-RT_FUNCTION float3 boxnormal(float t, Ray ray) {
+RT_FUNCTION float3 boxnormal(float t, Ray ray, float3 boxmin, float3 boxmax) {
   float3 t0 = (boxmin - ray.origin) / ray.direction;
   float3 t1 = (boxmax - ray.origin) / ray.direction;
 
@@ -34,6 +35,8 @@ RT_FUNCTION float3 boxnormal(float t, Ray ray) {
 
 // Program that performs the ray-box intersection
 RT_PROGRAM void Intersect(int pid) {
+  const float3 boxmin = boxmin_buffer[pid];
+  const float3 boxmax = boxmax_buffer[pid];
   float3 t0 = (boxmin - ray.origin) / ray.direction;
   float3 t1 = (boxmax - ray.origin) / ray.direction;
   float tmin = max_component(min_vec(t0, t1));
@@ -41,13 +44,13 @@ RT_PROGRAM void Intersect(int pid) {
 
   if (tmin <= tmax) {
     if (rtPotentialIntersection(tmin)) {
-      geo_index = 0;
+      geo_index = pid;
       bc = make_float2(0);
-      rtReportIntersection(0);
+      rtReportIntersection(material_buffer[pid]);
     } else if (rtPotentialIntersection(tmax)) {
-      geo_index = 0;
+      geo_index = pid;
       bc = make_float2(0);
-      rtReportIntersection(0);
+      rtReportIntersection(material_buffer[pid]);
     }
   }
 }
@@ -67,15 +70,17 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
   rec.P = rtTransformPoint(RT_OBJECT_TO_WORLD, hit_point);
 
   // Normal
-  float3 normal = boxnormal(t_hit, ray);
+  float3 normal =
+      boxnormal(t_hit, ray, boxmin_buffer[index], boxmax_buffer[index]);
   normal = normalize(rtTransformNormal(RT_OBJECT_TO_WORLD, normal));
   rec.shading_normal = rec.geometric_normal = normal;
 
   // Texture coordinates
   rec.u = rec.v = 0.f;
+  rec.dpdu = rec.dpdv = make_float3(0.f);
 
-  // Texture Index
-  rec.index = index;
+  // Texture Index, boxes have a single texture
+  rec.index = 0;
 
   return rec;
 }
@@ -83,6 +88,6 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
 // returns the bounding box of the pid'th primitive in this gometry.
 RT_PROGRAM void Get_Bounds(int pid, float result[6]) {
   Aabb* aabb = (Aabb*)result;
-  aabb->m_min = boxmin - make_float3(0.001f);
-  aabb->m_max = boxmax + make_float3(0.001f);
+  aabb->m_min = boxmin_buffer[pid] - make_float3(0.001f);
+  aabb->m_max = boxmax_buffer[pid] + make_float3(0.001f);
 }
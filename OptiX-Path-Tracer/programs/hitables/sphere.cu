@@ -24,12 +24,15 @@ rtDeclareVariable(Ray, ray, rtCurrentRay, );
 rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
-// Primitive Parameters
-rtDeclareVariable(float3, center, , );
-rtDeclareVariable(float, radius, , );
+// Primitive Parameters, one entry per sphere of the batch
+rtBuffer<float3> center_buffer;
+rtBuffer<float> radius_buffer;
+rtBuffer<int> material_buffer;  // GeometryInstance material index
 
 // Checks if Ray intersects Sphere and computes hit distance
 RT_PROGRAM void hit_sphere(int pid) {
+  const float3 center = center_buffer[pid];
+  const float radius = radius_buffer[pid];
   const float3 oc = ray.origin - center;
 
   // if the ray hits the sphere, the following equation has two roots:
@@ -48,16 +51,16 @@ RT_PROGRAM void hit_sphere(int pid) {
   // first root of the sphere equation:
   float t = (-b - sqrtf(discriminant)) / a;
   if (rtPotentialIntersection(t)) {
-    geo_index = 0;
+    geo_index = pid;
     bc = make_float2(0);
-    rtReportIntersection(0);
+    rtReportIntersection(material_buffer[pid]);
   }
 
   t = (-b + sqrtf(discriminant)) / a;
   if (rtPotentialIntersection(t)) {
-    geo_index = 0;
+    geo_index = pid;
     bc = make_float2(0);
-    rtReportIntersection(0);
+    rtReportIntersection(material_buffer[pid]);
   }
 }
 
@@ -76,7 +79,7 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
   rec.P = rtTransformPoint(RT_OBJECT_TO_WORLD, hit_point);
 
   // Normal
-  float3 T = (rec.P - center) / radius;
+  float3 T = (rec.P - center_buffer[index]) / radius_buffer[index];
   float3 normal = normalize(rtTransformNormal(RT_OBJECT_TO_WORLD, T));
   rec.shading_normal = rec.geometric_normal = normal;
 
@@ -86,8 +89,13 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
   rec.u = 1.f - (phi + PI_F) / (2.f * PI_F);
   rec.v = (theta + PI_F / 2.f) / PI_F;
 
-  // Texture Index
-  rec.index = index;
+  // Texture coordinate derivatives
+  Sphere_Derivatives(T, radius_buffer[index], rec.dpdu, rec.dpdv);
+  rec.dpdu = rtTransformVector(RT_OBJECT_TO_WORLD, rec.dpdu);
+  rec.dpdv = rtTransformVector(RT_OBJECT_TO_WORLD, rec.dpdv);
+
+  // Texture Index, spheres have a single texture
+  rec.index = 0;
 
   return rec;
 }
@@ -95,6 +103,6 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
 // Computes Sphere bounding box attributes
 RT_PROGRAM void get_bounds(int pid, float result[6]) {
   Aabb* aabb = (Aabb*)result;
-  aabb->m_min = center - radius;
-  aabb->m_max = center + radius;
+  aabb->m_min = center_buffer[pid] - radius_buffer[pid];
+  aabb->m_max = center_buffer[pid] + radius_buffer[pid];
 }
@@ -1,5 +1,6 @@
 #include "../prd.cuh"
 #include "hitables.cuh"
+#include "vertex_attributes.hpp"
 
 // OptiX Context objects
 rtDeclareVariable(Ray, ray, rtCurrentRay, );
@@ -15,6 +16,29 @@ rtBuffer<float2> texcoord_buffer;
 rtBuffer<int3> index_buffer;
 rtBuffer<int> material_buffer;
 
+// Compact attributes, see vertex_attributes.hpp. They are used instead of the
+// float buffers above when they aren't empty.
+rtBuffer<ushort4> packed_vertex_buffer;
+rtBuffer<uint> packed_normal_buffer;
+rtBuffer<uint> packed_texcoord_buffer;
+rtDeclareVariable(float3, vertex_origin, , );
+rtDeclareVariable(float3, vertex_scale, , );
+
+RT_FUNCTION float3 Vertex(int i) {
+  if (packed_vertex_buffer.size() == 0) return vertex_buffer[i];
+  return Decode_Position(packed_vertex_buffer[i], vertex_origin, vertex_scale);
+}
+
+RT_FUNCTION float3 Normal(int i) {
+  if (packed_normal_buffer.size() == 0) return normal_buffer[i];
+  return Decode_Normal(packed_normal_buffer[i]);
+}
+
+RT_FUNCTION float2 Texcoord(int i) {
+  if (packed_texcoord_buffer.size() == 0) return texcoord_buffer[i];
+  return Decode_Texcoord(packed_texcoord_buffer[i]);
+}
+
 // Attribute Program (for GeometryTriangles)
 RT_PROGRAM void Attributes() {
   geo_index = rtGetPrimitiveIndex();  // texture index
@@ -28,9 +52,9 @@ RT_PROGRAM void Intersect(int pid) {
   const int3 v_idx = index_buffer[pid];
 
   // Triangle Vertex
-  float3 a = vertex_buffer[v_idx.x];
-  float3 b = vertex_buffer[v_idx.y];
-  float3 c = vertex_buffer[v_idx.z];
+  float3 a = Vertex(v_idx.x);
+  float3 b = Vertex(v_idx.y);
+  float3 c = Vertex(v_idx.z);
 
   float3 e1 = b - a;
   float3 e2 = c - a;
@@ -63,9 +87,9 @@ RT_PROGRAM void Get_Bounds(int pid, float result[6]) {
 
   // Triangle Vertex
   const int3 v_idx = index_buffer[pid];
-  float3 a = vertex_buffer[v_idx.x];
-  float3 b = vertex_buffer[v_idx.y];
-  float3 c = vertex_buffer[v_idx.z];
+  float3 a = Vertex(v_idx.x);
+  float3 b = Vertex(v_idx.y);
+  float3 c = Vertex(v_idx.z);
 
   // find min and max iterating through vertices
   // min(minX, minY, minZ)
@@ -95,9 +119,9 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
   const int3 v_idx = index_buffer[index];
 
   // Triangle Vertex
-  float3 a = vertex_buffer[v_idx.x];
-  float3 b = vertex_buffer[v_idx.y];
-  float3 c = vertex_buffer[v_idx.z];
+  float3 a = Vertex(v_idx.x);
+  float3 b = Vertex(v_idx.y);
+  float3 c = Vertex(v_idx.z);
 
   float3 e1 = rtTransformPoint(RT_OBJECT_TO_WORLD, b - a);
   float3 e2 = rtTransformPoint(RT_OBJECT_TO_WORLD, c - a);
@@ -117,29 +141,33 @@ RT_CALLABLE_PROGRAM HitRecord Get_HitRecord(int index,    // primitive index
   rec.geometric_normal = Ng;
 
   // Shading Normal
-  if (normal_buffer.size() == 0) {
+  if (normal_buffer.size() == 0 && packed_normal_buffer.size() == 0) {
     rec.shading_normal = Ng;
   } else {
-    float3 a_n = normal_buffer[v_idx.x];
-    float3 b_n = normal_buffer[v_idx.y];
-    float3 c_n = normal_buffer[v_idx.z];
+    float3 a_n = Normal(v_idx.x);
+    float3 b_n = Normal(v_idx.y);
+    float3 c_n = Normal(v_idx.z);
 
     float3 Ns = a_n * b0 + b_n * b1 + c_n * b2;
     Ns = normalize(rtTransformNormal(RT_OBJECT_TO_WORLD, Ns));
     rec.shading_normal = Ns;
   }
 
-  // Texture Coordinates
-  if (texcoord_buffer.size() == 0) {
+  // Texture Coordinates and their derivatives
+  if (texcoord_buffer.size() == 0 && packed_texcoord_buffer.size() == 0) {
     rec.u = 0.f;
     rec.v = 0.f;
+    rec.dpdu = rec.dpdv = make_float3(0.f);
   } else {
-    float2 a_uv = texcoord_buffer[v_idx.x];
-    float2 b_uv = texcoord_buffer[v_idx.y];
-    float2 c_uv = texcoord_buffer[v_idx.z];
+    float2 a_uv = Texcoord(v_idx.x);
+    float2 b_uv = Texcoord(v_idx.y);
+    float2 c_uv = Texcoord(v_idx.z);
 
     rec.u = a_uv.x * b0 + b_uv.x * b1 + c_uv.x * b2;
     rec.v = a_uv.y * b0 + b_uv.y * b1 + c_uv.y * b2;
+
+    Triangle_Derivatives(e1, e2, b_uv - a_uv, c_uv - a_uv, rec.dpdu,
+                         rec.dpdv);
   }
 
   // Texture Index
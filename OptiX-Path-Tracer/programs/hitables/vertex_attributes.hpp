@@ -0,0 +1,168 @@
+#pragma once
+
+#include "../vec.hpp"
+
+// vertex_attributes.hpp: compact vertex attribute formats of the meshes,
+// encoded on the host and decoded by the triangle programs and the CPU
+// backend with the same functions:
+// - normals: octahedral mapping, two 16-bit snorms in a uint
+// - texcoords: two half floats in a uint
+// - positions: three 16-bit unorms relative to the mesh bounds, padded to a
+// ushort4 so they are read with a single 8 byte load
+
+// Storage of the mesh vertex attributes
+typedef enum {
+  FULL_ATTRIBUTES,     // float positions, normals and texcoords
+  COMPACT_ATTRIBUTES,  // compact normals and texcoords
+  COMPACT_POSITIONS    // compact positions, normals and texcoords
+} Mesh_Attributes;
+
+// Bits of a float and back, without the CUDA intrinsics so the host has them
+RT_FUNCTION __host__ uint Float_Bits(float f) {
+  union {
+    float f;
+    uint u;
+  } bits;
+  bits.f = f;
+  return bits.u;
+}
+
+RT_FUNCTION __host__ float Bits_Float(uint u) {
+  union {
+    float f;
+    uint u;
+  } bits;
+  bits.u = u;
+  return bits.f;
+}
+
+/////////////
+// Normals //
+/////////////
+
+// Unit normal of an octahedral encoding. The lower hemisphere is folded over
+// the diagonals of the square.
+RT_FUNCTION __host__ float3 Decode_Normal(uint packed) {
+  float x = fmaxf((short)(packed & 0xffff) / 32767.f, -1.f);
+  float y = fmaxf((short)(packed >> 16) / 32767.f, -1.f);
+  float z = 1.f - fabsf(x) - fabsf(y);
+
+  float t = fmaxf(-z, 0.f);
+  x += x >= 0.f ? -t : t;
+  y += y >= 0.f ? -t : t;
+
+  return normalize(make_float3(x, y, z));
+}
+
+inline __host__ uint Pack_Snorm2(float x, float y) {
+  int qx = (int)fminf(fmaxf(x, -32767.f), 32767.f);
+  int qy = (int)fminf(fmaxf(y, -32767.f), 32767.f);
+  return (uint)(unsigned short)qx | ((uint)(unsigned short)qy << 16);
+}
+
+// Octahedral encoding of a normal. Picks the closest decoded normal among the
+// four grid points around the projection, instead of just rounding it.
+inline __host__ uint Encode_Normal(const float3 &n) {
+  float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+  if (sum == 0.f) return 0u;
+
+  float x = n.x / sum, y = n.y / sum;
+  if (n.z < 0.f) {
+    float fx = (1.f - fabsf(y)) * (x >= 0.f ? 1.f : -1.f);
+    float fy = (1.f - fabsf(x)) * (y >= 0.f ? 1.f : -1.f);
+    x = fx;
+    y = fy;
+  }
+
+  // distances rather than cosines, which are all 1 in float precision
+  float3 unit = n / length(n);
+  float gx = floorf(x * 32767.f), gy = floorf(y * 32767.f);
+  uint best = 0u;
+  float bestDistance = 4.f;
+
+  for (int i = 0; i < 4; i++) {
+    uint packed = Pack_Snorm2(gx + (i & 1), gy + (i >> 1));
+    float3 error = Decode_Normal(packed) - unit;
+    float distance = dot(error, error);
+
+    if (distance < bestDistance) {
+      bestDistance = distance;
+      best = packed;
+    }
+  }
+
+  return best;
+}
+
+///////////////
+// Texcoords //
+///////////////
+
+RT_FUNCTION __host__ float Decode_Half(uint h) {
+  uint sign = (h & 0x8000u) << 16;
+  uint exponent = h & 0x7c00u;
+
+  // denormals
+  if (exponent == 0u)
+    return Bits_Float(sign | Float_Bits((h & 0x3ffu) * (1.f / 16777216.f)));
+
+  // infinities and NaNs
+  if (exponent == 0x7c00u)
+    return Bits_Float(sign | 0x7f800000u | ((h & 0x3ffu) << 13));
+
+  return Bits_Float(sign | (((h & 0x7fffu) << 13) + 0x38000000u));
+}
+
+// Half float of a float, rounded to nearest even
+inline __host__ uint Encode_Half(float f) {
+  uint bits = Float_Bits(f);
+  uint sign = (bits >> 16) & 0x8000u;
+  bits &= 0x7fffffffu;
+
+  // infinities, NaNs and floats that round to infinity
+  if (bits >= 0x7f800000u)
+    return sign | (bits > 0x7f800000u ? 0x7e00u : 0x7c00u);
+  if (bits >= 0x477ff000u) return sign | 0x7c00u;
+
+  // denormal halves, the addition does the rounding
+  if (bits < 0x38800000u)
+    return sign | (Float_Bits(Bits_Float(bits) + 0.5f) - 0x3f000000u);
+
+  // rebias the exponent and round the mantissa
+  bits += 0xc8000fffu + ((bits >> 13) & 1u);
+  return sign | (bits >> 13);
+}
+
+RT_FUNCTION __host__ float2 Decode_Texcoord(uint packed) {
+  return make_float2(Decode_Half(packed & 0xffffu), Decode_Half(packed >> 16));
+}
+
+inline __host__ uint Encode_Texcoord(const float2 &t) {
+  return Encode_Half(t.x) | (Encode_Half(t.y) << 16);
+}
+
+///////////////
+// Positions //
+///////////////
+
+// 'origin' is the minimum of the mesh bounds and 'scale' their extent over
+// 65535
+RT_FUNCTION __host__ float3 Decode_Position(const ushort4 &q,
+                                            const float3 &origin,
+                                            const float3 &scale) {
+  return origin + make_float3(q.x, q.y, q.z) * scale;
+}
+
+inline __host__ unsigned short Quantize_Unorm16(float p, float origin,
+                                                float scale) {
+  if (scale <= 0.f) return 0;
+  float q = floorf((p - origin) / scale + 0.5f);
+  return (unsigned short)fminf(fmaxf(q, 0.f), 65535.f);
+}
+
+inline __host__ ushort4 Encode_Position(const float3 &p, const float3 &origin,
+                                        const float3 &scale) {
+  return make_ushort4(Quantize_Unorm16(p.x, origin.x, scale.x),
+                      Quantize_Unorm16(p.y, origin.y, scale.y),
+                      Quantize_Unorm16(p.z, origin.z, scale.z), 0);
+}
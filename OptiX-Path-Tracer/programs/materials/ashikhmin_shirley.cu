@@ -26,18 +26,20 @@ rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
 // Material Parameters
-rtDeclareVariable(Texture_Function, diffuse_color, , );
-rtDeclareVariable(Texture_Function, specular_color, , );
+rtDeclareVariable(int, diffuse_color, , );   // texture table index
+rtDeclareVariable(int, specular_color, , );  // texture table index
 rtDeclareVariable(float, nu, , );
 rtDeclareVariable(float, nv, , );
 
-RT_FUNCTION Ashikhmin_Shirley_Parameters Get_Parameters(const float3 &P,
-                                                        float u, float v,
-                                                        int index) {
+RT_FUNCTION Ashikhmin_Shirley_Parameters Get_Parameters(
+    const float3 &P, float u, float v, int index,
+    const Texture_Footprint &footprint) {
   Ashikhmin_Shirley_Parameters surface;
 
-  surface.diffuse_color = diffuse_color(u, v, P, index);
-  surface.specular_color = specular_color(u, v, P, index);
+  surface.diffuse_color =
+      Sample_Texture(diffuse_color, u, v, P, index, footprint);
+  surface.specular_color =
+      Sample_Texture(specular_color, u, v, P, index, footprint);
   surface.nu = nu;
   surface.nv = nv;
 
@@ -52,7 +54,8 @@ RT_PROGRAM void closest_hit() {
   float3 Wo = rec.Wo;             // Ray view direction
   float3 N = rec.shading_normal;  // normal
 
-  Ashikhmin_Shirley_Parameters surface = Get_Parameters(P, rec.u, rec.v, index);
+  Ashikhmin_Shirley_Parameters surface =
+      Get_Parameters(P, rec.u, rec.v, index, Hit_Footprint(rec, prd));
 
   // Sample BRDF
   float3 Wi = Sample(surface, P, Wo, N, prd.seed);
@@ -38,8 +38,8 @@ rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
 // Material Parameters
-rtDeclareVariable(Texture_Function, base_texture, , );
-rtDeclareVariable(Texture_Function, extinction_texture, , );
+rtDeclareVariable(int, base_texture, , );        // texture table index
+rtDeclareVariable(int, extinction_texture, , );  // texture table index
 rtDeclareVariable(float, ref_idx, , );
 rtDeclareVariable(float, density, , );
 
@@ -50,7 +50,9 @@ RT_PROGRAM void closest_hit() {
   float3 Wo = -rec.Wo;            // Ray view direction
   float3 N = rec.shading_normal;  // normal
 
-  float3 base_color = base_texture(rec.u, rec.v, P, index);
+  Texture_Footprint footprint = Hit_Footprint(rec, prd);
+  float3 base_color =
+      Sample_Texture(base_texture, rec.u, rec.v, P, index, footprint);
   float3 absorption = make_float3(1.f);
 
   float ni_over_nt;
@@ -63,7 +65,8 @@ RT_PROGRAM void closest_hit() {
     cosine = ref_idx * cosine / length(Wo);
 
     // Apply the Beer-Lambert Law
-    float3 extinction = extinction_texture(rec.u, rec.v, P, index);
+    float3 extinction = Sample_Texture(extinction_texture, rec.u, rec.v, P,
+                                       index, footprint);
     // absorption = expf(-t_hit * extinction);
   }
 
@@ -12,13 +12,14 @@ rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
 // Material Parameters
-rtDeclareVariable(Texture_Function, sample_texture, , );
+rtDeclareVariable(int, sample_texture, , );  // texture table index
 
-RT_FUNCTION Isotropic_Parameters Get_Parameters(const float3 &P, float u,
-                                                float v, int index) {
+RT_FUNCTION Isotropic_Parameters Get_Parameters(
+    const float3 &P, float u, float v, int index,
+    const Texture_Footprint &footprint) {
   Isotropic_Parameters surface;
 
-  surface.color = sample_texture(u, v, P, index);
+  surface.color = Sample_Texture(sample_texture, u, v, P, index, footprint);
 
   return surface;
 }
@@ -31,10 +32,12 @@ RT_PROGRAM void closest_hit() {
   float3 Wo = rec.Wo;             // Ray view direction
   float3 N = rec.shading_normal;  // normal
 
-  Isotropic_Parameters surface = Get_Parameters(P, rec.u, rec.v, index);
+  Isotropic_Parameters surface =
+      Get_Parameters(P, rec.u, rec.v, index, Hit_Footprint(rec, prd));
 
   // Sample Direct Light
-  float3 direct = Direct_Light(surface, P, Wo, N, false, prd.seed);
+  float3 direct =
+      Direct_Light(surface, P, Wo, N, false, prd.coneSpread, prd.seed);
   prd.radiance += prd.throughput * direct;
 
   // Sample BRDF
@@ -28,4 +28,8 @@ RT_FUNCTION float3 Evaluate(const Isotropic_Parameters &surface,
                             float &pdf) {  // shading normal
   pdf = PDF(surface, P, Wo, Wi, N);
   return 0.25 * PI_F * surface.color;
+}
+
+RT_FUNCTION bool Is_Medium(const Isotropic_Parameters & /* surface */) {
+  return true;
 }
\ No newline at end of file
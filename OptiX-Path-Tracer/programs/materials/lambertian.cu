@@ -32,15 +32,17 @@ rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
 // Material Parameters
-rtDeclareVariable(Texture_Function, sample_texture, , );
+rtDeclareVariable(int, sample_texture, , );  // texture table index
 
-RT_FUNCTION Lambertian_Parameters Get_Parameters(const float3 &P,  // hit point
-                                                 float u,  // texture coord x
-                                                 float v,  // texture coord y
-                                                 int index) {  // texture index
+RT_FUNCTION Lambertian_Parameters Get_Parameters(
+    const float3 &P,                       // hit point
+    float u,                               // texture coord x
+    float v,                               // texture coord y
+    int index,                             // texture index
+    const Texture_Footprint &footprint) {  // image lookup footprint
   Lambertian_Parameters surface;
 
-  surface.color = sample_texture(u, v, P, index);
+  surface.color = Sample_Texture(sample_texture, u, v, P, index, footprint);
 
   return surface;
 }
@@ -53,10 +55,12 @@ RT_PROGRAM void closest_hit() {
   float3 Wo = rec.Wo;             // Ray view direction
   float3 N = rec.shading_normal;  // normal
 
-  Lambertian_Parameters surface = Get_Parameters(P, rec.u, rec.v, index);
+  Lambertian_Parameters surface =
+      Get_Parameters(P, rec.u, rec.v, index, Hit_Footprint(rec, prd));
 
   // Sample Direct Light
-  float3 direct = Direct_Light(surface, P, Wo, N, false, prd.seed);
+  float3 direct =
+      Direct_Light(surface, P, Wo, N, false, prd.coneSpread, prd.seed);
   prd.radiance += prd.throughput * direct;
 
   // Sample BRDF
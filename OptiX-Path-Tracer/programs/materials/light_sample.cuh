@@ -9,6 +9,8 @@
 #include "oren_nayar.cuh"
 #include "torrance_sparrow.cuh"
 
+#include "../pdfs/environment.hpp"
+
 // Light sampling callable programs
 rtDeclareVariable(int, numLights, , );
 rtBuffer<float3> Light_Emissions;
@@ -24,6 +26,55 @@ rtBuffer<rtCallableProgramId<float(const float3 &,    // P
                                    const float3 &)>>  // N
     Light_PDF;
 
+// Environment light, the HDR map of the environmental_mapping miss program
+// sampled with the distribution of programs/pdfs/environment.hpp
+rtDeclareVariable(int, environmentLight, , );     // 0 if it isn't sampled
+rtDeclareVariable(int, environmentTexture, , );   // texture table index
+rtDeclareVariable(int, environmentSpherical, , );
+rtDeclareVariable(int, environmentWidth, , );
+rtDeclareVariable(int, environmentHeight, , );
+rtBuffer<float> Environment_Marginal;
+rtBuffer<float> Environment_Conditional;
+
+// Distribution accessor of the environment sampling functions
+struct Device_Environment {
+  RT_FUNCTION int width() const { return environmentWidth; }
+  RT_FUNCTION int height() const { return environmentHeight; }
+  RT_FUNCTION bool isSpherical() const { return environmentSpherical; }
+  RT_FUNCTION float marginal(int i) const { return Environment_Marginal[i]; }
+
+  RT_FUNCTION float conditional(int row, int i) const {
+    return Environment_Conditional[row * (environmentWidth + 1) + i];
+  }
+};
+
+// Radiance of the environment in direction 'Wi', as the miss program sees it
+// from a ray cone of the given spread
+RT_FUNCTION float3 Environment_Emission(const float3 &Wi, float spread) {
+  float2 uv = Environment_UV(Wi, environmentSpherical);
+  return 2.f * Sample_Texture(environmentTexture, uv.x, uv.y,
+                              make_float3(0.f), 0, Direction_Footprint(spread));
+}
+
+// Traces a shadow ray, only lights facing N don't occlude it unless
+// 'lightsOcclude' is set. Rays towards the environment set it, since it's
+// behind everything.
+RT_FUNCTION bool In_Shadow(const float3 &P, const float3 &Wi, const float3 &N,
+                           bool lightsOcclude = false) {
+  PerRayData_Shadow prdShadow;
+  prdShadow.inShadow = false;  // left as is if the ray hits nothing
+  prdShadow.lightsOcclude = lightsOcclude;
+  prdShadow.normal = N;
+  Ray shadowRay = make_Ray(/* origin   : */ P,
+                           /* direction: */ Wi,
+                           /* ray type : */ 1,
+                           /* tmin     : */ 1e-3f,
+                           /* tmax     : */ RT_DEFAULT_MAX);
+  rtTrace(world, shadowRay, prdShadow);
+
+  return prdShadow.inShadow;
+}
+
 RT_FUNCTION float PowerHeuristic(unsigned int numf, float fPdf,
                                  unsigned int numg, float gPdf) {
   float f = numf * fPdf;
@@ -32,20 +83,77 @@ RT_FUNCTION float PowerHeuristic(unsigned int numf, float fPdf,
   return (f * f) / (f * f + g * g);
 }
 
+// Direct light of the environment, multiple importance sampling of a sample of
+// the environment and of a BRDF sample. Both need a shadow ray, which every
+// hit occludes.
+template <typename T>
+RT_FUNCTION float3 Direct_Environment(T &surface,        // surface parameters
+                                      const float3 &P,   // next ray origin
+                                      const float3 &Wo,  // previous ray dir
+                                      const float3 &N,   // surface normal
+                                      float spread,      // ray cone spread
+                                      uint &seed) {
+  float3 directLight = make_float3(0.f);
+  Device_Environment environment;
+
+  // Sample environment
+  float r1 = rnd(seed);
+  float r2 = rnd(seed);
+  float lightPDF;
+  float3 Wi = Sample_Environment(environment, r1, r2, lightPDF);
+
+  // media scatter light from behind N too
+  bool facing = Is_Medium(surface) || dot(Wi, N) >= 0.f;
+
+  if (lightPDF != 0.f && facing && !In_Shadow(P, Wi, N, true)) {
+    float matPDF;
+    float3 matValue = Evaluate(surface, P, Wo, Wi, N, matPDF);
+
+    if (matPDF != 0.f && !isNull(matValue)) {
+      float weight = PowerHeuristic(1, lightPDF, 1, matPDF);
+      directLight +=
+          matValue * Environment_Emission(Wi, spread) * weight / lightPDF;
+    }
+  }
+
+  // Sample BRDF
+  Wi = Sample(surface, P, Wo, N, seed);
+  float matPDF;
+  float3 matValue = Evaluate(surface, P, Wo, Wi, N, matPDF);
+
+  if (matPDF != 0.f && !isNull(matValue)) {
+    lightPDF = Environment_PDF(environment, Wi);
+
+    // black parts of the map have no density
+    if (lightPDF == 0.f || In_Shadow(P, Wi, N, true)) return directLight;
+
+    float weight = PowerHeuristic(1, matPDF, 1, lightPDF);
+    directLight +=
+        matValue * Environment_Emission(Wi, spread) * weight / matPDF;
+  }
+
+  return directLight;
+}
+
 template <typename T>
 RT_FUNCTION float3 Direct_Light(T &surface,        // surface parameters
                                 const float3 &P,   // next ray origin
                                 const float3 &Wo,  // previous ray direction
                                 const float3 &N,   // surface normal
-                                bool isLight, uint &seed) {
+                                bool isLight,
+                                float spread,  // ray cone spread
+                                uint &seed) {
   float3 directLight = make_float3(0.f);
 
-  // return black if there's no light
-  if (numLights == 0) return make_float3(0.f);
+  // return black if there's no light, the environment counts as the last one
+  int count = numLights + (environmentLight ? 1 : 0);
+  if (count == 0) return make_float3(0.f);
 
   // ramdomly pick one light and multiply the result by the number of lights
   // it's the same as dividing by the PDF if they have the same probability
-  int index = ((int)(rnd(seed) * numLights)) % numLights;
+  int index = ((int)(rnd(seed) * count)) % count;
+  if (index == numLights)
+    return count * Direct_Environment(surface, P, Wo, N, spread, seed);
 
   // return black if there's just one light and we just hit it
   if (isLight && numLights == 1) return make_float3(0.f);
@@ -58,18 +166,8 @@ RT_FUNCTION float3 Direct_Light(T &surface,        // surface parameters
   // only sample if surface normal is in the light direction
   if (dot(Wi, N) < 0.f) return make_float3(0.f);
 
-  // Check if light is occluded
-  PerRayData_Shadow prdShadow;
-  prdShadow.normal = N;
-  Ray shadowRay = make_Ray(/* origin   : */ P,
-                           /* direction: */ Wi,
-                           /* ray type : */ 1,
-                           /* tmin     : */ 1e-3f,
-                           /* tmax     : */ RT_DEFAULT_MAX);
-  rtTrace(world, shadowRay, prdShadow);
-
   // if light is occluded, return black
-  if (prdShadow.inShadow) return make_float3(0.f);
+  if (In_Shadow(P, Wi, N)) return make_float3(0.f);
 
   // Multiple Importance Sample
 
@@ -93,13 +191,13 @@ RT_FUNCTION float3 Direct_Light(T &surface,        // surface parameters
     lightPDF = Light_PDF[index](P, Wo, Wi, N);
 
     // we didn't hit anything, ignore BRDF sample
-    if (!lightPDF || isNull(emission)) return directLight;
+    if (!lightPDF || isNull(emission)) return count * directLight;
 
     float weight = PowerHeuristic(1, matPDF, 1, lightPDF);
     directLight += matValue * emission * weight / matPDF;
   }
 
-  return directLight;
+  return count * directLight;
 }
 
 #endif
\ No newline at end of file
@@ -21,11 +21,12 @@
 #include "../sampling.cuh"
 #include "../vec.hpp"
 
-// Typedef of Texture callable program calls
-typedef rtCallableProgramId<float3(float, float, float3, int)> Texture_Function;
+#ifdef __CUDACC__
+#include "../textures/texture.cuh"
 
 // Typedef of geometry parameters callable program calls
 typedef rtCallableProgramX<HitRecord(int, Ray, float, float2)> HitRecord_Function;
+#endif
 
 RT_FUNCTION float schlick(float cosine, float ref_idx) {
   float r0 = (1.f - ref_idx) / (1.f + ref_idx);
@@ -86,4 +87,11 @@ RT_FUNCTION float FrDielectric(float _cosThetaI, float _etaI, float _etaT) {
   float Rperp = ((etaI * cosThetaI) - (etaT * cosThetaT)) /
                 ((etaI * cosThetaI) + (etaT * cosThetaT));
   return (Rparl * Rparl + Rperp * Rperp) / 2;
+}
+
+// Whether a material scatters light arriving from every direction, as the
+// phase function of a medium does, rather than from the hemisphere of N
+template <typename T>
+RT_FUNCTION bool Is_Medium(const T & /* surface */) {
+  return false;
 }
\ No newline at end of file
@@ -32,7 +32,7 @@ rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
 // Material Parameters
-rtDeclareVariable(Texture_Function, sample_texture, , );
+rtDeclareVariable(int, sample_texture, , );  // texture table index
 rtDeclareVariable(float, fuzz, , );
 
 RT_PROGRAM void closest_hit() {
@@ -42,7 +42,8 @@ RT_PROGRAM void closest_hit() {
   float3 Wo = rec.Wo;             // Ray view direction
   float3 N = rec.shading_normal;  // normal
 
-  float3 color = sample_texture(rec.u, rec.v, P, index);
+  float3 color = Sample_Texture(sample_texture, rec.u, rec.v, P, index,
+                                Hit_Footprint(rec, prd));
 
   // reflect ray
   float3 reflected = reflect(-Wo, N);
@@ -27,15 +27,16 @@ rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
 // Material Parameters
-rtDeclareVariable(Texture_Function, sample_texture, , );
+rtDeclareVariable(int, sample_texture, , );  // texture table index
 rtDeclareVariable(float, rA, , );
 rtDeclareVariable(float, rB, , );
 
-RT_FUNCTION Oren_Nayar_Parameters Get_Parameters(const float3 &P, float u,
-                                                 float v, int index) {
+RT_FUNCTION Oren_Nayar_Parameters Get_Parameters(
+    const float3 &P, float u, float v, int index,
+    const Texture_Footprint &footprint) {
   Oren_Nayar_Parameters surface;
 
-  surface.color = sample_texture(u, v, P, index);
+  surface.color = Sample_Texture(sample_texture, u, v, P, index, footprint);
   surface.rA = rA;
   surface.rB = rB;
 
@@ -50,10 +51,12 @@ RT_PROGRAM void closest_hit() {
   float3 Wo = rec.Wo;             // Ray view direction
   float3 N = rec.shading_normal;  // normal
 
-  Oren_Nayar_Parameters surface = Get_Parameters(P, rec.u, rec.v, index);
+  Oren_Nayar_Parameters surface =
+      Get_Parameters(P, rec.u, rec.v, index, Hit_Footprint(rec, prd));
 
   // Sample Direct Light
-  float3 direct = Direct_Light(surface, P, Wo, N, false, prd.seed);
+  float3 direct =
+      Direct_Light(surface, P, Wo, N, false, prd.coneSpread, prd.seed);
   prd.radiance += prd.throughput * direct;
 
   // Sample BRDF
@@ -20,15 +20,16 @@ rtDeclareVariable(int, geo_index, attribute geo_index, );  // primitive index
 rtDeclareVariable(float2, bc, attribute bc, );  // triangle barycentrics
 
 // Material Parameters
-rtDeclareVariable(Texture_Function, sample_texture, , );
+rtDeclareVariable(int, sample_texture, , );  // texture table index
 rtDeclareVariable(float, nu, , );
 rtDeclareVariable(float, nv, , );
 
-RT_FUNCTION Torrance_Sparrow_Parameters Get_Parameters(const float3 &P, float u,
-                                                       float v, int index) {
+RT_FUNCTION Torrance_Sparrow_Parameters Get_Parameters(
+    const float3 &P, float u, float v, int index,
+    const Texture_Footprint &footprint) {
   Torrance_Sparrow_Parameters surface;
 
-  surface.color = sample_texture(u, v, P, index);
+  surface.color = Sample_Texture(sample_texture, u, v, P, index, footprint);
   surface.nu = nu;
   surface.nv = nv;
 
@@ -43,7 +44,8 @@ RT_PROGRAM void closest_hit() {
   float3 Wo = rec.Wo;             // Ray view direction
   float3 N = rec.shading_normal;  // normal
 
-  Torrance_Sparrow_Parameters surface = Get_Parameters(P, rec.u, rec.v, index);
+  Torrance_Sparrow_Parameters surface =
+      Get_Parameters(P, rec.u, rec.v, index, Hit_Footprint(rec, prd));
 
   // Sample BRDF
   float3 Wi = Sample(surface, P, Wo, N, prd.seed);
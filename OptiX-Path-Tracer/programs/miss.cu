@@ -20,11 +20,11 @@
 rtDeclareVariable(Ray, ray, rtCurrentRay, );
 rtDeclareVariable(PerRayData, prd, rtPayload, );
 
-// Texture Samplers
+// Texture table indices
 // TODO: remove one of these
-rtDeclareVariable(Texture_Function, sample_color1, , );
-rtDeclareVariable(Texture_Function, sample_color2, , );
-rtDeclareVariable(Texture_Function, sample_texture, , );
+rtDeclareVariable(int, sample_color1, , );
+rtDeclareVariable(int, sample_color2, , );
+rtDeclareVariable(int, sample_texture, , );
 
 // Gradient Color Background
 RT_PROGRAM void gradient_color() {
@@ -32,8 +32,9 @@ RT_PROGRAM void gradient_color() {
   const float t = 0.5f * (unit_direction.y + 1.f);
 
   // make gradient color
-  float3 c = (1.f - t) * sample_color1(0, 0, make_float3(0.f), 0);
-  c += t * sample_color2(0, 0, make_float3(0.f), 0);
+  float3 c =
+      (1.f - t) * Sample_Texture(sample_color1, 0, 0, make_float3(0.f), 0);
+  c += t * Sample_Texture(sample_color2, 0, 0, make_float3(0.f), 0);
 
   prd.throughput *= c;
   prd.scatterEvent = rayMissed;
@@ -41,7 +42,7 @@ RT_PROGRAM void gradient_color() {
 
 // Constant Color Background
 RT_PROGRAM void constant_color() {
-  prd.throughput *= sample_texture(0, 0, make_float3(0.f), 0);
+  prd.throughput *= Sample_Texture(sample_texture, 0, 0, make_float3(0.f), 0);
   prd.scatterEvent = rayMissed;
 }
 
@@ -54,7 +55,8 @@ RT_PROGRAM void image_background() {
   float u = (theta + M_PIf) * (0.5f * M_1_PIf);
   float v = 0.5f * (1.f + sinf(phi));
 
-  prd.throughput *= sample_texture(u, v, make_float3(0.f), 0);
+  prd.throughput *= Sample_Texture(sample_texture, u, v, make_float3(0.f), 0,
+                                   Direction_Footprint(prd.coneSpread));
   prd.scatterEvent = rayMissed;
 }
 
@@ -90,6 +92,8 @@ RT_PROGRAM void environmental_mapping() {
     v = phi / PI_F;
   }
 
-  prd.throughput *= 2.f * sample_texture(u, v, make_float3(0.f), 0);
+  float3 color = Sample_Texture(sample_texture, u, v, make_float3(0.f), 0,
+                                Direction_Footprint(prd.coneSpread));
+  prd.throughput *= 2.f * color;
   prd.scatterEvent = rayMissed;
 }
\ No newline at end of file
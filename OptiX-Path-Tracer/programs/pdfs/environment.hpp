@@ -0,0 +1,115 @@
+#pragma once
+
+#include "../vec.hpp"
+
+// environment.hpp: importance sampling of the HDR environment map, shared by
+// the device programs and the CPU backend. The host builds a piecewise
+// constant 2D distribution over the map, proportional to the luminance of its
+// texels times sin(theta), the size of their solid angle: a CDF over its rows
+// and a CDF over the cells of each row.
+
+// The sampler reads the distribution through an accessor class, 'Dist', with:
+// - width(), height(): cells of the distribution, which cover the whole map
+// - marginal(i): CDF of the rows, height() + 1 entries from 0 to 1
+// - conditional(row, i): CDF of the cells of a row, width() + 1 entries
+// - isSpherical(): mapping of the map, as in the environmental_mapping miss
+// program
+
+// Texcoords of a direction, as the environmental_mapping miss program computes
+// them, with u wrapped to [0, 1)
+RT_FUNCTION __host__ float2 Environment_UV(const float3 &d, bool isSpherical) {
+  float3 n = normalize(d);
+  float u;
+
+  if (isSpherical)
+    u = atan2f(n.z, n.x) * (0.5f / PI_F);
+  else
+    u = 1.f - atan2f(n.x, n.z) * (0.5f / PI_F);
+
+  float v = acosf(fminf(fmaxf(n.y, -1.f), 1.f)) / PI_F;
+  return make_float2(u - floorf(u), v);
+}
+
+// Direction of the texcoords (u, v), the inverse of Environment_UV
+RT_FUNCTION __host__ float3 Environment_Direction(float u, float v,
+                                                  bool isSpherical) {
+  float theta = PI_F * v;
+  float sinTheta = sinf(theta), cosTheta = cosf(theta);
+
+  if (isSpherical) {
+    float phi = 2.f * PI_F * u;
+    return make_float3(sinTheta * cosf(phi), cosTheta, sinTheta * sinf(phi));
+  }
+
+  float phi = 2.f * PI_F * (1.f - u);
+  return make_float3(sinTheta * sinf(phi), cosTheta, sinTheta * cosf(phi));
+}
+
+// Last index i of a CDF with cdf(i) <= x, among its 'count' intervals. The
+// marginal CDF is searched if 'row' is negative, the row's one otherwise.
+// Intervals of zero probability are never returned for x < 1.
+template <typename Dist>
+RT_FUNCTION __host__ int Find_Interval(const Dist &dist, int row, int count,
+                                       float x) {
+  int lo = 0, hi = count - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi + 1) >> 1;
+    float cdf = row < 0 ? dist.marginal(mid) : dist.conditional(row, mid);
+
+    if (cdf <= x)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return lo;
+}
+
+// Density of a cell over the texcoords, taken to solid angle by the Jacobian
+// of the mapping, 2 pi^2 sin(theta)
+template <typename Dist>
+RT_FUNCTION __host__ float Environment_Cell_PDF(const Dist &dist, int row,
+                                                int col, float sinTheta) {
+  if (sinTheta <= 0.f) return 0.f;
+
+  float rowPDF = dist.marginal(row + 1) - dist.marginal(row);
+  float colPDF = dist.conditional(row, col + 1) - dist.conditional(row, col);
+  return rowPDF * colPDF * dist.width() * dist.height() /
+         (2.f * PI_F * PI_F * sinTheta);
+}
+
+// Samples a direction towards the environment from the random numbers r1 and
+// r2 in [0, 1), and gives its solid angle PDF
+template <typename Dist>
+RT_FUNCTION __host__ float3 Sample_Environment(const Dist &dist, float r1,
+                                               float r2, float &pdf) {
+  int width = dist.width(), height = dist.height();
+
+  // row from the marginal CDF, then a cell of the row
+  int row = Find_Interval(dist, -1, height, r1);
+  float m0 = dist.marginal(row), m1 = dist.marginal(row + 1);
+  int col = Find_Interval(dist, row, width, r2);
+  float c0 = dist.conditional(row, col), c1 = dist.conditional(row, col + 1);
+
+  // uniform within the cell
+  float u = (col + (r2 - c0) / (c1 - c0)) / width;
+  float v = (row + (r1 - m0) / (m1 - m0)) / height;
+
+  pdf = Environment_Cell_PDF(dist, row, col, sinf(PI_F * v));
+  return Environment_Direction(u, v, dist.isSpherical());
+}
+
+// Solid angle PDF of sampling the direction 'Wi'
+template <typename Dist>
+RT_FUNCTION __host__ float Environment_PDF(const Dist &dist,
+                                           const float3 &Wi) {
+  float2 uv = Environment_UV(Wi, dist.isSpherical());
+  int width = dist.width(), height = dist.height();
+
+  int col = (int)(uv.x * width), row = (int)(uv.y * height);
+  if (col >= width) col = width - 1;
+  if (row >= height) row = height - 1;
+
+  return Environment_Cell_PDF(dist, row, col, sinf(PI_F * uv.y));
+}
@@ -18,6 +18,7 @@
 
 #include "hitables/hitables.cuh"
 #include "random.cuh"
+#include "textures/texture_table.hpp"
 #include "vec.hpp"
 
 // Scatter events
@@ -38,6 +39,7 @@ struct HitRecord {
   float3 geometric_normal;
   float3 shading_normal;
   float3 Wo;  // view direction(i.e. direction to camera)
+  float3 dpdu, dpdv;  // hit point derivatives over the texcoords, or zero
 };
 
 // Radiance PRD containing variables that should be propagated as the ray
@@ -48,16 +50,30 @@ struct PerRayData {
   float time;
   float3 throughput, radiance;
 
+  // ray cone of the texture footprints, its width at the ray origin and the
+  // angle it grows by per unit of distance
+  float coneWidth, coneSpread;
+
   // data related to the last hit
   ScatterEvent scatterEvent;
   bool isSpecular;
 
-  // data related to the next ray
+  // data related to the next ray, the origin holds the current ray's until
+  // the closest hit program bounces it
   float3 origin, direction;
 };
 
+// Texture footprint of a hit, from the ray cone of the ray that found it
+RT_FUNCTION __host__ Texture_Footprint Hit_Footprint(const HitRecord &rec,
+                                                     const PerRayData &prd) {
+  float width = prd.coneWidth + prd.coneSpread * length(rec.P - prd.origin);
+  return Cone_Footprint(width, -rec.Wo, rec.geometric_normal, rec.dpdu,
+                        rec.dpdv);
+}
+
 // Shadow Ray PRD
 struct PerRayData_Shadow {
   bool inShadow;
+  bool lightsOcclude;  // lights facing 'normal' occlude the ray too
   float3 normal;
 };
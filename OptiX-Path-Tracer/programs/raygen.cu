@@ -14,6 +14,7 @@
 // limitations under the License.                                           //
 // ======================================================================== //
 
+#include "accumulate.cuh"
 #include "prd.cuh"
 #include "sampling.cuh"
 #include "vec.hpp"
@@ -29,11 +30,15 @@ rtDeclareVariable(PerRayData, prd, rtPayload, );
 rtBuffer<float4, 2> acc_buffer;      // HDR color frame buffer
 rtBuffer<uchar4, 2> display_buffer;  // display buffer
 
-rtDeclareVariable(int, samples, , );   // number of samples
-rtDeclareVariable(int, frame, , );     // frame number
+rtDeclareVariable(int, samples, , );   // number of samples in this launch
+rtDeclareVariable(int, frame, , );     // number of previously done samples
 rtDeclareVariable(int, russian, , );   // russian roulette flag
 rtDeclareVariable(int, maxDepth, , );  // max ray depth
 
+// set if Direct_Light samples the environment map
+rtDeclareVariable(int, environmentLight, , );
+rtDeclareVariable(int, environmentTexture, , );  // -1 without an HDR map
+
 rtDeclareVariable(rtObject, world, , );  // scene/top obj variable
 
 // Camera parameters
@@ -69,17 +74,31 @@ RT_FUNCTION float3 color(Ray& ray, uint& seed) {
   prd.time = time0 + rnd(prd.seed) * (time1 - time0);
   prd.throughput = make_float3(1.f);
   prd.radiance = make_float3(0.f);
+  prd.coneWidth = 0.f;
+  prd.coneSpread =
+      Pixel_Spread(camera_lower_left_corner, camera_horizontal,
+                   camera_vertical, camera_origin, launchDim.y);
 
   bool previousHitSpecular = false;
 
   // iterative version of recursion
   for (int depth = 0; depth < maxDepth; depth++) {
+    prd.origin = ray.origin;   // read by the texture footprints
     rtTrace(world, ray, prd);  // Trace a new ray
 
     // ray got 'lost' to the environment
     // return attenuation set by miss shader
-    if (prd.scatterEvent == rayMissed)
+    if (prd.scatterEvent == rayMissed) {
+      // a sampled environment already lit the previous, diffuse, bounce
+      if (environmentLight && depth > 0 && !previousHitSpecular)
+        return prd.radiance;
+
+      // HDR maps aren't clamped, like their light samples, so that sampling
+      // them converges to the same image
+      if (environmentTexture >= 0) return prd.radiance + prd.throughput;
+
       return prd.radiance + clamp(prd.throughput, 0.f, 1.f);
+    }
 
     // ray hit a light, return radiance
     else if (prd.scatterEvent == rayHitLight) {
@@ -95,6 +114,9 @@ RT_FUNCTION float3 color(Ray& ray, uint& seed) {
 
     // ray is still alive, and got properly bounced
     else {
+      // the cone keeps its spread, surfaces don't widen it
+      prd.coneWidth += prd.coneSpread * length(prd.origin - ray.origin);
+
       // generate a new ray
       ray = make_Ray(/* origin   : */ prd.origin,
                      /* direction: */ prd.direction,
@@ -122,47 +144,22 @@ RT_FUNCTION float3 color(Ray& ray, uint& seed) {
   return make_float3(0.f);
 }
 
-// Remove NaN values
-RT_FUNCTION float3 de_nan(const float3& c) {
-  float3 temp = c;
-
-  if (!(temp.x == temp.x)) temp.x = 0.f;
-  if (!(temp.y == temp.y)) temp.y = 0.f;
-  if (!(temp.z == temp.z)) temp.z = 0.f;
-
-  return temp;
-}
-
-RT_FUNCTION uchar4 make_Color(float4 col) {
-  float3 temp = sqrt(make_float3(col.x, col.y, col.z) / (frame + 1));
-  temp = clamp(temp, 0.f, 1.f);
-
-  int r = int(255.99 * temp.x);  // R
-  int g = int(255.99 * temp.y);  // G
-  int b = int(255.99 * temp.z);  // B
-  int a = int(255.99 * 1.f);     // A
-
-  return make_uchar4(r, g, b, a);
-}
+// Color seen through the film coordinates (u, v)
+struct Pixel_Radiance {
+  RT_FUNCTION float3 operator()(float u, float v, uint& seed) const {
+    Ray ray = Camera::generateRay(u, v, seed);
+    return color(ray, seed);
+  }
+};
 
 RT_PROGRAM void renderPixel() {
-  // get RNG seed
-  uint seed = tea<64>(launchDim.x * pixelID.y + pixelID.x, frame);
+  // trace this launch's samples, summing them locally
+  float4 batch =
+      accumulate(Pixel_Radiance(), pixelID, launchDim, frame, samples);
 
-  // initialize acc buffer if needed
+  // write them to the acc buffer once
   uint2 index = make_uint2(pixelID.x, launchDim.y - pixelID.y - 1);
-  if (frame == 0) acc_buffer[index] = make_float4(0.f);
-
-  // Subpixel jitter: send the ray through a different position inside the
-  // pixel each time, to provide antialiasing.
-  float u = float(pixelID.x + rnd(seed)) / launchDim.x;
-  float v = float(pixelID.y + rnd(seed)) / launchDim.y;
-
-  // trace ray
-  Ray ray = Camera::generateRay(u, v, seed);
-
-  // accumulate pixel color
-  float3 col = de_nan(color(ray, seed));
-  acc_buffer[index] += make_float4(col.x, col.y, col.z, 1.f);
-  display_buffer[index] = make_Color(acc_buffer[index]);
-}
\ No newline at end of file
+  float4 acc = add_Samples(acc_buffer[index], batch, frame);
+  acc_buffer[index] = acc;
+  display_buffer[index] = make_Color(acc, frame + samples);
+}
@@ -3,3 +3,47 @@
 #include "../prd.cuh"
 #include "../random.cuh"
 #include "../vec.hpp"
+#include "texture_table.hpp"
+
+// Flat texture table, set in the context once the scene is built
+rtBuffer<Texture_Entry> texture_table;
+rtBuffer<int> texture_children;
+rtBuffer<float3> noise_vectors;       // NOISE_TABLE_SIZE per noise table
+rtBuffer<int> noise_permutations;     // x, y and z permutations per table
+
+// Texture table accessor of Evaluate_Texture, image entries hold the ids of
+// bindless texture samplers. The samplers of mipmapped images pick their
+// levels, and their anisotropic probes, from the footprint gradients.
+struct Device_Texture_Table {
+  RT_FUNCTION const Texture_Entry &entry(int i) const {
+    return texture_table[i];
+  }
+
+  RT_FUNCTION int child(int i) const { return texture_children[i]; }
+
+  RT_FUNCTION float4 image(int data, float u, float v,
+                           const Texture_Footprint &footprint) const {
+    return rtTex2DGrad<float4>(data, u, v, footprint.ddx, footprint.ddy);
+  }
+
+  RT_FUNCTION float3 noiseVector(int n, int i) const {
+    return noise_vectors[n * NOISE_TABLE_SIZE + i];
+  }
+
+  RT_FUNCTION int permutation(int n, int axis, int i) const {
+    return noise_permutations[(n * 3 + axis) * NOISE_TABLE_SIZE + i];
+  }
+};
+
+// Samples texture 'index' of the texture table
+RT_FUNCTION float3 Sample_Texture(int index, float u, float v, float3 p,
+                                  int i) {
+  return Evaluate_Texture(Device_Texture_Table(), index, u, v, p, i);
+}
+
+// Samples texture 'index', filtering its images over 'footprint'
+RT_FUNCTION float3 Sample_Texture(int index, float u, float v, float3 p, int i,
+                                  const Texture_Footprint &footprint) {
+  return Evaluate_Texture(Device_Texture_Table(), index, u, v, p, i,
+                          footprint);
+}
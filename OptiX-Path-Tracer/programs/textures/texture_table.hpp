@@ -0,0 +1,286 @@
+#pragma once
+
+#include "../vec.hpp"
+
+// texture_table.hpp: flat texture table shared by the device programs and the
+// CPU backend. Every texture is an entry of one typed table, interpreted by a
+// single evaluator, instead of a tree of callable programs.
+
+// Types of textures
+typedef enum {
+  CONSTANT_TEXTURE,
+  CHECKER_TEXTURE,
+  NOISE_TEXTURE,
+  IMAGE_TEXTURE,
+  GRADIENT_TEXTURE,
+  VECTOR_TEXTURE
+} Texture_Type;
+
+// Entry of the texture table
+struct Texture_Entry {
+  int type;
+  int data;          // image sampler or noise table index
+  int first, count;  // children, checker odd/even or vector elements
+  float scale;       // noise scale
+  float3 colors[3];  // constant color or gradient colors
+};
+
+// Number of random vectors and permutation entries of a noise table
+#define NOISE_TABLE_SIZE 256
+
+// Texcoord gradients of an image lookup, the axes of the ellipse the lookup
+// covers in texture space. Zero gradients read the full resolution level.
+struct Texture_Footprint {
+  float2 ddx, ddy;
+};
+
+// The evaluator reads the table through an accessor class, 'Table', with:
+// - entry(i): the i-th texture of the table
+// - child(i): the i-th entry of the child index table
+// - image(data, u, v, footprint): filtered lookup of an image, bilinear on
+// the full resolution level for a zero footprint
+// - noiseVector(n, i), permutation(n, axis, i): tables of noise n
+
+////////////////////////
+// Texture footprints //
+////////////////////////
+
+// Footprint of a ray cone of the given width where it meets a surface. The
+// cone's cross section projects to an ellipse on the tangent plane, stretched
+// along the ray by the inverse cosine, and its axes are taken to texture space
+// with the least squares inverse of the position derivatives 'dpdu' and
+// 'dpdv'. Surfaces without texcoord derivatives get a zero footprint.
+RT_FUNCTION __host__ Texture_Footprint Cone_Footprint(float width,
+                                                      const float3 &direction,
+                                                      const float3 &normal,
+                                                      const float3 &dpdu,
+                                                      const float3 &dpdv) {
+  Texture_Footprint footprint;
+  footprint.ddx = footprint.ddy = make_float2(0.f);
+
+  float a = dot(dpdu, dpdu), b = dot(dpdu, dpdv), c = dot(dpdv, dpdv);
+  float det = a * c - b * b;
+  if (!(width > 0.f) || !(det > 1e-12f * a * c)) return footprint;
+
+  float3 d = normalize(direction), n = normalize(normal);
+  float3 across = cross(d, n);
+  if (dot(across, across) < 1e-8f) across = dpdu;  // head-on, any axis will do
+  across = normalize(across - dot(across, n) * n);
+  float3 along = cross(n, across);
+
+  // grazing cones are clamped, their footprint would cover the whole image
+  float cosine = fmaxf(fabsf(dot(d, n)), 0.05f);
+  float3 axes[2] = {along * (width / cosine), across * width};
+  float2 gradients[2];
+
+  for (int i = 0; i < 2; i++) {
+    float pu = dot(axes[i], dpdu), pv = dot(axes[i], dpdv);
+    gradients[i] = make_float2(c * pu - b * pv, a * pv - b * pu) / det;
+  }
+
+  footprint.ddx = gradients[0];
+  footprint.ddy = gradients[1];
+  return footprint;
+}
+
+// Position derivatives over the texcoords of a triangle with edges 'e1' and
+// 'e2' and texcoord deltas 'uv1' and 'uv2'. Both are zero for degenerate
+// mappings.
+RT_FUNCTION __host__ void Triangle_Derivatives(const float3 &e1,
+                                               const float3 &e2,
+                                               const float2 &uv1,
+                                               const float2 &uv2,
+                                               float3 &dpdu, float3 &dpdv) {
+  float det = uv1.x * uv2.y - uv1.y * uv2.x;
+
+  if (fabsf(det) < 1e-12f) {
+    dpdu = dpdv = make_float3(0.f);
+    return;
+  }
+
+  dpdu = (uv2.y * e1 - uv1.y * e2) / det;
+  dpdv = (uv1.x * e2 - uv2.x * e1) / det;
+}
+
+// Position derivatives over the texcoords of the sphere mapping, at the unit
+// sphere point 'n' of a sphere of the given radius. They vanish at the poles.
+RT_FUNCTION __host__ void Sphere_Derivatives(const float3 &n, float radius,
+                                             float3 &dpdu, float3 &dpdv) {
+  float r = sqrtf(n.x * n.x + n.z * n.z);
+  dpdu = 2.f * PI_F * radius * make_float3(n.z, 0.f, -n.x);
+
+  if (r < 1e-4f)
+    dpdv = make_float3(0.f);
+  else
+    dpdv = PI_F * radius * make_float3(-n.y * n.x / r, r, -n.y * n.z / r);
+}
+
+// Footprint of a lookup in a latitude-longitude map, from the angle between
+// the rays of neighbouring pixels. The map spans 2 pi radians horizontally
+// and pi vertically.
+RT_FUNCTION __host__ Texture_Footprint Direction_Footprint(float spread) {
+  Texture_Footprint footprint;
+  footprint.ddx = make_float2(spread / (2.f * PI_F), 0.f);
+  footprint.ddy = make_float2(0.f, spread / PI_F);
+  return footprint;
+}
+
+//////////////////////////
+// Perlin noise texture //
+//////////////////////////
+
+RT_FUNCTION __host__ float Perlin_Interp(float3 c[2][2][2], float u, float v,
+                                         float w) {
+  float uu = u * u * (3 - 2 * u);
+  float vv = v * v * (3 - 2 * v);
+  float ww = w * w * (3 - 2 * w);
+  float accum = 0;
+
+  for (int i = 0; i < 2; i++)
+    for (int j = 0; j < 2; j++)
+      for (int k = 0; k < 2; k++) {
+        float3 weight_v = make_float3(u - i, v - j, w - k);
+        accum += (i * uu + (1 - i) * (1 - uu)) * (j * vv + (1 - j) * (1 - vv)) *
+                 (k * ww + (1 - k) * (1 - ww)) * dot(c[i][j][k], weight_v);
+      }
+
+  return accum;
+}
+
+template <typename Table>
+RT_FUNCTION __host__ float Noise(const Table &table, int n, float3 p) {
+  float u = p.x - floorf(p.x);
+  float v = p.y - floorf(p.y);
+  float w = p.z - floorf(p.z);
+
+  int i = (int)floorf(p.x);
+  int j = (int)floorf(p.y);
+  int k = (int)floorf(p.z);
+  float3 c[2][2][2];
+
+  for (int di = 0; di < 2; di++)
+    for (int dj = 0; dj < 2; dj++)
+      for (int dk = 0; dk < 2; dk++)
+        c[di][dj][dk] =
+            table.noiseVector(n, table.permutation(n, 0, (i + di) & 255) ^
+                                     table.permutation(n, 1, (j + dj) & 255) ^
+                                     table.permutation(n, 2, (k + dk) & 255));
+
+  return Perlin_Interp(c, u, v, w);
+}
+
+template <typename Table>
+RT_FUNCTION __host__ float Turb(const Table &table, int n, float3 p) {
+  float accum = 0;
+  float3 temp_p = p;
+  float weight = 1.0;
+
+  for (int i = 0; i < 7; i++) {
+    accum += weight * Noise(table, n, temp_p);
+    weight *= 0.5;
+    temp_p *= 2;
+  }
+
+  return fabsf(accum);
+}
+
+////////////////////////
+// Texture evaluation //
+////////////////////////
+
+// Device code inlines the whole evaluator. Host code keeps the loop over every
+// texture type out of line, so the common constant and vector lookups of
+// Evaluate_Texture don't pay for the stack frame of the noise and image ones.
+#if defined(__CUDA_ARCH__)
+#define TEXTURE_ENTRIES RT_FUNCTION
+#elif defined(_MSC_VER)
+#define TEXTURE_ENTRIES __declspec(noinline)
+#else
+#define TEXTURE_ENTRIES __attribute__((noinline))
+#endif
+
+// Evaluates texture 'index' of the table. Checker and vector textures pick one
+// of their children and continue with it, so the loop replaces the nested
+// callable program calls. Image lookups are filtered over 'footprint'.
+template <typename Table>
+TEXTURE_ENTRIES __host__ float3 Evaluate_Entries(
+    const Table &table, int index, float u, float v, const float3 &p, int i,
+    const Texture_Footprint &footprint) {
+  while (true) {
+    const Texture_Entry &tex = table.entry(index);
+
+    switch (tex.type) {
+      case CONSTANT_TEXTURE:
+        return tex.colors[0];
+
+      case CHECKER_TEXTURE: {
+        float sines = sinf(10 * p.x) * sinf(10 * p.y) * sinf(10 * p.z);
+
+        index = table.child(tex.first + (sines < 0 ? 0 : 1));
+        i = 0;
+        break;
+      }
+
+      case NOISE_TEXTURE: {
+        // the axis switch of the old noise program fell through to Z_AXIS
+        // for every axis, so that's what is rendered
+        float sinValue =
+            sinf(tex.scale * p.z + 5 * Turb(table, tex.data, tex.scale * p));
+
+        return make_float3(1.f) * 0.5f * (1 + sinValue);
+      }
+
+      case IMAGE_TEXTURE:
+        return make_float3(table.image(tex.data, u, v, footprint));
+
+      case GRADIENT_TEXTURE: {
+        const float3 unit_direction = normalize(p);
+        const float x = fabsf(unit_direction.x);
+        const float y = fabsf(unit_direction.y);
+        const float z = fabsf(unit_direction.z);
+
+        return x * tex.colors[0] + y * tex.colors[1] + z * tex.colors[2];
+      }
+
+      case VECTOR_TEXTURE:
+        if (i >= tex.count || i < 0) return make_float3(0.f);
+
+        index = table.child(tex.first + i);
+        i = 0;
+        break;
+
+      default:
+        return make_float3(0.f);
+    }
+  }
+}
+
+// Evaluates texture 'index' of the table. Vector textures ending in a
+// constant, most of the lookups, are resolved here, the other types continue
+// in Evaluate_Entries.
+template <typename Table>
+RT_FUNCTION __host__ float3 Evaluate_Texture(
+    const Table &table, int index, float u, float v, const float3 &p, int i,
+    const Texture_Footprint &footprint) {
+  while (true) {
+    const Texture_Entry &tex = table.entry(index);
+
+    if (tex.type == CONSTANT_TEXTURE) return tex.colors[0];
+    if (tex.type != VECTOR_TEXTURE)
+      return Evaluate_Entries(table, index, u, v, p, i, footprint);
+    if (i >= tex.count || i < 0) return make_float3(0.f);
+
+    index = table.child(tex.first + i);
+    i = 0;
+  }
+}
+
+// Evaluates texture 'index' with full resolution image lookups
+template <typename Table>
+RT_FUNCTION __host__ float3 Evaluate_Texture(const Table &table, int index,
+                                             float u, float v,
+                                             const float3 &p, int i) {
+  Texture_Footprint footprint;
+  footprint.ddx = footprint.ddy = make_float2(0.f);
+  return Evaluate_Texture(table, index, u, v, p, i, footprint);
+}